@@ -59,6 +59,12 @@ HEADERS += \
     bsdetect.h \
     bsqmakegen.h \
     bsvisitor.h \
+    bsdb.h \
+    bscache.h \
+    bsninjagen.h \
+    bsmakegen.h \
+    bstrace.h \
+    bsgraph.h \
     bscallbacks.h
 
 SOURCES += \
@@ -100,7 +106,13 @@ SOURCES += \
     bsrunner.c \
     bshost.c \
     bsqmakegen.c \
-    bsvisitor.c
+    bsvisitor.c \
+    bsdb.c \
+    bscache.c \
+    bsninjagen.c \
+    bsmakegen.c \
+    bstrace.c \
+    bsgraph.c
 
 
 
@@ -0,0 +1,512 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bscache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#define BS_PATH_SEP ';'
+#else
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#define BS_PATH_SEP ':'
+#endif
+
+typedef struct BaseDir {
+    char* path; // denormalized, without trailing slash
+    int len;
+    const char* name;
+} BaseDir;
+static BaseDir s_bases[2] = { { 0, 0, "{{root_build_dir}}" }, { 0, 0, "{{root_source_dir}}" } };
+
+static void setbase(BaseDir* b, const char* dir)
+{
+    free(b->path);
+    b->len = strlen(dir);
+    while( b->len > 1 && ( dir[b->len-1] == '/' || dir[b->len-1] == '\\' ) )
+        b->len--;
+    b->path = (char*)malloc(b->len + 1);
+    memcpy(b->path,dir,b->len);
+    b->path[b->len] = 0;
+}
+
+void bs_cachebase(const char* denormalizedSourceDir, const char* denormalizedBuildDir)
+{
+    // the longer one first, since the build directory is often within the source directory or vice versa
+    const int sourceFirst = strlen(denormalizedSourceDir) > strlen(denormalizedBuildDir);
+    s_bases[0].name = sourceFirst ? "{{root_source_dir}}" : "{{root_build_dir}}";
+    s_bases[1].name = sourceFirst ? "{{root_build_dir}}" : "{{root_source_dir}}";
+    setbase(&s_bases[0],sourceFirst ? denormalizedSourceDir : denormalizedBuildDir);
+    setbase(&s_bases[1],sourceFirst ? denormalizedBuildDir : denormalizedSourceDir);
+}
+
+static char* rewrite(const char* str, unsigned int len, int toNames, unsigned int* outLen)
+{
+    // replaces the root directories in str by their names or the other way round; str can consist of
+    // zero terminated parts, which are kept
+    unsigned int cap = len + 64, n = 0, i = 0, j;
+    char* res = (char*)malloc(cap);
+    while( i < len )
+    {
+        const char* to = 0;
+        unsigned int fromLen = 0;
+        for( j = 0; j < 2 && to == 0; j++ )
+        {
+            const BaseDir* b = &s_bases[j];
+            const char* from = toNames ? b->path : b->name;
+            if( from == 0 )
+                continue;
+            fromLen = strlen(from);
+            if( i + fromLen > len || memcmp(str+i,from,fromLen) != 0 )
+                continue;
+            const char next = i + fromLen < len ? str[i+fromLen] : 0;
+            if( toNames && next != '/' && next != '\\' && next != '"' && next != ' ' && next != 0 )
+                continue; // only a prefix of another directory name
+            to = toNames ? b->name : b->path;
+        }
+        const unsigned int toLen = to ? strlen(to) : 1;
+        if( n + toLen + 1 > cap )
+        {
+            cap = ( n + toLen + 1 ) * 2;
+            res = (char*)realloc(res,cap);
+        }
+        if( to )
+        {
+            memcpy(res+n,to,toLen);
+            i += fromLen;
+        }else
+            res[n] = str[i++];
+        n += toLen;
+    }
+    res[n] = 0;
+    if( outLen )
+        *outLen = n;
+    return res;
+}
+
+static char* entrypath(const char* dir, BSHash h, const char* ext)
+{
+    // the entries are distributed over 256 subdirectories named by the first byte of the hash
+    char* path = (char*)malloc(strlen(dir) + 1 + 2 + 1 + 16 + strlen(ext) + 20 + 1);
+    sprintf(path,"%s/%02x/%016llx%s", dir, (unsigned int)(h >> 56), h, ext);
+    return path;
+}
+
+static char* readall(const char* denormalizedPath, long* len)
+{
+    FILE* f = bs_fopen(denormalizedPath,"rb");
+    if( f == NULL )
+        return 0;
+    fseek(f,0,SEEK_END);
+    *len = ftell(f);
+    fseek(f,0,SEEK_SET);
+    char* buf = (char*)malloc(*len + 1);
+    if( buf != 0 && fread(buf,1,*len,f) != (size_t)*len )
+    {
+        free(buf);
+        buf = 0;
+    }
+    fclose(f);
+    return buf;
+}
+
+static int copyfile(const char* denormalizedTo, const char* denormalizedFrom)
+{
+    FILE* in = bs_fopen(denormalizedFrom,"rb");
+    if( in == NULL )
+        return -1;
+    FILE* out = bs_fopen(denormalizedTo,"wb");
+    if( out == NULL )
+    {
+        fclose(in);
+        return -1;
+    }
+    char buf[16384];
+    size_t n;
+    int res = 0;
+    while( res == 0 && ( n = fread(buf,1,sizeof(buf),in) ) > 0 )
+    {
+        if( fwrite(buf,1,n,out) != n )
+            res = -1;
+    }
+    if( ferror(in) )
+        res = -1;
+    fclose(in);
+    if( fclose(out) != 0 )
+        res = -1;
+    bs_invalidate2(denormalizedTo);
+    return res;
+}
+
+static int store(const char* path, const char* fromFile, const char* data, unsigned int len)
+{
+    // writes either the file or the data to a temporary file which then atomically replaces path
+    char* tmp = (char*)malloc(strlen(path) + 32);
+    sprintf(tmp,"%s.%d.tmp", path, (int)getpid());
+    int res;
+    if( fromFile )
+        res = copyfile(tmp,fromFile);
+    else
+    {
+        FILE* out = bs_fopen(tmp,"wb");
+        res = out != NULL && fwrite(data,1,len,out) == len ? 0 : -1;
+        if( out != NULL && fclose(out) != 0 )
+            res = -1;
+    }
+    if( res == 0 )
+    {
+#ifdef _WIN32
+        remove(path);
+#endif
+        res = rename(tmp,path);
+    }
+    if( res != 0 )
+        remove(tmp);
+    free(tmp);
+    return res;
+}
+
+// the headers are mostly the same for all sources, so their hashes are remembered while their time doesn't change
+typedef struct HashEntry {
+    char* path;
+    BSTime time;
+    BSHash hash;
+} HashEntry;
+static HashEntry* s_hashes = 0;
+static unsigned int s_hashCap = 0;
+static unsigned int s_hashCount = 0;
+
+static HashEntry* findhash(const char* path)
+{
+    unsigned int i = (unsigned int)bs_hash(path,strlen(path),BS_HASH_INIT) & (s_hashCap - 1);
+    while( s_hashes[i].path != 0 && strcmp(s_hashes[i].path,path) != 0 )
+        i = ( i + 1 ) & (s_hashCap - 1);
+    return &s_hashes[i];
+}
+
+static int hashfile(const char* denormalizedPath, BSHash* h)
+{
+    // continues h with the hash of the file content
+    const BSTime t = bs_exists2(denormalizedPath);
+    if( t == 0 )
+        return -1;
+    if( ( s_hashCount + 1 ) * 2 > s_hashCap )
+    {
+        HashEntry* old = s_hashes;
+        const unsigned int oldCap = s_hashCap;
+        s_hashCap = oldCap ? oldCap * 2 : 1024;
+        s_hashes = (HashEntry*)calloc(s_hashCap,sizeof(HashEntry));
+        unsigned int i;
+        for( i = 0; i < oldCap; i++ )
+        {
+            if( old[i].path != 0 )
+                *findhash(old[i].path) = old[i];
+        }
+        free(old);
+    }
+    HashEntry* e = findhash(denormalizedPath);
+    if( e->path == 0 || e->time != t )
+    {
+        BSHash fh = BS_HASH_INIT;
+        if( bs_hashfile(denormalizedPath,&fh) != 0 )
+            return -1;
+        if( e->path == 0 )
+        {
+            e->path = (char*)malloc(strlen(denormalizedPath)+1);
+            strcpy(e->path,denormalizedPath);
+            s_hashCount++;
+        }
+        e->time = t;
+        e->hash = fh;
+    }
+    *h = bs_hash((const char*)&e->hash,sizeof(e->hash),*h);
+    return 0;
+}
+
+static int objecthash(BSHash key, const char* deps, unsigned int depsLen, BSHash* h)
+{
+    // the hash of the key and the paths and contents of the headers; deps as in the manifest
+    const char* end = deps + depsLen;
+    *h = key;
+    while( deps < end )
+    {
+        const int len = strlen(deps);
+        *h = bs_hash(deps,len+1,*h);
+        char* path = rewrite(deps,len,0,0);
+        const int res = hashfile(path,h);
+        free(path);
+        if( res != 0 )
+            return -1;
+        deps += len + 1;
+    }
+    return 0;
+}
+
+static BSTime compilertime(const char* name)
+{
+    // the changed time of the compiler executable, looked up in PATH if need be
+    if( strchr(name,'/') != 0 || strchr(name,'\\') != 0 )
+        return bs_exists2(name);
+    const char* path = getenv("PATH");
+    if( path == 0 )
+        return 0;
+    char* buf = (char*)malloc(strlen(path) + strlen(name) + 6);
+    BSTime t = 0;
+    while( t == 0 && *path )
+    {
+        const char* sep = strchr(path,BS_PATH_SEP);
+        const int len = sep ? sep - path : (int)strlen(path);
+        memcpy(buf,path,len);
+        sprintf(buf+len,"/%s",name);
+        t = bs_exists2(buf);
+#ifdef _WIN32
+        if( t == 0 )
+        {
+            strcat(buf,".exe");
+            t = bs_exists2(buf);
+        }
+#endif
+        path += len + ( sep ? 1 : 0 );
+    }
+    free(buf);
+    return t;
+}
+
+int bs_cachekey(const char* cmd, const char* denormalizedSource, BSHash* key)
+{
+    // the first word of cmd is the compiler, optionally quoted
+    const char* p = cmd;
+    while( *p == ' ' )
+        p++;
+    const char quote = *p == '"' ? '"' : ' ';
+    if( quote == '"' )
+        p++;
+    const char* end = p;
+    while( *end && *end != quote )
+        end++;
+    char* name = (char*)malloc(end - p + 1);
+    memcpy(name,p,end-p);
+    name[end-p] = 0;
+    const BSTime t = compilertime(name);
+    free(name);
+    if( t == 0 )
+        return -1;
+
+    unsigned int len;
+    char* relative = rewrite(cmd,strlen(cmd),1,&len);
+    BSHash h = bs_hash(relative,len,BS_HASH_INIT);
+    free(relative);
+    h = bs_hash((const char*)&t,sizeof(t),h);
+    if( denormalizedSource != 0 && bs_hashfile(denormalizedSource,&h) != 0 )
+        return -1;
+    *key = h;
+    return 0;
+}
+
+static void writedep(FILE* out, const char* path)
+{
+    // in make syntax
+    for( ; *path; path++ )
+    {
+        if( *path == ' ' || *path == '#' )
+            fputc('\\',out);
+        else if( *path == '$' )
+            fputc('$',out);
+        fputc(*path,out);
+    }
+}
+
+int bs_cacheget(const char* dir, BSHash key, const char* normalizedOut, const char* denormalizedDepfile)
+{
+    char* manifest = entrypath(dir,key,".m");
+    long len = 0;
+    char* deps = readall(manifest,&len);
+    BSHash h;
+    if( deps == 0 || objecthash(key,deps,len,&h) != 0 )
+    {
+        free(deps);
+        free(manifest);
+        return 0;
+    }
+    char* obj = entrypath(dir,h,".o");
+    char* from = (char*)malloc(strlen(obj) + 1024);
+    // the object shares the data with the entry if the file system supports it (e.g. Btrfs, XFS, APFS)
+    int res = bs_exists2(obj) != 0 && bs_normalize_path(obj,from,strlen(obj) + 1024) == BS_OK &&
+            bs_copy2(normalizedOut,from,BS_RefLink) == 0;
+    free(from);
+    if( res )
+    {
+        // the copy has the time of the entry, but the object has to be newer than the source like when compiled
+        bs_touch(normalizedOut);
+        // recreate the depfile as if the compiler had written it
+        FILE* out = bs_fopen(denormalizedDepfile,"w");
+        if( out != NULL )
+        {
+            writedep(out,bs_denormalize_path(normalizedOut));
+            fputc(':',out);
+            const char* p = deps;
+            while( p < deps + len )
+            {
+                char* path = rewrite(p,strlen(p),0,0);
+                fputs(" \\\n  ",out);
+                writedep(out,path);
+                free(path);
+                p += strlen(p) + 1;
+            }
+            fputc('\n',out);
+        }
+        if( out == NULL || fclose(out) != 0 )
+            res = 0;
+        bs_touch2(obj);
+        bs_touch2(manifest);
+    }
+    free(obj);
+    free(deps);
+    free(manifest);
+    return res;
+}
+
+int bs_cacheput(const char* dir, BSHash key, const char* normalizedOut, const char* deps, unsigned int depsLen)
+{
+    BSHash h;
+    char* relative = rewrite(deps,depsLen,1,&depsLen);
+    if( objecthash(key,relative,depsLen,&h) != 0 )
+    {
+        free(relative);
+        return -1;
+    }
+    char* obj = entrypath(dir,h,".o");
+    char* manifest = entrypath(dir,key,".m");
+    char* p = strrchr(obj,'/');
+    *p = 0;
+    bs_mkrdir2(obj);
+    *p = '/';
+    p = strrchr(manifest,'/');
+    *p = 0;
+    bs_mkdir2(manifest);
+    *p = '/';
+    int res = store(obj,bs_denormalize_path(normalizedOut),0,0);
+    if( res == 0 )
+        res = store(manifest,0,relative,depsLen);
+    free(relative);
+    free(obj);
+    free(manifest);
+    return res;
+}
+
+typedef struct CacheFile {
+    char* path;
+    BSTime time;
+    long long size;
+} CacheFile;
+
+static int olderfirst(const void* lhs, const void* rhs)
+{
+    const BSTime l = ((const CacheFile*)lhs)->time;
+    const BSTime r = ((const CacheFile*)rhs)->time;
+    return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static void addfile(CacheFile** files, int* count, int* cap, const char* dir, const char* name,
+                    BSTime time, long long size)
+{
+    if( *count == *cap )
+    {
+        *cap = *cap ? *cap * 2 : 256;
+        *files = (CacheFile*)realloc(*files, *cap * sizeof(CacheFile));
+    }
+    CacheFile* f = &(*files)[(*count)++];
+    f->path = (char*)malloc(strlen(dir) + 1 + strlen(name) + 1);
+    sprintf(f->path,"%s/%s",dir,name);
+    f->time = time;
+    f->size = size;
+}
+
+void bs_cachetrim(const char* dir, long long maxBytes)
+{
+    CacheFile* files = 0;
+    int count = 0, cap = 0, i;
+    long long total = 0;
+    char* sub = (char*)malloc(strlen(dir) + 4 + 512); // room for the file names
+    for( i = 0; i < 256; i++ )
+    {
+        sprintf(sub,"%s/%02x", dir, i);
+#ifdef _WIN32
+        const int len = strlen(sub);
+        strcpy(sub+len,"/*");
+        WIN32_FIND_DATAA fd;
+        HANDLE h = FindFirstFileA(sub,&fd);
+        sub[len] = 0;
+        if( h == INVALID_HANDLE_VALUE )
+            continue;
+        do
+        {
+            if( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+                continue;
+            const long long size = ( (long long)fd.nFileSizeHigh << 32 ) | fd.nFileSizeLow;
+            const BSTime t = ( ( (BSTime)fd.ftLastWriteTime.dwHighDateTime << 32 ) |
+                               fd.ftLastWriteTime.dwLowDateTime ) - 116444736000000000LL;
+            addfile(&files,&count,&cap,sub,fd.cFileName,t,size);
+            total += size;
+        }while( FindNextFileA(h,&fd) );
+        FindClose(h);
+#else
+        DIR* d = opendir(sub);
+        if( d == 0 )
+            continue;
+        struct dirent* e;
+        while( ( e = readdir(d) ) != 0 )
+        {
+            if( e->d_name[0] == '.' )
+                continue;
+            const int len = strlen(sub);
+            sprintf(sub+len,"/%s",e->d_name);
+            struct stat st;
+            const int ok = stat(sub,&st) == 0 && S_ISREG(st.st_mode);
+            sub[len] = 0;
+            if( !ok )
+                continue;
+            addfile(&files,&count,&cap,sub,e->d_name,st.st_mtime,st.st_size);
+            total += st.st_size;
+        }
+        closedir(d);
+#endif
+    }
+    if( total > maxBytes )
+    {
+        // like ccache go a bit below the limit, so the cache is not trimmed again after each build
+        qsort(files,count,sizeof(CacheFile),olderfirst);
+        for( i = 0; i < count && total > maxBytes / 10 * 9; i++ )
+        {
+            if( remove(files[i].path) == 0 )
+                total -= files[i].size;
+        }
+    }
+    for( i = 0; i < count; i++ )
+        free(files[i].path);
+    free(files);
+    free(sub);
+}
@@ -0,0 +1,45 @@
+#ifndef BSCACHE_H
+#define BSCACHE_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bshost.h"
+
+// The object cache is a directory which can be shared by build directories; it works like the direct mode
+// of ccache. The key of a compilation is the hash of the compiler (name and changed time), the command line
+// without the output files and the content of the source file. For each key a manifest lists the headers the
+// source included the last time it was compiled; the object is stored under the hash of the key and the
+// content of these headers. Files are written to a temporary name and then renamed, so concurrent builds
+// only ever see complete entries. Each hit touches the entry, so the least recently used are removed first.
+// Like the base_dir of ccache, the paths within the root source and build directory are replaced by the names
+// {{root_source_dir}} and {{root_build_dir}} in the key and the manifest, so worktrees of the same project in
+// different directories share the entries.
+
+extern void bs_cachebase(const char* denormalizedSourceDir, const char* denormalizedBuildDir);
+                    // sets the root directories to be replaced; to be called before the other functions
+extern int bs_cachekey(const char* cmd, const char* denormalizedSource, BSHash* key);
+                    // returns 0 on success; only cmd and the compiler are hashed if denormalizedSource is 0
+extern int bs_cacheget(const char* dir, BSHash key, const char* normalizedOut, const char* denormalizedDepfile);
+                    // reflinks or copies the object to out and writes a depfile; returns 1 on a hit, 0 otherwise
+extern int bs_cacheput(const char* dir, BSHash key, const char* normalizedOut, const char* deps, unsigned int depsLen);
+                    // deps as listed in the depfile, each terminated by a zero; returns 0 on success
+extern void bs_cachetrim(const char* dir, long long maxBytes); // removes the least recently used entries
+
+#endif // BSCACHE_H
@@ -0,0 +1,364 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bsdb.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+// File layout: the 8 byte magic, followed by records; all numbers are in host byte order since the file
+// is only used on the machine where it was written. Each record starts with a header, followed by the
+// path and the deps, and is padded to a multiple of 8 bytes. The kind of the record tells the output records from
+// the scan records, which are separate key spaces.
+static const char s_magic[8] = { 'B', 'U', 'S', 'Y', 'D', 'B', '4', '\n' };
+
+enum { OutputRecord, ScanRecord };
+
+typedef struct DbHeader {
+    unsigned int size; // of the whole record including padding
+    unsigned int pathLen;
+    unsigned int depsLen;
+    unsigned int duration;
+    unsigned int peakMem;
+    unsigned short kind;
+    unsigned short flags; // of a scan record
+    long long mtime;
+    long long checked;
+    BSHash contentHash;
+    BSHash cmdHash;
+} DbHeader;
+
+typedef struct DbEntry {
+    const char* path; // points either into the mapped file or to owned
+    unsigned int pathLen;
+    unsigned int kind;
+    unsigned int flags; // of a scan record, which only uses mtime of rec
+    BSDbRecord rec;
+    char* owned; // path and deps of records added during this session
+} DbEntry;
+
+struct BSDb {
+    DbEntry* entries; // open addressing hash table
+    unsigned int cap; // a power of two
+    unsigned int count;
+    unsigned int records; // in the file including the overridden ones
+    char* data; // the mapped file
+    size_t dataLen;
+    FILE* out;
+    char* path;
+};
+
+static unsigned int align8(unsigned int n)
+{
+    return ( n + 7 ) & ~7u;
+}
+
+static DbEntry* find(BSDb* db, unsigned int kind, const char* path, unsigned int len)
+{
+    // returns the entry of kind and path or the free slot where it belongs
+    unsigned int i = (unsigned int)bs_hash(path,len,BS_HASH_INIT + kind) & (db->cap - 1);
+    for(;;)
+    {
+        DbEntry* e = &db->entries[i];
+        if( e->path == 0 || ( e->kind == kind && e->pathLen == len && memcmp(e->path,path,len) == 0 ) )
+            return e;
+        i = ( i + 1 ) & (db->cap - 1);
+    }
+}
+
+static void grow(BSDb* db)
+{
+    DbEntry* old = db->entries;
+    const unsigned int oldCap = db->cap;
+    db->cap = oldCap ? oldCap * 2 : 1024;
+    db->entries = (DbEntry*)calloc(db->cap,sizeof(DbEntry));
+    unsigned int i;
+    for( i = 0; i < oldCap; i++ )
+    {
+        if( old[i].path != 0 )
+            *find(db,old[i].kind,old[i].path,old[i].pathLen) = old[i];
+    }
+    free(old);
+}
+
+static DbEntry* insert(BSDb* db, unsigned int kind, const char* path, unsigned int len)
+{
+    if( ( db->count + 1 ) * 2 > db->cap )
+        grow(db);
+    DbEntry* e = find(db,kind,path,len);
+    if( e->path == 0 )
+    {
+        e->path = path;
+        e->pathLen = len;
+        e->kind = kind;
+        db->count++;
+    }
+    return e;
+}
+
+static int load(BSDb* db)
+{
+    // returns 1 if the file is complete, 0 if the rest of the file after the last valid record was ignored
+    if( db->dataLen < sizeof(s_magic) || memcmp(db->data,s_magic,sizeof(s_magic)) != 0 )
+        return db->dataLen == 0;
+    size_t off = sizeof(s_magic);
+    while( off < db->dataLen )
+    {
+        DbHeader h;
+        if( db->dataLen - off < sizeof(h) )
+            return 0;
+        memcpy(&h,db->data+off,sizeof(h));
+        if( h.size < sizeof(h) || h.size > db->dataLen - off || h.size != align8(h.size) ||
+                sizeof(h) + (size_t)h.pathLen + h.depsLen > h.size || h.pathLen == 0 )
+            return 0;
+        const char* path = db->data + off + sizeof(h);
+        if( h.kind != OutputRecord && h.kind != ScanRecord )
+            return 0;
+        DbEntry* e = insert(db,h.kind,path,h.pathLen);
+        e->path = path; // an existing entry now points to the newer record
+        e->flags = h.flags;
+        e->rec.mtime = h.mtime;
+        e->rec.checked = h.checked;
+        e->rec.contentHash = h.contentHash;
+        e->rec.cmdHash = h.cmdHash;
+        e->rec.deps = path + h.pathLen;
+        e->rec.depsLen = h.depsLen;
+        e->rec.duration = h.duration;
+        e->rec.peakMem = h.peakMem;
+        db->records++;
+        off += h.size;
+    }
+    return 1;
+}
+
+static int append(FILE* out, const DbEntry* e)
+{
+    static const char pad[8] = { 0 };
+    const char* path = e->path;
+    const unsigned int pathLen = e->pathLen;
+    const BSDbRecord* rec = &e->rec;
+    DbHeader h;
+    memset(&h,0,sizeof(h));
+    h.kind = e->kind;
+    h.flags = e->flags;
+    h.pathLen = pathLen;
+    h.depsLen = rec->depsLen;
+    h.size = align8(sizeof(h) + pathLen + rec->depsLen);
+    h.mtime = rec->mtime;
+    h.checked = rec->checked;
+    h.contentHash = rec->contentHash;
+    h.cmdHash = rec->cmdHash;
+    h.duration = rec->duration;
+    h.peakMem = rec->peakMem;
+    if( fwrite(&h,sizeof(h),1,out) != 1 ||
+            fwrite(path,1,pathLen,out) != pathLen ||
+            ( rec->depsLen && fwrite(rec->deps,1,rec->depsLen,out) != rec->depsLen ) ||
+            fwrite(pad,1,h.size - sizeof(h) - pathLen - rec->depsLen,out) != h.size - sizeof(h) - pathLen - rec->depsLen )
+        return -1;
+    return 0;
+}
+
+static int compact(BSDb* db)
+{
+    // writes the latest records to a new file which then replaces the current file
+    const int len = strlen(db->path);
+    char* tmp = (char*)malloc(len + 5);
+    strcpy(tmp,db->path);
+    strcpy(tmp+len,".tmp");
+    FILE* out = bs_fopen(tmp,"wb");
+    int res = out != NULL ? 0 : -1;
+    if( out != NULL )
+    {
+        if( fwrite(s_magic,sizeof(s_magic),1,out) != 1 )
+            res = -1;
+        unsigned int i;
+        for( i = 0; i < db->cap && res == 0; i++ )
+        {
+            if( db->entries[i].path != 0 )
+                res = append(out,&db->entries[i]);
+        }
+        if( fclose(out) != 0 )
+            res = -1;
+    }
+    if( res == 0 )
+    {
+#ifdef _WIN32
+        remove(db->path);
+#endif
+        res = rename(tmp,db->path);
+    }
+    if( res != 0 )
+        remove(tmp);
+    else
+        db->records = db->count;
+    free(tmp);
+    return res;
+}
+
+static void mapfile(BSDb* db)
+{
+#ifdef _WIN32
+    FILE* f = bs_fopen(db->path,"rb");
+    if( f == NULL )
+        return;
+    fseek(f,0,SEEK_END);
+    const long len = ftell(f);
+    fseek(f,0,SEEK_SET);
+    if( len > 0 )
+    {
+        db->data = (char*)malloc(len);
+        if( db->data != NULL && fread(db->data,1,len,f) == (size_t)len )
+            db->dataLen = len;
+    }
+    fclose(f);
+#else
+    const int fd = open(db->path,O_RDONLY);
+    if( fd < 0 )
+        return;
+    struct stat st;
+    if( fstat(fd,&st) == 0 && st.st_size > 0 )
+    {
+        void* p = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if( p != MAP_FAILED )
+        {
+            db->data = (char*)p;
+            db->dataLen = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+static void unmapfile(BSDb* db)
+{
+    if( db->data == 0 )
+        return;
+#ifdef _WIN32
+    free(db->data);
+#else
+    munmap(db->data,db->dataLen);
+#endif
+    db->data = 0;
+    db->dataLen = 0;
+}
+
+BSDb* bs_dbopen(const char* denormalizedPath)
+{
+    BSDb* db = (BSDb*)calloc(1,sizeof(BSDb));
+    if( db == 0 )
+        return 0;
+    db->path = (char*)malloc(strlen(denormalizedPath)+1);
+    strcpy(db->path,denormalizedPath);
+    mapfile(db);
+    do
+        grow(db); // avoid rehashing while loading, records are at least 64 bytes
+    while( db->cap < db->dataLen / 64 * 2 );
+    if( !load(db) || db->dataLen == 0 )
+        compact(db); // start a new file, or drop a damaged tail, e.g. from an interrupted build
+
+    db->out = bs_fopen(db->path,"ab");
+    if( db->out == NULL )
+    {
+        bs_dbclose(db);
+        return 0;
+    }
+    return db;
+}
+
+const BSDbRecord* bs_dbget(BSDb* db, const char* normalizedPath)
+{
+    const DbEntry* e = find(db,OutputRecord,normalizedPath,strlen(normalizedPath));
+    return e->path != 0 ? &e->rec : 0;
+}
+
+static int put(BSDb* db, unsigned int kind, const char* normalizedPath, const BSDbRecord* rec, unsigned int flags)
+{
+    const unsigned int len = strlen(normalizedPath);
+    char* owned = (char*)malloc(len + rec->depsLen);
+    if( owned == 0 )
+        return -1;
+    memcpy(owned,normalizedPath,len);
+    if( rec->depsLen )
+        memcpy(owned+len,rec->deps,rec->depsLen);
+
+    DbEntry* e = insert(db,kind,owned,len);
+    free(e->owned);
+    e->owned = owned;
+    e->path = owned;
+    e->flags = flags;
+    e->rec = *rec;
+    e->rec.deps = owned + len;
+
+    db->records++;
+    if( append(db->out,e) != 0 || fflush(db->out) != 0 )
+        return -1;
+    return 0;
+}
+
+int bs_dbput(BSDb* db, const char* normalizedPath, const BSDbRecord* rec)
+{
+    return put(db,OutputRecord,normalizedPath,rec,0);
+}
+
+int bs_dbgetscan(BSDb* db, const char* normalizedPath, BSDbScan* scan)
+{
+    const DbEntry* e = find(db,ScanRecord,normalizedPath,strlen(normalizedPath));
+    if( e->path == 0 )
+        return 0;
+    scan->mtime = e->rec.mtime;
+    scan->flags = e->flags;
+    return 1;
+}
+
+int bs_dbputscan(BSDb* db, const char* normalizedPath, const BSDbScan* scan)
+{
+    BSDbRecord rec;
+    memset(&rec,0,sizeof(rec));
+    rec.mtime = scan->mtime;
+    return put(db,ScanRecord,normalizedPath,&rec,scan->flags);
+}
+
+void bs_dbclose(BSDb* db)
+{
+    if( db == 0 )
+        return;
+    if( db->out != NULL )
+    {
+        fclose(db->out);
+        if( db->records > db->count )
+            compact(db);
+    }
+    unmapfile(db);
+    unsigned int i;
+    for( i = 0; i < db->cap; i++ )
+        free(db->entries[i].owned);
+    free(db->entries);
+    free(db->path);
+    free(db);
+}
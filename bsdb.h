@@ -0,0 +1,60 @@
+#ifndef BSDB_H
+#define BSDB_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bshost.h"
+
+// The build state database keeps one record per output file of the build; it is a binary file in the
+// root build directory which is memory mapped when opened; updates are appended to the file during the
+// build, and when the database is closed the file is compacted so that it includes only the latest
+// record of each output. Besides the outputs it keeps what was found by scanning source files, e.g. whether a
+// header needs moc; these scan records are a separate key space, so a file can have both kinds of record.
+
+typedef struct BSDbRecord {
+    long long mtime; // of the output when the record was written
+    long long checked; // the output was unchanged by a run of the command at this time (restat), 0 if not
+    BSHash contentHash; // of the output, 0 if not known
+    BSHash cmdHash; // of the command which produced the output
+    const char* deps; // the files the output depends on (e.g. the headers), each terminated by a zero
+    unsigned int depsLen; // number of bytes of deps including the terminating zeros
+    unsigned int duration; // of the command in milliseconds, 0 if not known
+    unsigned int peakMem; // max. resident memory of the command in kilobytes, 0 if not known
+} BSDbRecord;
+
+typedef enum BSDbScanFlag {
+    BS_DbNeedsMoc = 1 // the file uses a macro like Q_OBJECT
+} BSDbScanFlag;
+
+typedef struct BSDbScan {
+    long long mtime; // of the file when it was scanned
+    unsigned int flags; // the BSDbScanFlag found in the file
+} BSDbScan;
+
+typedef struct BSDb BSDb;
+
+extern BSDb* bs_dbopen(const char* denormalizedPath); // loads the file if present; returns 0 on error
+extern const BSDbRecord* bs_dbget(BSDb*, const char* normalizedPath); // returns 0 if there is no record
+extern int bs_dbput(BSDb*, const char* normalizedPath, const BSDbRecord*); // replaces the record; returns 0 on success
+extern int bs_dbgetscan(BSDb*, const char* normalizedPath, BSDbScan*); // returns 1 if there is a scan record
+extern int bs_dbputscan(BSDb*, const char* normalizedPath, const BSDbScan*); // returns 0 on success
+extern void bs_dbclose(BSDb*); // compacts the file if need be and frees the db
+
+#endif // BSDB_H
@@ -0,0 +1,746 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bsgraph.h"
+#include "bsrunner.h"
+#include "bsparser.h"
+#include "lauxlib.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BSGraphBlock {
+    BSGraphBlock* next;
+    size_t used;
+    size_t cap;
+    double align; // the data follows the header
+};
+
+static void* alloc(BSGraphBlock** blocks, size_t size)
+{
+    // the memory is only freed with the graph
+    size = ( size + 7 ) & ~(size_t)7;
+    BSGraphBlock* b = *blocks;
+    if( b == 0 || b->cap - b->used < size )
+    {
+        const size_t cap = size > 65536 ? size : 65536;
+        b = (BSGraphBlock*)malloc(sizeof(BSGraphBlock) + cap);
+        b->next = *blocks;
+        b->used = 0;
+        b->cap = cap;
+        *blocks = b;
+    }
+    void* res = (char*)(b + 1) + b->used;
+    b->used += size;
+    return res;
+}
+
+static void freeblocks(BSGraphBlock** blocks)
+{
+    while( *blocks )
+    {
+        BSGraphBlock* b = *blocks;
+        *blocks = b->next;
+        free(b);
+    }
+}
+
+static const char* savestr(BSGraphBlock** blocks, lua_State* L, int index)
+{
+    if( !lua_isstring(L,index) )
+        return 0;
+    size_t len;
+    const char* str = lua_tolstring(L,index,&len);
+    char* res = (char*)alloc(blocks,len+1);
+    memcpy(res,str,len+1);
+    return res;
+}
+
+static const char* const* savelist(BSGraphBlock** blocks, lua_State* L, int list, int* count)
+{
+    const int n = lua_istable(L,list) ? lua_objlen(L,list) : 0;
+    const char** res = (const char**)alloc(blocks,n*sizeof(char*));
+    int i;
+    for( i = 0; i < n; i++ )
+    {
+        lua_rawgeti(L,list,i+1);
+        res[i] = savestr(blocks,L,-1);
+        lua_pop(L,1);
+    }
+    *count = n;
+    return res;
+}
+
+static void addPath(lua_State* L, int lhs, int rhs)
+{
+    if( *lua_tostring(L,rhs) == '/' )
+        lua_pushvalue(L, rhs);
+    else if( bs_add_path(L,lhs,rhs) )
+        luaL_error(L,"creating absolute path from provided root gives an error: %s %s",
+                   lua_tostring(L,lhs), lua_tostring(L,rhs) );
+}
+
+static void pushpath(lua_State* L, int inst, int path)
+{
+    // pushes path, made absolute with the directory of the module of inst if relative
+    if( path < 0 )
+        path += lua_gettop(L) + 1;
+    bs_getModuleVar(L,inst,"#dir");
+    addPath(L,-1,path);
+    lua_replace(L,-2);
+}
+
+// indexed by BSProductKind; the classes are checked in this order
+static const char* s_classes[] = { 0, "Library", "Executable", "SourceSet", "Group", "Config", "LuaScript",
+                                   "LuaScriptForeach", "Copy", "Message", "Moc", "Rcc", "Uic" };
+
+static int productkind(lua_State* L, int builtins, int inst)
+{
+    lua_getmetatable(L,inst);
+    const int cls = lua_gettop(L);
+    int kind;
+    for( kind = BS_LibraryProduct; kind <= BS_UicProduct; kind++ )
+    {
+        // use isa instead of strcmp so that users can subclass the built-in classes
+        lua_getfield(L,builtins,s_classes[kind]);
+        const int res = bs_isa(L,-1,cls);
+        lua_pop(L,1);
+        if( res )
+            break;
+    }
+    if( kind > BS_UicProduct )
+    {
+        lua_getfield(L,cls,"#name");
+        luaL_error(L,"don't know how to build instances of class '%s'", lua_tostring(L,-1));
+    }
+    lua_pop(L,1); // cls
+    return kind;
+}
+
+static void order(lua_State* L, int inst, int index, int insts)
+{
+    // appends inst to insts after everything it depends on, if not yet there
+    lua_pushvalue(L,inst);
+    lua_rawget(L,index);
+    const int state = lua_tointeger(L,-1); // 0: not visited, -1: being visited, else the position in insts
+    lua_pop(L,1);
+    if( state > 0 )
+        return;
+    if( state < 0 )
+    {
+        lua_getfield(L,inst,"#decl");
+        bs_declpath(L,-1,".");
+        luaL_error(L,"product '%s' depends on itself", lua_tostring(L,-1));
+    }
+    luaL_checkstack(L,LUA_MINSTACK,"dependency chain too deep");
+    lua_pushvalue(L,inst);
+    lua_pushinteger(L,-1);
+    lua_rawset(L,index);
+
+    lua_getfield(L,inst,"deps");
+    const int deps = lua_gettop(L);
+    size_t i;
+    for( i = 1; lua_istable(L,deps) && i <= lua_objlen(L,deps); i++ )
+    {
+        lua_rawgeti(L,deps,i);
+        order(L,lua_gettop(L),index,insts);
+        lua_pop(L,1); // dep
+    }
+    lua_pop(L,1); // deps
+
+    const int n = lua_objlen(L,insts) + 1;
+    lua_pushvalue(L,inst);
+    lua_rawseti(L,insts,n);
+    lua_pushvalue(L,inst);
+    lua_pushinteger(L,n);
+    lua_rawset(L,index);
+}
+
+// indexed by BSFlagList
+static const char* s_flagfields[] = { "cflags", "cflags_c", "cflags_cc", "cflags_objc", "cflags_objcc",
+                                      "defines", "include_dirs",
+                                      "ldflags", "lib_dirs", "lib_names", "lib_files", "frameworks" };
+
+static void flatten(lua_State* L, int conf, int lists)
+{
+    // appends the flags of conf to the lists (a table of BS_FlagListCount lists), the ones of its configs first
+    luaL_checkstack(L,LUA_MINSTACK,"configs nested too deep");
+    lua_getfield(L,conf,"configs");
+    const int configs = lua_gettop(L);
+    size_t i;
+    for( i = 1; lua_istable(L,configs) && i <= lua_objlen(L,configs); i++ )
+    {
+        lua_rawgeti(L,configs,i);
+        flatten(L,lua_gettop(L),lists);
+        lua_pop(L,1); // config
+    }
+    lua_pop(L,1); // configs
+
+    int f;
+    for( f = 0; f < BS_FlagListCount; f++ )
+    {
+        const int isPath = f == BS_include_dirs || f == BS_lib_dirs || f == BS_lib_files;
+        lua_getfield(L,conf,s_flagfields[f]);
+        const int list = lua_gettop(L);
+        lua_rawgeti(L,lists,f+1);
+        const int out = lua_gettop(L);
+        for( i = 1; lua_istable(L,list) && i <= lua_objlen(L,list); i++ )
+        {
+            lua_rawgeti(L,list,i);
+            if( isPath )
+            {
+                pushpath(L,conf,-1);
+                lua_replace(L,-2);
+            }
+            lua_rawseti(L,out,lua_objlen(L,out)+1);
+        }
+        lua_pop(L,2); // list, out
+    }
+}
+
+static int findpch(lua_State* L, int inst)
+{
+    // pushes the absolute path of the header to be precompiled and returns 1; the pch of the product wins over
+    // the one of its configs, and a later config over an earlier one; returns 0 and pushes nothing if not set
+    lua_getfield(L,inst,"pch");
+    if( lua_isstring(L,-1) && strcmp(lua_tostring(L,-1),".") != 0 )
+    {
+        pushpath(L,inst,-1);
+        lua_replace(L,-2);
+        return 1;
+    }
+    lua_pop(L,1); // pch
+
+    luaL_checkstack(L,LUA_MINSTACK,"configs nested too deep");
+    lua_getfield(L,inst,"configs");
+    const int configs = lua_gettop(L);
+    size_t i;
+    for( i = lua_istable(L,configs) ? lua_objlen(L,configs) : 0; i >= 1; i-- )
+    {
+        lua_rawgeti(L,configs,i);
+        const int found = findpch(L,lua_gettop(L));
+        if( found )
+        {
+            lua_replace(L,configs);
+            lua_pop(L,1); // conf
+            return 1;
+        }
+        lua_pop(L,1); // conf
+    }
+    lua_pop(L,1); // configs
+    return 0;
+}
+
+static void pushlinkfile(lua_State* L, int inst, int binst, int kind, int os)
+{
+    // pushes the path of the file linked by the Library or Executable inst
+    lua_getfield(L,binst,"root_build_dir");
+    bs_getModuleVar(L,inst,"#rdir");
+    addPath(L,-2,-1);
+    lua_replace(L,-3);
+    lua_pop(L,1); // rdir
+    lua_pushstring(L,"/");
+
+    int dynamic = 0;
+    if( kind == BS_LibraryProduct )
+    {
+        lua_getfield(L,inst,"lib_type");
+        dynamic = lua_isstring(L,-1) && strcmp(lua_tostring(L,-1),"shared") == 0;
+        lua_pop(L,1);
+    }
+    if( os != BS_windows && kind == BS_LibraryProduct )
+        lua_pushstring(L,"lib"); // if not on Windows prefix the lib name with "lib"
+    else
+        lua_pushstring(L,"");
+    lua_getfield(L,inst,"name");
+    if( lua_isnil(L,-1) || lua_objlen(L,-1) == 0 )
+    {
+        lua_pop(L,1);
+        lua_getfield(L,inst,"#decl");
+        lua_getfield(L,-1,"#name");
+        lua_replace(L,-2);
+    }
+    if( kind == BS_ExecutableProduct )
+        lua_pushstring(L, os == BS_windows ? ".exe" : "");
+    else if( dynamic )
+        lua_pushstring(L, os == BS_windows ? ".dll" : os == BS_mac ? ".dylib" : ".so");
+    else
+        lua_pushstring(L, os == BS_windows ? ".lib" : ".a");
+    lua_concat(L,5);
+}
+
+static void lowerproduct(lua_State* L, BSGraph* g, BSGraphNode* node, int inst, int index, int binst)
+{
+    const int top = lua_gettop(L);
+    BSGraphBlock** blocks = &g->blocks;
+
+    lua_getfield(L,inst,"#decl");
+    if( lua_istable(L,-1) )
+    {
+        bs_declpath(L,-1,".");
+        node->name = savestr(blocks,L,-1);
+        lua_pop(L,1); // name
+    }else
+        node->name = "";
+    lua_pop(L,1); // decl
+
+    lua_getfield(L,inst,"to_host");
+    node->toHost = lua_toboolean(L,-1);
+    lua_pop(L,1);
+
+    lua_getfield(L,inst,"deps");
+    const int deps = lua_gettop(L);
+    const int ndeps = lua_istable(L,deps) ? lua_objlen(L,deps) : 0;
+    int* depNodes = (int*)alloc(blocks,ndeps*sizeof(int));
+    int i;
+    for( i = 0; i < ndeps; i++ )
+    {
+        lua_rawgeti(L,deps,i+1);
+        lua_rawget(L,index);
+        depNodes[i] = lua_tointeger(L,-1) - 1;
+        lua_pop(L,1);
+    }
+    node->deps = depNodes;
+    node->depCount = ndeps;
+    lua_pop(L,1); // deps
+
+    node->toolchain = BS_notc;
+    node->os = BS_noos;
+    const int compiled = node->kind == BS_LibraryProduct || node->kind == BS_ExecutableProduct ||
+            node->kind == BS_SourceSetProduct;
+    if( compiled )
+    {
+        node->toolchain = bs_getToolchain(L,binst,node->toHost);
+        node->os = bs_getOperatingSystem(L,binst,node->toHost);
+
+        lua_createtable(L,BS_FlagListCount,0);
+        const int lists = lua_gettop(L);
+        for( i = 1; i <= BS_FlagListCount; i++ )
+        {
+            lua_createtable(L,0,0);
+            lua_rawseti(L,lists,i);
+        }
+
+        lua_getfield(L,binst,"#ctdefaults");
+        lua_getfield(L,binst, node->toHost ? "host_toolchain" : "target_toolchain");
+        lua_rawget(L,-2);
+        if( !lua_isnil(L,-1) )
+            flatten(L,lua_gettop(L),lists);
+        lua_pop(L,2); // ctdefaults, config
+        int defaults[BS_FlagListCount];
+        for( i = 0; i < BS_FlagListCount; i++ )
+        {
+            lua_rawgeti(L,lists,i+1);
+            defaults[i] = lua_objlen(L,-1);
+            lua_pop(L,1);
+        }
+
+        flatten(L,inst,lists);
+        for( i = 0; i < BS_FlagListCount; i++ )
+        {
+            lua_rawgeti(L,lists,i+1);
+            node->flags[i].items = savelist(blocks,L,lua_gettop(L),&node->flags[i].count);
+            node->flags[i].defaults = defaults[i];
+            lua_pop(L,1);
+        }
+        lua_pop(L,1); // lists
+
+        if( findpch(L,inst) )
+        {
+            node->pch = savestr(blocks,L,-1);
+            lua_pop(L,1);
+        }
+
+        if( node->kind == BS_LibraryProduct )
+        {
+            lua_getfield(L,inst,"def_file");
+            if( lua_isstring(L,-1) && strcmp(lua_tostring(L,-1),".") != 0 )
+            {
+                pushpath(L,inst,-1);
+                node->defFile = savestr(blocks,L,-1);
+                lua_pop(L,1);
+            }
+            lua_pop(L,1); // def_file
+        }
+
+        if( node->kind != BS_SourceSetProduct )
+        {
+            pushlinkfile(L,inst,binst,node->kind,node->os);
+            const char** out = (const char**)alloc(blocks,sizeof(char*));
+            out[0] = savestr(blocks,L,-1);
+            node->outputs.items = out;
+            node->outputs.count = 1;
+            lua_pop(L,1); // file
+        }
+    }else if( node->kind == BS_MocProduct )
+    {
+        lua_getfield(L,inst,"defines");
+        node->flags[BS_defines].items = savelist(blocks,L,lua_gettop(L),&node->flags[BS_defines].count);
+        lua_pop(L,1);
+    }
+
+    if( compiled || node->kind == BS_LuaScriptForeachProduct || node->kind == BS_CopyProduct ||
+            node->kind == BS_MocProduct || node->kind == BS_RccProduct || node->kind == BS_UicProduct )
+    {
+        lua_getfield(L,inst,"sources");
+        const int sources = lua_gettop(L);
+        const int n = lua_istable(L,sources) ? lua_objlen(L,sources) : 0;
+        lua_createtable(L,n,0);
+        const int paths = lua_gettop(L);
+        for( i = 1; i <= n; i++ )
+        {
+            lua_rawgeti(L,sources,i);
+            pushpath(L,inst,-1);
+            lua_rawseti(L,paths,i);
+            lua_pop(L,1); // source
+        }
+        node->inputs.items = savelist(blocks,L,paths,&node->inputs.count);
+        lua_pop(L,2); // sources, paths
+    }
+
+    if( node->kind == BS_LuaScriptProduct )
+    {
+        lua_getfield(L,binst,"root_build_dir");
+        bs_getModuleVar(L,inst,"#rdir");
+        addPath(L,-2,-1); // root_build_dir, rdir, root_build_dir+rdir
+        lua_replace(L,-3);
+        lua_pop(L,1);
+        const int outDir = lua_gettop(L);
+
+        lua_getfield(L,inst,"outputs");
+        const int outputs = lua_gettop(L);
+        const int n = lua_istable(L,outputs) ? lua_objlen(L,outputs) : 0;
+        lua_createtable(L,n,0);
+        const int paths = lua_gettop(L);
+        for( i = 1; i <= n; i++ )
+        {
+            lua_rawgeti(L,outputs,i);
+            if( *lua_tostring(L,-1) == '/' )
+                luaL_error(L,"the 'outputs' field requires relative paths");
+            addPath(L,outDir,lua_gettop(L));
+            lua_rawseti(L,paths,i);
+            lua_pop(L,1); // output
+        }
+        node->outputs.items = savelist(blocks,L,paths,&node->outputs.count);
+        lua_pop(L,3); // outDir, outputs, paths
+    }
+
+    assert( top == lua_gettop(L) );
+}
+
+static int graphgc(lua_State* L)
+{
+    BSGraph* g = (BSGraph*)lua_touserdata(L,1);
+    luaL_unref(L,LUA_REGISTRYINDEX,g->insts);
+    freeblocks(&g->blocks);
+    return 0;
+}
+
+int bs_graphlower(lua_State* L) // param: array of productinst, returns: graph
+{
+    enum { PRODS = 1 };
+    const int top = lua_gettop(L);
+
+    BSGraph* g = (BSGraph*)lua_newuserdata(L,sizeof(BSGraph));
+    memset(g,0,sizeof(BSGraph));
+    g->insts = LUA_NOREF;
+    if( luaL_newmetatable(L,"BSGraph") )
+    {
+        lua_pushcfunction(L,graphgc);
+        lua_setfield(L,-2,"__gc");
+    }
+    lua_setmetatable(L,-2);
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "builtins");
+    lua_call(L,1,1);
+    const int builtins = lua_gettop(L);
+    lua_getfield(L,builtins,"#inst");
+    const int binst = lua_gettop(L);
+
+    lua_createtable(L,0,0);
+    const int insts = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int index = lua_gettop(L); // productinst -> position in insts
+    size_t i;
+    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
+    {
+        lua_rawgeti(L,PRODS,i);
+        order(L,lua_gettop(L),index,insts);
+        lua_pop(L,1); // inst
+    }
+
+    const int n = lua_objlen(L,insts);
+    BSGraphNode* nodes = (BSGraphNode*)alloc(&g->blocks,n*sizeof(BSGraphNode));
+    memset(nodes,0,n*sizeof(BSGraphNode));
+    g->nodes = nodes;
+    int j;
+    for( j = 0; j < n; j++ )
+    {
+        lua_rawgeti(L,insts,j+1);
+        const int inst = lua_gettop(L);
+        nodes[j].kind = productkind(L,builtins,inst);
+        lowerproduct(L,g,&nodes[j],inst,index,binst);
+        lua_pop(L,1); // inst
+    }
+    g->count = n;
+    lua_pushvalue(L,insts);
+    g->insts = luaL_ref(L,LUA_REGISTRYINDEX);
+
+    lua_pop(L,4); // builtins, binst, insts, index
+    assert( top + 1 == lua_gettop(L) );
+    return 1;
+}
+
+BSGraph* bs_tograph(lua_State* L, int index)
+{
+    return (BSGraph*)luaL_checkudata(L,index,"BSGraph");
+}
+
+void bs_graphinst(lua_State* L, const BSGraph* g, int node)
+{
+    lua_rawgeti(L,LUA_REGISTRYINDEX,g->insts);
+    lua_rawgeti(L,-1,node+1);
+    lua_replace(L,-2);
+}
+
+void bs_graphdepout(lua_State* L, const BSGraph* g, int node)
+{
+    const int top = lua_gettop(L);
+    const BSGraphNode* n = &g->nodes[node];
+
+    bs_graphinst(L,g,node);
+    const int inst = lua_gettop(L);
+
+    lua_createtable(L,n->depCount,0);
+    lua_pushinteger(L,BS_Mixed);
+    lua_setfield(L,-2,"#kind");
+    const int out = lua_gettop(L);
+
+    int nout = 0;
+    int i;
+    for( i = 0; i < n->depCount; i++ )
+    {
+        bs_graphinst(L,g,n->deps[i]);
+        lua_getfield(L,-1,"#out");
+        lua_replace(L,-2);
+        const int subout = lua_gettop(L);
+        int k = BS_Nothing;
+        if( lua_istable(L,subout) )
+        {
+            lua_getfield(L,subout,"#kind");
+            k = lua_tointeger(L,-1);
+            lua_pop(L,1);
+        }
+
+        if( k == BS_Mixed )
+        {
+            const int nsubout = lua_objlen(L,subout);
+            int j;
+            for( j = 1; j <= nsubout; j++ )
+            {
+                lua_rawgeti(L,subout,j);
+                lua_rawseti(L,out,++nout);
+            }
+            lua_pop(L,1); // subout
+        }else if( lua_istable(L,subout) )
+            lua_rawseti(L,out,++nout); // eats subout
+        else
+            lua_pop(L,1);
+    }
+    lua_setfield(L,inst,"#out");
+    lua_pop(L,1); // inst
+    assert( top == lua_gettop(L) );
+}
+
+static const char* proddesig(BSGraphBlock** blocks, lua_State* L, int job, int desigs)
+{
+    // the designator of the product of job, calculated once per product
+    lua_getfield(L,job,"prod");
+    if( !lua_istable(L,-1) )
+    {
+        lua_pop(L,1);
+        return 0;
+    }
+    lua_pushvalue(L,-1);
+    lua_rawget(L,desigs);
+    const char* res = (const char*)lua_touserdata(L,-1);
+    lua_pop(L,1);
+    if( res == 0 )
+    {
+        lua_getfield(L,-1,"#decl");
+        bs_declpath(L,-1,".");
+        res = savestr(blocks,L,-1);
+        lua_pop(L,2); // decl, desig
+        lua_pushvalue(L,-1);
+        lua_pushlightuserdata(L,(void*)res);
+        lua_rawset(L,desigs);
+    }
+    lua_pop(L,1); // prod
+    return res;
+}
+
+BSJobGraph* bs_joblower(lua_State* L, int graph)
+{
+    const int top = lua_gettop(L);
+    if( graph < 0 )
+        graph += top + 1;
+    lua_getfield(L,graph,"jobs");
+    const int jobs = lua_gettop(L);
+    const int n = lua_objlen(L,jobs);
+    lua_createtable(L,0,n);
+    const int index = lua_gettop(L); // job -> index in jobs
+    lua_createtable(L,0,0);
+    const int desigs = lua_gettop(L); // product -> designator
+    int i, j;
+    for( i = 1; i <= n; i++ )
+    {
+        lua_rawgeti(L,jobs,i);
+        lua_pushinteger(L,i);
+        lua_rawset(L,index);
+    }
+
+    // the deps of job i within this graph are the jobs edges[first[i]] to edges[first[i+1]-1]
+    int* first = (int*)malloc((n+2)*sizeof(int));
+    int* edges = 0;
+    int edgeCount = 0, edgeCap = 0;
+    int* wait = (int*)calloc(n+1,sizeof(int));
+    int* dependentCount = (int*)calloc(n+1,sizeof(int));
+    for( i = 1; i <= n; i++ )
+    {
+        first[i] = edgeCount;
+        lua_rawgeti(L,jobs,i);
+        lua_getfield(L,-1,"deps");
+        const int deps = lua_gettop(L);
+        for( j = 1; lua_istable(L,deps) && j <= (int)lua_objlen(L,deps); j++ )
+        {
+            lua_rawgeti(L,deps,j);
+            lua_getfield(L,-1,"graph");
+            const int current = lua_rawequal(L,-1,graph);
+            lua_pop(L,1);
+            lua_rawget(L,index);
+            const int dep = current ? lua_tointeger(L,-1) : 0;
+            lua_pop(L,1);
+            if( dep == 0 )
+                continue;
+            if( edgeCount == edgeCap )
+            {
+                edgeCap = edgeCap ? edgeCap * 2 : 1024;
+                edges = (int*)realloc(edges,edgeCap*sizeof(int));
+            }
+            edges[edgeCount++] = dep;
+            wait[i]++;
+            dependentCount[dep]++;
+        }
+        lua_pop(L,2); // job, deps
+    }
+    first[n+1] = edgeCount;
+
+    // the dependents of job i are the jobs rev[revFirst[i]] to rev[revFirst[i+1]-1]
+    int* revFirst = (int*)malloc((n+2)*sizeof(int));
+    int* rev = (int*)malloc((edgeCount ? edgeCount : 1)*sizeof(int));
+    revFirst[1] = 0;
+    for( i = 1; i <= n; i++ )
+        revFirst[i+1] = revFirst[i] + dependentCount[i];
+    int* fill = (int*)calloc(n+1,sizeof(int));
+    for( i = 1; i <= n; i++ )
+    {
+        for( j = first[i]; j < first[i+1]; j++ )
+        {
+            const int dep = edges[j];
+            rev[revFirst[dep] + fill[dep]++] = i;
+        }
+    }
+
+    // Kahn's algorithm; the jobs which are ready from the start keep their planned order
+    int* order = (int*)malloc((n+1)*sizeof(int));
+    int head = 0, tail = 0;
+    for( i = 1; i <= n; i++ )
+        if( wait[i] == 0 )
+            order[tail++] = i;
+    while( head < tail )
+    {
+        const int job = order[head++];
+        for( j = revFirst[job]; j < revFirst[job+1]; j++ )
+            if( --wait[rev[j]] == 0 )
+                order[tail++] = rev[j];
+    }
+
+    BSJobGraph* g = 0;
+    if( tail == n )
+    {
+        g = (BSJobGraph*)calloc(1,sizeof(BSJobGraph));
+        BSJobNode* nodes = (BSJobNode*)alloc(&g->blocks,n*sizeof(BSJobNode));
+        int* pos = wait; // all zero now, reused as job -> node
+        for( i = 0; i < n; i++ )
+            pos[order[i]] = i;
+        for( i = 0; i < n; i++ )
+        {
+            const int job = order[i];
+            BSJobNode* node = &nodes[i];
+            node->job = job;
+            lua_rawgeti(L,jobs,job);
+            const int t = lua_gettop(L);
+            lua_getfield(L,t,"op");
+            node->op = lua_isnil(L,-1) ? -1 : lua_tointeger(L,-1);
+            lua_getfield(L,t,"cmd");
+            node->cmd = savestr(&g->blocks,L,-1);
+            lua_getfield(L,t,"inputs");
+            node->inputs = savelist(&g->blocks,L,lua_gettop(L),&node->inputCount);
+            lua_getfield(L,t,"outputs");
+            node->outputs = savelist(&g->blocks,L,lua_gettop(L),&node->outputCount);
+            lua_pop(L,4); // op, cmd, inputs, outputs
+            node->product = proddesig(&g->blocks,L,t,desigs);
+            lua_pop(L,1); // job
+
+            int* deps = (int*)alloc(&g->blocks,(first[job+1] - first[job])*sizeof(int));
+            node->depCount = 0;
+            for( j = first[job]; j < first[job+1]; j++ )
+                deps[node->depCount++] = pos[edges[j]];
+            node->deps = deps;
+            int* dependents = (int*)alloc(&g->blocks,dependentCount[job]*sizeof(int));
+            node->dependentCount = 0;
+            for( j = revFirst[job]; j < revFirst[job+1]; j++ )
+                dependents[node->dependentCount++] = pos[rev[j]];
+            node->dependents = dependents;
+        }
+        g->nodes = nodes;
+        g->count = n;
+    }
+
+    free(first);
+    free(edges);
+    free(wait);
+    free(dependentCount);
+    free(revFirst);
+    free(rev);
+    free(fill);
+    free(order);
+    lua_pop(L,3); // jobs, index, desigs
+    assert( top == lua_gettop(L) );
+    return g;
+}
+
+void bs_jobfree(BSJobGraph* g)
+{
+    if( g == 0 )
+        return;
+    freeblocks(&g->blocks);
+    free(g);
+}
@@ -0,0 +1,117 @@
+#ifndef BSGRAPH_H
+#define BSGRAPH_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "lua.h"
+
+// After the products to build are selected, they and everything they depend on are lowered once to the graph
+// below: one node per product instance in topological order, with the class, the resolved sources, the flags
+// collected from the configs and the deps as node indices. The runner, the visitor and the generators walk
+// this graph instead of the deps and configs of the product tables. The strings are copied, so the nodes
+// don't change and can be read without the lua_State. What the products pass on to each other (the #out of
+// the instances) is still calculated when the graph is walked, since it depends on the backend.
+
+typedef enum BSProductKind { BS_NoProduct,
+                             BS_LibraryProduct, BS_ExecutableProduct, BS_SourceSetProduct,
+                             BS_GroupProduct, BS_ConfigProduct,
+                             BS_LuaScriptProduct, BS_LuaScriptForeachProduct,
+                             BS_CopyProduct, BS_MessageProduct,
+                             BS_MocProduct, BS_RccProduct, BS_UicProduct
+                           } BSProductKind;
+
+typedef enum BSFlagList { // named after the fields of Config
+                          BS_cflags, BS_cflags_c, BS_cflags_cc, BS_cflags_objc, BS_cflags_objcc,
+                          BS_defines, BS_include_dirs,
+                          BS_ldflags, BS_lib_dirs, BS_lib_names, BS_lib_files, BS_frameworks,
+                          BS_FlagListCount
+                        } BSFlagList;
+
+typedef struct BSStrings {
+    const char* const* items;
+    int count;
+    int defaults; // the first items come from the defaults of the toolchain (see set_defaults)
+} BSStrings;
+
+typedef struct BSGraphNode {
+    int kind; // BSProductKind; decides which tools build the product
+    const char* name; // the designator of the product, e.g. "a.b.lib"
+    int toHost;
+    int toolchain; // BSToolchain, only set for Library, Executable and SourceSet, else BS_notc
+    int os; // BSOperatingSystem, dito
+    BSStrings inputs; // the declared sources as absolute, normalized paths; Copy adds the files of its deps
+    BSStrings outputs; // the file linked by Library and Executable, the outputs of LuaScript
+    BSStrings flags[BS_FlagListCount]; // the configs first, depth-first, then the fields of the product;
+                                       // the paths are absolute and normalized
+    const char* pch; // dito; the one of the product wins over the ones of the configs, 0 if none
+    const char* defFile; // dito; 0 if none
+    const int* deps; // in the order of the deps field, all with a lower index
+    int depCount;
+} BSGraphNode;
+
+typedef struct BSGraphBlock BSGraphBlock;
+
+typedef struct BSGraph {
+    const BSGraphNode* nodes;
+    int count;
+    int insts; // registry reference to the array of the product instances; the one of node i is at i+1
+    BSGraphBlock* blocks; // the memory of the nodes, arrays and strings
+} BSGraph;
+
+extern int bs_graphlower(lua_State* L);
+// param: array of productinst
+// returns: the graph as userdata; it is freed by the garbage collector
+extern BSGraph* bs_tograph(lua_State* L, int index);
+extern void bs_graphinst(lua_State* L, const BSGraph*, int node); // pushes the product instance of node
+extern void bs_graphdepout(lua_State* L, const BSGraph*, int node);
+// sets the #out of the product instance of node to a BS_Mixed with everything its deps pass on
+
+// The runner plans the jobs of a build in Lua tables, since planning needs the product tables anyway. Before
+// the jobs are run, they are lowered to the flat representation below in the same way: one node per job in
+// topological order, with the strings copied and the dependencies as node indices. The scheduler of the runner
+// works on it in plain C.
+
+typedef struct BSJobNode {
+    int job; // index of the job in the jobs table of the Lua graph
+    int op; // the BSBuildOperation of the job, -1 for the barrier which ends a product
+    const char* product; // the designator of the product, 0 if none
+    const char* cmd; // 0 if the job runs within BUSY, e.g. a Lua script
+    const char* const* inputs;
+    int inputCount;
+    const char* const* outputs;
+    int outputCount;
+    const int* deps; // the nodes which have to finish before this one, all with a lower index
+    int depCount;
+    const int* dependents; // the nodes which wait for this one, all with a higher index
+    int dependentCount;
+} BSJobNode;
+
+typedef struct BSJobGraph {
+    const BSJobNode* nodes;
+    int count;
+    BSGraphBlock* blocks;
+} BSJobGraph;
+
+extern BSJobGraph* bs_joblower(lua_State* L, int graph);
+    // graph is the Lua job graph; the deps which belong to other graphs are left out since these graphs are
+    // finished already; returns 0 if the jobs depend on each other in a cycle
+extern void bs_jobfree(BSJobGraph*);
+
+#endif // BSGRAPH_H
@@ -49,6 +49,7 @@ int bs_mkdir2(const char* denormalizedPath)
 {
     // TODO: is the Windows version expecting ANSI or UTF-8?
     const int res = _mkdir(denormalizedPath);
+    bs_invalidate2(denormalizedPath);
     if( res == -1 && errno == EEXIST )
         return 0;
     else
@@ -62,6 +63,24 @@ int bs_mkdir2(const char* denormalizedPath)
 #include <sys/stat.h>
 #include <errno.h>
 #include <utime.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
+extern char **environ;
 
 // https://stackoverflow.com/questions/933850/how-do-i-find-the-location-of-the-executable-in-c
 static int appPath(char* buf, int len)
@@ -85,6 +104,7 @@ static int appPath(char* buf, int len)
 int bs_mkdir2(const char* denormalizedPath)
 {
     const int res = mkdir(denormalizedPath,0777); // returns 0 on success, -1 otherwise
+    bs_invalidate2(denormalizedPath);
     if( res == -1 && errno == EEXIST )
         return 0;
     else
@@ -338,13 +358,9 @@ BSPathStatus bs_thisapp()
 // https://stackoverflow.com/questions/7430248/creating-a-new-directory-in-c
 // https://stackoverflow.com/questions/6094665/how-does-stat-under-windows-exactly-work
 // https://stackoverflow.com/questions/230062/whats-the-best-way-to-check-if-a-file-exists-in-c
-time_t bs_exists(const char* normalizedPath)
+BSTime bs_exists(const char* normalizedPath)
 {
-    struct stat st = {0};
-    if( stat(bs_denormalize_path(normalizedPath), &st) == 0 )
-        return st.st_mtime;
-    else
-        return 0;
+    return bs_exists2(bs_denormalize_path(normalizedPath));
 }
 
 int bs_forbidden_fschar(unsigned int ch)
@@ -549,12 +565,449 @@ FILE* bs_fopen(const char* path, const char* modes)
     return fopen(path,modes);
 }
 
+#ifdef _WIN32
 int bs_exec(const char* cmd)
 {
     // TODO convert from utf-8
     return system(cmd);
 }
 
+static HANDLE s_procs[MAXIMUM_WAIT_OBJECTS];
+static int s_procIds[MAXIMUM_WAIT_OBJECTS];
+static char s_procIsThread[MAXIMUM_WAIT_OBJECTS]; // started by bs_spawncopy
+static HANDLE s_procJobs[MAXIMUM_WAIT_OBJECTS]; // the job object of the process, or NULL
+static int s_procCount = 0;
+static int s_nextProcId = 0;
+
+static int startproc(char* line)
+{
+    if( s_procCount >= MAXIMUM_WAIT_OBJECTS )
+        return -1;
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    memset(&si,0,sizeof(si));
+    si.cb = sizeof(si);
+    memset(&pi,0,sizeof(pi));
+    // the tool can be a child of cmd.exe, so its peak memory is only known by a job object which contains both;
+    // the process is started suspended so it is in the job before it can start the tool
+    HANDLE job = CreateJobObjectA(NULL, NULL);
+    if( !CreateProcessA(NULL, line, NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &pi) )
+    {
+        if( job != NULL )
+            CloseHandle(job);
+        return -1;
+    }
+    if( job != NULL && !AssignProcessToJobObject(job, pi.hProcess) )
+    {
+        CloseHandle(job); // e.g. BUSY itself runs in a job which doesn't allow nesting (before Windows 8)
+        job = NULL;
+    }
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    s_procs[s_procCount] = pi.hProcess;
+    s_procJobs[s_procCount] = job;
+    s_procIsThread[s_procCount] = 0;
+    s_procIds[s_procCount] = s_nextProcId++;
+    return s_procIds[s_procCount++];
+}
+
+int bs_spawn(const char* cmd)
+{
+    // same interpretation of the command line as by system()
+    const char* prefix = "cmd.exe /c ";
+    char* line = (char*)malloc(strlen(prefix)+strlen(cmd)+1);
+    strcpy(line,prefix);
+    strcat(line,cmd);
+    const int res = startproc(line);
+    free(line);
+    return res;
+}
+
+static char* joinargs(char* const argv[])
+{
+    // CreateProcess takes a command line which the program splits like CommandLineToArgvW: each arg is quoted,
+    // a quote in it is escaped by a backslash and the backslashes before a quote or the end are doubled
+    int len = 1, i;
+    for( i = 0; argv[i] != 0; i++ )
+        len += 2 * strlen(argv[i]) + 3;
+    char* line = (char*)malloc(len);
+    char* out = line;
+    for( i = 0; argv[i] != 0; i++ )
+    {
+        if( i != 0 )
+            *out++ = ' ';
+        *out++ = '"';
+        const char* p;
+        int slashes = 0;
+        for( p = argv[i]; *p; p++ )
+        {
+            if( *p == '\\' )
+                slashes++;
+            else
+            {
+                if( *p == '"' )
+                {
+                    for( ; slashes >= 0; slashes-- )
+                        *out++ = '\\';
+                }
+                slashes = 0;
+            }
+            *out++ = *p;
+        }
+        for( ; slashes > 0; slashes-- )
+            *out++ = '\\';
+        *out++ = '"';
+    }
+    *out = 0;
+    return line;
+}
+
+int bs_spawnv(char* const argv[])
+{
+    // the program is started directly, not by cmd.exe
+    char* line = joinargs(argv);
+    const int res = startproc(line);
+    free(line);
+    return res;
+}
+
+static int finish(int i, int* status, unsigned int* peakMem)
+{
+    // collects the result of the process or thread at index i of the table, which has finished
+    DWORD code = 1;
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+    if( peakMem )
+        *peakMem = 0; // i.e. unknown
+    if( s_procIsThread[i] )
+        GetExitCodeThread(s_procs[i],&code);
+    else
+    {
+        GetExitCodeProcess(s_procs[i],&code);
+        // the largest committed memory of any process in the job, i.e. of the tool and not of cmd.exe
+        if( peakMem && s_procJobs[i] != NULL && QueryInformationJobObject(s_procJobs[i],
+                            JobObjectExtendedLimitInformation, &info, sizeof(info), NULL) )
+            *peakMem = (unsigned int)(info.PeakProcessMemoryUsed / 1024);
+    }
+    CloseHandle(s_procs[i]);
+    if( s_procJobs[i] != NULL )
+        CloseHandle(s_procJobs[i]);
+    const int id = s_procIds[i];
+    s_procCount--;
+    s_procs[i] = s_procs[s_procCount];
+    s_procJobs[i] = s_procJobs[s_procCount];
+    s_procIsThread[i] = s_procIsThread[s_procCount];
+    s_procIds[i] = s_procIds[s_procCount];
+    if( status )
+        *status = code;
+    return id;
+}
+
+int bs_execv(char* const argv[])
+{
+    const int id = bs_spawnv(argv);
+    if( id < 0 )
+    {
+        fprintf(stderr,"# ERR: cannot start process: %s\n", argv[0]);
+        fflush(stderr);
+        return -1;
+    }
+    int i = 0, status = -1;
+    while( s_procIds[i] != id )
+        i++;
+    WaitForSingleObject(s_procs[i], INFINITE);
+    finish(i,&status,0);
+    return status;
+}
+
+int bs_wait(int* status, unsigned int* peakMem)
+{
+    if( s_procCount == 0 )
+        return -1;
+    const DWORD res = WaitForMultipleObjects(s_procCount, s_procs, FALSE, INFINITE);
+    if( res < WAIT_OBJECT_0 || res >= WAIT_OBJECT_0 + s_procCount )
+        return -1;
+    return finish(res - WAIT_OBJECT_0,status,peakMem);
+}
+
+int bs_cpucount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+unsigned int bs_memavailable(void)
+{
+    MEMORYSTATUSEX ms;
+    ms.dwLength = sizeof(ms);
+    if( !GlobalMemoryStatusEx(&ms) )
+        return 0;
+    return (unsigned int)(ms.ullAvailPhys / (1024 * 1024));
+}
+#else
+static char** splitcmd(const char* cmd)
+{
+    // splits cmd into words the same way as sh does for the quoting used by BUSY; returns a malloc'ed,
+    // null terminated argv, or 0 if cmd uses redirection, pipes, variables, globbing or the like which
+    // require a shell
+    const int len = strlen(cmd);
+    const int maxArgs = len / 2 + 2; // each word takes at least one char and a separator, or two quotes
+    char** argv = (char**)malloc(maxArgs * sizeof(char*) + len + 1);
+    if( argv == 0 )
+        return 0;
+    char* out = (char*)(argv + maxArgs);
+    const char* p = cmd;
+    int argc = 0, ok = 1;
+    while( ok )
+    {
+        while( *p == ' ' || *p == '\t' )
+            p++;
+        if( *p == 0 )
+            break;
+        argv[argc++] = out;
+        if( *p == '#' || *p == '~' )
+            ok = 0; // comment or home expansion
+        while( ok && *p != 0 && *p != ' ' && *p != '\t' )
+        {
+            if( *p == '\'' )
+            {
+                p++;
+                while( *p != 0 && *p != '\'' )
+                    *out++ = *p++;
+                if( *p == 0 )
+                    ok = 0;
+                else
+                    p++;
+            }else if( *p == '"' )
+            {
+                p++;
+                while( ok && *p != 0 && *p != '"' )
+                {
+                    if( *p == '\\' && p[1] != 0 && strchr("\\\"$`",p[1]) != 0 )
+                        p++;
+                    else if( *p == '$' || *p == '`' )
+                        ok = 0;
+                    *out++ = *p++;
+                }
+                if( *p == 0 )
+                    ok = 0;
+                else
+                    p++;
+            }else if( *p == '\\' )
+            {
+                p++;
+                if( *p == 0 || *p == '\n' )
+                    ok = 0;
+                else
+                    *out++ = *p++;
+            }else if( strchr("|&;<>()$`*?[\n", *p) != 0 || ( *p == '=' && argc == 1 ) )
+                ok = 0;
+            else
+                *out++ = *p++;
+        }
+        *out++ = 0;
+    }
+    if( !ok || argc == 0 )
+    {
+        free(argv);
+        return 0;
+    }
+    argv[argc] = 0;
+    return argv;
+}
+
+int bs_spawnv(char* const argv[])
+{
+    pid_t pid;
+    if( posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0 )
+        return -1;
+    return pid;
+}
+
+int bs_spawn(const char* cmd)
+{
+    // runs the tool directly if the command line doesn't require a shell
+    char** argv = splitcmd(cmd);
+    if( argv == 0 )
+    {
+        char* const sh[] = { "/bin/sh", "-c", (char*)cmd, 0 };
+        return bs_spawnv(sh);
+    }
+    const int pid = bs_spawnv(argv);
+    free(argv);
+    return pid;
+}
+
+static int waitfor(pid_t pid, const char* what)
+{
+    if( pid < 0 )
+    {
+        fprintf(stderr,"# ERR: cannot start process: %s\n", what);
+        fflush(stderr);
+        return -1;
+    }
+    int st = 0;
+    pid_t res;
+    do
+    {
+        res = waitpid(pid,&st,0);
+    }while( res == -1 && errno == EINTR );
+    if( res == -1 )
+        return -1;
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : ( st ? st : -1 );
+}
+
+int bs_exec(const char* cmd)
+{
+    return waitfor(bs_spawn(cmd),cmd);
+}
+
+int bs_execv(char* const argv[])
+{
+    return waitfor(bs_spawnv(argv),argv[0]);
+}
+
+int bs_wait(int* status, unsigned int* peakMem)
+{
+    int st = 0;
+    pid_t pid;
+    struct rusage ru;
+    memset(&ru,0,sizeof(ru));
+    do
+    {
+        // the rusage includes the children of the process it waited for, e.g. cc1 started by gcc
+        pid = wait4(-1,&st,0,&ru);
+    }while( pid == -1 && errno == EINTR );
+    if( pid == -1 )
+        return -1;
+    if( status )
+        *status = WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : ( st ? st : -1 );
+    if( peakMem )
+#ifdef __APPLE__
+        *peakMem = (unsigned int)(ru.ru_maxrss / 1024); // bytes on macOS
+#else
+        *peakMem = (unsigned int)ru.ru_maxrss; // kilobytes
+#endif
+    return pid;
+}
+
+int bs_cpucount()
+{
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+unsigned int bs_memavailable(void)
+{
+    // MemAvailable also counts the page cache which can be reclaimed, unlike the free pages
+    FILE* f = fopen("/proc/meminfo","r");
+    if( f != NULL )
+    {
+        char line[128];
+        unsigned long long kb = 0;
+        int found = 0;
+        while( !found && fgets(line,sizeof(line),f) != NULL )
+            found = sscanf(line,"MemAvailable: %llu kB",&kb) == 1;
+        fclose(f);
+        if( found )
+            return (unsigned int)(kb / 1024);
+    }
+#ifdef _SC_AVPHYS_PAGES
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+    const long size = sysconf(_SC_PAGESIZE);
+    if( pages > 0 && size > 0 )
+        return (unsigned int)((unsigned long long)pages * size / (1024 * 1024));
+#endif
+    return 0;
+}
+#endif
+
+BSHash bs_hash(const char* data, int len, BSHash h)
+{
+    int i;
+    for( i = 0; i < len; i++ )
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int bs_hashfile(const char* denormalizedPath, BSHash* h)
+{
+    FILE* f = bs_fopen(denormalizedPath,"rb");
+    if( f == NULL )
+        return -1;
+    char buf[16384];
+    size_t n;
+    while( ( n = fread(buf,1,sizeof(buf),f) ) > 0 )
+        *h = bs_hash(buf,n,*h);
+    fclose(f);
+    return 0;
+}
+
+static int findtoken(const char* data, size_t len, const char* const* tokens)
+{
+    size_t i;
+    for( i = 0; i < len; i++ )
+    {
+        if( i > 0 && ( isalnum((unsigned char)data[i-1]) || data[i-1] == '_' ) )
+            continue;
+        int j;
+        for( j = 0; tokens[j] != 0; j++ )
+        {
+            if( data[i] != tokens[j][0] )
+                continue;
+            const size_t n = strlen(tokens[j]);
+            if( i + n <= len && memcmp(data+i,tokens[j],n) == 0 &&
+                    ( i + n == len || !( isalnum((unsigned char)data[i+n]) || data[i+n] == '_' ) ) )
+                return j + 1;
+        }
+    }
+    return 0;
+}
+
+int bs_findtoken(const char* denormalizedPath, const char* const* tokens)
+{
+#ifdef _WIN32
+    FILE* f = bs_fopen(denormalizedPath,"rb");
+    if( f == NULL )
+        return -1;
+    fseek(f,0,SEEK_END);
+    const long len = ftell(f);
+    fseek(f,0,SEEK_SET);
+    char* data = (char*)malloc(len+1);
+    int res = -1;
+    if( data != NULL && fread(data,1,len,f) == (size_t)len )
+        res = findtoken(data,len,tokens);
+    free(data);
+    fclose(f);
+    return res;
+#else
+    const int fd = open(denormalizedPath,O_RDONLY);
+    if( fd < 0 )
+        return -1;
+    struct stat st;
+    int res = -1;
+    if( fstat(fd,&st) == 0 )
+    {
+        if( st.st_size == 0 )
+            res = 0;
+        else
+        {
+            void* p = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if( p != MAP_FAILED )
+            {
+                res = findtoken((const char*)p,st.st_size,tokens);
+                munmap(p,st.st_size);
+            }
+        }
+    }
+    close(fd);
+    return res;
+#endif
+}
+
 const char*bs_filename(const char* path)
 {
 #if 0
@@ -725,38 +1178,635 @@ BSPathStatus bs_apply_source_expansion(const char* source, const char* string, i
     return BS_OK;
 }
 
-time_t bs_exists2(const char* denormalizedPath)
+// the stat cache is an open addressing hash table from denormalized path to changed time
+typedef struct StatEntry {
+    char* path;
+    BSTime time;
+} StatEntry;
+static StatEntry* s_stats = 0;
+static unsigned int s_statCap = 0; // a power of two
+static unsigned int s_statCount = 0;
+
+static StatEntry* findstat(const char* path)
 {
-    struct stat st = {0};
-    if( stat(denormalizedPath, &st) == 0 )
-        return st.st_mtime;
-    else
+    unsigned int i = (unsigned int)bs_hash(path,strlen(path),BS_HASH_INIT) & (s_statCap - 1);
+    while( s_stats[i].path != 0 && strcmp(s_stats[i].path,path) != 0 )
+        i = ( i + 1 ) & (s_statCap - 1);
+    return &s_stats[i];
+}
+
+#ifndef _WIN32
+static BSTime stattime(const struct stat* st)
+{
+#if defined(__APPLE__)
+    return (BSTime)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(st_mtime) || defined(__linux__)
+    return (BSTime)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+    return (BSTime)st->st_mtime * 1000000000;
+#endif
+}
+#endif
+
+static BSTime filetime(const char* denormalizedPath)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if( !GetFileAttributesExA(denormalizedPath, GetFileExInfoStandard, &data) )
         return 0;
+    // FILETIME counts 100ns intervals since 1601-01-01
+    const BSTime t = ( (BSTime)data.ftLastWriteTime.dwHighDateTime << 32 ) | data.ftLastWriteTime.dwLowDateTime;
+    return ( t - 116444736000000000LL ) * 100;
+#else
+    struct stat st;
+    if( stat(denormalizedPath, &st) != 0 )
+        return 0;
+    return stattime(&st);
+#endif
 }
 
-int bs_copy(const char* normalizedToPath, const char* normalizedFromPath)
+BSTime bs_exists2(const char* denormalizedPath)
+{
+    if( ( s_statCount + 1 ) * 2 > s_statCap )
+    {
+        StatEntry* old = s_stats;
+        const unsigned int oldCap = s_statCap;
+        s_statCap = oldCap ? oldCap * 2 : 1024;
+        s_stats = (StatEntry*)calloc(s_statCap,sizeof(StatEntry));
+        unsigned int i;
+        for( i = 0; i < oldCap; i++ )
+        {
+            if( old[i].path != 0 )
+                *findstat(old[i].path) = old[i];
+        }
+        free(old);
+    }
+    StatEntry* e = findstat(denormalizedPath);
+    if( e->path == 0 )
+    {
+        e->path = (char*)malloc(strlen(denormalizedPath)+1);
+        strcpy(e->path,denormalizedPath);
+        e->time = filetime(denormalizedPath);
+        s_statCount++;
+    }
+    return e->time;
+}
+
+void bs_invalidate2(const char* denormalizedPath)
+{
+    unsigned int i;
+    if( denormalizedPath == 0 )
+    {
+        for( i = 0; i < s_statCap; i++ )
+            free(s_stats[i].path);
+        free(s_stats);
+        s_stats = 0;
+        s_statCap = 0;
+        s_statCount = 0;
+        return;
+    }
+    if( s_statCount == 0 )
+        return;
+    StatEntry* e = findstat(denormalizedPath);
+    if( e->path != 0 )
+        e->time = filetime(denormalizedPath); // keeping the entry avoids rehashing the cluster
+}
+
+void bs_invalidate(const char* normalizedPath)
+{
+    bs_invalidate2( normalizedPath ? bs_denormalize_path(normalizedPath) : 0 );
+}
+
+#ifdef _WIN32
+static int samefile(const char* to, const char* from)
+{
+    WIN32_FILE_ATTRIBUTE_DATA a, b;
+    if( !GetFileAttributesExA(from, GetFileExInfoStandard, &a) || !GetFileAttributesExA(to, GetFileExInfoStandard, &b) )
+        return 0;
+    if( a.nFileSizeHigh != b.nFileSizeHigh || a.nFileSizeLow != b.nFileSizeLow )
+        return 0;
+    if( CompareFileTime(&a.ftLastWriteTime,&b.ftLastWriteTime) == 0 )
+        return 1;
+    BSHash ha = BS_HASH_INIT, hb = BS_HASH_INIT;
+    if( bs_hashfile(from,&ha) != 0 || bs_hashfile(to,&hb) != 0 || ha != hb )
+        return 0;
+    // same content; give it the time of from so it is up-to-date next time
+    HANDLE h = CreateFileA(to, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, 0);
+    if( h != INVALID_HANDLE_VALUE )
+    {
+        SetFileTime(h, 0, 0, &a.ftLastWriteTime);
+        CloseHandle(h);
+    }
+    return 1;
+}
+
+static int copyfile(const char* to, const char* from, int mode)
+{
+    // doesn't touch the stat cache nor global buffers, so it can run in a thread
+    if( mode == BS_CopyFile || mode == BS_RefLink )
+    {
+        if( samefile(to,from) )
+            return 0;
+    }
+    DeleteFileA(to);
+    if( mode == BS_SymLink && CreateSymbolicLinkA(to, from, 0x2) ) // SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE
+        return 0;
+    if( mode == BS_HardLink && CreateHardLinkA(to, from, 0) )
+        return 0;
+    // CopyFile keeps the changed time of from
+    return CopyFileA(from, to, FALSE ) ? 0 : -1;
+}
+#else
+static int samefile(const char* to, const char* from, const struct stat* src, int mode)
+{
+    struct stat dst;
+    if( lstat(to,&dst) != 0 )
+        return 0;
+    if( mode == BS_SymLink )
+    {
+        char buf[PATH_MAX];
+        const ssize_t len = readlink(to,buf,sizeof(buf)-1);
+        if( len < 0 )
+            return 0;
+        buf[len] = 0;
+        return strcmp(buf,from) == 0;
+    }
+    if( !S_ISREG(dst.st_mode) )
+        return 0;
+    if( dst.st_dev == src->st_dev && dst.st_ino == src->st_ino )
+        return 1; // a hardlink of from
+    if( mode == BS_HardLink || dst.st_size != src->st_size )
+        return 0;
+    if( stattime(&dst) == stattime(src) )
+        return 1;
+    BSHash a = BS_HASH_INIT, b = BS_HASH_INIT;
+    if( bs_hashfile(from,&a) != 0 || bs_hashfile(to,&b) != 0 || a != b )
+        return 0;
+    // same content; give it the time of from so it is up-to-date next time
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1].tv_sec = stattime(src) / 1000000000;
+    ts[1].tv_nsec = stattime(src) % 1000000000;
+    utimensat(AT_FDCWD, to, ts, 0);
+    return 1;
+}
+
+static int copydata(int in, int out, off_t size)
+{
+    off_t done = 0;
+#ifdef SYS_copy_file_range
+    // the kernel copies the data without passing it through user space, or shares the extents (e.g. on NFS)
+    while( done < size )
+    {
+        const ssize_t n = syscall(SYS_copy_file_range, in, 0, out, 0, (size_t)( size - done ), 0);
+        if( n <= 0 )
+            break;
+        done += n;
+    }
+    if( done == size )
+        return 0;
+#endif
+#ifdef __linux__
+    while( done < size )
+    {
+        const ssize_t n = sendfile(out, in, 0, (size_t)( size - done ));
+        if( n <= 0 )
+            break;
+        done += n;
+    }
+    if( done == size )
+        return 0;
+#endif
+    char buf[65536];
+    if( lseek(in,done,SEEK_SET) < 0 || lseek(out,done,SEEK_SET) < 0 )
+        return -1;
+    for(;;)
+    {
+        const ssize_t n = read(in,buf,sizeof(buf));
+        if( n == 0 )
+            return 0;
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        ssize_t w = 0;
+        while( w < n )
+        {
+            const ssize_t res = write(out,buf+w,n-w);
+            if( res < 0 && errno != EINTR )
+                return -1;
+            if( res > 0 )
+                w += res;
+        }
+    }
+}
+
+static int copyfile(const char* to, const char* from, int mode)
+{
+    // doesn't touch the stat cache nor global buffers, so it can run in a forked process
+    const int in = open(from,O_RDONLY);
+    if( in < 0 )
+        return -1;
+    struct stat src;
+    if( fstat(in,&src) != 0 )
+    {
+        close(in);
+        return -1;
+    }
+    if( samefile(to,from,&src,mode) )
+    {
+        close(in);
+        return 0;
+    }
+    // to could be a link to from, thus never write through it
+    unlink(to);
+    if( ( mode == BS_SymLink && symlink(from,to) == 0 ) || ( mode == BS_HardLink && link(from,to) == 0 ) )
+    {
+        close(in);
+        return 0;
+    }
+#ifdef __APPLE__
+    if( mode == BS_RefLink && clonefile(from,to,0) == 0 )
+    {
+        close(in);
+        return 0;
+    }
+#endif
+    // otherwise copy, also if a link cannot be made (e.g. across file systems)
+    const int out = open(to,O_WRONLY|O_CREAT|O_TRUNC,src.st_mode & 0777);
+    if( out < 0 )
+    {
+        close(in);
+        return -1;
+    }
+    int res = -1;
+#ifdef FICLONE
+    if( mode == BS_RefLink && ioctl(out,FICLONE,in) == 0 )
+        res = 0;
+#endif
+    if( res != 0 )
+        res = copydata(in,out,src.st_size);
+    if( res == 0 )
+    {
+        // the copy keeps the changed time of from, like a link, so size and time tell whether it is up-to-date
+        struct timespec ts[2];
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec = stattime(&src) / 1000000000;
+        ts[1].tv_nsec = stattime(&src) % 1000000000;
+        futimens(out,ts);
+    }
+    close(in);
+    if( close(out) != 0 )
+        res = -1;
+    if( res != 0 )
+        unlink(to);
+    return res;
+}
+#endif
+
+int bs_copy2(const char* normalizedToPath, const char* normalizedFromPath, int mode)
 {
     bs_apply_source_expansion(normalizedToPath,"{{source_dir}}",0);
     bs_mkrdir2(bs_global_buffer());
 
+    const int res = copyfile(bs_denormalize_path(normalizedToPath), bs_denormalize_path(normalizedFromPath), mode);
+    bs_invalidate(normalizedToPath);
+    return res;
+}
+
+int bs_copy(const char* normalizedToPath, const char* normalizedFromPath)
+{
+    return bs_copy2(normalizedToPath,normalizedFromPath,BS_CopyFile);
+}
+
+#define BS_SPAWN_COPY_SIZE 1000000 // smaller files are copied faster than a process or thread is started
+
 #ifdef _WIN32
-    return CopyFileA(bs_denormalize_path(normalizedFromPath), bs_denormalize_path(normalizedToPath), FALSE ) ? 0 : -1; // returns 0 on success, -1 otherwise
-#else
+typedef struct CopyArgs {
+    char* to;
+    char* from;
+    int mode;
+} CopyArgs;
+
+static DWORD WINAPI copythread(LPVOID data)
+{
+    CopyArgs* args = (CopyArgs*)data;
+    const int res = copyfile(args->to,args->from,args->mode);
+    free(args->to);
+    free(args->from);
+    free(args);
+    return res == 0 ? 0 : 1;
+}
+#endif
+
+int bs_spawncopy(const char* normalizedToPath, const char* normalizedFromPath, int mode, int* status)
+{
+    bs_apply_source_expansion(normalizedToPath,"{{source_dir}}",0);
+    bs_mkrdir2(bs_global_buffer());
+
     const char* to = bs_denormalize_path(normalizedToPath);
     const char* from = bs_denormalize_path(normalizedFromPath);
-    const int fromLen = strlen(from);
-    const int toLen = 3+fromLen+strlen(to)+2;
-    char* cmd = (char*)malloc(toLen+1);
-    strcpy(cmd,"cp ");
-    strcpy(cmd+3,from);
-    *(cmd+3+fromLen) = ' ';
-    strcpy(cmd+3+1+fromLen,to);
-    cmd[toLen] = 0;
-    // fprintf(stdout,"%s\n",cmd);
-    // fflush(stdout);
-    const int res = bs_exec(cmd);
-    free(cmd);
+    *status = 0;
+    if( mode == BS_CopyFile || mode == BS_RefLink )
+    {
+        const BSTime t = bs_exists2(from);
+        // bs_exists2 doesn't know the size, so use the stat of the platform
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        const int big = t != 0 && GetFileAttributesExA(from, GetFileExInfoStandard, &data) &&
+                ( data.nFileSizeHigh != 0 || data.nFileSizeLow >= BS_SPAWN_COPY_SIZE );
+        if( big && s_procCount < MAXIMUM_WAIT_OBJECTS )
+        {
+            CopyArgs* args = (CopyArgs*)malloc(sizeof(CopyArgs));
+            args->to = _strdup(to);
+            args->from = _strdup(from);
+            args->mode = mode;
+            HANDLE h = CreateThread(NULL, 0, copythread, args, 0, NULL);
+            if( h != NULL )
+            {
+                s_procs[s_procCount] = h;
+                s_procJobs[s_procCount] = NULL;
+                s_procIsThread[s_procCount] = 1;
+                s_procIds[s_procCount] = s_nextProcId++;
+                return s_procIds[s_procCount++];
+            }
+            free(args->to);
+            free(args->from);
+            free(args);
+        }
+#else
+        struct stat st;
+        if( t != 0 && stat(from,&st) == 0 && st.st_size >= BS_SPAWN_COPY_SIZE )
+        {
+            fflush(stdout);
+            fflush(stderr);
+            const pid_t pid = fork();
+            if( pid == 0 )
+                _exit( copyfile(to,from,mode) == 0 ? 0 : 1 );
+            if( pid > 0 )
+                return pid;
+        }
+#endif
+    }
+    *status = copyfile(to,from,mode);
+    bs_invalidate2(to);
+    return 0;
+}
+
+long long bs_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (long long)( (double)c.QuadPart * 1000000.0 / (double)f.QuadPart );
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// GNU make passes its jobserver to the commands it starts in MAKEFLAGS, as a pair of pipe descriptors
+// (--jobserver-auth=R,W or --jobserver-fds=R,W in older versions), a named pipe (--jobserver-auth=fifo:PATH)
+// or a semaphore on Windows (--jobserver-auth=NAME). Each process may run one job without a token; for each
+// further job it reads a token (one byte) and writes the same byte back when the job is done.
+#define BS_MAX_TOKENS 1024
+static char s_tokens[BS_MAX_TOKENS]; // the tokens held by this process
+static int s_tokenCount = 0;
+static int s_joined = 0; // 1 if connected to a jobserver, either of a parent make or our own
+static char* s_oldMakeflags = 0; // MAKEFLAGS before this process created its own jobserver
+static int s_ownServer = 0;
+#ifdef _WIN32
+static HANDLE s_sem = NULL;
+#else
+static int s_readFd = -1; // non-blocking if possible
+static int s_writeFd = -1;
+static int s_ownRead = 0; // s_readFd was opened by this process
+static int s_pipe[2] = { -1, -1 }; // the pipe of our own jobserver
+#endif
+
+static const char* jobserverarg(const char* flags)
+{
+    // returns the value of the last jobserver option in flags, or 0 if there is none
+    const char* res = 0;
+    const char* p = flags;
+    while( p != 0 && *p )
+    {
+        const char* q = strstr(p,"--jobserver-auth=");
+        const char* r = strstr(p,"--jobserver-fds=");
+        if( q == 0 && r == 0 )
+            break;
+        if( q == 0 || ( r != 0 && r < q ) )
+            res = p = r + strlen("--jobserver-fds=");
+        else
+            res = p = q + strlen("--jobserver-auth=");
+    }
     return res;
+}
+
+static void setmakeflags(const char* value)
+{
+#ifdef _WIN32
+    _putenv_s("MAKEFLAGS", value ? value : "");
+#else
+    if( value )
+        setenv("MAKEFLAGS", value, 1);
+    else
+        unsetenv("MAKEFLAGS");
+#endif
+}
+
+#ifndef _WIN32
+static int nonblocking(int fd)
+{
+    // the descriptors of a pipe are shared with other processes, so they have to stay blocking; on Linux a
+    // non-blocking descriptor of our own can be opened for the same pipe; returns -1 if not possible
+    char proc[64];
+    sprintf(proc,"/proc/self/fd/%d",fd);
+    return open(proc, O_RDONLY | O_NONBLOCK);
+}
+#endif
+
+int bs_jobserver_open(int maxJobs)
+{
+    bs_jobserver_close();
+    const char* flags = getenv("MAKEFLAGS");
+    const char* arg = jobserverarg(flags);
+    if( arg != 0 )
+    {
+        // join the jobserver of the make which started us
+        int len = 0;
+        while( arg[len] && !isspace((unsigned char)arg[len]) )
+            len++;
+        char* name = (char*)malloc(len+1);
+        memcpy(name,arg,len);
+        name[len] = 0;
+#ifdef _WIN32
+        s_sem = OpenSemaphoreA(SEMAPHORE_ALL_ACCESS, FALSE, name);
+        s_joined = s_sem != NULL;
+#else
+        int r = -1, w = -1;
+        if( strncmp(name,"fifo:",5) == 0 )
+        {
+            r = w = open(name+5, O_RDWR | O_NONBLOCK);
+            s_ownRead = r >= 0;
+        }else if( sscanf(name,"%d,%d",&r,&w) == 2 && r >= 0 && w >= 0 &&
+                  fcntl(r,F_GETFD) != -1 && fcntl(w,F_GETFD) != -1 )
+        {
+            const int own = nonblocking(r);
+            if( own >= 0 )
+            {
+                r = own;
+                s_ownRead = 1;
+            }
+        }else
+            r = w = -1; // make didn't pass the descriptors, e.g. because the rule is not marked with +
+        s_readFd = r;
+        s_writeFd = w;
+        s_joined = r >= 0;
+#endif
+        free(name);
+        return s_joined;
+    }
+    if( maxJobs <= 1 )
+        return 0;
+
+    // be the jobserver of the commands we start, e.g. a make or BUSY run by a LuaScript
+    if( maxJobs - 1 > BS_MAX_TOKENS )
+        maxJobs = BS_MAX_TOKENS + 1;
+    char* newflags = (char*)malloc((flags ? strlen(flags) : 0) + 128);
+#ifdef _WIN32
+    char name[64];
+    sprintf(name,"busy_jobserver_%lu", (unsigned long)GetCurrentProcessId());
+    s_sem = CreateSemaphoreA(NULL, maxJobs - 1, maxJobs - 1, name);
+    if( s_sem == NULL )
+    {
+        free(newflags);
+        return 0;
+    }
+    sprintf(newflags,"%s%s-j%d --jobserver-auth=%s", flags ? flags : "", flags && *flags ? " " : "", maxJobs, name);
+#else
+    if( pipe(s_pipe) != 0 )
+    {
+        s_pipe[0] = s_pipe[1] = -1;
+        free(newflags);
+        return 0;
+    }
+    int i;
+    for( i = 0; i < maxJobs - 1; i++ )
+        if( write(s_pipe[1],"+",1) != 1 )
+            break;
+    s_writeFd = s_pipe[1];
+    s_readFd = nonblocking(s_pipe[0]);
+    s_ownRead = s_readFd >= 0;
+    if( !s_ownRead )
+        s_readFd = s_pipe[0];
+    sprintf(newflags,"%s%s-j%d --jobserver-auth=%d,%d", flags ? flags : "", flags && *flags ? " " : "",
+            maxJobs, s_pipe[0], s_pipe[1]);
+#endif
+    s_oldMakeflags = flags ? strdup(flags) : 0;
+    s_ownServer = 1;
+    s_joined = 1;
+    setmakeflags(newflags);
+    free(newflags);
+    return 1;
+}
+
+int bs_jobserver_acquire(void)
+{
+    if( !s_joined )
+        return 1;
+    if( s_tokenCount >= BS_MAX_TOKENS )
+        return 0;
+#ifdef _WIN32
+    if( WaitForSingleObject(s_sem, 0) != WAIT_OBJECT_0 )
+        return 0;
+    s_tokens[s_tokenCount++] = '+';
+    return 1;
+#else
+    if( !s_ownRead )
+    {
+        // the descriptor is blocking, so only read if a token seems to be available
+        struct pollfd pfd;
+        pfd.fd = s_readFd;
+        pfd.events = POLLIN;
+        if( poll(&pfd,1,0) != 1 )
+            return 0;
+    }
+    char ch;
+    if( read(s_readFd,&ch,1) != 1 )
+        return 0;
+    s_tokens[s_tokenCount++] = ch;
+    return 1;
+#endif
+}
+
+void bs_jobserver_release(void)
+{
+    if( !s_joined || s_tokenCount == 0 )
+        return;
+    const char ch = s_tokens[--s_tokenCount];
+#ifdef _WIN32
+    ReleaseSemaphore(s_sem, 1, NULL);
+#else
+    while( write(s_writeFd,&ch,1) != 1 && errno == EINTR )
+        ;
+#endif
+}
+
+void bs_jobserver_close(void)
+{
+    while( s_tokenCount > 0 )
+        bs_jobserver_release();
+#ifdef _WIN32
+    if( s_sem != NULL )
+        CloseHandle(s_sem);
+    s_sem = NULL;
+#else
+    if( s_ownRead )
+        close(s_readFd);
+    if( s_pipe[0] >= 0 )
+    {
+        close(s_pipe[0]);
+        close(s_pipe[1]);
+    }
+    s_pipe[0] = s_pipe[1] = -1;
+    s_readFd = s_writeFd = -1;
+    s_ownRead = 0;
+#endif
+    if( s_ownServer )
+    {
+        setmakeflags(s_oldMakeflags);
+        free(s_oldMakeflags);
+        s_oldMakeflags = 0;
+        s_ownServer = 0;
+    }
+    s_joined = 0;
+}
+
+int bs_spawnfunc(int (*func)(void* data), void* data)
+{
+#ifdef _WIN32
+    // a thread would share the process-wide buffers and caches of this module with the caller
+    return 0;
+#else
+    fflush(stdout);
+    fflush(stderr);
+    const pid_t pid = fork();
+    if( pid == 0 )
+    {
+        const int res = func(data);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(res);
+    }
+    return pid > 0 ? pid : 0;
 #endif
 }
 
@@ -928,10 +1978,38 @@ BSPathPart bs_tokenType(const char* what, int len)
 
 int bs_touch(const char* normalizedPath)
 {
-    return utime(bs_denormalize_path(normalizedPath),0); // returns zero on success, -1 otherwise
+    return bs_touch2(bs_denormalize_path(normalizedPath));
 }
 
 int bs_touch2(const char* denormalizedPath)
 {
-    return utime(denormalizedPath,0); // returns zero on success, -1 otherwise
+    const int res = utime(denormalizedPath,0); // returns zero on success, -1 otherwise
+    bs_invalidate2(denormalizedPath);
+    return res;
+}
+
+int bs_settime(const char* normalizedPath, BSTime t)
+{
+    const char* path = bs_denormalize_path(normalizedPath);
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, 0);
+    if( h == INVALID_HANDLE_VALUE )
+        return -1;
+    const unsigned long long ft = t / 100 + 116444736000000000LL;
+    FILETIME mt;
+    mt.dwLowDateTime = (DWORD)ft;
+    mt.dwHighDateTime = (DWORD)(ft >> 32);
+    const int res = SetFileTime(h, 0, 0, &mt) ? 0 : -1;
+    CloseHandle(h);
+#else
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT; // keep the access time
+    ts[1].tv_sec = t / 1000000000;
+    ts[1].tv_nsec = t % 1000000000;
+    const int res = utimensat(AT_FDCWD, path, ts, 0);
+#endif
+    bs_invalidate2(path);
+    return res;
 }
@@ -36,10 +36,15 @@ extern const char* bs_denormalize_path(const char* path);
 extern int bs_isWinRoot(const char* normalizedPath); // 1..yes, 0..no
 extern int bs_isWinRoot2(const char* denormalizedPath); // 1..yes, 0..no
 
-extern time_t bs_exists(const char* normalizedPath); // changed time if exists, 0 if not
-extern time_t bs_exists2(const char* denormalizedPath); // changed time if exists, 0 if not
+typedef long long BSTime; // nanoseconds since the epoch, as far as supported by the file system
+extern BSTime bs_exists(const char* normalizedPath); // changed time if exists, 0 if not
+extern BSTime bs_exists2(const char* denormalizedPath); // changed time if exists, 0 if not
+                                                       // the results are cached for the process lifetime
+extern void bs_invalidate(const char* normalizedPath); // to be called when a file was changed; 0 clears the cache
+extern void bs_invalidate2(const char* denormalizedPath);
 extern int bs_touch(const char* normalizedPath);
 extern int bs_touch2(const char* denormalizedPath);
+extern int bs_settime(const char* normalizedPath, BSTime); // sets the changed time; returns 0 on success
 extern BSPathStatus bs_thisapp();
 
 extern BSPathStatus bs_apply_source_expansion(const char* normalizedPath, const char* string, int onlyFileParts); // returns denormalized
@@ -55,7 +60,43 @@ extern int bs_mkdir2(const char* denormalizedPath);
 extern int bs_mkrdir2(const char* denormalizedPath);
 
 extern int bs_exec(const char* cmd); // returns 0 on success
-extern int bs_copy(const char* normalizedToPath, const char* normalizedFromPath );
+extern int bs_execv(char* const argv[]); // argv[0] is looked up in PATH, argv is null terminated; returns 0 on success
+extern int bs_spawn(const char* cmd); // starts cmd without waiting; returns a process id >= 0, or -1 on error
+                                      // on Unix the program is started directly unless cmd requires a shell
+extern int bs_spawnv(char* const argv[]); // like bs_spawn, but with an argv vector; the program is started
+                                          // directly on all platforms, the args are passed as they are
+extern int bs_wait(int* status, unsigned int* peakMem);
+    // waits for any process started with bs_spawn; returns its id or -1 if none running; status is set to 0 if the
+    // process succeeded, peakMem (if not 0) to the max. resident memory of the process in kilobytes, or 0 if unknown
+extern int bs_cpucount(); // number of online processors, at least 1
+extern unsigned int bs_memavailable(void); // memory available for new processes in megabytes, 0 if unknown
+extern long long bs_clock(void); // monotonic time in microseconds
+extern int bs_jobserver_open(int maxJobs);
+    // joins the GNU make jobserver named in MAKEFLAGS, or creates one with maxJobs - 1 tokens (if maxJobs > 1) and
+    // names it in MAKEFLAGS for the commands started afterwards; returns 1 if jobs are coordinated by a jobserver
+extern int bs_jobserver_acquire(void); // takes a token without waiting; returns 1 on success or if there is no jobserver
+extern void bs_jobserver_release(void); // gives back a token taken with bs_jobserver_acquire
+extern void bs_jobserver_close(void); // gives back all tokens and restores MAKEFLAGS
+extern int bs_copy(const char* normalizedToPath, const char* normalizedFromPath ); // same as bs_copy2 with BS_CopyFile
+typedef enum BSCopyMode { BS_CopyFile, BS_HardLink, BS_RefLink, BS_SymLink } BSCopyMode;
+extern int bs_copy2(const char* normalizedToPath, const char* normalizedFromPath, int mode );
+    // copies in-process or links the file; returns 0 on success; falls back to a copy if no link can be made;
+    // a copy keeps the changed time of the original; to is left as is if it has the same size and changed time
+    // as from, or the same content
+extern int bs_spawncopy(const char* normalizedToPath, const char* normalizedFromPath, int mode, int* status );
+    // like bs_copy2, but large files are copied in the background; returns an id for bs_wait in this case,
+    // otherwise 0 and the result is set in status
+extern int bs_spawnfunc(int (*func)(void* data), void* data);
+    // runs func in a child process and returns an id for bs_wait; returns 0 if this is not supported on the
+    // platform or fails, in which case the caller has to call func itself
+
+typedef unsigned long long BSHash;
+#define BS_HASH_INIT 14695981039346656037ULL
+extern BSHash bs_hash(const char* data, int len, BSHash h); // FNV-1a; start with h = BS_HASH_INIT
+extern int bs_hashfile(const char* denormalizedPath, BSHash* h); // continues h with the file content; returns 0 on success
+extern int bs_findtoken(const char* denormalizedPath, const char* const* tokens);
+    // looks for the first occurrence of one of the identifiers of the null terminated tokens list in the file;
+    // returns the index + 1 of the token found, 0 if there is none, or -1 if the file cannot be read
 
 extern const char* bs_filename(const char* path);
 extern int bs_forbidden_fschar(unsigned int ch);
@@ -23,9 +23,13 @@
 #include "bsparser.h"
 #include "bsrunner.h"
 #include "bsqmakegen.h"
+#include "bsninjagen.h"
+#include "bsmakegen.h"
 #include "bshost.h"
 #include "bsunicode.h"
 #include "bsvisitor.h"
+#include "bsgraph.h"
+#include "bstrace.h"
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
@@ -167,6 +171,14 @@ int bs_compile (lua_State *L)
         lua_replace(L,PARAMS);
     }
 
+    lua_getglobal(L,"#trace");
+    if( lua_isstring(L,-1) && bs_traceopen(lua_tostring(L,-1)) != 0 )
+    {
+        fprintf(stderr,"# WRN: cannot open trace file %s\n", lua_tostring(L,-1));
+        fflush(stderr);
+    }
+    lua_pop(L,1);
+
     // set lua path so no environment can intervene
     lua_getglobal(L, "package");
     lua_pushstring(L,"./?.lua");
@@ -458,29 +470,38 @@ int bs_execute (lua_State *L)
 
     lua_pop(L,3); // source_dir, binst, build_dir
 
+    long long start = bs_clock();
     lua_pushcfunction(L, bs_findProductsToProcess);
     lua_pushvalue(L,ROOT);
     lua_pushvalue(L,PRODS);
     lua_pushvalue(L,builtins);
     lua_call(L,3,1);
     lua_replace(L,PRODS);
+    bs_traceevent("bs_findProductsToProcess","phase",0,start,0);
 
     lua_pop(L,1); // builtins
 
+    // lower the products and everything they depend on to the graph walked by the runner
+    start = bs_clock();
+    lua_pushcfunction(L, bs_graphlower);
+    lua_pushvalue(L,PRODS);
+    lua_call(L,1,1);
+    const int graph = lua_gettop(L);
+    bs_traceevent("bs_graphlower","phase",0,start,0);
+
     // build all products in the set; first check for error message dependents
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
-    {
-        lua_pushcfunction(L, bs_precheck);
-        lua_rawgeti(L,PRODS,i);
-        lua_call(L,1,0);
-    }
-    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
-    {
-        lua_pushcfunction(L, bs_run);
-        lua_rawgeti(L,PRODS,i);
-        lua_call(L,1,0);
-    }
+    start = bs_clock();
+    lua_pushcfunction(L, bs_precheck);
+    lua_pushvalue(L,graph);
+    lua_call(L,1,0);
+    bs_traceevent("precheck","phase",0,start,0);
+    // all products share one job graph, so independent products are built in parallel
+    lua_pushcfunction(L, bs_runAll);
+    lua_pushvalue(L,graph);
+    lua_call(L,1,0);
+    bs_traceclose();
+
+    lua_pop(L,1); // graph
 
     const int bottom = lua_gettop(L);
     assert( top == bottom );
@@ -615,27 +636,47 @@ static int bs_generate (lua_State *L)
 
     lua_pop(L,1); // builtins
 
+    lua_pushcfunction(L, bs_graphlower);
+    lua_pushvalue(L,PRODS);
+    lua_call(L,1,1);
+    const int graph = lua_gettop(L);
+
     // generate all products in the set; first check for error message dependents
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
-    {
-        lua_pushcfunction(L, bs_precheck);
-        lua_rawgeti(L,PRODS,i);
-        lua_call(L,1,0);
-    }
+    lua_pushcfunction(L, bs_precheck);
+    lua_pushvalue(L,graph);
+    lua_call(L,1,0);
 
     if( strcmp(lua_tostring(L,WHAT),"qmake") == 0 )
     {
         lua_pushcfunction(L, bs_genQmake);
         lua_pushvalue(L,ROOT);
         lua_pushvalue(L,PRODS);
-        lua_call(L,2,0);
+        lua_pushvalue(L,graph);
+        lua_call(L,3,0);
+    }else if( strcmp(lua_tostring(L,WHAT),"ninja") == 0 )
+    {
+        lua_pushcfunction(L, bs_genNinja);
+        lua_pushvalue(L,ROOT);
+        lua_pushvalue(L,PRODS);
+        lua_pushvalue(L,graph);
+        lua_call(L,3,0);
+    }else if( strcmp(lua_tostring(L,WHAT),"make") == 0 )
+    {
+        lua_pushcfunction(L, bs_genMake);
+        lua_pushvalue(L,ROOT);
+        lua_pushvalue(L,PRODS);
+        lua_pushvalue(L,graph);
+        lua_call(L,3,0);
     }else if( strcmp(lua_tostring(L,WHAT),"test") == 0 )
     {
-        for( i = 1; i <= lua_objlen(L,PRODS); i++ )
+        // the nodes come in topological order, so the deps are visited first
+        const BSGraph* g = bs_tograph(L,graph);
+        int i;
+        for( i = 0; i < g->count; i++ )
         {
             lua_pushcfunction(L, bs_visit);
-            lua_rawgeti(L,PRODS,i);
+            lua_pushvalue(L,graph);
+            lua_pushinteger(L,i);
             BSVisitorCtx* ctx = bs_newctx(L);
             ctx->d_data = 0;
             ctx->d_log = 0;
@@ -644,10 +685,13 @@ static int bs_generate (lua_State *L)
             ctx->d_begin = Test_BSBeginOp;
             ctx->d_param = Test_BSOpParam;
             ctx->d_fork = Test_BSForkGroup;
-            lua_call(L,2,0);
+            lua_call(L,3,0);
         }
     }else
         luaL_error(L,"unknown generator '%s'", lua_tostring(L,WHAT));
+    bs_traceclose();
+
+    lua_pop(L,1); // graph
 
     const int bottom = lua_gettop(L);
     assert( top == bottom );
@@ -0,0 +1,654 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bsmakegen.h"
+#include "bsvisitor.h"
+#include "bsgraph.h"
+#include "bshost.h"
+#include "lauxlib.h"
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+// The generator writes a single, non-recursive Makefile for GNU make 4.0 or later while it walks the product
+// graph; each product is visited once by bs_visit and its rules are written as soon as the operation is complete.
+// There is one explicit rule per operation; the rules of a product have order-only prerequisites on a phony
+// target per dependency of the product (named by the designator of the dependency) and on the directories
+// of the outputs, which have their own rules, so no directories have to be created before running make.
+
+typedef struct Buf {
+    char* d;
+    int len;
+    int cap;
+} Buf;
+
+static void add(Buf* b, const char* str, int len)
+{
+    if( len < 0 )
+        len = strlen(str);
+    if( b->len + len + 1 > b->cap )
+    {
+        b->cap = ( b->len + len + 1 ) * 2;
+        b->d = (char*)realloc(b->d,b->cap);
+    }
+    memcpy(b->d + b->len, str, len);
+    b->len += len;
+    b->d[b->len] = 0;
+}
+
+static void adds(Buf* b, const char* str)
+{
+    add(b,str,-1);
+}
+
+static void clear(Buf* b)
+{
+    b->len = 0;
+    if( b->d )
+        b->d[0] = 0;
+}
+
+static const char* str(Buf* b)
+{
+    return b->d ? b->d : "";
+}
+
+static void addquoted(Buf* b, const char* prefix, const char* path, const char* suffix)
+{
+    adds(b,prefix);
+    adds(b,"\"");
+    adds(b,path);
+    adds(b,"\"");
+    adds(b,suffix);
+}
+
+static void addname(Buf* b, const char* path)
+{
+    // a target or prerequisite
+    int i;
+    for( i = 0; path[i]; i++ )
+    {
+        if( path[i] == '$' )
+            add(b,"$",1);
+        else if( path[i] == ' ' || path[i] == '#' )
+            add(b,"\\",1);
+#ifdef _WIN32
+        else if( path[i] == ':' && i != 1 ) // make knows drive letters
+#else
+        else if( path[i] == ':' )
+#endif
+            add(b,"\\",1);
+        add(b,path+i,1);
+    }
+}
+
+static void addpath(Buf* b, const char* path)
+{
+    adds(b," ");
+    addname(b,path);
+}
+
+static void writerecipe(FILE* out, const char* cmd)
+{
+    fputc('\t',out);
+    for( ; *cmd; cmd++ )
+    {
+        if( *cmd == '$' )
+            fputc('$',out);
+        if( *cmd != '\n' )
+            fputc(*cmd,out);
+    }
+    fputc('\n',out);
+}
+
+typedef struct MakeGen {
+    lua_State* L;
+    int dirs; // registry reference of the set of directories which already have a rule
+    FILE* out;
+    const char* buildDir; // denormalized
+    const char* target; // designator of the product being generated
+    int op, toolchain, os, stamps;
+    Buf cmd;
+    Buf flags; // cflags, defines and include dirs of a compile, defines of moc, -name of rcc or args of lua
+    Buf ldflags, libdirs, libnames, libfiles, frameworks;
+    Buf ins; // quoted for the command line
+    Buf outs;
+    Buf mins; // escaped for the rule
+    Buf out1; // the first output, not escaped
+    Buf more; // the remaining outputs, not escaped, each terminated by a zero
+    Buf prodOuts; // the outputs of all rules of the product
+    Buf orderOnly; // the phony targets of the dependencies of the product
+    Buf dirOnly; // the directories of the outputs of the current rule
+} MakeGen;
+
+static int linkmsvc(MakeGen* gen)
+{
+    // clang on windows uses the lib.exe compatible llvm-lib.exe tool
+    return gen->toolchain == BS_msvc || ( gen->os == BS_windows && gen->toolchain == BS_clang );
+}
+
+static void needdir(MakeGen* gen, const char* path)
+{
+    // adds the directory of the output to the order-only prerequisites; the rule is written the first time
+    lua_State* L = gen->L;
+    const char* slash = strrchr(path,'/');
+    if( slash == NULL || slash == path )
+        return;
+    lua_pushlstring(L,path,slash-path);
+    const char* dir = lua_tostring(L,-1);
+    addpath(&gen->dirOnly,dir);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,gen->dirs);
+    const int dirs = lua_gettop(L);
+    lua_pushvalue(L,-2);
+    lua_rawget(L,dirs);
+    if( lua_isnil(L,-1) )
+    {
+        Buf tmp = { 0, 0, 0 };
+        addname(&tmp,dir);
+        fprintf(gen->out,"%s:\n",str(&tmp));
+        clear(&tmp);
+#ifdef _WIN32
+        addquoted(&tmp,"cmd /c if not exist ",dir,"");
+        addquoted(&tmp," mkdir ",dir,"");
+#else
+        addquoted(&tmp,"mkdir -p ",dir,"");
+#endif
+        writerecipe(gen->out,str(&tmp));
+        fputc('\n',gen->out);
+        free(tmp.d);
+        lua_pushvalue(L,dirs-1);
+        lua_pushboolean(L,1);
+        lua_rawset(L,dirs);
+    }
+    lua_pop(L,3); // dir, dirs, flag
+}
+
+static int beginOp(BSBuildOperation op, const char* command, int toolchain, int os, void* data)
+{
+    MakeGen* gen = (MakeGen*)data;
+    if( op == BS_EnteringProduct )
+        return 0;
+    gen->op = op;
+    gen->toolchain = toolchain;
+    gen->os = os;
+    clear(&gen->cmd);
+    clear(&gen->flags);
+    clear(&gen->ldflags);
+    clear(&gen->libdirs);
+    clear(&gen->libnames);
+    clear(&gen->libfiles);
+    clear(&gen->frameworks);
+    clear(&gen->ins);
+    clear(&gen->outs);
+    clear(&gen->mins);
+    clear(&gen->out1);
+    clear(&gen->more);
+    clear(&gen->dirOnly);
+    switch( op )
+    {
+    case BS_RunMoc:
+    case BS_RunRcc:
+    case BS_RunUic:
+    case BS_RunLua:
+        addquoted(&gen->cmd,"",command,"");
+        break;
+    case BS_Copy:
+#ifdef _WIN32
+        adds(&gen->cmd,"cmd /c copy /Y");
+#else
+        adds(&gen->cmd,"cp");
+#endif
+        break;
+    default:
+        adds(&gen->cmd,command);
+        break;
+    }
+    return 0;
+}
+
+static void opParam(BSBuildParam param, const char* value, void* data)
+{
+    MakeGen* gen = (MakeGen*)data;
+    switch( param )
+    {
+    case BS_infile:
+        addquoted(&gen->ins," ",value,"");
+        addpath(&gen->mins,value);
+        break;
+    case BS_outfile:
+        if( gen->out1.len == 0 )
+            adds(&gen->out1,value);
+        else
+            add(&gen->more,value,strlen(value)+1);
+        addquoted(&gen->outs," ",value,"");
+        needdir(gen,value);
+        break;
+    case BS_cflag:
+        adds(&gen->flags," ");
+        adds(&gen->flags,value);
+        break;
+    case BS_define:
+        // strings can potentially include whitespace, thus quotes
+        if( gen->op == BS_RunMoc )
+        {
+            if( strstr(value,"\\\"") != NULL )
+                addquoted(&gen->flags," -D ",value,"");
+            else
+            {
+                adds(&gen->flags," -D ");
+                adds(&gen->flags,value);
+            }
+        }else if( strstr(value,"\\\"") != NULL )
+        {
+            adds(&gen->flags," \"-D");
+            adds(&gen->flags,value);
+            adds(&gen->flags,"\" ");
+        }else
+        {
+            adds(&gen->flags," -D");
+            adds(&gen->flags,value);
+            adds(&gen->flags," ");
+        }
+        break;
+    case BS_include_dir:
+        addquoted(&gen->flags," -I",value," ");
+        break;
+    case BS_ldflag:
+        adds(&gen->ldflags," ");
+        adds(&gen->ldflags,value);
+        break;
+    case BS_lib_dir:
+        addquoted(&gen->libdirs, linkmsvc(gen) ? " /libpath:" : " -L", value, " ");
+        break;
+    case BS_lib_name:
+        adds(&gen->libnames, linkmsvc(gen) ? " " : " -l");
+        adds(&gen->libnames,value);
+        adds(&gen->libnames, linkmsvc(gen) ? ".lib " : " ");
+        break;
+    case BS_lib_file:
+        addquoted(&gen->libfiles," ",value," ");
+        break;
+    case BS_framework:
+        if( gen->os == BS_mac )
+        {
+            adds(&gen->frameworks," -framework ");
+            adds(&gen->frameworks,value);
+            adds(&gen->frameworks," ");
+        }
+        break;
+    case BS_defFile:
+        if( gen->os == BS_windows )
+            addquoted(&gen->ldflags, linkmsvc(gen) ? " /def:" : " ", value, " ");
+        break;
+    case BS_name:
+        addquoted(&gen->flags," -name ",value,"");
+        break;
+    case BS_arg:
+        adds(&gen->flags," ");
+        adds(&gen->flags,value);
+        break;
+    }
+}
+
+static void writerule(MakeGen* gen, const char* cmd, const char* rspFile, const char* rspContent)
+{
+    FILE* out = gen->out;
+    Buf tmp = { 0, 0, 0 };
+    addname(&tmp,str(&gen->out1));
+    adds(&gen->prodOuts," ");
+    adds(&gen->prodOuts,str(&tmp));
+    fprintf(out,"%s:%s |%s%s\n",str(&tmp),str(&gen->mins),str(&gen->dirOnly),str(&gen->orderOnly));
+    if( rspFile )
+    {
+        // the $(file) function writes the response file before the command runs and expands to nothing
+        clear(&tmp);
+        adds(&tmp,"$(file >");
+        adds(&tmp,rspFile);
+        adds(&tmp,",");
+        adds(&tmp,rspContent);
+        adds(&tmp,")");
+        fputc('\t',out);
+        fwrite(tmp.d,1,tmp.len,out); // already escaped by the caller
+        fputc('\n',out);
+    }
+    writerecipe(out,cmd);
+
+    // the other outputs are created by the same command
+    const char* o = str(&gen->more);
+    while( o < gen->more.d + gen->more.len )
+    {
+        clear(&tmp);
+        addname(&tmp,o);
+        adds(&gen->prodOuts," ");
+        adds(&gen->prodOuts,str(&tmp));
+        fprintf(out,"%s:",str(&tmp));
+        clear(&tmp);
+        addpath(&tmp,str(&gen->out1));
+        fprintf(out,"%s ;\n",str(&tmp));
+        o += strlen(o) + 1;
+    }
+    fputc('\n',out);
+    free(tmp.d);
+}
+
+static void linkop(MakeGen* gen)
+{
+    const char* out = str(&gen->out1);
+    Buf cmd = { 0, 0, 0 };
+    Buf rsp = { 0, 0, 0 };
+    adds(&rsp,out);
+    adds(&rsp,".rsp");
+    int useRsp = 1;
+    adds(&cmd,str(&gen->cmd));
+    if( linkmsvc(gen) )
+    {
+        switch( gen->op )
+        {
+        case BS_LinkExe:
+            addquoted(&cmd," /nologo @",str(&rsp),"");
+            addquoted(&cmd," /out:",out,"");
+            break;
+        case BS_LinkDll:
+            {
+                addquoted(&cmd," /nologo /dll @",str(&rsp),"");
+                addquoted(&cmd," /out:",out,"");
+                // the importlib is called xyz.dll.lib
+                char* implib = (char*)malloc(strlen(out) + 5);
+                sprintf(implib,"%s.lib",out);
+                addquoted(&cmd," /implib:",implib,"");
+                add(&gen->more,implib,strlen(implib)+1);
+                free(implib);
+            }
+            break;
+        case BS_LinkLib:
+            if( gen->toolchain == BS_clang )
+            {
+                clear(&cmd);
+                adds(&cmd,"llvm-lib");
+            }
+            addquoted(&cmd," /nologo /out:",out,"");
+            addquoted(&cmd," @",str(&rsp),"");
+            break;
+        }
+    }else
+    {
+        switch( gen->op )
+        {
+        case BS_LinkExe:
+            addquoted(&cmd," @",str(&rsp),"");
+            addquoted(&cmd," -o ",out,"");
+            break;
+        case BS_LinkDll:
+            adds(&cmd, gen->os == BS_mac ? " -dynamiclib" : " -shared");
+            addquoted(&cmd," @",str(&rsp),"");
+            addquoted(&cmd," -o ",out,"");
+            break;
+        case BS_LinkLib:
+            addquoted(&cmd," r ",out,"");
+            if( gen->os == BS_mac )
+            {
+                // the ar on macs doesn't support @file
+                useRsp = 0;
+                adds(&cmd,str(&gen->ins));
+            }else
+                addquoted(&cmd," @",str(&rsp),"");
+            break;
+        }
+    }
+
+    if( useRsp )
+    {
+        Buf content = { 0, 0, 0 };
+        adds(&content,str(&gen->ins));
+        if( gen->op != BS_LinkLib )
+        {
+            adds(&content,str(&gen->ldflags));
+            adds(&content,str(&gen->libdirs));
+            adds(&content,str(&gen->libnames));
+            adds(&content,str(&gen->libfiles));
+            adds(&content,str(&gen->frameworks));
+        }
+        Buf file = { 0, 0, 0 };
+        Buf text = { 0, 0, 0 };
+        const char* p;
+        for( p = str(&rsp); *p; p++ )
+        {
+            if( *p == '$' )
+                add(&file,"$",1);
+            add(&file,p,1);
+        }
+        for( p = str(&content); *p; p++ )
+        {
+            if( *p == '$' )
+                add(&text,"$",1);
+            add(&text,p,1);
+        }
+        writerule(gen,str(&cmd),str(&file),str(&text));
+        free(file.d);
+        free(text.d);
+        free(content.d);
+    }else
+        writerule(gen,str(&cmd),0,0);
+    free(cmd.d);
+    free(rsp.d);
+}
+
+static void endOp(void* data)
+{
+    MakeGen* gen = (MakeGen*)data;
+    Buf cmd = { 0, 0, 0 };
+    adds(&cmd,str(&gen->cmd));
+    switch( gen->op )
+    {
+    case BS_Compile:
+        adds(&cmd,str(&gen->flags));
+        if( gen->toolchain == BS_msvc )
+        {
+            // cl.exe can only list the included headers on the console, thus no header dependencies
+            adds(&cmd," /nologo /c");
+            addquoted(&cmd," /Fo",str(&gen->out1),"");
+            adds(&cmd,str(&gen->ins));
+            writerule(gen,str(&cmd),0,0);
+        }else
+        {
+            // the compiler writes the included headers (without the system headers) to a makefile
+            // next to the object file; -MP adds empty rules so deleted headers don't break the build
+            adds(&cmd," -MMD -MP -MF \"");
+            adds(&cmd,str(&gen->out1));
+            adds(&cmd,".d\" -c -o");
+            adds(&cmd,str(&gen->outs));
+            adds(&cmd,str(&gen->ins));
+            writerule(gen,str(&cmd),0,0);
+            Buf dep = { 0, 0, 0 };
+            adds(&dep,str(&gen->out1));
+            adds(&dep,".d");
+            clear(&cmd);
+            addpath(&cmd,str(&dep));
+            fprintf(gen->out,"-include%s\n\n",str(&cmd));
+            free(dep.d);
+        }
+        break;
+    case BS_LinkExe:
+    case BS_LinkDll:
+    case BS_LinkLib:
+        linkop(gen);
+        break;
+    case BS_RunMoc:
+    case BS_RunRcc:
+    case BS_RunUic:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd," -o");
+        adds(&cmd,str(&gen->outs));
+        adds(&cmd,str(&gen->flags));
+        writerule(gen,str(&cmd),0,0);
+        break;
+    case BS_RunLua:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd,str(&gen->flags));
+        if( gen->out1.len == 0 )
+        {
+            // a LuaScriptForeach without declared outputs runs each time like with BUSY;
+            // the target is phony
+            char* stamp = (char*)malloc(strlen(gen->buildDir) + strlen(gen->target) + 32);
+            sprintf(stamp,"%s/%s.%d.stamp", gen->buildDir, gen->target, ++gen->stamps);
+            adds(&gen->out1,stamp);
+            free(stamp);
+            clear(&gen->dirOnly);
+            Buf tmp = { 0, 0, 0 };
+            addpath(&tmp,str(&gen->out1));
+            fprintf(gen->out,".PHONY:%s\n",str(&tmp));
+            free(tmp.d);
+        }
+        writerule(gen,str(&cmd),0,0);
+        break;
+    case BS_Copy:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd,str(&gen->outs));
+        writerule(gen,str(&cmd),0,0);
+        break;
+    default:
+        break;
+    }
+    free(cmd.d);
+}
+
+static void genproduct(lua_State* L, int graph, int node, int ctx, MakeGen* gen)
+{
+    const int top = lua_gettop(L);
+    const BSGraph* g = bs_tograph(L,graph);
+    const BSGraphNode* n = &g->nodes[node];
+
+    clear(&gen->orderOnly);
+    int i;
+    for( i = 0; i < n->depCount; i++ )
+        addpath(&gen->orderOnly,g->nodes[n->deps[i]].name);
+
+    gen->target = n->name;
+    clear(&gen->prodOuts);
+
+    lua_pushcfunction(L, bs_visit);
+    lua_pushvalue(L,graph);
+    lua_pushinteger(L,node);
+    lua_pushvalue(L,ctx);
+    lua_call(L,3,0);
+
+    Buf name = { 0, 0, 0 };
+    addname(&name,n->name);
+    fprintf(gen->out,".PHONY: %s\n",str(&name));
+    fprintf(gen->out,"%s:%s",str(&name),str(&gen->prodOuts));
+    if( gen->orderOnly.len )
+        fprintf(gen->out," |%s",str(&gen->orderOnly));
+    fprintf(gen->out,"\n\n");
+    free(name.d);
+
+    assert( top == lua_gettop(L) );
+}
+
+int bs_genMake(lua_State* L) // args: root module def, array of productinst, graph
+{
+    enum { ROOT = 1, PRODS, GRAPH };
+    const int top = lua_gettop(L);
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "builtins");
+    lua_call(L,1,1);
+    lua_getfield(L,-1,"#inst");
+    lua_getfield(L,-1,"root_build_dir");
+    const int buildDir = lua_gettop(L);
+
+    if( !bs_exists(lua_tostring(L,buildDir)) )
+    {
+        if( bs_mkdir(lua_tostring(L,buildDir)) != 0 )
+            luaL_error(L,"error creating directory %s", lua_tostring(L,buildDir));
+    }
+
+    lua_pushvalue(L,buildDir);
+    lua_pushstring(L,"/Makefile");
+    lua_concat(L,2);
+    const int path = lua_gettop(L);
+
+    MakeGen gen;
+    memset(&gen,0,sizeof(gen));
+    gen.out = bs_fopen(bs_denormalize_path(lua_tostring(L,path)),"w");
+    if( gen.out == NULL )
+        luaL_error(L,"cannot open file for writing: %s", lua_tostring(L,path));
+    gen.buildDir = bs_denormalize_path(lua_tostring(L,buildDir));
+    gen.L = L;
+
+    const char* text = "# generated by BUSY, do not modify; requires GNU make 4.0 or later\n\n"
+                       "MAKEFLAGS += -r\n"
+                       ".SUFFIXES:\n"
+                       ".DELETE_ON_ERROR:\n"
+                       ".PHONY: all\n";
+    fwrite(text,1,strlen(text),gen.out);
+
+    // the first rule is the default goal
+    Buf def = { 0, 0, 0 };
+    size_t i;
+    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
+    {
+        lua_rawgeti(L,PRODS,i);
+        lua_getfield(L,-1,"#decl");
+        bs_declpath(L,-1,".");
+        addpath(&def,lua_tostring(L,-1));
+        lua_pop(L,3); // prod, decl, desig
+    }
+    fprintf(gen.out,"all:%s\n\n",str(&def));
+    free(def.d);
+
+    BSVisitorCtx* ctx = bs_newctx(L);
+    const int ctxIdx = lua_gettop(L);
+    ctx->d_data = &gen;
+    ctx->d_begin = beginOp;
+    ctx->d_param = opParam;
+    ctx->d_end = endOp;
+
+    lua_createtable(L,0,0);
+    gen.dirs = luaL_ref(L,LUA_REGISTRYINDEX);
+
+    const BSGraph* g = bs_tograph(L,GRAPH);
+    int n;
+    for( n = 0; n < g->count; n++ )
+        genproduct(L,GRAPH,n,ctxIdx,&gen);
+    fclose(gen.out);
+    luaL_unref(L,LUA_REGISTRYINDEX,gen.dirs);
+
+    fprintf(stdout,"# generated %s\n", bs_denormalize_path(lua_tostring(L,path)));
+    fflush(stdout);
+
+    free(gen.cmd.d);
+    free(gen.flags.d);
+    free(gen.ldflags.d);
+    free(gen.libdirs.d);
+    free(gen.libnames.d);
+    free(gen.libfiles.d);
+    free(gen.frameworks.d);
+    free(gen.ins.d);
+    free(gen.outs.d);
+    free(gen.mins.d);
+    free(gen.out1.d);
+    free(gen.more.d);
+    free(gen.prodOuts.d);
+    free(gen.orderOnly.d);
+    free(gen.dirOnly.d);
+
+    lua_pop(L,5); // builtins, binst, buildDir, path, ctx
+    assert( top == lua_gettop(L) );
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef BSMAKEGEN_H
+#define BSMAKEGEN_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "lua.h"
+
+extern int bs_genMake(lua_State* L);
+// args: root module def, array of productinst, graph of the products (see bs_graphlower)
+// writes a Makefile to the root build directory
+
+
+#endif // BSMAKEGEN_H
@@ -0,0 +1,576 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bsninjagen.h"
+#include "bsvisitor.h"
+#include "bsgraph.h"
+#include "bshost.h"
+#include "lauxlib.h"
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+// The generator walks the product graph and receives the operations of each product from bs_visit; it writes
+// one build statement per operation; the statements of a product have order-only dependencies on a phony target
+// per dependency of the product (named by the designator of the dependency), so the order is the same as when
+// BUSY runs the build.
+
+typedef struct Buf {
+    char* d;
+    int len;
+    int cap;
+} Buf;
+
+static void add(Buf* b, const char* str, int len)
+{
+    if( len < 0 )
+        len = strlen(str);
+    if( b->len + len + 1 > b->cap )
+    {
+        b->cap = ( b->len + len + 1 ) * 2;
+        b->d = (char*)realloc(b->d,b->cap);
+    }
+    memcpy(b->d + b->len, str, len);
+    b->len += len;
+    b->d[b->len] = 0;
+}
+
+static void adds(Buf* b, const char* str)
+{
+    add(b,str,-1);
+}
+
+static void clear(Buf* b)
+{
+    b->len = 0;
+    if( b->d )
+        b->d[0] = 0;
+}
+
+static const char* str(Buf* b)
+{
+    return b->d ? b->d : "";
+}
+
+static void addquoted(Buf* b, const char* prefix, const char* path, const char* suffix)
+{
+    adds(b,prefix);
+    adds(b,"\"");
+    adds(b,path);
+    adds(b,"\"");
+    adds(b,suffix);
+}
+
+static void addpath(Buf* b, const char* path)
+{
+    // a path in a build statement, preceded by a blank
+    adds(b," ");
+    for( ; *path; path++ )
+    {
+        if( *path == '$' || *path == ' ' || *path == ':' )
+            add(b,"$",1);
+        add(b,path,1);
+    }
+}
+
+static void writevalue(FILE* out, const char* name, const char* value)
+{
+    fprintf(out,"  %s = ",name);
+    for( ; *value; value++ )
+    {
+        if( *value == '$' )
+            fputc('$',out);
+        if( *value != '\n' )
+            fputc(*value,out);
+    }
+    fputc('\n',out);
+}
+
+typedef struct NinjaGen {
+    FILE* out;
+    const char* buildDir; // denormalized
+    const char* target; // designator of the product being generated
+    int op, toolchain, os, stamps;
+    Buf cmd;
+    Buf flags; // cflags, defines and include dirs of a compile, defines of moc, -name of rcc or args of lua
+    Buf ldflags, libdirs, libnames, libfiles, frameworks;
+    Buf ins; // quoted for the command line
+    Buf outs;
+    Buf nins; // escaped for the build statement
+    Buf nouts;
+    Buf out1; // the first output, not escaped
+    Buf prodOuts; // the outputs of all statements of the product
+    Buf orderOnly; // the phony targets of the dependencies of the product
+} NinjaGen;
+
+static int linkmsvc(NinjaGen* gen)
+{
+    // clang on windows uses the lib.exe compatible llvm-lib.exe tool
+    return gen->toolchain == BS_msvc || ( gen->os == BS_windows && gen->toolchain == BS_clang );
+}
+
+static int beginOp(BSBuildOperation op, const char* command, int toolchain, int os, void* data)
+{
+    NinjaGen* gen = (NinjaGen*)data;
+    if( op == BS_EnteringProduct )
+        return 0;
+    gen->op = op;
+    gen->toolchain = toolchain;
+    gen->os = os;
+    clear(&gen->cmd);
+    clear(&gen->flags);
+    clear(&gen->ldflags);
+    clear(&gen->libdirs);
+    clear(&gen->libnames);
+    clear(&gen->libfiles);
+    clear(&gen->frameworks);
+    clear(&gen->ins);
+    clear(&gen->outs);
+    clear(&gen->nins);
+    clear(&gen->nouts);
+    clear(&gen->out1);
+    switch( op )
+    {
+    case BS_RunMoc:
+    case BS_RunRcc:
+    case BS_RunUic:
+    case BS_RunLua:
+        addquoted(&gen->cmd,"",command,"");
+        break;
+    case BS_Copy:
+#ifdef _WIN32
+        adds(&gen->cmd,"cmd /c copy /Y");
+#else
+        adds(&gen->cmd,"cp");
+#endif
+        break;
+    default:
+        adds(&gen->cmd,command);
+        break;
+    }
+    return 0;
+}
+
+static void opParam(BSBuildParam param, const char* value, void* data)
+{
+    NinjaGen* gen = (NinjaGen*)data;
+    switch( param )
+    {
+    case BS_infile:
+        addquoted(&gen->ins," ",value,"");
+        addpath(&gen->nins,value);
+        break;
+    case BS_outfile:
+        if( gen->out1.len == 0 )
+            adds(&gen->out1,value);
+        addquoted(&gen->outs," ",value,"");
+        addpath(&gen->nouts,value);
+        break;
+    case BS_cflag:
+        adds(&gen->flags," ");
+        adds(&gen->flags,value);
+        break;
+    case BS_define:
+        // strings can potentially include whitespace, thus quotes
+        if( gen->op == BS_RunMoc )
+        {
+            if( strstr(value,"\\\"") != NULL )
+                addquoted(&gen->flags," -D ",value,"");
+            else
+            {
+                adds(&gen->flags," -D ");
+                adds(&gen->flags,value);
+            }
+        }else if( strstr(value,"\\\"") != NULL )
+        {
+            adds(&gen->flags," \"-D");
+            adds(&gen->flags,value);
+            adds(&gen->flags,"\" ");
+        }else
+        {
+            adds(&gen->flags," -D");
+            adds(&gen->flags,value);
+            adds(&gen->flags," ");
+        }
+        break;
+    case BS_include_dir:
+        addquoted(&gen->flags," -I",value," ");
+        break;
+    case BS_ldflag:
+        adds(&gen->ldflags," ");
+        adds(&gen->ldflags,value);
+        break;
+    case BS_lib_dir:
+        addquoted(&gen->libdirs, linkmsvc(gen) ? " /libpath:" : " -L", value, " ");
+        break;
+    case BS_lib_name:
+        adds(&gen->libnames, linkmsvc(gen) ? " " : " -l");
+        adds(&gen->libnames,value);
+        adds(&gen->libnames, linkmsvc(gen) ? ".lib " : " ");
+        break;
+    case BS_lib_file:
+        addquoted(&gen->libfiles," ",value," ");
+        break;
+    case BS_framework:
+        if( gen->os == BS_mac )
+        {
+            adds(&gen->frameworks," -framework ");
+            adds(&gen->frameworks,value);
+            adds(&gen->frameworks," ");
+        }
+        break;
+    case BS_defFile:
+        if( gen->os == BS_windows )
+            addquoted(&gen->ldflags, linkmsvc(gen) ? " /def:" : " ", value, " ");
+        break;
+    case BS_name:
+        addquoted(&gen->flags," -name ",value,"");
+        break;
+    case BS_arg:
+        adds(&gen->flags," ");
+        adds(&gen->flags,value);
+        break;
+    }
+}
+
+static void writebuild(NinjaGen* gen, const char* rule, const char* implicitOut)
+{
+    fprintf(gen->out,"build%s",str(&gen->nouts));
+    if( implicitOut )
+    {
+        Buf tmp = { 0, 0, 0 };
+        addpath(&tmp,implicitOut);
+        fprintf(gen->out," |%s",str(&tmp));
+        free(tmp.d);
+    }
+    fprintf(gen->out,": %s%s%s\n",rule,str(&gen->nins),str(&gen->orderOnly));
+    adds(&gen->prodOuts,str(&gen->nouts));
+}
+
+static void linkop(NinjaGen* gen)
+{
+    const char* out = str(&gen->out1);
+    Buf cmd = { 0, 0, 0 };
+    Buf rsp = { 0, 0, 0 };
+    adds(&rsp,out);
+    adds(&rsp,".rsp");
+    int useRsp = 1;
+    char* implib = 0;
+    adds(&cmd,str(&gen->cmd));
+    if( linkmsvc(gen) )
+    {
+        switch( gen->op )
+        {
+        case BS_LinkExe:
+            addquoted(&cmd," /nologo @",str(&rsp),"");
+            addquoted(&cmd," /out:",out,"");
+            break;
+        case BS_LinkDll:
+            addquoted(&cmd," /nologo /dll @",str(&rsp),"");
+            addquoted(&cmd," /out:",out,"");
+            // the importlib is called xyz.dll.lib
+            implib = (char*)malloc(strlen(out) + 5);
+            sprintf(implib,"%s.lib",out);
+            addquoted(&cmd," /implib:",implib,"");
+            break;
+        case BS_LinkLib:
+            if( gen->toolchain == BS_clang )
+            {
+                clear(&cmd);
+                adds(&cmd,"llvm-lib");
+            }
+            addquoted(&cmd," /nologo /out:",out,"");
+            addquoted(&cmd," @",str(&rsp),"");
+            break;
+        }
+    }else
+    {
+        switch( gen->op )
+        {
+        case BS_LinkExe:
+            addquoted(&cmd," @",str(&rsp),"");
+            addquoted(&cmd," -o ",out,"");
+            break;
+        case BS_LinkDll:
+            adds(&cmd, gen->os == BS_mac ? " -dynamiclib" : " -shared");
+            addquoted(&cmd," @",str(&rsp),"");
+            addquoted(&cmd," -o ",out,"");
+            break;
+        case BS_LinkLib:
+            addquoted(&cmd," r ",out,"");
+            if( gen->os == BS_mac )
+            {
+                // the ar on macs doesn't support @file
+                useRsp = 0;
+                adds(&cmd,str(&gen->ins));
+            }else
+                addquoted(&cmd," @",str(&rsp),"");
+            break;
+        }
+    }
+
+    writebuild(gen, gen->op == BS_LinkLib ? "ar" : "link", implib);
+    writevalue(gen->out,"cmd",str(&cmd));
+    if( useRsp )
+    {
+        Buf content = { 0, 0, 0 };
+        adds(&content,str(&gen->ins));
+        if( gen->op != BS_LinkLib )
+        {
+            adds(&content,str(&gen->ldflags));
+            adds(&content,str(&gen->libdirs));
+            adds(&content,str(&gen->libnames));
+            adds(&content,str(&gen->libfiles));
+            adds(&content,str(&gen->frameworks));
+        }
+        writevalue(gen->out,"rspfile",str(&rsp));
+        writevalue(gen->out,"rspfile_content",str(&content));
+        free(content.d);
+    }
+    if( implib )
+    {
+        Buf tmp = { 0, 0, 0 };
+        addpath(&tmp,implib);
+        adds(&gen->prodOuts,str(&tmp));
+        free(tmp.d);
+    }
+    free(implib);
+    free(cmd.d);
+    free(rsp.d);
+}
+
+static void endOp(void* data)
+{
+    NinjaGen* gen = (NinjaGen*)data;
+    Buf cmd = { 0, 0, 0 };
+    adds(&cmd,str(&gen->cmd));
+    switch( gen->op )
+    {
+    case BS_Compile:
+        adds(&cmd,str(&gen->flags));
+        if( gen->toolchain == BS_msvc )
+        {
+            adds(&cmd," /nologo /showIncludes /c");
+            addquoted(&cmd," /Fo",str(&gen->out1),"");
+            adds(&cmd,str(&gen->ins));
+            writebuild(gen,"cl",0);
+        }else
+        {
+            // let the compiler write the included headers to a depfile next to the object file
+            adds(&cmd," -MD -MF \"");
+            adds(&cmd,str(&gen->out1));
+            adds(&cmd,".d\" -c -o");
+            adds(&cmd,str(&gen->outs));
+            adds(&cmd,str(&gen->ins));
+            writebuild(gen,"cc",0);
+        }
+        writevalue(gen->out,"cmd",str(&cmd));
+        break;
+    case BS_LinkExe:
+    case BS_LinkDll:
+    case BS_LinkLib:
+        linkop(gen);
+        break;
+    case BS_RunMoc:
+    case BS_RunRcc:
+    case BS_RunUic:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd," -o");
+        adds(&cmd,str(&gen->outs));
+        adds(&cmd,str(&gen->flags));
+        writebuild(gen, gen->op == BS_RunMoc ? "moc" : gen->op == BS_RunRcc ? "rcc" : "uic", 0 );
+        writevalue(gen->out,"cmd",str(&cmd));
+        break;
+    case BS_RunLua:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd,str(&gen->flags));
+        if( gen->nouts.len == 0 )
+        {
+            // a LuaScriptForeach without declared outputs runs each time like with BUSY;
+            // the stamp file is never created
+            char* stamp = (char*)malloc(strlen(gen->buildDir) + strlen(gen->target) + 32);
+            sprintf(stamp,"%s/%s.%d.stamp", gen->buildDir, gen->target, ++gen->stamps);
+            addpath(&gen->nouts,stamp);
+            free(stamp);
+        }
+        writebuild(gen,"lua",0);
+        writevalue(gen->out,"cmd",str(&cmd));
+        break;
+    case BS_Copy:
+        adds(&cmd,str(&gen->ins));
+        adds(&cmd,str(&gen->outs));
+        writebuild(gen,"copy",0);
+        writevalue(gen->out,"cmd",str(&cmd));
+        break;
+    default:
+        break;
+    }
+    free(cmd.d);
+}
+
+static void genproduct(lua_State* L, int graph, int node, int ctx, NinjaGen* gen)
+{
+    const int top = lua_gettop(L);
+    const BSGraph* g = bs_tograph(L,graph);
+    const BSGraphNode* n = &g->nodes[node];
+
+    clear(&gen->orderOnly);
+    int i;
+    for( i = 0; i < n->depCount; i++ )
+    {
+        if( i == 0 )
+            adds(&gen->orderOnly," ||");
+        addpath(&gen->orderOnly,g->nodes[n->deps[i]].name);
+    }
+
+    gen->target = n->name;
+    clear(&gen->prodOuts);
+
+    lua_pushcfunction(L, bs_visit);
+    lua_pushvalue(L,graph);
+    lua_pushinteger(L,node);
+    lua_pushvalue(L,ctx);
+    lua_call(L,3,0);
+
+    Buf name = { 0, 0, 0 };
+    addpath(&name,n->name);
+    fprintf(gen->out,"build%s: phony%s%s\n\n", str(&name), str(&gen->prodOuts), str(&gen->orderOnly));
+    free(name.d);
+
+    assert( top == lua_gettop(L) );
+}
+
+int bs_genNinja(lua_State* L) // args: root module def, array of productinst, graph
+{
+    enum { ROOT = 1, PRODS, GRAPH };
+    const int top = lua_gettop(L);
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "builtins");
+    lua_call(L,1,1);
+    lua_getfield(L,-1,"#inst");
+    lua_getfield(L,-1,"root_build_dir");
+    const int buildDir = lua_gettop(L);
+
+    if( !bs_exists(lua_tostring(L,buildDir)) )
+    {
+        if( bs_mkdir(lua_tostring(L,buildDir)) != 0 )
+            luaL_error(L,"error creating directory %s", lua_tostring(L,buildDir));
+    }
+
+    lua_pushvalue(L,buildDir);
+    lua_pushstring(L,"/build.ninja");
+    lua_concat(L,2);
+    const int path = lua_gettop(L);
+
+    NinjaGen gen;
+    memset(&gen,0,sizeof(gen));
+    gen.out = bs_fopen(bs_denormalize_path(lua_tostring(L,path)),"w");
+    if( gen.out == NULL )
+        luaL_error(L,"cannot open file for writing: %s", lua_tostring(L,path));
+    gen.buildDir = bs_denormalize_path(lua_tostring(L,buildDir));
+
+    const char* text = "# generated by BUSY, do not modify\n"
+                       "ninja_required_version = 1.7\n\n"
+                       "rule cc\n"
+                       "  command = $cmd\n"
+                       "  depfile = $out.d\n"
+                       "  deps = gcc\n"
+                       "  description = CC $out\n\n"
+                       "rule cl\n"
+                       "  command = $cmd\n"
+                       "  deps = msvc\n"
+                       "  description = CC $out\n\n"
+                       "rule link\n"
+                       "  command = $cmd\n"
+                       "  rspfile = $rspfile\n"
+                       "  rspfile_content = $rspfile_content\n"
+                       "  description = LINK $out\n\n"
+                       "rule ar\n"
+                       "  command = $cmd\n"
+                       "  rspfile = $rspfile\n"
+                       "  rspfile_content = $rspfile_content\n"
+                       "  description = AR $out\n\n"
+                       "rule moc\n"
+                       "  command = $cmd\n"
+                       "  description = MOC $out\n\n"
+                       "rule rcc\n"
+                       "  command = $cmd\n"
+                       "  description = RCC $out\n\n"
+                       "rule uic\n"
+                       "  command = $cmd\n"
+                       "  description = UIC $out\n\n"
+                       "rule lua\n"
+                       "  command = $cmd\n"
+                       "  restat = 1\n"
+                       "  description = LUA $in\n\n"
+                       "rule copy\n"
+                       "  command = $cmd\n"
+                       "  description = COPY $out\n\n";
+    fwrite(text,1,strlen(text),gen.out);
+
+    BSVisitorCtx* ctx = bs_newctx(L);
+    const int ctxIdx = lua_gettop(L);
+    ctx->d_data = &gen;
+    ctx->d_begin = beginOp;
+    ctx->d_param = opParam;
+    ctx->d_end = endOp;
+
+    const BSGraph* g = bs_tograph(L,GRAPH);
+    int n;
+    for( n = 0; n < g->count; n++ )
+        genproduct(L,GRAPH,n,ctxIdx,&gen);
+
+    size_t i;
+
+    Buf def = { 0, 0, 0 };
+    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
+    {
+        lua_rawgeti(L,PRODS,i);
+        lua_getfield(L,-1,"#decl");
+        bs_declpath(L,-1,".");
+        addpath(&def,lua_tostring(L,-1));
+        lua_pop(L,3); // prod, decl, desig
+    }
+    fprintf(gen.out,"default%s\n",str(&def));
+    free(def.d);
+    fclose(gen.out);
+
+    fprintf(stdout,"# generated %s\n", bs_denormalize_path(lua_tostring(L,path)));
+    fflush(stdout);
+
+    free(gen.cmd.d);
+    free(gen.flags.d);
+    free(gen.ldflags.d);
+    free(gen.libdirs.d);
+    free(gen.libnames.d);
+    free(gen.libfiles.d);
+    free(gen.frameworks.d);
+    free(gen.ins.d);
+    free(gen.outs.d);
+    free(gen.nins.d);
+    free(gen.nouts.d);
+    free(gen.out1.d);
+    free(gen.prodOuts.d);
+    free(gen.orderOnly.d);
+
+    lua_pop(L,5); // builtins, binst, buildDir, path, ctx
+    assert( top == lua_gettop(L) );
+    return 0;
+}
@@ -23,6 +23,8 @@
 #include "bslex.h" 
 #include "bshost.h"
 #include "bsunicode.h"
+#include "bstrace.h"
+#include "bscache.h"
 #include <memory.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -2096,8 +2098,9 @@ static void set_defaults(BSParserContext* ctx, int n, int row, int col)
 
 static int checkListType(BSParserContext* ctx, int n, int t)
 {
-    lua_getfield(ctx->L,-1,"#kind");
-    const int k = lua_tointeger(ctx->L,n);
+    // n is the index of the type
+    lua_getfield(ctx->L,n,"#kind");
+    const int k = lua_tointeger(ctx->L,-1);
     lua_pop(ctx->L,1);
     if( k != BS_ListType )
         return 0;
@@ -2109,17 +2112,347 @@ static int checkListType(BSParserContext* ctx, int n, int t)
     return !err;
 }
 
+// The results of trycompile are kept in the file .busy_trycompile in the root build directory, so the compiler only
+// runs for probes which are new or of which the compiler changed. After the magic each record is a line
+// "<key> <result> <length of cmd> <length of code>", followed by the command, the code and a newline; the key is
+// the hash of the compiler (name and changed time), the command and the code.
+static const char s_tryMagic[] = "BUSYTRY1\n";
+
+static int trykey(const char* cmd, const char* code, size_t codeLen, char* hex)
+{
+    // writes the key as 16 hex digits to hex; returns 0 if the compiler was not found
+    BSHash h;
+    if( bs_cachekey(cmd,0,&h) != 0 )
+        return 0;
+    h = bs_hash(code,codeLen,h);
+    sprintf(hex,"%016llx",(unsigned long long)h);
+    return 1;
+}
+
+static void trypath(lua_State* L, int rootOutDir)
+{
+    // pushes the denormalized path of the result file
+    lua_pushstring(L,"./.busy_trycompile");
+    const int res = bs_add_path(L,rootOutDir,lua_gettop(L));
+    assert(res==0);
+    lua_pushstring(L,bs_denormalize_path(lua_tostring(L,-1)));
+    lua_replace(L,-3);
+    lua_pop(L,1);
+}
+
+static void tryload(BSParserContext* ctx, int binst, int rootOutDir)
+{
+    // loads the results of previous runs into #trycompile of binst (key -> boolean); the probes of which the
+    // compiler changed since are collected in #trystale, to be run together with the first probe not yet known;
+    // the file is rewritten without these
+    lua_State* L = ctx->L;
+    lua_getfield(L,binst,"#trycompile");
+    const int loaded = lua_istable(L,-1);
+    lua_pop(L,1);
+    if( loaded )
+        return;
+    const int top = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int results = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int stale = lua_gettop(L);
+    trypath(L,rootOutDir);
+    const int path = lua_gettop(L);
+
+    char* data = 0;
+    long len = 0;
+    FILE* f = bs_fopen(lua_tostring(L,path),"rb");
+    if( f != NULL && fseek(f,0,SEEK_END) == 0 && ( len = ftell(f) ) > 0 && fseek(f,0,SEEK_SET) == 0 )
+    {
+        data = (char*)malloc(len);
+        if( fread(data,1,len,f) != (size_t)len )
+            len = 0;
+    }
+    if( f != NULL )
+        fclose(f);
+    const size_t magicLen = sizeof(s_tryMagic) - 1;
+    int dirty = len < (long)magicLen || memcmp(data,s_tryMagic,magicLen) != 0;
+    char* valid = (char*)malloc(len + magicLen);
+    memcpy(valid,s_tryMagic,magicLen);
+    size_t validLen = magicLen;
+    const char* p = data + magicLen;
+    const char* end = data + len;
+    while( !dirty && p < end )
+    {
+        const char* nl = (const char*)memchr(p,'\n',end-p);
+        char hex[17], key[17];
+        int res;
+        unsigned int cmdLen, codeLen;
+        if( nl == 0 || nl - p > 64 )
+            break;
+        char line[65];
+        memcpy(line,p,nl-p);
+        line[nl-p] = 0;
+        if( sscanf(line,"%16s %d %u %u",hex,&res,&cmdLen,&codeLen) != 4 || (size_t)(end - nl) < cmdLen + codeLen + 2 )
+            break;
+        const char* cmd = nl + 1;
+        const char* code = cmd + cmdLen;
+        const char* next = code + codeLen + 1;
+        lua_pushlstring(L,cmd,cmdLen);
+        if( trykey(lua_tostring(L,-1),code,codeLen,key) && strcmp(key,hex) == 0 )
+        {
+            lua_pushboolean(L,res);
+            lua_setfield(L,results,hex);
+            memcpy(valid+validLen,p,next-p);
+            validLen += next - p;
+            lua_pop(L,1); // cmd
+        }else
+        {
+            lua_createtable(L,0,2);
+            lua_pushvalue(L,-2);
+            lua_setfield(L,-2,"cmd");
+            lua_pushlstring(L,code,codeLen);
+            lua_setfield(L,-2,"code");
+            lua_rawseti(L,stale,lua_objlen(L,stale)+1);
+            lua_pop(L,1); // cmd
+        }
+        p = next;
+    }
+    if( p != end || lua_objlen(L,stale) != 0 )
+        dirty = 1;
+    if( dirty )
+    {
+        f = bs_fopen(lua_tostring(L,path),"wb");
+        if( f != NULL )
+        {
+            fwrite(valid,1,validLen,f);
+            fclose(f);
+        }
+    }
+    free(data);
+    free(valid);
+    lua_pop(L,1); // path
+    lua_setfield(L,binst,"#trystale");
+    lua_setfield(L,binst,"#trycompile");
+    assert( top == lua_gettop(L) );
+}
+
+static void tryrun(BSParserContext* ctx, int probes, int rootOutDir, int os)
+{
+    // runs the probes (tables with cmd, code and key) with as many compilers at once as the -j option allows and
+    // sets their res field; each probe has its own source and object file, so they can run in parallel
+    lua_State* L = ctx->L;
+    const int top = lua_gettop(L);
+    const int n = lua_objlen(L,probes);
+    const char* nul = strcmp(lua_tostring(L,os),"win32")==0 || strcmp(lua_tostring(L,os),"msdos")==0 ||
+            strcmp(lua_tostring(L,os),"winrt")==0 ? " 2> nul" : " 2>/dev/null";
+    lua_getglobal(L,"#jobs");
+    int maxJobs = lua_isnumber(L,-1) ? lua_tointeger(L,-1) : bs_cpucount();
+    lua_pop(L,1);
+    if( maxJobs > 32 )
+        maxJobs = 32; // bs_wait on Windows can wait for at most 64 processes
+    int i, next = 1, nrunning = 0;
+    for( i = 1; i <= n; i++ )
+    {
+        lua_rawgeti(L,probes,i);
+        const int probe = lua_gettop(L);
+        lua_getfield(L,probe,"cmd");
+        const char* cmd = lua_tostring(L,-1);
+        lua_getfield(L,probe,"key");
+        lua_pushfstring(L,"./_trycompile_%s.c",lua_tostring(L,-1));
+        bs_add_path(L,rootOutDir,lua_gettop(L));
+        lua_pushstring(L,bs_denormalize_path(lua_tostring(L,-1)));
+        lua_setfield(L,probe,"src");
+        lua_pushfstring(L,"./_trycompile_%s.obj",lua_tostring(L,-3));
+        bs_add_path(L,rootOutDir,lua_gettop(L));
+        lua_pushstring(L,bs_denormalize_path(lua_tostring(L,-1)));
+        lua_setfield(L,probe,"obj");
+        lua_pop(L,5); // key, paths
+        lua_getfield(L,probe,"src");
+        lua_getfield(L,probe,"obj");
+        if( strncmp(cmd,"cl ",3) == 0 )
+            lua_pushfstring(L,"%s /Fo\"%s\" \"%s\"%s",cmd,lua_tostring(L,-1),lua_tostring(L,-2),nul);
+        else
+            lua_pushfstring(L,"%s -o \"%s\" \"%s\"%s",cmd,lua_tostring(L,-1),lua_tostring(L,-2),nul);
+        lua_setfield(L,probe,"run");
+        lua_pop(L,3); // cmd, src, obj
+        lua_pushboolean(L,0);
+        lua_setfield(L,probe,"res");
+
+        lua_getfield(L,probe,"src");
+        FILE* tmp = bs_fopen(lua_tostring(L,-1),"w");
+        if( tmp == NULL )
+            error(ctx, 0, 0,"cannot create temporary file %s", lua_tostring(L,-1) );
+        lua_getfield(L,probe,"code");
+        fwrite(lua_tostring(L,-1),1,lua_objlen(L,-1),tmp);
+        fclose(tmp);
+        lua_pop(L,3); // probe, src, code
+    }
+    int* pids = (int*)malloc(n*sizeof(int));
+    for( i = 0; i < n; i++ )
+        pids[i] = -1;
+    while( next <= n || nrunning > 0 )
+    {
+        while( next <= n && nrunning < maxJobs )
+        {
+            lua_rawgeti(L,probes,next);
+            lua_getfield(L,-1,"run");
+            pids[next-1] = bs_spawn(lua_tostring(L,-1));
+            if( pids[next-1] >= 0 )
+                nrunning++;
+            lua_pop(L,2); // probe, run
+            next++;
+        }
+        if( nrunning == 0 )
+            continue;
+        int status;
+        const int pid = bs_wait(&status,0);
+        if( pid < 0 )
+            break;
+        for( i = 0; i < n; i++ )
+        {
+            if( pids[i] == pid )
+            {
+                pids[i] = -1;
+                nrunning--;
+                lua_rawgeti(L,probes,i+1);
+                lua_pushboolean(L,status == 0);
+                lua_setfield(L,-2,"res");
+                lua_pop(L,1);
+                break;
+            }
+        }
+    }
+    free(pids);
+    for( i = 1; i <= n; i++ )
+    {
+        lua_rawgeti(L,probes,i);
+        lua_getfield(L,-1,"src");
+        remove(lua_tostring(L,-1));
+        lua_getfield(L,-2,"obj");
+        remove(lua_tostring(L,-1));
+        lua_pop(L,3); // probe, src, obj
+    }
+    assert( top == lua_gettop(L) );
+}
+
+static int trycached(BSParserContext* ctx, int binst, int rootOutDir, int os, int cmd, int code)
+{
+    // returns the result of compiling code with cmd, which is only run if not known from a previous build;
+    // if need be the probes of which the compiler changed are run again at the same time
+    lua_State* L = ctx->L;
+    const int top = lua_gettop(L);
+    tryload(ctx,binst,rootOutDir);
+    lua_getfield(L,binst,"#trycompile");
+    const int results = lua_gettop(L);
+    char hex[17];
+    const int cacheable = trykey(lua_tostring(L,cmd),lua_tostring(L,code),lua_objlen(L,code),hex);
+    if( cacheable )
+    {
+        lua_getfield(L,results,hex);
+        if( lua_isboolean(L,-1) )
+        {
+            const int res = lua_toboolean(L,-1);
+            lua_settop(L,top);
+            return res;
+        }
+        lua_pop(L,1);
+    }else
+        sprintf(hex,"%016llx",(unsigned long long)bs_hash(lua_tostring(L,code),lua_objlen(L,code),
+                                                          bs_hash(lua_tostring(L,cmd),lua_objlen(L,cmd),BS_HASH_INIT)));
+
+    lua_createtable(L,1,0);
+    const int probes = lua_gettop(L);
+    lua_createtable(L,0,4);
+    lua_pushvalue(L,cmd);
+    lua_setfield(L,-2,"cmd");
+    lua_pushvalue(L,code);
+    lua_setfield(L,-2,"code");
+    lua_pushstring(L,hex);
+    lua_setfield(L,-2,"key");
+    lua_rawseti(L,probes,1);
+    lua_createtable(L,0,0);
+    const int keys = lua_gettop(L); // of the probes, to skip duplicates
+    lua_pushboolean(L,1);
+    lua_setfield(L,keys,hex);
+    lua_getfield(L,binst,"#trystale");
+    const int stale = lua_gettop(L);
+    size_t i;
+    for( i = 1; cacheable && i <= lua_objlen(L,stale); i++ )
+    {
+        lua_rawgeti(L,stale,i);
+        lua_getfield(L,-1,"cmd");
+        lua_getfield(L,-2,"code");
+        if( trykey(lua_tostring(L,-2),lua_tostring(L,-1),lua_objlen(L,-1),hex) )
+        {
+            lua_pushstring(L,hex);
+            lua_getfield(L,results,hex);
+            lua_getfield(L,keys,hex);
+            const int known = !lua_isnil(L,-1) || !lua_isnil(L,-2);
+            lua_pop(L,1);
+            if( !known )
+            {
+                lua_pushboolean(L,1);
+                lua_setfield(L,keys,hex);
+                lua_pop(L,1);
+                lua_setfield(L,-4,"key");
+                lua_pushvalue(L,-3);
+                lua_rawseti(L,probes,lua_objlen(L,probes)+1);
+            }else
+                lua_pop(L,2);
+        }
+        lua_pop(L,3); // probe, cmd, code
+    }
+    lua_pop(L,2); // keys, stale
+    lua_createtable(L,0,0);
+    lua_setfield(L,binst,"#trystale");
+
+    tryrun(ctx,probes,rootOutDir,os);
+
+    FILE* out = 0;
+    if( cacheable )
+    {
+        trypath(L,rootOutDir);
+        out = bs_fopen(lua_tostring(L,-1),"ab");
+        lua_pop(L,1);
+    }
+    for( i = 1; i <= lua_objlen(L,probes); i++ )
+    {
+        lua_rawgeti(L,probes,i);
+        lua_getfield(L,-1,"key");
+        lua_getfield(L,-2,"res");
+        lua_getfield(L,-3,"cmd");
+        lua_getfield(L,-4,"code");
+        if( cacheable )
+        {
+            lua_pushvalue(L,-3);
+            lua_setfield(L,results,lua_tostring(L,-5));
+        }
+        if( out != NULL )
+        {
+            fprintf(out,"%s %d %u %u\n",lua_tostring(L,-4),lua_toboolean(L,-3),(unsigned int)lua_objlen(L,-2),
+                    (unsigned int)lua_objlen(L,-1));
+            fwrite(lua_tostring(L,-2),1,lua_objlen(L,-2),out);
+            fwrite(lua_tostring(L,-1),1,lua_objlen(L,-1),out);
+            fputc('\n',out);
+        }
+        lua_pop(L,5); // probe, key, res, cmd, code
+    }
+    if( out != NULL )
+        fclose(out);
+    lua_rawgeti(L,probes,1);
+    lua_getfield(L,-1,"res");
+    const int res = lua_toboolean(L,-1);
+    lua_settop(L,top);
+    return res;
+}
+
 static void trycompile(BSParserContext* ctx, int n, int row, int col)
 {
     BS_BEGIN_LUA_FUNC(ctx,2); // out: value, type
     if( n < 1 )
         error(ctx, row, col,"expecting at least one argument" );
-    lua_getfield(ctx->L,-1,"#kind");
-    lua_getfield(ctx->L,-2,"#type");
+    const int first = lua_gettop(ctx->L) - 2 * n + 1;
+    lua_getfield(ctx->L,first+1,"#kind");
+    lua_getfield(ctx->L,first+1,"#type");
     if( lua_tointeger(ctx->L,-2) != BS_BaseType || lua_tointeger(ctx->L,-1) != BS_string )
         error(ctx, row, col,"expecting at least one argument of string type" );
     lua_pop(ctx->L,2);
-    const int first = lua_gettop(ctx->L) - 2 * n + 1;
 
     lua_getfield(ctx->L,ctx->builtins,"#inst");
     const int binst = lua_gettop(ctx->L);
@@ -2127,12 +2460,6 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
     lua_getfield(ctx->L,binst,"root_build_dir");
     const int rootOutDir = lua_gettop(ctx->L);
 
-    lua_pushstring(ctx->L,"./_trycompile_.c");
-    const int tmppath = lua_gettop(ctx->L);
-    const int res = bs_add_path(ctx->L,rootOutDir,tmppath);
-    assert(res==0);
-    lua_replace(ctx->L,tmppath);
-
     if( !ctx->skipMode )
     {
         if( !bs_exists(lua_tostring(ctx->L,rootOutDir)) )
@@ -2140,13 +2467,6 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
             if( bs_mkdir(lua_tostring(ctx->L,rootOutDir)) != 0 )
                 error(ctx, row, col,"error creating directory %s", lua_tostring(ctx->L,rootOutDir));
         }
-
-        FILE* tmp = bs_fopen(bs_denormalize_path(lua_tostring(ctx->L,tmppath)),"w");
-        if( tmp == NULL )
-            error(ctx, row, col,"cannot create temporary file %s", lua_tostring(ctx->L,tmppath) );
-        const int codelen = lua_objlen(ctx->L,first);
-        fwrite(lua_tostring(ctx->L,first),1,codelen,tmp);
-        fclose(tmp);
     }
 
     lua_getfield(ctx->L,binst,"target_toolchain");
@@ -2169,11 +2489,11 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
     {
         // TODO: unify the following code with bsrunner addAll
         size_t i;
-        if( !checkListType(ctx,first+1+1,BS_string) )
+        if( !checkListType(ctx,first+2+1,BS_string) )
             error(ctx, row, col,"expecting argument 2 of string list type" );
-        for( i = 1; i <= lua_objlen(ctx->L,first+1); i++ )
+        for( i = 1; i <= lua_objlen(ctx->L,first+2); i++ )
         {
-            lua_rawgeti(ctx->L,first+1,i);
+            lua_rawgeti(ctx->L,first+2,i);
             lua_pushvalue(ctx->L,defines);
             if( strstr(lua_tostring(ctx->L,-2),"\\\"") != NULL )
                 lua_pushfstring(ctx->L," \"-D%s\" ", lua_tostring(ctx->L,-2)); // strings can potentially include whitespace, thus quotes
@@ -2185,11 +2505,11 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
         }
         if( n >= 3 )
         {
-            if( !checkListType(ctx,first+2+1,BS_path) )
+            if( !checkListType(ctx,first+4+1,BS_path) )
                 error(ctx, row, col,"expecting argument 3 of path list type" );
-            for( i = 1; i <= lua_objlen(ctx->L,first+2); i++ )
+            for( i = 1; i <= lua_objlen(ctx->L,first+4); i++ )
             {
-                lua_rawgeti(ctx->L,first+2,i);
+                lua_rawgeti(ctx->L,first+4,i);
                 const int path = lua_gettop(ctx->L);
                 if( *lua_tostring(ctx->L,-1) != '/' )
                 {
@@ -2206,13 +2526,13 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
             }
             if( n == 4 )
             {
-                if( !checkListType(ctx,first+3+1,BS_string) )
-                    error(ctx, row, col,"expecting argument 3 of string list type" );
-                for( i = 1; i <= lua_objlen(ctx->L,first+3); i++ )
+                if( !checkListType(ctx,first+6+1,BS_string) )
+                    error(ctx, row, col,"expecting argument 4 of string list type" );
+                for( i = 1; i <= lua_objlen(ctx->L,first+6); i++ )
                 {
                     lua_pushvalue(ctx->L,cflags);
                     lua_pushstring(ctx->L," ");
-                    lua_rawgeti(ctx->L,first+3,i);
+                    lua_rawgeti(ctx->L,first+6,i);
                     lua_concat(ctx->L,3);
                     lua_replace(ctx->L,cflags);
                 }
@@ -2235,22 +2555,15 @@ static void trycompile(BSParserContext* ctx, int n, int row, int col)
     lua_pushvalue(ctx->L,cflags);
     lua_pushvalue(ctx->L,includes);
     lua_pushvalue(ctx->L,defines);
-    lua_pushfstring(ctx->L," %s",bs_denormalize_path(lua_tostring(ctx->L,tmppath)));
-    if( strcmp(lua_tostring(ctx->L,os),"win32")==0 ||
-            strcmp(lua_tostring(ctx->L,os),"msdos")==0 ||
-            strcmp(lua_tostring(ctx->L,os),"winrt")==0 )
-        lua_pushstring(ctx->L," 2> nul");
-    else
-        lua_pushstring(ctx->L," 2>/dev/null");
-    lua_concat(ctx->L,6);
-    lua_replace(ctx->L,cmd);
+    lua_concat(ctx->L,4);
+    lua_replace(ctx->L,cmd); // the source and object file are added by tryrun
 
     int res2 = 0;
 
     if( !ctx->skipMode )
-        res2 = !bs_exec(lua_tostring(ctx->L,cmd)); // works for all gcc, clang and cl
+        res2 = trycached(ctx,binst,rootOutDir,os,cmd,first); // works for all gcc, clang and cl
 
-    lua_pop(ctx->L,10); // binst, rootOutDir, tmppath, ts, os, cflags, defines, includes, dir, cmd
+    lua_pop(ctx->L,9); // binst, rootOutDir, ts, os, cflags, defines, includes, dir, cmd
 
     lua_pushboolean(ctx->L,res2);
     lua_getfield(ctx->L,ctx->builtins,"bool");
@@ -4766,7 +5079,9 @@ int bs_parse(lua_State* L)
         lua_error(L);
     }
 
+    const long long start = bs_clock();
     block(&ctx,&ctx.module,0,0);
+    bs_traceevent(bs_denormalize_path(ctx.filepath),"bs_compile",0,start,0);
     lua_pushvalue(L,BS_NewModule);
 
     bslex_freehilex(ctx.lex);
@@ -21,6 +21,7 @@
 #include "bsrunner.h"
 #include "bshost.h"
 #include "bsparser.h"
+#include "bsgraph.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,56 +33,6 @@ static const char* s_listFill1 = " \\\n\t\"";
 //#define BS_QMAKE_GEN_ABS_SOURCE_PATHS
 #define BS_QMAKE_HAVE_COPY
 
-static int mark(lua_State* L) // args: productinst, order, no returns
-{
-    const int inst = 1;
-    const int order = 2;
-
-    const int top = lua_gettop(L);
-
-    lua_getfield(L,inst,"#decl");
-    const int decl = lua_gettop(L);
-
-    lua_getfield(L,-1,"#qmake");
-    if( lua_isnil(L,-1) )
-    {
-        bs_declpath(L,decl,".");
-        lua_setfield(L,decl,"#qmake"); // mark decl
-    }else
-    {
-        lua_pop(L,2); // decl, qmake
-        return 0;
-    }
-    lua_pop(L,1); // qmake
-
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
-        return 0;
-
-    const int ndeps = lua_objlen(L,deps);
-    int i;
-    for( i = 1; i <= ndeps; i++ )
-    {
-        // move along dependency tree and mark
-        lua_pushcfunction(L, mark);
-        lua_rawgeti(L,deps,i);
-        lua_pushvalue(L,order);
-        lua_call(L,2,0);
-    }
-    lua_pop(L,1); // deps
-
-    lua_pushvalue(L,decl);
-    lua_rawseti(L,order,lua_objlen(L,order)+1 );
-
-    lua_pop(L,1); // decl
-
-    const int bottom = lua_gettop(L);
-    assert( top == bottom );
-
-    return 0;
-}
-
 static void addPath(lua_State* L, int lhs, int rhs)
 {
     if( *lua_tostring(L,rhs) == '/' )
@@ -99,8 +50,6 @@ static int isa(lua_State* L, int builtins, int cls, const char* what )
     return res;
 }
 
-static void visitDeps(lua_State* L, int inst);
-
 static void addDep(lua_State* L, int list, int kind, int path )
 {
     lua_createtable(L,0,2);
@@ -250,10 +199,10 @@ static void pushObjectFileName(lua_State* L, int declpath, int source, int toolc
     assert( top + 1 == bottom );
 }
 
-static void libraryDep(lua_State* L, int inst, int builtins, int isSourceSet)
+static void libraryDep(lua_State* L, const BSGraph* g, int node, int inst, int builtins, int isSourceSet)
 {
     const int top = lua_gettop(L);
-    visitDeps(L,inst);
+    const BSGraphNode* n = &g->nodes[node];
 
     const int lib_type = pushLibraryPath(L,inst,builtins,isSourceSet,0,1);
     const int path = lua_gettop(L);
@@ -275,57 +224,49 @@ static void libraryDep(lua_State* L, int inst, int builtins, int isSourceSet)
         const int toolchain = bs_getToolchain(L,binst,0);
         lua_pop(L,1); // binst
 
-        lua_getfield(L,inst,"sources");
-        const int sources = lua_gettop(L);
-        size_t i;
-        for( i = 1; i <= lua_objlen(L,sources); i++ )
+        int i;
+        for( i = 0; i < n->inputs.count; i++ )
         {
-            lua_rawgeti(L,sources,i);
+            lua_pushstring(L,n->inputs.items[i]);
             const int source = lua_gettop(L);
             pushObjectFileName(L,declpath,source,toolchain);
             const int name = lua_gettop(L);
             addDep(L,out,BS_ObjectFiles,name);
             lua_pop(L,2); // source, name
         }
-        lua_pop(L,1); // sources
 
         // for the BS_ObjectFiles you pass also consider BS_SourceFiles from deps
-        lua_getfield(L,inst,"deps");
-        const int deps = lua_gettop(L);
-        if( !lua_isnil(L,deps) )
+        for( i = 0; i < n->depCount; i++ )
         {
-            for( i = 1; i <= lua_objlen(L,deps); i++ )
+            bs_graphinst(L,g,n->deps[i]);
+            const int dep = lua_gettop(L);
+            lua_getfield(L,dep,"#out");
+            const int res = lua_gettop(L);
+            if( !lua_isnil(L,res) )
             {
-                lua_rawgeti(L,deps,i);
-                const int dep = lua_gettop(L);
-                lua_getfield(L,dep,"#out");
-                const int res = lua_gettop(L);
-                if( !lua_isnil(L,res) )
+                size_t j;
+                for( j = lua_objlen(L,res); j > 0; j-- )
                 {
-                    size_t j;
-                    for( j = lua_objlen(L,res); j > 0; j-- )
+                    lua_rawgeti(L,res,j);
+                    const int item = lua_gettop(L);
+                    lua_getfield(L,item,"#kind");
+                    const int k = lua_tointeger(L,-1);
+                    lua_pop(L,1); // kind
+                    if( k == BS_SourceFiles )
                     {
-                        lua_rawgeti(L,res,j);
-                        const int item = lua_gettop(L);
-                        lua_getfield(L,item,"#kind");
-                        const int k = lua_tointeger(L,-1);
-                        lua_pop(L,1); // kind
-                        if( k == BS_SourceFiles )
-                        {
-                            lua_getfield(L,item,"#path");
-                            const int path = lua_gettop(L);
-                            pushObjectFileName(L,declpath,path,toolchain);
-                            const int name = lua_gettop(L);
-                            addDep(L,out,BS_ObjectFiles,name);
-                            lua_pop(L,2); // path, name
-                        }
-                        lua_pop(L,1); // item
+                        lua_getfield(L,item,"#path");
+                        const int path = lua_gettop(L);
+                        pushObjectFileName(L,declpath,path,toolchain);
+                        const int name = lua_gettop(L);
+                        addDep(L,out,BS_ObjectFiles,name);
+                        lua_pop(L,2); // path, name
                     }
+                    lua_pop(L,1); // item
                 }
-                lua_pop(L,2); // dep, res
             }
+            lua_pop(L,2); // dep, res
         }
-        lua_pop(L,2); // deps, declpath
+        lua_pop(L,1); // declpath
     }else
         addDep(L,out,lib_type,path);
 
@@ -337,7 +278,6 @@ static void libraryDep(lua_State* L, int inst, int builtins, int isSourceSet)
 static void exeDep(lua_State* L, int inst, int builtins)
 {
     const int top = lua_gettop(L);
-    visitDeps(L,inst);
 
     lua_getfield(L,inst,"#out");
     const int out = lua_gettop(L);
@@ -355,7 +295,6 @@ static void exeDep(lua_State* L, int inst, int builtins)
 static void scriptDep(lua_State* L, int inst, int builtins)
 {
     const int top = lua_gettop(L);
-    visitDeps(L,inst);
 
     lua_getfield(L,inst,"#out");
     const int out = lua_gettop(L);
@@ -387,10 +326,9 @@ static void scriptDep(lua_State* L, int inst, int builtins)
     assert( top == lua_gettop(L) );
 }
 
-static void mocDep(lua_State* L, int inst)
+static void mocDep(lua_State* L, const BSGraphNode* n, int inst)
 {
     const int top = lua_gettop(L);
-    visitDeps(L,inst);
 
     lua_getfield(L,inst,"#out");
     const int out = lua_gettop(L);
@@ -400,13 +338,10 @@ static void mocDep(lua_State* L, int inst)
     lua_replace(L,-2);
     const int declpath = lua_gettop(L);
 
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    int i;
+    for( i = 0; i < n->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,n->inputs.items[i]);
         const int source = lua_gettop(L);
 
         const int lang = bs_guessLang(lua_tostring(L,source));
@@ -441,15 +376,14 @@ static void mocDep(lua_State* L, int inst)
         lua_pop(L,2); // source, outFile
     }
 
-    lua_pop(L,3); // out, declpath, sources
+    lua_pop(L,2); // out, declpath
 
     assert( top == lua_gettop(L) );
 }
 
-static void rccDep(lua_State* L, int inst)
+static void rccDep(lua_State* L, const BSGraphNode* n, int inst)
 {
     const int top = lua_gettop(L);
-    visitDeps(L,inst);
 
     lua_getfield(L,inst,"#out");
     const int out = lua_gettop(L);
@@ -459,13 +393,10 @@ static void rccDep(lua_State* L, int inst)
     lua_replace(L,-2);
     const int declpath = lua_gettop(L);
 
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    int i;
+    for( i = 0; i < n->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,n->inputs.items[i]);
         const int source = lua_gettop(L);
 
         int len;
@@ -481,7 +412,7 @@ static void rccDep(lua_State* L, int inst)
         lua_pop(L,2); // source, outFile
     }
 
-    lua_pop(L,3); // out, declpath, sources
+    lua_pop(L,2); // out, declpath
 
     assert( top == lua_gettop(L) );
 }
@@ -517,100 +448,54 @@ static void mergeOut(lua_State* L, int toInst, int fromInst )
     lua_pop(L,2); // fromOut, toOut
 }
 
-static void groupDep(lua_State* L, int inst)
+static void groupDep(lua_State* L, const BSGraph* g, int node, int inst)
 {
-    visitDeps(L,inst);
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
-    {
-        lua_pop(L,1); // nil
-        return;
-    }
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,deps); i++ )
+    const BSGraphNode* n = &g->nodes[node];
+    int i;
+    for( i = 0; i < n->depCount; i++ )
     {
-        lua_rawgeti(L,deps,i);
+        bs_graphinst(L,g,n->deps[i]);
         const int dep = lua_gettop(L);
 
         mergeOut(L,inst,dep);
 
         lua_pop(L,1); // dep
     }
-
-    lua_pop(L,1); // deps
 }
 
-typedef enum BS_Class { BS_NoClass, BS_LibraryClass, BS_ExecutableClass, BS_SourceSetClass,
-                        BS_GroupClass, BS_ConfigClass,
-                        BS_LuaScriptClass, BS_LuaScriptForEachClass, BS_CopyClass, BS_MessageClass,
-                        BS_MocClass, BS_RccClass, BS_UicClass } BS_Class;
-static const char* getClassName(int cls)
+static const char* getClassName(int kind)
 {
-    switch( cls )
+    switch( kind )
     {
-    case BS_LibraryClass:
+    case BS_LibraryProduct:
         return "Library";
-    case BS_ExecutableClass:
+    case BS_ExecutableProduct:
         return "Executable";
-    case BS_SourceSetClass:
+    case BS_SourceSetProduct:
         return "SourceSet";
-    case BS_GroupClass:
+    case BS_GroupProduct:
         return "Group";
-    case BS_ConfigClass:
+    case BS_ConfigProduct:
         return "Config";
-    case BS_LuaScriptClass:
+    case BS_LuaScriptProduct:
         return "LuaScript";
-    case BS_LuaScriptForEachClass:
+    case BS_LuaScriptForeachProduct:
         return "LuaScriptForEach";
-    case BS_CopyClass:
+    case BS_CopyProduct:
         return "Copy";
-    case BS_MessageClass:
+    case BS_MessageProduct:
         return "Message";
-    case BS_MocClass:
+    case BS_MocProduct:
         return "Moc";
-    case BS_RccClass:
+    case BS_RccProduct:
         return "Rcc";
-    case BS_UicClass:
+    case BS_UicProduct:
         return "Uic";
     default:
         return "<unknown>";
     }
 }
 
-static int getClass(lua_State* L, int prodinst, int builtins)
-{
-    lua_getmetatable(L,prodinst);
-    const int cls = lua_gettop(L);
-    int res = BS_NoClass;
-    if( isa( L, builtins, cls, "Library" ) )
-        res = BS_LibraryClass;
-    else if( isa( L, builtins, cls, "Executable") )
-        res = BS_ExecutableClass;
-    else if( isa( L, builtins, cls, "SourceSet") )
-        res = BS_SourceSetClass;
-    else if( isa( L, builtins, cls, "Group") )
-        res = BS_GroupClass;
-    else if( isa( L, builtins, cls, "Config") )
-        res = BS_ConfigClass;
-    else if( isa( L, builtins, cls, "LuaScript") )
-        res = BS_LuaScriptClass;
-    else if( isa( L, builtins, cls, "LuaScriptForeach") )
-        res = BS_LuaScriptForEachClass;
-    else if( isa( L, builtins, cls, "Copy") )
-        res = BS_CopyClass;
-    else if( isa( L, builtins, cls, "Message") )
-        res = BS_MessageClass;
-    else if( isa( L, builtins, cls, "Moc") )
-        res = BS_MocClass;
-    else if( isa( L, builtins, cls, "Rcc") )
-        res = BS_RccClass;
-    else if( isa( L, builtins, cls, "Uic") )
-        res = BS_UicClass;
-    lua_pop(L,1); // cls
-    return res;
-}
-
 static void assureOut(lua_State* L, int inst)
 {
     lua_getfield(L,inst,"#out");
@@ -623,180 +508,111 @@ static void assureOut(lua_State* L, int inst)
         lua_pop(L,1);
 }
 
-static int calcDep(lua_State* L) // param: inst
+static void calcDep(lua_State* L, const BSGraph* g, int node, int builtins)
 {
-    const int inst = 1;
+    const int top = lua_gettop(L);
+
+    bs_graphinst(L,g,node);
+    const int inst = lua_gettop(L);
 
     lua_getfield(L,inst,"#visited");
     const int done = !lua_isnil(L,-1);
     lua_pop(L,1);
 
-    lua_pushboolean(L,1);
-    lua_setfield(L,inst,"#visited");
-
     if( done )
-        return 0; // we're already calculated result set
-
-    visitDeps(L,inst);
-
-    lua_getglobal(L, "require");
-    lua_pushstring(L, "builtins");
-    lua_call(L,1,1);
-    const int builtins = lua_gettop(L);
+    {
+        lua_pop(L,1); // inst
+        return; // we're already calculated result set
+    }
 
-    lua_getmetatable(L,inst);
-    const int cls = lua_gettop(L);
+    lua_pushboolean(L,1);
+    lua_setfield(L,inst,"#visited");
 
-    switch( getClass(L,inst,builtins) )
+    // the deps were already calculated, since they come first in the graph
+    switch( g->nodes[node].kind )
     {
-    case BS_LibraryClass:
+    case BS_LibraryProduct:
         assureOut(L,inst);
-        libraryDep(L,inst,builtins,0);
+        libraryDep(L,g,node,inst,builtins,0);
         break;
-    case BS_ExecutableClass:
+    case BS_ExecutableProduct:
         assureOut(L,inst);
         exeDep(L,inst,builtins);
         break;
-    case BS_ConfigClass:
-    case BS_LuaScriptForEachClass:
-    case BS_CopyClass:
-    case BS_MessageClass:
-    case BS_UicClass:
-        break; // NOP
-    case BS_LuaScriptClass:
+    case BS_LuaScriptProduct:
         assureOut(L,inst);
         scriptDep(L,inst,builtins);
         break;
-    case BS_SourceSetClass:
+    case BS_SourceSetProduct:
         assureOut(L,inst);
-        libraryDep(L,inst,builtins,1);
+        libraryDep(L,g,node,inst,builtins,1);
         break;
-    case BS_GroupClass:
-        groupDep(L,inst);
+    case BS_GroupProduct:
+        groupDep(L,g,node,inst);
         break;
-    case BS_MocClass:
+    case BS_MocProduct:
         assureOut(L,inst);
-        mocDep(L,inst);
+        mocDep(L,&g->nodes[node],inst);
         break;
-    case BS_RccClass:
+    case BS_RccProduct:
         assureOut(L,inst);
-        rccDep(L,inst);
+        rccDep(L,&g->nodes[node],inst);
         break;
     default:
-        lua_getfield(L,cls,"#name");
-        luaL_error(L,"don't know how to process instances of class '%s'", lua_tostring(L,-1));
-        break;
-    }
-
-    lua_pop(L,2); // builtins, cls
-    return 0;
-}
-
-static void visitDeps(lua_State* L, int inst)
-{
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-
-    if( lua_isnil(L,deps) )
-    {
-        lua_pop(L,1); // nil
-        return;
+        break; // NOP
     }
 
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,deps); i++ )
-    {
-        lua_pushcfunction(L, calcDep);
-        lua_rawgeti(L,deps,i);
-        lua_call(L,1,0);
-    }
-    lua_pop(L,1); // deps
+    lua_pop(L,1); // inst
+    assert( top == lua_gettop(L) );
 }
 
-static int iterateDeps(lua_State* L, int inst, int filter, int inverse, FILE* out,
+static int iterateDeps(lua_State* L, const BSGraph* g, int node, int filter, int inverse, FILE* out,
                         void (*iterator)(lua_State* L, int inst, int item, FILE* out))
 {
     const int top = lua_gettop(L);
+    const BSGraphNode* n = &g->nodes[node];
 
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
-    {
-        lua_pop(L,1); // nil
-        return 0;
-    }
+    bs_graphinst(L,g,node);
+    const int inst = lua_gettop(L);
 
-    size_t i;
-    int n = 0;
-    if( inverse )
+    int i;
+    int count = 0;
+    for( i = 0; i < n->depCount; i++ )
     {
-        for( i = lua_objlen(L,deps); i > 0; i-- )
-        {
-            lua_rawgeti(L,deps,i);
-            const int dep = lua_gettop(L);
+        bs_graphinst(L,g,n->deps[inverse ? n->depCount - 1 - i : i]);
+        const int dep = lua_gettop(L);
 
-            lua_getfield(L,dep,"#out");
-            const int res = lua_gettop(L);
+        lua_getfield(L,dep,"#out");
+        const int res = lua_gettop(L);
 
-            if( !lua_isnil(L,res) )
-            {
-                size_t j;
-                for( j = lua_objlen(L,res); j > 0; j-- )
-                {
-                    lua_rawgeti(L,res,j);
-                    const int item = lua_gettop(L);
-                    lua_getfield(L,item,"#kind");
-                    const int k = lua_tointeger(L,-1);
-                    lua_pop(L,1);
-                    if( k == filter )
-                    {
-                        n++;
-                        iterator(L,inst, item, out);
-                    }
-                    lua_pop(L,1); // item
-                }
-            }
-
-            lua_pop(L,2); // dep, res
-        }
-    }else
-    {
-        for( i = 1; i <= lua_objlen(L,deps); i++ )
+        if( !lua_isnil(L,res) )
         {
-            lua_rawgeti(L,deps,i);
-            const int dep = lua_gettop(L);
-
-            lua_getfield(L,dep,"#out");
-            const int res = lua_gettop(L);
-
-            if( !lua_isnil(L,res) )
+            const size_t len = lua_objlen(L,res);
+            size_t j;
+            for( j = 1; j <= len; j++ )
             {
-                size_t j;
-                for( j = 1; j <= lua_objlen(L,res); j++ )
+                lua_rawgeti(L,res,inverse ? len - j + 1 : j);
+                const int item = lua_gettop(L);
+                lua_getfield(L,item,"#kind");
+                const int k = lua_tointeger(L,-1);
+                lua_pop(L,1);
+                if( k == filter )
                 {
-                    lua_rawgeti(L,res,j);
-                    const int item = lua_gettop(L);
-                    lua_getfield(L,item,"#kind");
-                    const int k = lua_tointeger(L,-1);
-                    lua_pop(L,1);
-                    if( k == filter )
-                    {
-                        n++;
-                        iterator(L,inst, item, out);
-                    }
-                    lua_pop(L,1); // item
+                    count++;
+                    iterator(L,inst, item, out);
                 }
+                lua_pop(L,1); // item
             }
-
-            lua_pop(L,2); // dep, res
         }
+
+        lua_pop(L,2); // dep, res
     }
 
-    lua_pop(L,1); // deps
+    lua_pop(L,1); // inst
 
     const int bottom = lua_gettop(L);
     assert( top ==  bottom);
-    return n;
+    return count;
 }
 
 static int s_sourceCount = 0;
@@ -812,68 +628,60 @@ static void renderDep(lua_State* L, int inst, int item, FILE* out)
     s_sourceCount++;
 }
 
-static int addSources(lua_State* L, int inst, FILE* out, int withHeaderDeps)
+static void pushSourcePath(lua_State* L, int builtins, const char* path)
+{
+    // path is absolute and normalized
+#ifndef BS_QMAKE_GEN_ABS_SOURCE_PATHS
+    lua_getfield(L,builtins,"#inst");
+    lua_getfield(L,-1,"root_source_dir");
+    const char* root = lua_tostring(L,-1);
+    const size_t len = strlen(root);
+    if( strncmp(root,path,len) == 0 && path[len] == '/' )
+        // we're always in a subdir of root_project_dir
+        lua_pushfstring(L,"../$$root_source_dir%s", path + len);
+    else
+        lua_pushstring(L,path);
+    lua_replace(L,-3);
+    lua_pop(L,1); // root_source_dir
+#else
+    lua_pushstring(L,path);
+#endif
+}
+
+static int addSources(lua_State* L, const BSGraph* g, int node, int builtins, FILE* out, int withHeaderDeps)
 {
     const int top = lua_gettop(L);
+    const BSGraphNode* n = &g->nodes[node];
 
-    int n = 0;
+    int count = 0;
     if( withHeaderDeps )
     {
         const char* text = "SOURCES +="; // NOTE: apparently separate OBJECTIVE_SOURCES for *.mm not necessary
         fwrite(text,1,strlen(text),out);
 
         s_sourceCount = 0;
-        iterateDeps(L,inst,BS_SourceFiles, 0,out,renderDep);
-        n = s_sourceCount; // RISK this works as long we don't use threads
+        iterateDeps(L,g,node,BS_SourceFiles, 0,out,renderDep);
+        count = s_sourceCount; // RISK this works as long we don't use threads
     }
 
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    bs_getModuleVar(L,inst,"#fsrdir");
-    const int relDir = lua_gettop(L);
-
-    size_t i;
-    const size_t len = lua_objlen(L,sources);
-    n += len;
-    for( i = 1; i <= len; i++ )
+    int i;
+    count += n->inputs.count;
+    for( i = 0; i < n->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
-        const int file = lua_gettop(L);
+        pushSourcePath(L,builtins,n->inputs.items[i]);
 
-        if( *lua_tostring(L,file) != '/' )
-        {
-#ifndef BS_QMAKE_GEN_ABS_SOURCE_PATHS
-            lua_pushstring(L,"../"); // we're always in a subdir of root_project_dir
-            lua_pushstring(L,"$$root_source_dir/");
-            addPath(L,relDir,file);
-            lua_pushstring(L,lua_tostring(L,-1));
-            lua_replace(L,-2);
-            lua_concat(L,3);
-#else
-            addPath(L,absDir,file);
-#endif
-            lua_replace(L,file);
-        }
-
-        const char* str = bs_denormalize_path(lua_tostring(L,file));
+        const char* str = bs_denormalize_path(lua_tostring(L,-1));
         fwrite(s_listFill1,1,strlen(s_listFill1),out);
         fwrite(str,1,strlen(str),out);
         fwrite("\"",1,1,out);
 
-        lua_pop(L,1); // file
+        lua_pop(L,1); // path
     }
 
-    lua_pop(L,3); // sources, absDir, relDir
-
-
     const int bottom = lua_gettop(L);
     assert( top ==  bottom);
 
-    return n;
+    return count;
 }
 
 static void addHeaders(lua_State* L, int inst, FILE* out)
@@ -1030,7 +838,7 @@ static int remapPath(lua_State* L, int builtins, int path)
     return res;
 }
 
-static void addIncludes(lua_State* L, int inst, int builtins, FILE* out, int head)
+static void addIncludes(lua_State* L, const BSGraphNode* n, int inst, int builtins, FILE* out, int head)
 {
     const int top = lua_gettop(L);
 
@@ -1042,28 +850,7 @@ static void addIncludes(lua_State* L, int inst, int builtins, FILE* out, int hea
 
     // NOTE: does only work if sources directly depends on run_moc; if there is a common root depending on
     // moc_sources and sources in parallel, it doesnt work
-    // iterateDeps(L,inst,BS_IncludeFiles, 0,out,renderInclude);
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        addIncludes(L, config, builtins, out, 0 );
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst,"include_dirs");
-    const int includes = lua_gettop(L);
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    bs_getModuleVar(L,inst,"#fsrdir");
-    const int relDir = lua_gettop(L);
+    // iterateDeps(L,g,node,BS_IncludeFiles, 0,out,renderInclude);
 
     lua_getfield(L,builtins,"#inst");
     lua_getfield(L,-1,"root_build_dir");
@@ -1071,52 +858,40 @@ static void addIncludes(lua_State* L, int inst, int builtins, FILE* out, int hea
     const int rootBuildDir = lua_gettop(L);
     const size_t rbdlen = strlen(lua_tostring(L,rootBuildDir));
 
-    for( i = 1; i <= lua_objlen(L,includes); i++ )
+    const BSStrings* includes = &n->flags[BS_include_dirs];
+    int i;
+    // NOTE we don't consider #ctdefaults (i.e. set_defaults) here, see genCommon
+    for( i = includes->defaults; i < includes->count; i++ )
     {
-        lua_rawgeti(L,includes,i);
-        const int include = lua_gettop(L);
-
-        if( *lua_tostring(L,include) != '/' )
-        {
-            // relative path
-#ifndef BS_QMAKE_GEN_ABS_SOURCE_PATHS
-            lua_pushstring(L,"../"); // we're always in a subdir of root_project_dir
-            lua_pushstring(L,"$$root_source_dir/");
-            addPath(L,relDir,include);
-            lua_pushstring(L,lua_tostring(L,-1));
-            lua_replace(L,-2);
-            lua_concat(L,3);
-#else
-            addPath(L,absDir,include);
-#endif
-            lua_replace(L,include);
-        }
-        if( strncmp(lua_tostring(L,rootBuildDir),lua_tostring(L,include),rbdlen) == 0 )
+        const char* include = includes->items[i];
+        if( strncmp(lua_tostring(L,rootBuildDir),include,rbdlen) == 0 )
         {
             // we have an include pointing to build_dir(); remap it to $$root_build_dir/qmake
-            const char* path = lua_tostring(L,include) + rbdlen + 1; // skip first '/'
-            const int n = findModulePath(L,inst,builtins,path);
+            const char* path = include + rbdlen + 1; // skip first '/'
+            const int count = findModulePath(L,inst,builtins,path);
             size_t j;
-            for(j=n; j>0; j--)
+            for(j=count; j>0; j--)
             {
                 lua_pushfstring(L,"$$root_build_dir/%s", lua_tostring(L, lua_gettop(L) - j + 1));
                 renderQuotedPath(L,-1,out);
                 lua_pop(L,1);
             }
-            lua_pop(L,n);
+            lua_pop(L,count);
         }else
-            renderQuotedPath(L,include,out);
-
-        lua_pop(L,1); // include
+        {
+            pushSourcePath(L,builtins,include);
+            renderQuotedPath(L,lua_gettop(L),out);
+            lua_pop(L,1); // path
+        }
     }
 
-    lua_pop(L,4); // includes, absDir, relDir, rootBuildDir
+    lua_pop(L,1); // rootBuildDir
 
     const int bottom = lua_gettop(L);
     assert( top ==  bottom);
 }
 
-static void addDefines(lua_State* L, int inst, FILE* out, int head)
+static void addDefines(lua_State* L, const BSGraphNode* n, FILE* out, int head)
 {
     const int top = lua_gettop(L);
 
@@ -1126,29 +901,16 @@ static void addDefines(lua_State* L, int inst, FILE* out, int head)
         fwrite(text,1,strlen(text),out);
     }
 
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        addDefines(L, config, out, 0 );
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst,"defines");
-    const int defines = lua_gettop(L);
-
     lua_getglobal(L, "require");
     lua_pushstring(L, "string");
     lua_call(L,1,1);
     const int strlib = lua_gettop(L);
 
-    for( i = 1; i <= lua_objlen(L,defines); i++ )
+    const BSStrings* defines = &n->flags[BS_defines];
+    int i;
+    for( i = defines->defaults; i < defines->count; i++ )
     {
-        lua_rawgeti(L,defines,i);
+        lua_pushstring(L,defines->items[i]);
         const int define = lua_gettop(L);
 
         fwrite(s_listFill1,1,strlen(s_listFill1),out);
@@ -1170,16 +932,14 @@ static void addDefines(lua_State* L, int inst, FILE* out, int head)
         lua_pop(L,1); // define
     }
 
-    lua_pop(L,2); // defines, strlib
+    lua_pop(L,1); // strlib
 
     const int bottom = lua_gettop(L);
     assert( top ==  bottom);
 }
 
-static void addFlags(lua_State* L, int inst, FILE* out, int head, const char* header, const char* field)
+static void addFlags(const BSGraphNode* n, FILE* out, int head, const char* header, int list)
 {
-    const int top = lua_gettop(L);
-
     if( head )
     {
         fwrite(header,1,strlen(header),out);
@@ -1187,40 +947,17 @@ static void addFlags(lua_State* L, int inst, FILE* out, int head, const char* he
         fwrite(text,1,strlen(text),out);
     }
 
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        addFlags(L, config, out, 0, header, field );
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst,field);
-    const int flags = lua_gettop(L);
-
-    for( i = 1; i <= lua_objlen(L,flags); i++ )
+    const BSStrings* flags = &n->flags[list];
+    int i;
+    for( i = flags->defaults; i < flags->count; i++ )
     {
-        lua_rawgeti(L,flags,i);
-        const int flag = lua_gettop(L);
-
         fwrite(s_listFill1,1,strlen(s_listFill1),out);
-        fwrite(lua_tostring(L,flag),1,lua_objlen(L,flag),out);
+        fwrite(flags->items[i],1,strlen(flags->items[i]),out);
         fwrite("\"",1,1,out);
-
-        lua_pop(L,1); // flag
     }
-
-    lua_pop(L,1); // flags
-
-    const int bottom = lua_gettop(L);
-    assert( top ==  bottom);
 }
 
-static void addDepLibs(lua_State* L, int inst, int builtins, int kind, FILE* out)
+static void addDepLibs(lua_State* L, const BSGraph* g, int node, int builtins, int kind, FILE* out)
 {
     const int top = lua_gettop(L);
 
@@ -1234,7 +971,7 @@ static void addDepLibs(lua_State* L, int inst, int builtins, int kind, FILE* out
 
     if( kind == BS_DynamicLib )
     {
-        iterateDeps(L,inst,BS_ObjectFiles,1,out,renderDep);
+        iterateDeps(L,g,node,BS_ObjectFiles,1,out,renderDep);
     }
 
     const int hasWl = ( kind == BS_DynamicLib || kind == BS_Executable ) && isLinux;
@@ -1253,13 +990,13 @@ static void addDepLibs(lua_State* L, int inst, int builtins, int kind, FILE* out
 
     if( kind == BS_DynamicLib )
     {
-        iterateDeps(L,inst,BS_DynamicLib,1,out,renderDep);
-        iterateDeps(L,inst,BS_StaticLib,1,out,renderDep);
+        iterateDeps(L,g,node,BS_DynamicLib,1,out,renderDep);
+        iterateDeps(L,g,node,BS_StaticLib,1,out,renderDep);
     }else if( kind == BS_Executable )
     {
-        iterateDeps(L,inst,BS_DynamicLib,1,out,renderDep);
-        iterateDeps(L,inst,BS_StaticLib,1,out,renderDep);
-        iterateDeps(L,inst,BS_SourceSetLib,0,out,renderDep);
+        iterateDeps(L,g,node,BS_DynamicLib,1,out,renderDep);
+        iterateDeps(L,g,node,BS_StaticLib,1,out,renderDep);
+        iterateDeps(L,g,node,BS_SourceSetLib,0,out,renderDep);
     }
 
     if( hasWl )
@@ -1282,14 +1019,14 @@ static void addDepLibs(lua_State* L, int inst, int builtins, int kind, FILE* out
     {
         if( kind == BS_DynamicLib )
         {
-            iterateDeps(L,inst,BS_ObjectFiles,1,out,renderDep);
-            iterateDeps(L,inst,BS_DynamicLib,1,out,renderDep);
-            iterateDeps(L,inst,BS_StaticLib,1,out,renderDep);
+            iterateDeps(L,g,node,BS_ObjectFiles,1,out,renderDep);
+            iterateDeps(L,g,node,BS_DynamicLib,1,out,renderDep);
+            iterateDeps(L,g,node,BS_StaticLib,1,out,renderDep);
         }else if( kind == BS_Executable )
         {
-            iterateDeps(L,inst,BS_DynamicLib,1,out,renderDep);
-            iterateDeps(L,inst,BS_StaticLib,1,out,renderDep);
-            iterateDeps(L,inst,BS_SourceSetLib,0,out,renderDep);
+            iterateDeps(L,g,node,BS_DynamicLib,1,out,renderDep);
+            iterateDeps(L,g,node,BS_StaticLib,1,out,renderDep);
+            iterateDeps(L,g,node,BS_SourceSetLib,0,out,renderDep);
         }
     }else
     {
@@ -1302,7 +1039,7 @@ static void addDepLibs(lua_State* L, int inst, int builtins, int kind, FILE* out
 }
 
 enum { BS_ForwardSourceSet, BS_ForwardStatic, BS_ForwardShared };
-static void forwardDepLibs(lua_State* L, int inst, int kind, FILE* out)
+static void forwardDepLibs(lua_State* L, const BSGraph* g, int node, int kind, FILE* out)
 {
     const int top = lua_gettop(L);
 
@@ -1317,23 +1054,23 @@ static void forwardDepLibs(lua_State* L, int inst, int kind, FILE* out)
 
         // dependend static libs are not merged with this static lib, but forwarded to the client
         // to be used in parallel with this static lib
-        iterateDeps(L,inst,BS_StaticLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_StaticLib,0,out,passOnDep);
 
         // this static lib cannot make use of dynamic libs and just forwards it
-        iterateDeps(L,inst,BS_DynamicLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_DynamicLib,0,out,passOnDep);
 
         // same reasoning as with BS_StaticLib
-        iterateDeps(L,inst,BS_SourceSetLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_SourceSetLib,0,out,passOnDep);
 
         // we don't forward object files, since these could be added to this static lib, but we already
         // have the static lib of the source set which we forward, so we don't have to also send the object files
         break;
     case BS_ForwardSourceSet:
         // a source set just translates sources to object files and just passes through everything from its dependencies
-        iterateDeps(L,inst,BS_StaticLib,0,out,passOnDep);
-        iterateDeps(L,inst,BS_DynamicLib,0,out,passOnDep);
-        iterateDeps(L,inst,BS_SourceSetLib,0,out,passOnDep);
-        iterateDeps(L,inst,BS_ObjectFiles,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_StaticLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_DynamicLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_SourceSetLib,0,out,passOnDep);
+        iterateDeps(L,g,node,BS_ObjectFiles,0,out,passOnDep);
         break;
     }
 
@@ -1341,7 +1078,7 @@ static void forwardDepLibs(lua_State* L, int inst, int kind, FILE* out)
     assert( top ==  bottom);
 }
 
-static void addLibs(lua_State* L, int inst, int kind, FILE* out, int head, int ismsvc)
+static void addLibs(lua_State* L, const BSGraphNode* n, int builtins, int kind, FILE* out, int head, int ismsvc)
 {
     const int top = lua_gettop(L);
     if( head )
@@ -1350,49 +1087,14 @@ static void addLibs(lua_State* L, int inst, int kind, FILE* out, int head, int i
         fwrite(text,1,strlen(text),out);
     }
 
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        addLibs(L, config, kind, out, 0, ismsvc );
-        mergeOut(L,inst,config);
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
     if( kind != BS_StaticLib )
     {
-        bs_getModuleVar(L,inst,"#dir");
-        const int absDir = lua_gettop(L);
-
-        bs_getModuleVar(L,inst,"#fsrdir");
-        const int relDir = lua_gettop(L);
-
-        lua_getfield(L,inst,"lib_dirs");
-        const int ldirs = lua_gettop(L);
-
-        for( i = 1; i <= lua_objlen(L,ldirs); i++ )
+        const BSStrings* ldirs = &n->flags[BS_lib_dirs];
+        int i;
+        for( i = ldirs->defaults; i < ldirs->count; i++ )
         {
-            lua_rawgeti(L,ldirs,i);
+            pushSourcePath(L,builtins,ldirs->items[i]);
             const int path = lua_gettop(L);
-            if( *lua_tostring(L,-1) != '/' )
-            {
-                // relative path
-#ifndef BS_QMAKE_GEN_ABS_SOURCE_PATHS
-                lua_pushstring(L,"../"); // we're always in a subdir of root_project_dir
-                lua_pushstring(L,"$$root_source_dir/");
-                addPath(L,relDir,path);
-                lua_pushstring(L,lua_tostring(L,-1));
-                lua_replace(L,-2);
-                lua_concat(L,3);
-#else
-                addPath(L,absDir,path);
-#endif
-                lua_replace(L,path);
-            }
             if(ismsvc)
                 lua_pushfstring(L,"/libpath:%s", bs_denormalize_path(lua_tostring(L,path)) );
             else
@@ -1403,31 +1105,26 @@ static void addLibs(lua_State* L, int inst, int kind, FILE* out, int head, int i
             lua_pop(L,2); // path, string
         }
 
-        lua_getfield(L,inst,"lib_names");
-        const int lnames = lua_gettop(L);
-        for( i = 1; i <= lua_objlen(L,lnames); i++ )
+        const BSStrings* lnames = &n->flags[BS_lib_names];
+        for( i = lnames->defaults; i < lnames->count; i++ )
         {
-            lua_rawgeti(L,lnames,i);
             if(ismsvc)
-                lua_pushfstring(L,"%s.lib", lua_tostring(L,-1));
+                lua_pushfstring(L,"%s.lib", lnames->items[i]);
             else
-                lua_pushfstring(L,"-l%s", lua_tostring(L,-1));
+                lua_pushfstring(L,"-l%s", lnames->items[i]);
             fwrite(s_listFill1,1,strlen(s_listFill1),out);
             fwrite(lua_tostring(L,-1),1,lua_objlen(L,-1),out);
             fwrite("\"",1,1,out);
-            lua_pop(L,2); // name, string
+            lua_pop(L,1); // string
         }
-        lua_getfield(L,inst,"frameworks");
-        const int fworks = lua_gettop(L);
-        for( i = 1; i <= lua_objlen(L,fworks); i++ )
+        const BSStrings* fworks = &n->flags[BS_frameworks];
+        for( i = fworks->defaults; i < fworks->count; i++ )
         {
             fwrite(s_listFill1,1,strlen(s_listFill1),out);
-            lua_rawgeti(L,fworks,i);
-            lua_pushfstring(L,"-framework %s\"", lua_tostring(L,-1));
+            lua_pushfstring(L,"-framework %s\"", fworks->items[i]);
             fwrite(lua_tostring(L,-1),1,lua_objlen(L,-1),out);
-            lua_pop(L,2); // name, string
+            lua_pop(L,1); // string
         }
-        lua_pop(L,5); // ldirs, absDir, relDir, lnames, fworks
         // TODO: def_file, lib_files
     }
 
@@ -1436,17 +1133,19 @@ static void addLibs(lua_State* L, int inst, int kind, FILE* out, int head, int i
     assert( top ==  bottom);
 }
 
-static void genCommon(lua_State* L, int inst, int builtins, int kind, FILE* out )
+static void genCommon(lua_State* L, const BSGraph* g, int node, int inst, int builtins, int kind, FILE* out )
 {
     // NOTE we don't consider #ctdefaults (i.e. set_defaults) here, since setting
     // these low-level, generic stuff is the business of qmake
 
+    const BSGraphNode* n = &g->nodes[node];
+
     fwrite("\n",1,1,out);
-    addDefines(L,inst,out,1);
+    addDefines(L,n,out,1);
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    addIncludes(L,inst, builtins,out,1);
+    addIncludes(L,n,inst,builtins,out,1);
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
@@ -1454,7 +1153,7 @@ static void genCommon(lua_State* L, int inst, int builtins, int kind, FILE* out
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    const int nSources = addSources(L,inst,out,1);
+    const int nSources = addSources(L,g,node,builtins,out,1);
     if( nSources == 0 )
     {
         fwrite(s_listFill1,1,strlen(s_listFill1),out);
@@ -1474,23 +1173,23 @@ static void genCommon(lua_State* L, int inst, int builtins, int kind, FILE* out
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    addFlags(L,inst,out,1, "QMAKE_CXXFLAGS", "cflags_cc" );
-    addFlags(L,inst,out,0, "", "cflags" );
+    addFlags(n,out,1, "QMAKE_CXXFLAGS", BS_cflags_cc );
+    addFlags(n,out,0, "", BS_cflags );
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    addFlags(L,inst,out,1, "QMAKE_CFLAGS", "cflags_c" );
-    addFlags(L,inst,out,0, "", "cflags" );
+    addFlags(n,out,1, "QMAKE_CFLAGS", BS_cflags_c );
+    addFlags(n,out,0, "", BS_cflags );
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    addFlags(L,inst,out,1, "QMAKE_LFLAGS", "ldflags" );
+    addFlags(n,out,1, "QMAKE_LFLAGS", BS_ldflags );
     fwrite("\n\n",1,2,out);
 
     // TODO cflags_objc, cflags_objcc
 }
 
-static void genLibrary(lua_State* L, int inst, int builtins, FILE* out, int isSourceSet )
+static void genLibrary(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out, int isSourceSet )
 {
     const int top = lua_gettop(L);
     lua_getfield(L,inst,"lib_type");
@@ -1526,9 +1225,9 @@ static void genLibrary(lua_State* L, int inst, int builtins, FILE* out, int isSo
         fwrite(text,1,strlen(text),out);
     }
 
-    genCommon(L,inst,builtins,lib_type,out);
+    genCommon(L,g,node,inst,builtins,lib_type,out);
 
-    forwardDepLibs(L,inst, (isSourceSet ? BS_ForwardSourceSet :
+    forwardDepLibs(L,g,node, (isSourceSet ? BS_ForwardSourceSet :
                                           ( lib_type == BS_StaticLib ? BS_ForwardStatic :
                                                                        BS_ForwardShared) ) , out);
 
@@ -1540,11 +1239,11 @@ static void genLibrary(lua_State* L, int inst, int builtins, FILE* out, int isSo
         lua_pop(L,2); // target_os, binst
 
         fwrite("\n",1,1,out);
-        addDepLibs(L,inst,builtins,lib_type,out);
+        addDepLibs(L,g,node,builtins,lib_type,out);
         fwrite("\n\n",1,2,out);
 
         fwrite("\n",1,1,out);
-        addLibs(L,inst,lib_type,out,1,win32);
+        addLibs(L,&g->nodes[node],builtins,lib_type,out,1,win32);
         fwrite("\n\n",1,2,out);
 
 #if 1 // ifndef BS_QMAKE_HAVE_COPY
@@ -1563,7 +1262,7 @@ static void genLibrary(lua_State* L, int inst, int builtins, FILE* out, int isSo
     assert( top ==  bottom);
 }
 
-static void genExe(lua_State* L, int inst, int builtins, FILE* out )
+static void genExe(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out )
 {
     const int top = lua_gettop(L);
     const char* text =
@@ -1592,7 +1291,7 @@ static void genExe(lua_State* L, int inst, int builtins, FILE* out )
     fwrite("\n",1,1,out);
     lua_pop(L,1); // name
 
-    genCommon(L,inst, builtins, BS_Executable,out);
+    genCommon(L,g,node,inst, builtins, BS_Executable,out);
 
     lua_getfield(L,builtins,"#inst");
     lua_getfield(L,-1,"target_os");
@@ -1600,11 +1299,11 @@ static void genExe(lua_State* L, int inst, int builtins, FILE* out )
     lua_pop(L,2); // target_os, binst
 
     fwrite("\n",1,1,out);
-    addDepLibs(L,inst,builtins,BS_Executable,out);
+    addDepLibs(L,g,node,builtins,BS_Executable,out);
     fwrite("\n\n",1,2,out);
 
     fwrite("\n",1,1,out);
-    addLibs(L,inst,BS_Executable,out,1,win32);
+    addLibs(L,&g->nodes[node],builtins,BS_Executable,out,1,win32);
     fwrite("\n\n",1,2,out);
 
 #ifndef BS_QMAKE_HAVE_COPY
@@ -1821,7 +1520,7 @@ static BSPathStatus apply_source_expansion(lua_State* L,const char* string)
     return BS_OK;
 }
 
-static void genCopy(lua_State* L, int inst, FILE* out )
+static void genCopy(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out )
 {
     const int top = lua_gettop(L);
 
@@ -1834,7 +1533,7 @@ static void genCopy(lua_State* L, int inst, FILE* out )
 
     const char* text7 = "COPY_SOURCES +=";
     fwrite(text7,1,strlen(text7),out);
-    addSources(L, inst, out,0);
+    addSources(L,g,node,builtins,out,0);
 
     lua_getfield(L,inst,"use_deps");
     const int use_deps = lua_gettop(L);
@@ -1844,13 +1543,13 @@ static void genCopy(lua_State* L, int inst, FILE* out )
         lua_rawgeti(L,use_deps,i);
         const char* name = lua_tostring(L,-1);
         if( strcmp(name,"executable") == 0 )
-            iterateDeps(L,inst,BS_Executable, 0,out,renderDep);
+            iterateDeps(L,g,node,BS_Executable, 0,out,renderDep);
         else if( strcmp(name,"static_lib") == 0 )
-            iterateDeps(L,inst,BS_StaticLib, 0,out,renderDep);
+            iterateDeps(L,g,node,BS_StaticLib, 0,out,renderDep);
         else if( strcmp(name,"shared_lib") == 0 )
-            iterateDeps(L,inst,BS_DynamicLib, 0,out,renderDep);
+            iterateDeps(L,g,node,BS_DynamicLib, 0,out,renderDep);
         else if( strcmp(name,"object_file") == 0 )
-            iterateDeps(L,inst,BS_ObjectFiles, 0,out,renderDep);
+            iterateDeps(L,g,node,BS_ObjectFiles, 0,out,renderDep);
         lua_pop(L,1);
     }
     lua_pop(L,1);
@@ -1893,7 +1592,7 @@ static void genCopy(lua_State* L, int inst, FILE* out )
     assert( top ==  bottom);
 }
 
-static void genMoc(lua_State* L, int inst, int builtins, FILE* out )
+static void genMoc(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out )
 {
     const char* text =
             "QT -= core gui\n"
@@ -1903,12 +1602,12 @@ static void genMoc(lua_State* L, int inst, int builtins, FILE* out )
     fwrite(text,1,strlen(text),out);
 
     fwrite("\n",1,1,out);
-    addDefines(L,inst,out,1);
+    addDefines(L,&g->nodes[node],out,1);
     fwrite("\n\n",1,2,out);
 
     const char* text7 = "MOC_SOURCES +=";
     fwrite(text7,1,strlen(text7),out);
-    addSources(L, inst, out,0);
+    addSources(L,g,node,builtins,out,0);
     fwrite("\n\n",1,2,out);
 
 #if 0
@@ -1960,7 +1659,7 @@ static void genMoc(lua_State* L, int inst, int builtins, FILE* out )
     //lua_pop(L,1); // name
 }
 
-static void genRcc(lua_State* L, int inst, int builtins, FILE* out )
+static void genRcc(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out )
 {
     const char* text =
             "QT -= core gui\n"
@@ -1971,7 +1670,7 @@ static void genRcc(lua_State* L, int inst, int builtins, FILE* out )
 
     const char* text7 = "RCC_SOURCES +=";
     fwrite(text7,1,strlen(text7),out);
-    addSources(L, inst, out,0);
+    addSources(L,g,node,builtins,out,0);
     fwrite("\n\n",1,2,out);
 
 #if 1
@@ -2004,7 +1703,7 @@ static void genRcc(lua_State* L, int inst, int builtins, FILE* out )
     fwrite(text4,1,strlen(text4),out);
 }
 
-static void genUic(lua_State* L, int inst, int builtins, FILE* out )
+static void genUic(lua_State* L, const BSGraph* g, int node, int inst, int builtins, FILE* out )
 {
     const char* text =
             "QT -= core gui\n"
@@ -2015,7 +1714,7 @@ static void genUic(lua_State* L, int inst, int builtins, FILE* out )
 
     const char* text7 = "UIC_SOURCES +=";
     fwrite(text7,1,strlen(text7),out);
-    addSources(L, inst, out,0);
+    addSources(L,g,node,builtins,out,0);
     fwrite("\n\n",1,2,out);
 
 #if 1
@@ -2047,22 +1746,17 @@ static void genUic(lua_State* L, int inst, int builtins, FILE* out )
     fwrite(text4,1,strlen(text4),out);
 }
 
-static int genproduct(lua_State* L) // arg: prodinst
+static void genproduct(lua_State* L, const BSGraph* g, int node, int builtins)
 {
     // Here we now do without the original module structure and instead linearize all modules depth-first
     // under a top-level subdirs project; this has the advantage that we get rid of the intermediate level
     // subdir projects.
 
-    const int prodinst = 1;
     const int top = lua_gettop(L);
+    const char* name = g->nodes[node].name;
 
-    lua_getfield(L,prodinst,"#decl");
-    const int decl = lua_gettop(L);
-
-    lua_getglobal(L, "require");
-    lua_pushstring(L, "builtins");
-    lua_call(L,1,1);
-    const int builtins = lua_gettop(L);
+    bs_graphinst(L,g,node);
+    const int prodinst = lua_gettop(L);
 
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
@@ -2070,10 +1764,7 @@ static int genproduct(lua_State* L) // arg: prodinst
     lua_getfield(L,binst,"root_build_dir");
     const int rootOutDir = lua_gettop(L);
 
-    lua_getfield(L,decl,"#qmake");
-    const int name = lua_gettop(L);
-
-    lua_pushfstring(L,"%s/%s/%s.pro", lua_tostring(L,rootOutDir), lua_tostring(L,name), lua_tostring(L,name) );
+    lua_pushfstring(L,"%s/%s/%s.pro", lua_tostring(L,rootOutDir), name, name );
     const int proPath = lua_gettop(L);
 
     FILE* out = bs_fopen(bs_denormalize_path(lua_tostring(L,proPath)),"w");
@@ -2083,32 +1774,32 @@ static int genproduct(lua_State* L) // arg: prodinst
     const char* text = "# generated by BUSY, do not modify\n";
     fwrite(text,1,strlen(text),out);
 
-    switch( getClass(L,prodinst,builtins) )
+    switch( g->nodes[node].kind )
     {
-    case BS_LibraryClass:
-        genLibrary(L,prodinst, builtins, out, 0);
+    case BS_LibraryProduct:
+        genLibrary(L,g,node,prodinst, builtins, out, 0);
         break;
-    case BS_ExecutableClass:
-        genExe(L,prodinst,builtins,out);
+    case BS_ExecutableProduct:
+        genExe(L,g,node,prodinst,builtins,out);
         break;
-    case BS_SourceSetClass:
-        genLibrary(L,prodinst, builtins, out, 1);
+    case BS_SourceSetProduct:
+        genLibrary(L,g,node,prodinst, builtins, out, 1);
         break;
-    case BS_MocClass:
-        genMoc(L,prodinst, builtins, out);
+    case BS_MocProduct:
+        genMoc(L,g,node,prodinst, builtins, out);
         break;
-    case BS_RccClass:
-        genRcc(L,prodinst, builtins, out);
+    case BS_RccProduct:
+        genRcc(L,g,node,prodinst, builtins, out);
         break;
-    case BS_UicClass:
-        genUic(L,prodinst, builtins, out);
+    case BS_UicProduct:
+        genUic(L,g,node,prodinst, builtins, out);
         break;
-    case BS_LuaScriptClass:
+    case BS_LuaScriptProduct:
         genScript(L,prodinst, out);
         break;
 #ifdef BS_QMAKE_HAVE_COPY
-    case BS_CopyClass:
-        genCopy(L,prodinst, out);
+    case BS_CopyProduct:
+        genCopy(L,g,node,prodinst,builtins, out);
         break;
 #endif
     default:
@@ -2119,11 +1810,10 @@ static int genproduct(lua_State* L) // arg: prodinst
 
     fclose(out);
 
-    lua_pop(L,6); // decl, builtins, binst, rootOutDir, name, proPath
+    lua_pop(L,4); // prodinst, binst, rootOutDir, proPath
 
     const int bottom = lua_gettop(L);
     assert(top == bottom);
-    return 0;
 }
 
 static int tryrun(lua_State* L, int builtins, const char* cmd)
@@ -2148,20 +1838,21 @@ static int tryrun(lua_State* L, int builtins, const char* cmd)
     return success;
 }
 
-int bs_genQmake(lua_State* L) // args: root module def, array of productinst
+int bs_genQmake(lua_State* L) // args: root module def, array of productinst, graph
 {
-    enum { ROOT = 1, PRODS };
+    enum { ROOT = 1, PRODS, GRAPH };
     const int top = lua_gettop(L);
 
-    size_t i;
-    lua_createtable(L,0,0);
-    const int order = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,PRODS); i++ )
-    {
-        lua_pushcfunction(L,mark);
-        lua_rawgeti(L,PRODS,i);
-        lua_pushvalue(L,order);
-        lua_call(L,2,0);
+    const BSGraph* g = bs_tograph(L,GRAPH);
+    int i;
+    for( i = 0; i < g->count; i++ )
+    {
+        // mark the decls which get a project; findModulePath looks for them
+        bs_graphinst(L,g,i);
+        lua_getfield(L,-1,"#decl");
+        lua_pushstring(L,g->nodes[i].name);
+        lua_setfield(L,-2,"#qmake");
+        lua_pop(L,2); // inst, decl
     }
 
     lua_getglobal(L, "require");
@@ -2409,37 +2100,26 @@ int bs_genQmake(lua_State* L) // args: root module def, array of productinst
             "SUBDIRS += \\\n";
     fwrite(text7,1,strlen(text7),out);
 
-    size_t len = lua_objlen(L,order);
-    for( i = 1; i <= len; i++ )
+    for( i = 0; i < g->count; i++ )
     {
-        lua_rawgeti(L,order,i);
-        const int decl = lua_gettop(L);
+        const BSGraphNode* n = &g->nodes[i];
 
-        lua_getfield(L,decl,"#qmake");
-        const int qmake = lua_gettop(L);
+        int j;
+        for( j = 0; j < n->depCount; j++ )
+            calcDep(L,g,n->deps[j],builtins);
 
-        lua_getfield(L,decl,"#owner");
-        lua_getfield(L,-1,"#inst"); // owner, modinst
-        lua_replace(L,-2); // modinst
-        lua_getfield(L,decl,"#name"); // modinst, name
-        lua_rawget(L,-2); // modinst, prodinst
-        lua_replace(L,-2); // prodinst
-        const int prodinst = lua_gettop(L);
-
-        visitDeps(L,prodinst);
-
-        const int cls = getClass(L,prodinst,builtins);
-        if( cls == BS_LibraryClass || cls == BS_ExecutableClass || cls == BS_SourceSetClass ||
-                cls == BS_MocClass || cls == BS_RccClass || cls == BS_UicClass || cls == BS_LuaScriptClass
+        if( n->kind == BS_LibraryProduct || n->kind == BS_ExecutableProduct || n->kind == BS_SourceSetProduct ||
+                n->kind == BS_MocProduct || n->kind == BS_RccProduct || n->kind == BS_UicProduct ||
+                n->kind == BS_LuaScriptProduct
         #ifdef BS_QMAKE_HAVE_COPY
-                || cls == BS_CopyClass
+                || n->kind == BS_CopyProduct
         #endif
                 )
         {
-            fprintf(stdout,"# generating %s\n", lua_tostring(L,qmake));
+            fprintf(stdout,"# generating %s\n", n->name);
             fflush(stdout);
 
-            lua_pushfstring(L,"%s/%s", lua_tostring(L,buildDir), lua_tostring(L,qmake));
+            lua_pushfstring(L,"%s/%s", lua_tostring(L,buildDir), n->name);
             const int path = lua_gettop(L);
 
             if( !bs_exists(lua_tostring(L,path)) )
@@ -2449,25 +2129,21 @@ int bs_genQmake(lua_State* L) // args: root module def, array of productinst
             }
 
             fwrite("\t",1,1,out);
-            fwrite(lua_tostring(L,qmake),1,lua_objlen(L,qmake),out);
+            fwrite(n->name,1,strlen(n->name),out);
             fwrite(" ",1,1,out);
-            if( i < len )
+            if( i + 1 < g->count )
                 fwrite("\\",1,1,out);
             fwrite("\n",1,1,out);
 
-            lua_pushcfunction(L,genproduct);
-            lua_pushvalue(L,prodinst);
-            lua_call(L,1,0);
+            genproduct(L,g,i,builtins);
             lua_pop(L,1); // path
-        }else if( cls == BS_LuaScriptForEachClass || cls == BS_MessageClass )
+        }else if( n->kind == BS_LuaScriptForeachProduct || n->kind == BS_MessageProduct )
         {
             // TODO: implement LuaScriptForEach
             fprintf(stdout,"# not generating \"%s\" because class \"%s\" is not supported by qmake generator\n",
-                    lua_tostring(L,qmake), getClassName(cls));
+                    n->name, getClassName(n->kind));
             fflush(stdout);
         }
-
-        lua_pop(L,3); // decl, qmake, prodinst
     }
     fclose(out);
 
@@ -2483,7 +2159,7 @@ int bs_genQmake(lua_State* L) // args: root module def, array of productinst
     fwrite(text9,1,strlen(text9),out);
     fclose(out);
 
-    lua_pop(L,12); // order builtins, binst, buildDir, confPath, sourceDir, mocPath, rccPath, uicPath, proPath, dummyPath
+    lua_pop(L,11); // builtins, binst, buildDir, confPath, sourceDir, mocPath, rccPath, uicPath, proPath, dummyPath
     assert( top == lua_gettop(L) );
     return 0;
 }
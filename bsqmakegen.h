@@ -23,6 +23,7 @@
 #include "lua.h"
 
 extern int bs_genQmake(lua_State* L);
+// args: root module def, array of productinst, graph of the products (see bs_graphlower)
 
 
 #endif // BSQMAKEGEN_H
@@ -20,9 +20,16 @@
 #include "bsrunner.h"
 #include "bshost.h"
 #include "bsparser.h" 
+#include "bscallbacks.h"
+#include "bsdb.h"
+#include "bscache.h"
+#include "bstrace.h"
+#include "bsgraph.h"
 #include "lauxlib.h"
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 // TODO: reimplement bsrunner using bsvisitor; BS_ALT_RUNCMD no longer needed
 
@@ -66,63 +73,1543 @@ static int runcmd(lua_State* L, const char* cmd)
 #endif
 }
 
-static int copycmd(lua_State* L, const char* normalizedToPath, const char* normalizedFromPath)
+static int altruncmd(lua_State* L)
 {
 #ifdef BS_ALT_RUNCMD
-    const char* to = bs_denormalize_path(normalizedToPath);
-    const char* from = bs_denormalize_path(normalizedFromPath);
-    const int len = 4 + 1 + 2 + strlen(from) + 1 + 2 + strlen(to) + 1;
+    lua_getglobal(L,"#runcmd");
+    const int res = lua_islightuserdata(L,-1);
+    lua_pop(L,1);
+    return res;
+#else
+    return 0;
+#endif
+}
+
+static int jobcount(lua_State* L)
+{
+    // the number of commands which may run in parallel; set by the -j option, default is the number of cpus
+    lua_getglobal(L,"#jobs");
+    int n = lua_isnumber(L,-1) ? lua_tointeger(L,-1) : bs_cpucount();
+    lua_pop(L,1);
+#ifdef _WIN32
+    if( n > 64 )
+        n = 64; // bs_wait on Windows can wait for at most 64 processes, so bs_spawn would fail beyond
+#endif
+    return n < 1 ? 1 : n;
+}
+
+static double memlimit(lua_State* L)
+{
+    // set by the -mem-limit option in megabytes, default is the memory available now; returns kilobytes, 0 if unknown
+    lua_getglobal(L,"#memlimit");
+    const double mb = lua_isnumber(L,-1) ? lua_tonumber(L,-1) : bs_memavailable();
+    lua_pop(L,1);
+    return mb * 1024;
+}
+
+static double memdefault(lua_State* L)
+{
+    // set by the -mem-default option in megabytes, the memory assumed for a job which never ran; returns kilobytes
+    lua_getglobal(L,"#memdefault");
+    const double mb = lua_isnumber(L,-1) ? lua_tonumber(L,-1) : 512;
+    lua_pop(L,1);
+    return mb * 1024;
+}
+
+static int restat(lua_State* L)
+{
+    // set by the -restat option; outputs which are unchanged after a run keep their previous changed time
+    lua_getglobal(L,"#restat");
+    const int res = lua_toboolean(L,-1);
+    lua_pop(L,1);
+    return res;
+}
+
+static int copycmd(lua_State* L, int job, int serial, int* status)
+{
+    // returns the process id if the file is copied in the background, otherwise 0 and the result is set in status
+    lua_getfield(L,job,"from");
+    lua_getfield(L,job,"to");
+    lua_getfield(L,job,"mode");
+    const int mode = lua_tointeger(L,-1);
+    int pid = 0;
+#ifdef BS_ALT_RUNCMD
+    const char* to = bs_denormalize_path(lua_tostring(L,-2));
+    const char* from = bs_denormalize_path(lua_tostring(L,-3));
     sprintf( (char*)bs_global_buffer(), "copy \"%s\" \"%s\"", from, to );
-    return runcmd(L, bs_global_buffer());
+    *status = runcmd(L, bs_global_buffer());
 #else
-    return bs_copy(normalizedToPath,normalizedFromPath);
+    if( serial )
+        *status = bs_copy2(lua_tostring(L,-2), lua_tostring(L,-3), mode);
+    else
+        pid = bs_spawncopy(lua_tostring(L,-2), lua_tostring(L,-3), mode, status);
 #endif
+    if( pid <= 0 && *status != 0 )
+    {
+        fprintf(stderr,"# ERR: cannot copy %s to %s\n", lua_tostring(L,-3), lua_tostring(L,-2));
+        fflush(stderr);
+    }
+    lua_pop(L,3); // from, to, mode
+    return pid;
+}
+
+int bs_declpath(lua_State* L, int decl, const char* separator)
+{
+    const int top = lua_gettop(L);
+
+    if( decl < 0 )
+        decl += top + 1;
+    lua_getfield(L,decl,"#name");
+    const int name = lua_gettop(L);
+    lua_getfield(L,decl,"#owner");
+    const int module = lua_gettop(L);
+    while(!lua_isnil(L,module))
+    {
+        lua_getfield(L,module,"#name");
+        if( lua_isnil(L,-1) )
+        {
+            lua_pop(L,1);
+            break;
+        }
+        lua_pushstring(L,separator);
+        lua_pushvalue(L,name);
+        lua_concat(L,3);
+        lua_replace(L,name);
+        lua_getfield(L,module,"#owner");
+        lua_replace(L,module);
+    }
+    lua_pop(L,1); // module
+
+    assert( top + 1 == lua_gettop(L) );
+    return 1;
+}
+
+static int calcdesig(lua_State* L, int decl)
+{
+    return bs_declpath(L,decl,".");
+}
+
+// The runner first walks the selected products and records each command as a job in the job graph;
+// afterwards the graph is executed with up to jobcount() commands running in parallel.
+// A job is a table with these fields:
+//   op: BSBuildOperation; cmd: the command line; argv: the args for the linked Lua; from, to: the Copy paths
+//   inputs, outputs: arrays of normalized paths used for the up-to-date check when the job is due
+//   always: run the job even if the outputs are up-to-date
+//   prod: the product instance; deps: array of jobs which have to be finished before this one can start
+//   graph: the graph the job belongs to
+// Each product has a barrier job (without op) which depends on all jobs of the product and is stored in
+// prod.#barrier; all jobs of a product depend on the barriers of the product deps (collected from the product
+// graph in prod.#barriers), so independent products are built concurrently, and a dependent product only
+// starts when everything it depends on is finished.
+
+static int jobgraph(lua_State* L)
+{
+    // pushes the current job graph or nil; returns 1 if there is one
+    lua_getglobal(L,"#jobgraph");
+    return lua_istable(L,-1);
+}
+
+static void append(lua_State* L, int list)
+{
+    // pops the value on top of the stack and appends it to list
+    if( list < 0 )
+        list += lua_gettop(L) + 1;
+    lua_rawseti(L,list,lua_objlen(L,list)+1);
+}
+
+static int newjob(lua_State* L, int inst, int op)
+{
+    // pushes a new job of product inst (if not 0) which depends on the barriers of the product deps
+    const int top = lua_gettop(L);
+
+    lua_createtable(L,0,8);
+    const int job = lua_gettop(L);
+    if( op >= 0 )
+    {
+        lua_pushinteger(L,op);
+        lua_setfield(L,job,"op");
+    }
+    lua_createtable(L,0,0);
+    lua_setfield(L,job,"inputs");
+    lua_createtable(L,0,0);
+    lua_setfield(L,job,"outputs");
+    lua_createtable(L,0,0);
+    const int deps = lua_gettop(L);
+    if( inst )
+    {
+        lua_pushvalue(L,inst);
+        lua_setfield(L,job,"prod");
+
+        lua_getfield(L,inst,"#barriers");
+        const int barriers = lua_gettop(L);
+        size_t i;
+        for( i = 1; lua_istable(L,barriers) && i <= lua_objlen(L,barriers); i++ )
+        {
+            lua_rawgeti(L,barriers,i);
+            append(L,deps);
+        }
+        lua_pop(L,1); // barriers
+    }
+    lua_setfield(L,job,"deps");
+
+    assert( top + 1 == lua_gettop(L) );
+    return job;
 }
 
-int bs_declpath(lua_State* L, int decl, const char* separator)
-{
-    const int top = lua_gettop(L);
+static void addfile(lua_State* L, int job, const char* what, int path)
+{
+    // appends path to the "inputs" or "outputs" of job
+    lua_getfield(L,job,what);
+    lua_pushvalue(L,path);
+    append(L,-2);
+    lua_pop(L,1); // list
+}
+
+static void addarg(lua_State* L, int job, const char* arg)
+{
+    // appends arg to the "args" of job, i.e. the program and its arguments if it is started without a shell;
+    // cmd is still set for the console, the database and BS_ALT_RUNCMD
+    lua_getfield(L,job,"args");
+    if( lua_isnil(L,-1) )
+    {
+        lua_pop(L,1);
+        lua_createtable(L,0,0);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,job,"args");
+    }
+    lua_pushstring(L,arg);
+    append(L,-2);
+    lua_pop(L,1); // args
+}
+
+static char* readall(const char* denormalizedPath)
+{
+    // returns the zero terminated content of the file, to be freed by the caller, or 0 if it cannot be read
+    FILE* f = bs_fopen(denormalizedPath,"rb");
+    if( f == NULL )
+        return 0;
+    fseek(f,0,SEEK_END);
+    const long len = ftell(f);
+    fseek(f,0,SEEK_SET);
+    char* buf = (char*)malloc(len+1);
+    if( buf == NULL || fread(buf,1,len,f) != (size_t)len )
+    {
+        free(buf);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    buf[len] = 0;
+    return buf;
+}
+
+static int readdepfile(lua_State* L, const char* denormalizedPath)
+{
+    // pushes the prerequisites of the make rule in the depfile written by gcc or clang with -MD as a string
+    // with each path terminated by a zero; returns 0 and pushes nothing if the file cannot be read
+    char* buf = readall(denormalizedPath);
+    if( buf == 0 )
+        return 0;
+
+    // skip the target; a colon followed by a blank terminates it (the target may contain a drive letter)
+    char* p = buf;
+    while( *p && !( p[0] == ':' && ( p[1] == 0 || isspace((unsigned char)p[1]) ) ) )
+        p++;
+    if( *p )
+        p++;
+    char* out = buf; // the result is written over the already parsed text
+    for(;;)
+    {
+        while( isspace((unsigned char)*p) || ( p[0] == '\\' && ( p[1] == '\n' || p[1] == '\r' ) ) )
+            p++;
+        if( *p == 0 )
+            break;
+        while( *p && !isspace((unsigned char)*p) )
+        {
+            if( p[0] == '\\' && ( p[1] == ' ' || p[1] == '#' ) )
+                p++; // escaped blank or hash
+            else if( p[0] == '$' && p[1] == '$' )
+                p++;
+            else if( p[0] == '\\' && ( p[1] == '\n' || p[1] == '\r' ) )
+                break;
+            *out++ = *p++;
+        }
+        *out++ = 0;
+    }
+    lua_pushlstring(L,buf,out-buf);
+    free(buf);
+    return 1;
+}
+
+static int readqrc(lua_State* L, const char* denormalizedPath)
+{
+    // pushes the files listed in the <file> elements of the Qt resource file as a string with each path terminated
+    // by a zero; relative paths are relative to the directory of the resource file; returns 0 and pushes nothing if
+    // the file cannot be read
+    char* buf = readall(denormalizedPath);
+    if( buf == 0 )
+        return 0;
+    int dirLen = strlen(denormalizedPath);
+    while( dirLen > 0 && denormalizedPath[dirLen-1] != '/' && denormalizedPath[dirLen-1] != '\\' )
+        dirLen--;
+
+    luaL_Buffer b;
+    luaL_buffinit(L,&b);
+    char* p = buf;
+    while( ( p = strchr(p,'<') ) != 0 )
+    {
+        if( strncmp(p,"<!--",4) == 0 )
+        {
+            p = strstr(p+4,"-->");
+            if( p == 0 )
+                break;
+            continue;
+        }
+        p++;
+        if( strncmp(p,"file",4) != 0 || ( p[4] != '>' && !isspace((unsigned char)p[4]) ) )
+            continue;
+        p = strchr(p,'>');
+        if( p == 0 )
+            break;
+        p++;
+        char* end = strchr(p,'<');
+        if( end == 0 )
+            break;
+        while( p < end && isspace((unsigned char)*p) )
+            p++;
+        char* last = end;
+        while( last > p && isspace((unsigned char)last[-1]) )
+            last--;
+        if( p == last )
+            continue;
+        if( *p != '/' && *p != '\\' && !( isalpha((unsigned char)p[0]) && p[1] == ':' ) )
+            luaL_addlstring(&b,denormalizedPath,dirLen);
+        while( p < last )
+        {
+            // the predefined entities of XML
+            if( strncmp(p,"&amp;",5) == 0 )
+                luaL_addchar(&b,'&'), p += 5;
+            else if( strncmp(p,"&lt;",4) == 0 )
+                luaL_addchar(&b,'<'), p += 4;
+            else if( strncmp(p,"&gt;",4) == 0 )
+                luaL_addchar(&b,'>'), p += 4;
+            else if( strncmp(p,"&quot;",6) == 0 )
+                luaL_addchar(&b,'"'), p += 6;
+            else if( strncmp(p,"&apos;",6) == 0 )
+                luaL_addchar(&b,'\''), p += 6;
+            else
+                luaL_addchar(&b,*p++);
+        }
+        luaL_addchar(&b,0);
+        p = end;
+    }
+    free(buf);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int jobdeps(lua_State* L, int job)
+{
+    // pushes the files the outputs of job depend on besides its inputs, i.e. the headers listed in the depfile
+    // written by the compiler or the files listed in a Qt resource file, as a string with each path terminated by
+    // a zero; returns 0 and pushes nothing if there are none or they cannot be read
+    int res = 0;
+    lua_getfield(L,job,"depfile");
+    if( lua_isstring(L,-1) )
+        res = readdepfile(L,lua_tostring(L,-1));
+    else
+    {
+        lua_getfield(L,job,"qrc");
+        lua_replace(L,-2);
+        if( lua_isstring(L,-1) )
+            res = readqrc(L,bs_denormalize_path(lua_tostring(L,-1)));
+    }
+    if( res )
+        lua_replace(L,-2);
+    else
+        lua_pop(L,1);
+    return res;
+}
+
+// The build state database in the root build directory records for each output the hash of the command which
+// produced it, so an output is rebuilt when e.g. a define or flag changes; it also records the headers listed
+// in the depfile of an object file, so the depfiles don't have to be parsed again for the up-to-date check.
+#define BS_BUILDDB ".busy_db"
+
+static BSDb* builddb(lua_State* L)
+{
+    lua_getglobal(L,"#builddb");
+    BSDb* db = (BSDb*)lua_touserdata(L,-1);
+    lua_pop(L,1);
+    return db;
+}
+
+static void openbuilddb(lua_State* L, const char* normalizedBuildDir)
+{
+    lua_pushfstring(L,"%s/" BS_BUILDDB, bs_denormalize_path(normalizedBuildDir));
+    BSDb* db = bs_dbopen(lua_tostring(L,-1));
+    if( db == 0 )
+    {
+        fprintf(stderr,"# WRN: cannot open build state database %s\n", lua_tostring(L,-1));
+        fflush(stderr);
+        lua_pushnil(L);
+    }else
+        lua_pushlightuserdata(L,db);
+    lua_setglobal(L,"#builddb");
+    lua_pop(L,1); // path
+}
+
+static void closebuilddb(lua_State* L)
+{
+    bs_dbclose(builddb(L));
+    lua_pushnil(L);
+    lua_setglobal(L,"#builddb");
+}
+
+static int jobhash(lua_State* L, int job, BSHash* h)
+{
+    // calculates the hash of the command of job (including the rsp file); returns 0 if there is no command
+    *h = BS_HASH_INIT;
+    lua_getfield(L,job,"cmd");
+    if( lua_isstring(L,-1) )
+        *h = bs_hash(lua_tostring(L,-1),lua_objlen(L,-1),*h);
+    else
+    {
+        lua_getfield(L,job,"argv");
+        if( !lua_istable(L,-1) )
+        {
+            lua_pop(L,2); // cmd, argv
+            return 0;
+        }
+        size_t i;
+        for( i = 1; i <= lua_objlen(L,-1); i++ )
+        {
+            lua_rawgeti(L,-1,i);
+            *h = bs_hash(lua_tostring(L,-1),lua_objlen(L,-1)+1,*h); // including the terminating zero
+            lua_pop(L,1);
+        }
+        lua_pop(L,1); // argv
+    }
+    lua_pop(L,1); // cmd
+
+    lua_getfield(L,job,"rsp");
+    if( lua_isstring(L,-1) )
+        bs_hashfile(bs_denormalize_path(lua_tostring(L,-1)),h);
+    lua_pop(L,1);
+    return 1;
+}
+
+static void logjob(lua_State* L, int job)
+{
+    // records the command hash and the depfile content of the job if it was run successfully;
+    // the outputs of the job were changed, so the cached times are no longer valid
+    lua_getfield(L,job,"#ran");
+    const int ran = lua_toboolean(L,-1);
+    lua_pop(L,1);
+    if( ran )
+    {
+        lua_getfield(L,job,"outputs");
+        const size_t n = lua_objlen(L,-1);
+        size_t i;
+        for( i = 1; i <= n; i++ )
+        {
+            lua_rawgeti(L,-1,i);
+            bs_invalidate(lua_tostring(L,-1));
+            lua_pop(L,1);
+        }
+        lua_pop(L,1); // outputs
+        if( n == 0 )
+            bs_invalidate(0); // we don't know what the job wrote
+    }
+    BSDb* db = builddb(L);
+    BSHash h;
+    if( !ran || db == 0 || !jobhash(L,job,&h) )
+        return;
+
+    BSDbRecord rec;
+    memset(&rec,0,sizeof(rec));
+    rec.cmdHash = h;
+    lua_getfield(L,job,"#cached");
+    const int cached = lua_toboolean(L,-1);
+    lua_getfield(L,job,"#start");
+    const long long start = (long long)lua_tonumber(L,-1);
+    lua_getfield(L,job,"#peak");
+    const unsigned int peak = lua_tointeger(L,-1);
+    lua_pop(L,3);
+
+    lua_pushnil(L); // replaced by the deps
+    if( jobdeps(L,job) )
+    {
+        rec.deps = lua_tostring(L,-1);
+        rec.depsLen = lua_objlen(L,-1);
+        lua_replace(L,-2);
+    }else
+    {
+        lua_getfield(L,job,"artool");
+        const int incremental = lua_isstring(L,-1);
+        lua_pop(L,1);
+        if( incremental )
+        {
+            // the members of the archive for the next incremental update, each terminated by a zero
+            lua_getfield(L,job,"inputs");
+            const int inputs = lua_gettop(L);
+            luaL_Buffer b;
+            luaL_buffinit(L,&b);
+            size_t i;
+            for( i = 1; i <= lua_objlen(L,inputs); i++ )
+            {
+                lua_rawgeti(L,inputs,i);
+                luaL_addvalue(&b);
+                luaL_addchar(&b,0);
+            }
+            luaL_pushresult(&b);
+            lua_replace(L,inputs);
+            rec.deps = lua_tostring(L,-1);
+            rec.depsLen = lua_objlen(L,-1);
+            lua_replace(L,-2);
+        }
+    }
+
+    const int hashOutputs = restat(L);
+    lua_getfield(L,job,"outputs");
+    size_t i;
+    for( i = 1; i <= lua_objlen(L,-1); i++ )
+    {
+        lua_rawgeti(L,-1,i);
+        const char* path = lua_tostring(L,-1);
+        rec.mtime = bs_exists(path);
+        rec.checked = 0;
+        rec.contentHash = BS_HASH_INIT;
+        if( !hashOutputs || rec.mtime == 0 || bs_hashfile(bs_denormalize_path(path),&rec.contentHash) != 0 )
+            rec.contentHash = 0;
+        const BSDbRecord* old = bs_dbget(db,path);
+        if( cached || start == 0 )
+            rec.duration = old != 0 ? old->duration : 0; // copying from the cache says nothing about the command
+        else
+            rec.duration = ( bs_clock() - start ) / 1000 + 1;
+        if( cached || peak == 0 )
+            rec.peakMem = old != 0 ? old->peakMem : 0; // e.g. the job was run in-process
+        else
+            rec.peakMem = peak;
+        if( rec.contentHash != 0 && old != 0 && old->contentHash == rec.contentHash && old->mtime != 0 &&
+                old->mtime < rec.mtime && bs_settime(path,old->mtime) == 0 )
+        {
+            // the output didn't change, so let it look as old as before, so the dependent jobs need not run;
+            // the job itself is up-to-date with the inputs as of now
+            rec.checked = rec.mtime;
+            rec.mtime = old->mtime;
+        }
+        if( bs_dbput(db,path,&rec) != 0 )
+        {
+            fprintf(stderr,"# WRN: cannot write to the build state database\n");
+            fflush(stderr);
+        }
+        lua_pop(L,1);
+    }
+    lua_pop(L,2); // deps, outputs
+}
+
+static const char* cachedir(lua_State* L)
+{
+    // set by the -cache option; the object cache is disabled if 0
+    lua_getglobal(L,"#cache");
+    const char* dir = lua_tostring(L,-1); // the string is still referenced by the global
+    lua_pop(L,1);
+    return dir;
+}
+
+static int fromcache(lua_State* L, int job)
+{
+    // returns 1 if the object of the compile job could be taken from the cache, otherwise the cache key is
+    // remembered in the job so the object can be added to the cache when compiled
+    const char* dir = cachedir(L);
+    if( dir == 0 )
+        return 0;
+    const int top = lua_gettop(L);
+    int res = 0;
+    lua_getfield(L,job,"cachecmd");
+    lua_getfield(L,job,"inputs");
+    lua_rawgeti(L,-1,1);
+    lua_getfield(L,job,"outputs");
+    lua_rawgeti(L,-1,1);
+    lua_getfield(L,job,"depfile");
+    BSHash key;
+    if( lua_isstring(L,-6) && bs_cachekey(lua_tostring(L,-6),bs_denormalize_path(lua_tostring(L,-4)),&key) == 0 )
+    {
+        res = bs_cacheget(dir,key,lua_tostring(L,-2),lua_tostring(L,-1));
+        if( res )
+        {
+            fprintf(stdout,"# from cache: %s\n", bs_denormalize_path(lua_tostring(L,-2)));
+            fflush(stdout);
+        }else
+        {
+            lua_pushlstring(L,(const char*)&key,sizeof(key));
+            lua_setfield(L,job,"#cachekey");
+        }
+    }
+    lua_pop(L,6); // cachecmd, inputs, src, outputs, out, depfile
+    assert( top == lua_gettop(L) );
+    return res;
+}
+
+static void cachejob(lua_State* L, int job)
+{
+    // adds the object of a successfully compiled job to the cache
+    lua_getfield(L,job,"#cachekey");
+    if( lua_isnil(L,-1) )
+    {
+        lua_pop(L,1);
+        return;
+    }
+    BSHash key;
+    memcpy(&key,lua_tostring(L,-1),sizeof(key));
+    lua_pop(L,1);
+    lua_getfield(L,job,"depfile");
+    if( readdepfile(L,lua_tostring(L,-1)) )
+    {
+        lua_getfield(L,job,"outputs");
+        lua_rawgeti(L,-1,1);
+        if( bs_cacheput(cachedir(L),key,lua_tostring(L,-1),lua_tostring(L,-3),lua_objlen(L,-3)) == 0 )
+        {
+            lua_pushboolean(L,1);
+            lua_setglobal(L,"#cacheput");
+        }
+        lua_pop(L,3); // deps, outputs, out
+    }
+    lua_pop(L,1); // depfile
+}
+
+static int outdated(lua_State* L, int job)
+{
+    // returns true if one of the outputs is missing or older than one of the inputs, or if the command changed
+    const int top = lua_gettop(L);
+
+    lua_getfield(L,job,"always");
+    int res = lua_toboolean(L,-1);
+    lua_pop(L,1);
+
+    BSDb* db = builddb(L);
+    BSHash h;
+    const BSDbRecord* rec = 0;
+    const int hasCmd = db != 0 && jobhash(L,job,&h);
+
+    BSTime outTime = 0, inTime = 0;
+    size_t i;
+    lua_getfield(L,job,"outputs");
+    for( i = 1; !res && i <= lua_objlen(L,-1); i++ )
+    {
+        lua_rawgeti(L,-1,i);
+        BSTime t = bs_exists(lua_tostring(L,-1));
+        if( hasCmd )
+        {
+            rec = bs_dbget(db,lua_tostring(L,-1));
+            if( rec == 0 || rec->cmdHash != h )
+                res = 1; // the command differs from the one which produced the output
+            else if( rec->checked > t && rec->mtime == t )
+                t = rec->checked; // the output was restated and not touched since
+        }
+        lua_pop(L,1);
+        if( t == 0 )
+            res = 1;
+        else if( outTime == 0 || t < outTime )
+            outTime = t;
+    }
+    lua_pop(L,1); // outputs
+    if( outTime == 0 )
+        res = 1; // a job without outputs always runs
+
+    lua_getfield(L,job,"inputs");
+    for( i = 1; !res && i <= lua_objlen(L,-1); i++ )
+    {
+        lua_rawgeti(L,-1,i);
+        const BSTime t = bs_exists(lua_tostring(L,-1));
+        lua_pop(L,1);
+        if( t > inTime )
+            inTime = t;
+    }
+    lua_pop(L,1); // inputs
+
+    lua_getfield(L,job,"depfile");
+    if( lua_isnil(L,-1) )
+    {
+        lua_pop(L,1);
+        lua_getfield(L,job,"qrc");
+    }
+    if( !res && lua_isstring(L,-1) )
+    {
+        // the headers included by a source file are listed in the depfile written by the compiler, the files of
+        // a Qt resource in the .qrc file, and both are recorded in the database; if there is no depfile yet we
+        // have to compile to get one
+        const char* deps = 0;
+        const char* end = 0;
+        if( rec != 0 && rec->depsLen != 0 )
+        {
+            deps = rec->deps;
+            end = deps + rec->depsLen;
+            lua_pushnil(L);
+        }else if( jobdeps(L,job) )
+        {
+            deps = lua_tostring(L,-1);
+            end = deps + lua_objlen(L,-1);
+        }else
+        {
+            lua_pushnil(L);
+            res = 1;
+        }
+        while( !res && deps < end )
+        {
+            const BSTime t = bs_exists2(deps);
+            if( t == 0 || t > outTime )
+                res = 1; // a missing header is treated as changed
+            deps += strlen(deps) + 1;
+        }
+        lua_pop(L,1); // deps
+    }
+    lua_pop(L,1); // depfile or qrc
+
+    assert( top == lua_gettop(L) );
+    return res || outTime < inTime;
+}
+
+static void announce(lua_State* L, int job)
+{
+    // print the "# building" line when the first job of a product is due
+    lua_getfield(L,job,"prod");
+    const int prod = lua_gettop(L);
+    if( lua_istable(L,prod) )
+    {
+        lua_getfield(L,prod,"#announced");
+        const int done = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        if( !done )
+        {
+            lua_pushboolean(L,1);
+            lua_setfield(L,prod,"#announced");
+            lua_getmetatable(L,prod);
+            lua_getfield(L,-1,"#name");
+            lua_getfield(L,prod,"#decl");
+            calcdesig(L,-1);
+            fprintf(stdout,"# building %s %s\n",lua_tostring(L,-3),lua_tostring(L,-1));
+            fflush(stdout);
+            lua_pop(L,4); // cls, name, decl, desig
+        }
+    }
+    lua_pop(L,1); // prod
+}
+
+static void arupdate(lua_State* L, int job)
+{
+    // in the incremental archive mode only the objects which are newer than the archive or not yet in it are
+    // replaced, and the members which are no longer inputs are deleted; the members of the archive are recorded
+    // in the database; if the archive or the record are missing the full command is run
+    const int top = lua_gettop(L);
+    BSDb* db = builddb(L);
+    lua_getfield(L,job,"artool");
+    const int tool = lua_gettop(L);
+    lua_getfield(L,job,"outputs");
+    lua_rawgeti(L,-1,1);
+    const int out = lua_gettop(L);
+    const BSTime outTime = lua_isstring(L,tool) && db != 0 ? bs_exists(lua_tostring(L,out)) : 0;
+    const BSDbRecord* rec = outTime != 0 ? bs_dbget(db,lua_tostring(L,out)) : 0;
+    if( rec == 0 || rec->depsLen == 0 )
+    {
+        lua_pop(L,3); // tool, outputs, out
+        return;
+    }
+
+    lua_createtable(L,0,0);
+    const int members = lua_gettop(L); // path -> true if stale
+    const char* p = rec->deps;
+    const char* end = p + rec->depsLen;
+    while( p < end )
+    {
+        lua_pushstring(L,p);
+        lua_pushboolean(L,1);
+        lua_rawset(L,members);
+        p += strlen(p) + 1;
+    }
+
+    lua_pushstring(L,"");
+    const int adds = lua_gettop(L);
+    lua_getfield(L,job,"inputs");
+    const int inputs = lua_gettop(L);
+    size_t i;
+    for( i = 1; i <= lua_objlen(L,inputs); i++ )
+    {
+        lua_rawgeti(L,inputs,i);
+        const int in = lua_gettop(L);
+        lua_pushvalue(L,in);
+        lua_rawget(L,members);
+        const int member = !lua_isnil(L,-1);
+        lua_pop(L,1);
+        if( !member || bs_exists(lua_tostring(L,in)) > outTime )
+        {
+            lua_pushfstring(L,"%s \"%s\"", lua_tostring(L,adds), bs_denormalize_path(lua_tostring(L,in)));
+            lua_replace(L,adds);
+        }
+        lua_pushvalue(L,in);
+        lua_pushboolean(L,0);
+        lua_rawset(L,members);
+        lua_pop(L,1); // in
+    }
+    lua_pop(L,1); // inputs
+
+    lua_pushstring(L,"");
+    const int dels = lua_gettop(L);
+    lua_pushnil(L);
+    while( lua_next(L,members) != 0 )
+    {
+        if( lua_toboolean(L,-1) )
+        {
+            // ar knows the members by their file name
+            lua_pushfstring(L,"%s \"%s\"", lua_tostring(L,dels), bs_filename(lua_tostring(L,-2)));
+            lua_replace(L,dels);
+        }
+        lua_pop(L,1); // value
+    }
+
+    const char* archive = bs_denormalize_path(lua_tostring(L,out));
+    lua_pushstring(L,"");
+    if( lua_objlen(L,dels) != 0 )
+        lua_pushfstring(L,"%s d \"%s\"%s", lua_tostring(L,tool), archive, lua_tostring(L,dels));
+    else
+        lua_pushstring(L,"");
+    if( lua_objlen(L,dels) != 0 && lua_objlen(L,adds) != 0 )
+        lua_pushstring(L," && ");
+    else
+        lua_pushstring(L,"");
+    if( lua_objlen(L,adds) == 0 )
+        lua_pushstring(L,"");
+    else
+    {
+        lua_getfield(L,job,"rsp");
+        const int useRsp = !lua_isnil(L,-1);
+        lua_pop(L,1);
+        if( useRsp )
+        {
+            lua_pushfstring(L,"%s.inc.rsp", archive);
+            FILE* f = bs_fopen(lua_tostring(L,-1),"w");
+            if( f == NULL )
+                luaL_error(L, "cannot open rsp file for writing: %s", lua_tostring(L,-1));
+            fwrite(lua_tostring(L,adds),1,lua_objlen(L,adds),f);
+            fclose(f);
+            lua_pushfstring(L,"%s r \"%s\" @\"%s\"", lua_tostring(L,tool), archive, lua_tostring(L,-1));
+            lua_replace(L,-2);
+        }else
+            lua_pushfstring(L,"%s r \"%s\"%s", lua_tostring(L,tool), archive, lua_tostring(L,adds));
+    }
+    lua_concat(L,4);
+    lua_setfield(L,job,"#runcmd");
+
+    lua_pop(L,6); // tool, outputs, out, members, adds, dels
+    assert( top == lua_gettop(L) );
+}
+
+static int dumpwriter(lua_State* L, const void* p, size_t sz, void* data)
+{
+    luaL_addlstring((luaL_Buffer*)data,(const char*)p,sz);
+    return 0;
+}
+
+typedef struct ChunkRun {
+    char** argv;
+    const char* code;
+    size_t len;
+} ChunkRun;
+
+static int chunkmain(void* data)
+{
+    ChunkRun* run = (ChunkRun*)data;
+    return lua_main_chunk(run->argv,run->code,run->len);
+}
+
+static int runchunk(lua_State* L, int chunk, char** argv, int serial, int* status)
+{
+    // the script of a LuaScriptForeach is compiled once and the bytecode is shared by all iterations; each
+    // iteration runs in a fresh Lua state, in a child process if the platform supports it
+    const int top = lua_gettop(L);
+    int pid = 0;
+    lua_getfield(L,chunk,"code");
+    if( lua_isnil(L,-1) )
+    {
+        lua_pop(L,1);
+        if( luaL_loadfile(L,argv[1]) != 0 )
+        {
+            fprintf(stderr,"%s\n", lua_tostring(L,-1));
+            fflush(stderr);
+            lua_pop(L,1); // error message
+            *status = -1;
+            return 0;
+        }
+        luaL_Buffer b;
+        luaL_buffinit(L,&b);
+        lua_dump(L,dumpwriter,&b);
+        luaL_pushresult(&b);
+        lua_replace(L,-2); // function
+        lua_pushvalue(L,-1);
+        lua_setfield(L,chunk,"code");
+    }
+    ChunkRun run;
+    run.argv = argv;
+    run.code = lua_tolstring(L,-1,&run.len);
+    if( !serial )
+        pid = bs_spawnfunc(chunkmain,&run);
+    if( pid == 0 )
+        *status = chunkmain(&run);
+    lua_pop(L,1); // code
+    assert( top == lua_gettop(L) );
+    return pid;
+}
+
+static int startjob(lua_State* L, int job, int serial, int* status)
+{
+    // runs job if it is not up-to-date; returns the process id if the job was started in the background,
+    // otherwise 0 and the result is set in status
+    const int top = lua_gettop(L);
+    int pid = 0;
+    *status = 0;
+
+    announce(L,job);
+
+    lua_getfield(L,job,"op");
+    const int isBarrier = lua_isnil(L,-1);
+    const int op = lua_tointeger(L,-1);
+    lua_pop(L,1);
+
+    if( isBarrier || !outdated(L,job) )
+        return 0;
+    lua_pushboolean(L,1);
+    lua_setfield(L,job,"#ran");
+    if( op == BS_Compile && fromcache(L,job) )
+    {
+        lua_pushboolean(L,1);
+        lua_setfield(L,job,"#cached");
+        return 0;
+    }
+    if( op == BS_LinkLib )
+        arupdate(L,job);
+
+    lua_getfield(L,job,"#runcmd"); // replaces cmd for this run only; cmd is still used for the database
+    if( lua_isnil(L,-1) )
+    {
+        lua_pop(L,1);
+        lua_getfield(L,job,"cmd");
+    }
+    const int cmd = lua_gettop(L);
+    if( op == BS_Copy )
+        pid = copycmd(L,job,serial,status);
+    else if( lua_isnil(L,cmd) )
+    {
+        // the script is run by the Lua interpreter linked with BUSY
+        lua_getfield(L,job,"argv");
+        const int args = lua_gettop(L);
+        const int argc = lua_objlen(L,args);
+        char** argv = (char**)malloc((argc+1)*sizeof(char*));
+        int i;
+        for( i = 0; i < argc; i++ )
+        {
+            lua_rawgeti(L,args,i+1);
+            argv[i] = (char*)lua_tostring(L,-1);
+            lua_pop(L,1); // the string is still referenced by args
+        }
+        argv[argc] = 0;
+        lua_getfield(L,job,"chunk");
+        if( lua_istable(L,-1) )
+            pid = runchunk(L,lua_gettop(L),argv,serial,status);
+        else
+            *status = lua_main(argc,argv);
+        free(argv);
+        lua_pop(L,2); // args, chunk
+    }else if( lua_objlen(L,cmd) == 0 )
+    {
+        // nothing to do but to mark the outputs as up-to-date
+        lua_getfield(L,job,"outputs");
+        size_t i;
+        for( i = 1; i <= lua_objlen(L,-1); i++ )
+        {
+            lua_rawgeti(L,-1,i);
+            bs_touch(lua_tostring(L,-1));
+            lua_pop(L,1);
+        }
+        lua_pop(L,1); // outputs
+    }else
+    {
+        lua_getfield(L,job,"clean");
+        if( lua_toboolean(L,-1) )
+        {
+            // the command doesn't remove what is no longer needed, so start from scratch
+            lua_getfield(L,job,"outputs");
+            size_t i;
+            for( i = 1; i <= lua_objlen(L,-1); i++ )
+            {
+                lua_rawgeti(L,-1,i);
+                remove(bs_denormalize_path(lua_tostring(L,-1)));
+                lua_pop(L,1);
+            }
+            lua_pop(L,1); // outputs
+        }
+        lua_pop(L,1); // clean
+        fprintf(stdout,"%s\n", lua_tostring(L,cmd));
+        fflush(stdout);
+        lua_getfield(L,job,"args");
+        const int args = lua_gettop(L);
+        if( lua_istable(L,args) && !altruncmd(L) )
+        {
+            // the tools with a fixed command line (moc, rcc, uic) are started directly with their argv
+            const int argc = lua_objlen(L,args);
+            char** argv = (char**)malloc((argc+1)*sizeof(char*));
+            int i;
+            for( i = 0; i < argc; i++ )
+            {
+                lua_rawgeti(L,args,i+1);
+                argv[i] = (char*)lua_tostring(L,-1);
+                lua_pop(L,1); // the string is still referenced by args
+            }
+            argv[argc] = 0;
+            if( serial )
+                *status = bs_execv(argv);
+            else
+            {
+                pid = bs_spawnv(argv);
+                if( pid < 0 )
+                {
+                    fprintf(stderr,"# ERR: cannot start process: %s\n", lua_tostring(L,cmd));
+                    fflush(stderr);
+                    *status = -1;
+                    pid = 0;
+                }
+            }
+            free(argv);
+        }
+        // otherwise the command stays a string: the flags, defines and paths of the compiler and linker are shell
+        // words as written in the BUSY files; bs_spawn splits it into an argv and only falls back to sh if it
+        // uses shell syntax
+        else if( serial )
+            *status = runcmd(L,lua_tostring(L,cmd)); // works for all gcc, clang and cl
+        else
+        {
+            pid = bs_spawn(lua_tostring(L,cmd));
+            if( pid < 0 )
+            {
+                fprintf(stderr,"# ERR: cannot start process: %s\n", lua_tostring(L,cmd));
+                fflush(stderr);
+                *status = -1;
+                pid = 0;
+            }
+        }
+        lua_pop(L,1); // args
+    }
+    lua_pop(L,1); // cmd
+
+    assert( top == lua_gettop(L) );
+    return pid;
+}
+
+static void addjob(lua_State* L)
+{
+    // pops the job on top of the stack and adds it to the current graph, or runs it immediately if there is no graph
+    const int job = lua_gettop(L);
+
+    if( !jobgraph(L) )
+    {
+        lua_pop(L,1); // nil
+        int status;
+        startjob(L,job,1,&status);
+        if( status != 0 )
+        {
+            // stderr was already written to the console
+            lua_pushnil(L);
+            lua_error(L);
+        }
+        cachejob(L,job);
+        logjob(L,job);
+        lua_pop(L,1); // job
+        return;
+    }
+    const int graph = lua_gettop(L);
+
+    lua_pushvalue(L,graph);
+    lua_setfield(L,job,"graph");
 
-    if( decl < 0 )
-        decl += top + 1;
-    lua_getfield(L,decl,"#name");
-    const int name = lua_gettop(L);
-    lua_getfield(L,decl,"#owner");
-    const int module = lua_gettop(L);
-    while(!lua_isnil(L,module))
+    lua_getfield(L,graph,"producers");
+    const int producers = lua_gettop(L);
+    lua_getfield(L,job,"deps");
+    const int deps = lua_gettop(L);
+
+    // the job depends on the jobs producing its inputs
+    size_t i;
+    lua_getfield(L,job,"inputs");
+    for( i = 1; i <= lua_objlen(L,-1); i++ )
     {
-        lua_getfield(L,module,"#name");
+        lua_rawgeti(L,-1,i);
+        lua_rawget(L,producers);
+        if( lua_istable(L,-1) )
+            append(L,deps);
+        else
+            lua_pop(L,1); // nil
+    }
+    lua_pop(L,1); // inputs
+
+    lua_getfield(L,job,"outputs");
+    for( i = 1; i <= lua_objlen(L,-1); i++ )
+    {
+        lua_rawgeti(L,-1,i);
+        lua_pushvalue(L,job);
+        lua_rawset(L,producers);
+    }
+    lua_pop(L,1); // outputs
+
+    lua_getfield(L,job,"prod");
+    if( lua_istable(L,-1) )
+    {
+        lua_getfield(L,-1,"#jobs");
         if( lua_isnil(L,-1) )
         {
             lua_pop(L,1);
-            break;
+            lua_createtable(L,0,0);
+            lua_pushvalue(L,-1);
+            lua_setfield(L,-3,"#jobs");
         }
-        lua_pushstring(L,separator);
-        lua_pushvalue(L,name);
-        lua_concat(L,3);
-        lua_replace(L,name);
-        lua_getfield(L,module,"#owner");
-        lua_replace(L,module);
+        lua_pushvalue(L,job);
+        append(L,-2);
+        lua_pop(L,1); // #jobs
     }
-    lua_pop(L,1); // module
+    lua_pop(L,1); // prod
 
-    assert( top + 1 == lua_gettop(L) );
-    return 1;
+    lua_getfield(L,graph,"jobs");
+    lua_pushvalue(L,job);
+    append(L,-2);
+
+    lua_pop(L,5); // job, graph, producers, deps, jobs
 }
 
-static int calcdesig(lua_State* L, int decl)
+static void addbarrier(lua_State* L, int inst)
 {
-    return bs_declpath(L,decl,".");
+    // the barrier of inst is finished when all jobs of inst and the barriers of its deps are finished
+    if( !jobgraph(L) )
+    {
+        lua_pop(L,1); // nil
+        return;
+    }
+    const int graph = lua_gettop(L);
+
+    const int job = newjob(L,inst,-1);
+    lua_pushvalue(L,graph);
+    lua_setfield(L,job,"graph");
+
+    lua_getfield(L,job,"deps");
+    const int deps = lua_gettop(L);
+    lua_getfield(L,inst,"#jobs");
+    size_t i;
+    for( i = 1; lua_istable(L,-1) && i <= lua_objlen(L,-1); i++ )
+    {
+        lua_rawgeti(L,-1,i);
+        append(L,deps);
+    }
+    lua_pop(L,2); // #jobs, deps
+    lua_pushnil(L);
+    lua_setfield(L,inst,"#jobs");
+
+    lua_pushvalue(L,job);
+    lua_setfield(L,inst,"#barrier");
+
+    lua_getfield(L,graph,"jobs");
+    lua_pushvalue(L,job);
+    append(L,-2);
+
+    lua_pop(L,3); // graph, job, jobs
 }
 
-static int isa(lua_State* L, int builtins, int cls, const char* what )
+typedef struct ReadyItem {
+    double prio;
+    int seq; // the order in which the jobs became ready
+    int node;
+} ReadyItem;
+
+typedef struct ReadyQueue {
+    // a binary heap of the ready nodes; the job with the longest estimated remaining path to the end of the build
+    // comes first, jobs with the same estimate in the order they became ready
+    ReadyItem* items;
+    int count;
+    int cap;
+    int last; // the last seq used
+    const double* prios; // of the nodes; 0 if the jobs run one after the other in the order they were planned
+} ReadyQueue;
+
+static int before(const ReadyItem* a, const ReadyItem* b)
 {
-    lua_getfield(L,builtins,what);
-    const int res = bs_isa(L,-1,cls);
-    lua_pop(L,1);
+    return a->prio > b->prio || ( a->prio == b->prio && a->seq < b->seq );
+}
+
+static double jobduration(lua_State* L, const BSJobNode* node)
+{
+    // the duration of the job in milliseconds the last time it ran, or a guess if it never ran
+    if( node->op < 0 )
+        return 0; // a barrier
+    double res = 1000;
+    BSDb* db = builddb(L);
+    if( db != 0 && node->outputCount > 0 )
+    {
+        const BSDbRecord* rec = bs_dbget(db,node->outputs[0]);
+        if( rec != 0 && rec->duration != 0 )
+            res = rec->duration;
+    }
+    return res;
+}
+
+static double jobmem(lua_State* L, const BSJobNode* node, double guess)
+{
+    // the peak memory of the job in kilobytes the last time it ran, or the guess if it never ran
+    if( node->op < 0 )
+        return 0;
+    double res = 0;
+    BSDb* db = builddb(L);
+    int i;
+    for( i = 0; db != 0 && i < node->outputCount; i++ )
+    {
+        const BSDbRecord* rec = bs_dbget(db,node->outputs[i]);
+        if( rec != 0 && rec->peakMem > res )
+            res = rec->peakMem;
+    }
+    return res != 0 ? res : guess;
+}
+
+static double* jobprios(lua_State* L, const BSJobGraph* g)
+{
+    // the estimated time from the start of each node to the end of the build along the longest chain of its
+    // dependents; the dependents come later in the graph, so one pass from the end suffices
+    double* res = (double*)malloc((g->count ? g->count : 1)*sizeof(double));
+    int i, j;
+    for( i = g->count - 1; i >= 0; i-- )
+    {
+        const BSJobNode* node = &g->nodes[i];
+        double max = 0;
+        for( j = 0; j < node->dependentCount; j++ )
+            if( res[node->dependents[j]] > max )
+                max = res[node->dependents[j]];
+        res[i] = max + jobduration(L,node);
+    }
     return res;
 }
 
+static void pushready(ReadyQueue* q, int node)
+{
+    if( q->count == q->cap )
+    {
+        q->cap = q->cap ? q->cap * 2 : 256;
+        q->items = (ReadyItem*)realloc(q->items,q->cap*sizeof(ReadyItem));
+    }
+    ReadyItem item;
+    item.seq = ++q->last;
+    item.node = node;
+    item.prio = q->prios ? q->prios[node] : 0;
+    int i = q->count++;
+    while( i > 0 && before(&item,&q->items[(i-1)/2]) )
+    {
+        q->items[i] = q->items[(i-1)/2];
+        i = (i-1)/2;
+    }
+    q->items[i] = item;
+}
+
+static int popready(ReadyQueue* q)
+{
+    // removes the first node of the queue and returns it, or returns -1 if the queue is empty
+    if( q->count == 0 )
+        return -1;
+    const int node = q->items[0].node;
+    const ReadyItem last = q->items[--q->count];
+    int i = 0;
+    for(;;)
+    {
+        int c = 2 * i + 1;
+        if( c >= q->count )
+            break;
+        if( c + 1 < q->count && before(&q->items[c+1],&q->items[c]) )
+            c++;
+        if( !before(&q->items[c],&last) )
+            break;
+        q->items[i] = q->items[c];
+        i = c;
+    }
+    q->items[i] = last;
+    return node;
+}
+
+static void release(const BSJobGraph* g, int node, int* wait, ReadyQueue* q)
+{
+    // decrements the wait count of the dependents of node and queues the ones which became ready
+    const BSJobNode* n = &g->nodes[node];
+    int i;
+    for( i = 0; i < n->dependentCount; i++ )
+        if( --wait[n->dependents[i]] == 0 )
+            pushready(q,n->dependents[i]);
+}
+
+static void tracestart(lua_State* L, int job, char* slots, int maxJobs)
+{
+    // takes a free slot for the job, which is the track of the job in the trace
+    if( !bs_tracing() )
+        return;
+    int i = 0;
+    while( i < maxJobs - 1 && slots[i] )
+        i++;
+    slots[i] = 1;
+    lua_pushinteger(L,i+1);
+    lua_setfield(L,job,"#slot");
+}
+
+static const char* s_opnames[] = { "Compile", "LinkExe", "LinkDll", "LinkLib", "RunMoc", "RunRcc", "RunUic",
+                                   "RunLua", "Copy" };
+
+static void traceend(lua_State* L, int job, const BSJobNode* node, char* slots, int status)
+{
+    // writes a trace event for the job if it was run, and releases its slot
+    if( !bs_tracing() )
+        return;
+    const int top = lua_gettop(L);
+    lua_getfield(L,job,"#slot");
+    const int slot = lua_tointeger(L,-1);
+    lua_getfield(L,job,"#start");
+    const long long start = (long long)lua_tonumber(L,-1);
+    lua_getfield(L,job,"#ran");
+    const int ran = lua_toboolean(L,-1);
+    lua_pop(L,3);
+    if( slot == 0 )
+        return;
+    slots[slot-1] = 0;
+    if( !ran )
+        return;
+
+    const char* args[9];
+    int n = 0;
+    if( node->product )
+    {
+        args[n++] = "product";
+        args[n++] = node->product;
+    }
+    const char* opname = node->op >= 0 && node->op < (int)(sizeof(s_opnames)/sizeof(s_opnames[0])) ?
+                s_opnames[node->op] : "";
+    args[n++] = "op";
+    args[n++] = opname;
+    lua_getfield(L,job,"#runcmd"); // replaces cmd for this run only
+    const char* cmd = lua_isstring(L,-1) ? lua_tostring(L,-1) : node->cmd;
+    if( cmd )
+    {
+        args[n++] = "cmd";
+        args[n++] = cmd;
+    }
+    if( status != 0 )
+    {
+        args[n++] = "status";
+        args[n++] = "failed";
+    }
+    args[n] = 0;
+
+    // the event is named after the file name of the first output
+    const char* name = node->outputCount > 0 ? node->outputs[0] : opname;
+    const char* p = name + strlen(name);
+    while( p > name && p[-1] != '/' )
+        p--;
+    bs_traceevent(p,"job",slot,start,args);
+    lua_settop(L,top);
+}
+
+static int keepgoing(lua_State* L)
+{
+    // set by the -k option; the number of failed jobs after which no more jobs are started, 0 means no limit
+    lua_getglobal(L,"#keepgoing");
+    const int n = lua_isnumber(L,-1) ? lua_tointeger(L,-1) : 1;
+    lua_pop(L,1);
+    return n < 0 ? 1 : n;
+}
+
+static void reportfailures(const BSJobGraph* g, const int* failures, int failed, const char* started)
+{
+    // prints the failed jobs at the end of the build, since their errors may have scrolled away long ago
+    int skipped = 0;
+    int i;
+    for( i = 0; i < g->count; i++ )
+        if( g->nodes[i].op >= 0 && !started[i] )
+            skipped++;
+    fprintf(stderr,"# ERR: %d job(s) failed", failed);
+    if( skipped )
+        fprintf(stderr,", %d job(s) were not run", skipped);
+    fprintf(stderr,":\n");
+    for( i = 0; i < failed; i++ )
+    {
+        const BSJobNode* node = &g->nodes[failures[i]];
+        fprintf(stderr,"#   %s %s", node->op >= 0 && node->op < (int)(sizeof(s_opnames)/sizeof(s_opnames[0])) ?
+                    s_opnames[node->op] : "", node->outputCount > 0 ? node->outputs[0] : "");
+        if( node->product )
+            fprintf(stderr," of %s", node->product);
+        fprintf(stderr,"\n");
+    }
+    fflush(stderr);
+}
+
+static int runjobs(lua_State* L, int graph)
+{
+    // runs the jobs of graph in dependency order with up to jobcount() processes in parallel;
+    // the jobs depending on a failed job are not run; after keepgoing() failures no more jobs are started at all,
+    // the running ones are awaited and 0 is returned;
+    // of the ready jobs the one with the longest chain of dependents (by their last durations) is started first;
+    // the scheduling works on the lowered graph, the Lua job tables are only used to start and finish the jobs
+    const int top = lua_gettop(L);
+
+    BSJobGraph* g = bs_joblower(L,graph);
+    if( g == 0 )
+    {
+        fprintf(stderr,"# ERR: the jobs of the build depend on each other in a cycle\n");
+        fflush(stderr);
+        return 0;
+    }
+    const int n = g->count;
+    lua_getfield(L,graph,"jobs");
+    const int jobs = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int running = lua_gettop(L); // pid -> node
+
+    int* wait = (int*)malloc((n ? n : 1)*sizeof(int));
+    char* started = (char*)calloc(n ? n : 1,1);
+    int* failures = (int*)malloc((n ? n : 1)*sizeof(int));
+    double* mems = (double*)calloc(n ? n : 1,sizeof(double)); // of the running nodes
+    int i;
+    for( i = 0; i < n; i++ )
+        wait[i] = g->nodes[i].depCount;
+
+    const int maxJobs = altruncmd(L) ? 1 : jobcount(L);
+    char* slots = (char*)calloc(maxJobs,1);
+    ReadyQueue q;
+    memset(&q,0,sizeof(q));
+    double* prios = maxJobs > 1 ? jobprios(L,g) : 0; // i.e. jobs on the critical path are started first
+    q.prios = prios;
+    for( i = 0; i < n; i++ )
+        if( wait[i] == 0 )
+            pushready(&q,i);
+    // with a jobserver each job but the first needs a token, so a parent make or the makes started by our commands
+    // don't run more than the requested number of jobs altogether
+    const int jobserver = maxJobs > 1 && bs_jobserver_open(maxJobs);
+    // jobs are only started while the sum of their peak memory in previous runs fits into the limit
+    const double memLimit = maxJobs > 1 ? memlimit(L) : 0;
+    const double memGuess = memdefault(L);
+    double memUsed = 0, mem = 0;
+    const int maxFailures = keepgoing(L);
+    int nrunning = 0, failed = 0, lost = 0, status, tokens = 0;
+    for(;;)
+    {
+        while( ( maxFailures == 0 || failed < maxFailures ) && nrunning < maxJobs && q.count > 0 )
+        {
+            if( memLimit > 0 )
+            {
+                mem = jobmem(L,&g->nodes[q.items[0].node],memGuess); // the node popready returns next
+                if( nrunning > 0 && memUsed + mem > memLimit )
+                    break; // wait until a running job releases its memory; a job alone may exceed the limit
+            }
+            if( jobserver && nrunning > tokens )
+            {
+                if( !bs_jobserver_acquire() )
+                    break; // no token available, wait for one of our jobs to finish
+                tokens++;
+            }
+            const int node = popready(&q);
+            started[node] = 1;
+            lua_rawgeti(L,jobs,g->nodes[node].job);
+            const int job = lua_gettop(L);
+            lua_pushnumber(L,(lua_Number)bs_clock());
+            lua_setfield(L,job,"#start");
+            tracestart(L,job,slots,maxJobs);
+            const int pid = startjob(L,job,maxJobs == 1,&status);
+            if( pid > 0 )
+            {
+                lua_pushinteger(L,pid);
+                lua_pushinteger(L,node);
+                lua_rawset(L,running);
+                nrunning++;
+                mems[node] = mem;
+                memUsed += mem;
+            }else if( status != 0 )
+            {
+                traceend(L,job,&g->nodes[node],slots,status);
+                failures[failed++] = node;
+            }else
+            {
+                traceend(L,job,&g->nodes[node],slots,status);
+                cachejob(L,job);
+                logjob(L,job);
+                release(g,node,wait,&q);
+            }
+            lua_pop(L,1); // job
+            while( tokens > 0 && tokens >= nrunning )
+            {
+                bs_jobserver_release();
+                tokens--;
+            }
+        }
+        if( nrunning == 0 )
+            break;
+        unsigned int peak;
+        const int pid = bs_wait(&status,&peak);
+        if( pid < 0 )
+        {
+            // the running jobs cannot be finished, so neither they nor their dependents count as built
+            fprintf(stderr,"# ERR: cannot wait for %d running job(s)\n", nrunning);
+            fflush(stderr);
+            lost = 1;
+            break;
+        }
+        lua_pushinteger(L,pid);
+        lua_rawget(L,running);
+        if( lua_isnil(L,-1) )
+        {
+            lua_pop(L,1);
+            continue; // not one of ours
+        }
+        const int node = lua_tointeger(L,-1);
+        lua_pop(L,1);
+        lua_pushinteger(L,pid);
+        lua_pushnil(L);
+        lua_rawset(L,running);
+        nrunning--;
+        memUsed -= mems[node];
+        while( tokens > 0 && tokens >= nrunning )
+        {
+            bs_jobserver_release();
+            tokens--;
+        }
+        lua_rawgeti(L,jobs,g->nodes[node].job);
+        const int job = lua_gettop(L);
+        lua_pushinteger(L,peak);
+        lua_setfield(L,job,"#peak");
+        traceend(L,job,&g->nodes[node],slots,status);
+        if( status != 0 )
+            failures[failed++] = node;
+        else
+        {
+            cachejob(L,job);
+            logjob(L,job);
+            release(g,node,wait,&q);
+        }
+        lua_pop(L,1); // job
+    }
+    if( failed && maxFailures != 1 )
+        reportfailures(g,failures,failed,started);
+    lua_pop(L,2); // jobs, running
+    free(slots);
+    free(q.items);
+    free(prios);
+    free(wait);
+    free(started);
+    free(failures);
+    free(mems);
+    bs_jobfree(g);
+    if( jobserver )
+        bs_jobserver_close();
+
+    assert( top == lua_gettop(L) );
+    return !failed && !lost;
+}
+
 int bs_guessLang(const char* name)
 {
     const int len = strlen(name);
@@ -173,18 +1660,14 @@ int bs_guessLang(const char* name)
     return BS_unknownLang;
 }
 
-static void addflags(lua_State* L, int list, int out)
+static void addflags(lua_State* L, const BSStrings* list, int out)
 {
-    if( list < 0 )
-        list += lua_gettop(L) + 1;
-
-    const int n = lua_objlen(L,list);
     int i;
-    for( i = 1; i <= n; i++ )
+    for( i = 0; i < list->count; i++ )
     {
         lua_pushvalue(L,out);
         lua_pushstring(L," ");
-        lua_rawgeti(L,list,i);
+        lua_pushstring(L,list->items[i]);
         lua_concat(L,3);
         lua_replace(L,out);
     }
@@ -216,86 +1699,6 @@ int bs_getModuleVar(lua_State* L, int inst, const char* name )
     return 1;
 }
 
-static void addall(lua_State* L,int inst,int cflags, int cflags_c, int cflags_cc, int cflags_objc, int cflags_objcc,
-                        int defines, int includes, int ismsvc)
-{
-    // TODO: avoid duplicates
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        // TODO: check for circular deps
-        addall(L,config,cflags,cflags_c,cflags_cc,cflags_objc,cflags_objcc,defines,includes,ismsvc);
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst,"cflags");
-    addflags(L,-1,cflags);
-    lua_pop(L,1);
-
-    lua_getfield(L,inst,"cflags_c");
-    addflags(L,-1,cflags_c);
-    lua_pop(L,1);
-
-    lua_getfield(L,inst,"cflags_cc");
-    addflags(L,-1,cflags_cc);
-    lua_pop(L,1);
-
-    lua_getfield(L,inst,"cflags_objc");
-    addflags(L,-1,cflags_objc);
-    lua_pop(L,1);
-
-    lua_getfield(L,inst,"cflags_objcc");
-    addflags(L,-1,cflags_objcc);
-    lua_pop(L,1);
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    lua_getfield(L,inst,"include_dirs");
-    const int incls = lua_gettop(L);
-
-    for( i = 1; i <= lua_objlen(L,incls); i++ )
-    {
-        lua_rawgeti(L,incls,i);
-        const int path = lua_gettop(L);
-        if( *lua_tostring(L,-1) != '/' )
-        {
-            // relative path
-            addPath(L,absDir,path);
-            lua_replace(L,path);
-        }
-        lua_pushvalue(L,includes);
-        lua_pushfstring(L," -I\"%s\" ", bs_denormalize_path(lua_tostring(L,path)) );
-        lua_concat(L,2);
-        lua_replace(L,includes);
-        lua_pop(L,1); // path
-    }
-    lua_pop(L,2); // absDir, incls
-
-    lua_getfield(L,inst,"defines");
-    const int defs = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,defs); i++ )
-    {
-        lua_rawgeti(L,defs,i);
-        lua_pushvalue(L,defines);
-        if( strstr(lua_tostring(L,-2),"\\\"") != NULL )
-            lua_pushfstring(L," \"-D%s\" ", lua_tostring(L,-2)); // strings can potentially include whitespace, thus quotes
-        else
-            lua_pushfstring(L," -D%s ", lua_tostring(L,-2));
-        lua_concat(L,2);
-        lua_replace(L,defines);
-        lua_pop(L,1); // def
-    }
-    lua_pop(L,1); // defs
-
-}
-
 BSToolchain bs_getToolchain(lua_State* L, int builtinsInst, int to_host)
 {
     if( to_host )
@@ -396,7 +1799,152 @@ static void prefixCmd(lua_State* L, int cmd, int binst, int to_host)
         lua_pop(L,1);
 }
 
-static void compilesources(lua_State* L, int inst, int builtins, int inlist)
+static void pchjob(lua_State* L, int inst, int pch, int outbase, int lang, int toolchain, int cmd)
+{
+    // pushes a new job which precompiles the header pch for lang; cmd is the compiler with the flags of the
+    // product; the object files include the header by "#pchbase", which makes the compiler use the .gch or .pch
+    const char* x;
+    const char* suffix;
+    switch( lang )
+    {
+    case BS_cc:
+        x = "c++-header";
+        suffix = "cc";
+        break;
+    case BS_objc:
+        x = "objective-c-header";
+        suffix = "m";
+        break;
+    case BS_objcc:
+        x = "objective-c++-header";
+        suffix = "mm";
+        break;
+    default:
+        x = "c-header";
+        suffix = "c";
+        break;
+    }
+    lua_pushfstring(L,"%s_%s_%s", lua_tostring(L,outbase), suffix, bs_filename(lua_tostring(L,pch)));
+    const int base = lua_gettop(L);
+    lua_pushfstring(L,"%s%s", lua_tostring(L,base), toolchain == BS_gcc ? ".gch" : ".pch");
+    const int out = lua_gettop(L);
+
+    const int job = newjob(L,inst,BS_Compile);
+    addfile(L,job,"inputs",pch);
+    addfile(L,job,"outputs",out);
+    lua_pushfstring(L,"%s.d", bs_denormalize_path(lua_tostring(L,out)));
+    lua_pushvalue(L,-1);
+    lua_setfield(L,job,"depfile");
+    lua_pushfstring(L,"%s -x %s -MD -MF \"%s\" -c -o \"%s\" \"%s\"", lua_tostring(L,cmd), x, lua_tostring(L,-1),
+                    bs_denormalize_path(lua_tostring(L,out)), bs_denormalize_path(lua_tostring(L,pch)) );
+    lua_setfield(L,job,"cmd");
+    lua_pop(L,1); // depfile
+    lua_pushvalue(L,base);
+    lua_setfield(L,job,"#pchbase");
+    lua_replace(L,base);
+    lua_pop(L,1); // out
+}
+
+static void writeifchanged(lua_State* L, const char* normalizedPath, const char* text, size_t len)
+{
+    // the file keeps its time stamp if it already has this content
+    const char* path = bs_denormalize_path(normalizedPath);
+    FILE* f = bs_fopen(path,"rb");
+    if( f != NULL )
+    {
+        char* buf = (char*)malloc(len+1);
+        const size_t n = buf ? fread(buf,1,len+1,f) : 0;
+        const int same = n == len && memcmp(buf,text,len) == 0;
+        free(buf);
+        fclose(f);
+        if( same )
+            return;
+    }
+    f = bs_fopen(path,"wb");
+    if( f == NULL )
+        luaL_error(L, "cannot open file for writing: %s", path);
+    fwrite(text,1,len,f);
+    fclose(f);
+    bs_invalidate(normalizedPath);
+}
+
+static void unitysources(lua_State* L, int inst, int sources, int absDir, int rootOutDir, int relDir)
+{
+    // replaces the sources of each language by generated files which each include up to unity_batch of them;
+    // a generated file is only rewritten if its members change, so its object is not compiled otherwise
+    lua_getfield(L,inst,"unity_batch");
+    const int batch = lua_tointeger(L,-1);
+    lua_pop(L,1);
+    if( batch < 2 )
+        return;
+    const int top = lua_gettop(L);
+
+    addPath(L,rootOutDir,relDir);
+    lua_pushstring(L,"/");
+    lua_getfield(L,inst,"#decl");
+    lua_getfield(L,-1,"#name");
+    lua_replace(L,-2);
+    lua_pushstring(L,"_unity_");
+    lua_concat(L,4);
+    const int outbase = lua_gettop(L);
+
+    lua_createtable(L,lua_objlen(L,sources),0);
+    const int result = lua_gettop(L);
+    int n = 0, count = 0;
+    size_t i;
+    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    {
+        // headers are skipped and unknown files reported by the caller
+        lua_rawgeti(L,sources,i);
+        const int lang = bs_guessLang(lua_tostring(L,-1));
+        if( lang != BS_c && lang != BS_cc && lang != BS_objc && lang != BS_objcc )
+            lua_rawseti(L,result,++n);
+        else
+            lua_pop(L,1);
+    }
+
+    const int langs[] = { BS_c, BS_cc, BS_objc, BS_objcc };
+    const char* exts[] = { ".c", ".cpp", ".m", ".mm" };
+    int l;
+    for( l = 0; l < 4; l++ )
+    {
+        int members = 0;
+        lua_pushstring(L,"");
+        const int text = lua_gettop(L);
+        for( i = 1; i <= lua_objlen(L,sources); i++ )
+        {
+            lua_rawgeti(L,sources,i);
+            const int file = lua_gettop(L);
+            if( bs_guessLang(lua_tostring(L,file)) == langs[l] )
+            {
+                if( *lua_tostring(L,file) != '/' )
+                    addPath(L,absDir,file);
+                else
+                    lua_pushvalue(L,file);
+                lua_pushfstring(L,"%s#include \"%s\"\n", lua_tostring(L,text), bs_denormalize_path(lua_tostring(L,-1)));
+                lua_replace(L,text);
+                lua_pop(L,1); // path
+                members++;
+            }
+            lua_pop(L,1); // file
+            if( members == batch || ( members > 0 && i == lua_objlen(L,sources) ) )
+            {
+                lua_pushfstring(L,"%s%d%s", lua_tostring(L,outbase), ++count, exts[l]);
+                writeifchanged(L,lua_tostring(L,-1),lua_tostring(L,text),lua_objlen(L,text));
+                lua_rawseti(L,result,++n);
+                lua_pushstring(L,"");
+                lua_replace(L,text);
+                members = 0;
+            }
+        }
+        lua_pop(L,1); // text
+    }
+    lua_replace(L,sources);
+    lua_pop(L,1); // outbase
+    assert( top == lua_gettop(L) );
+}
+
+static void compilesources(lua_State* L, int inst, const BSGraphNode* node, int builtins, int inlist)
 {
     const int top = lua_gettop(L);
 
@@ -410,20 +1958,8 @@ static void compilesources(lua_State* L, int inst, int builtins, int inlist)
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
-    lua_getfield(L,inst,"to_host");
-    const int to_host = lua_toboolean(L,-1);
-    lua_pop(L,1);
-
-    const int toolchain = bs_getToolchain(L,binst,to_host);
-
-    lua_getfield(L,binst,"#ctdefaults");
-    if( to_host )
-        lua_getfield(L,binst,"host_toolchain");
-    else
-        lua_getfield(L,binst,"target_toolchain");
-    lua_rawget(L,-2);
-    lua_replace(L,-2);
-    const int ctdefaults = lua_gettop(L);
+    const int to_host = node->toHost;
+    const int toolchain = node->toolchain;
 
     lua_getfield(L,binst,"root_build_dir");
     const int rootOutDir = lua_gettop(L);
@@ -436,43 +1972,67 @@ static void compilesources(lua_State* L, int inst, int builtins, int inlist)
 
     lua_pushstring(L,"");
     const int cflags = lua_gettop(L);
+    addflags(L,&node->flags[BS_cflags],cflags);
     lua_pushstring(L,"");
     const int cflags_c = lua_gettop(L);
+    addflags(L,&node->flags[BS_cflags_c],cflags_c);
     lua_pushstring(L,"");
     const int cflags_cc = lua_gettop(L);
+    addflags(L,&node->flags[BS_cflags_cc],cflags_cc);
     lua_pushstring(L,"");
     const int cflags_objc = lua_gettop(L);
+    addflags(L,&node->flags[BS_cflags_objc],cflags_objc);
     lua_pushstring(L,"");
     const int cflags_objcc = lua_gettop(L);
+    addflags(L,&node->flags[BS_cflags_objcc],cflags_objcc);
+
+    // TODO: avoid duplicates
+    size_t i;
     lua_pushstring(L,"");
     const int defines = lua_gettop(L);
+    for( i = 0; i < node->flags[BS_defines].count; i++ )
+    {
+        const char* def = node->flags[BS_defines].items[i];
+        lua_pushvalue(L,defines);
+        if( strstr(def,"\\\"") != NULL )
+            lua_pushfstring(L," \"-D%s\" ", def); // strings can potentially include whitespace, thus quotes
+        else
+            lua_pushfstring(L," -D%s ", def);
+        lua_concat(L,2);
+        lua_replace(L,defines);
+    }
     lua_pushstring(L,"");
     const int includes = lua_gettop(L);
+    for( i = 0; i < node->flags[BS_include_dirs].count; i++ )
+    {
+        lua_pushvalue(L,includes);
+        lua_pushfstring(L," -I\"%s\" ", bs_denormalize_path(node->flags[BS_include_dirs].items[i]) );
+        lua_concat(L,2);
+        lua_replace(L,includes);
+    }
 
-    if( !lua_isnil(L,ctdefaults) )
-        addall(L,ctdefaults,cflags,cflags_c,cflags_cc,cflags_objc,cflags_objcc,defines,includes,toolchain == BS_msvc);
-    // TODO: fix order according to specs
-    addall(L,inst,cflags,cflags_c,cflags_cc,cflags_objc,cflags_objcc,defines,includes,toolchain == BS_msvc);
-
-    size_t i;
-
-    lua_getfield(L,inst,"sources");
+    lua_createtable(L,node->inputs.count,0);
     const int sources = lua_gettop(L);
-    lua_createtable(L,lua_objlen(L,sources),0);
-    const int tmp = lua_gettop(L);
-    copyItems(L,inlist,tmp, BS_SourceFiles);
-    int n = lua_objlen(L,tmp);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    copyItems(L,inlist,sources, BS_SourceFiles);
+    int n = lua_objlen(L,sources);
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        // copy all sources to a new table to avoid changing the original sources
-        lua_rawgeti(L,sources,i);
-        lua_rawseti(L,tmp,++n);
+        lua_pushstring(L,node->inputs.items[i]);
+        lua_rawseti(L,sources,++n);
     }
-    lua_replace(L,sources);
+    unitysources(L,inst,sources,absDir,rootOutDir,relDir);
 
     // the result of source files received via dependencies appeares before the results of this source files
     copyItems(L,inlist,outlist, BS_ObjectFiles);
 
+    if( node->pch )
+        lua_pushstring(L,node->pch);
+    else
+        lua_pushnil(L);
+    const int pch = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int pchjobs = lua_gettop(L); // lang -> job
+
     n = lua_objlen(L,outlist);
     for( i = 1; i <= lua_objlen(L,sources); i++ )
     {
@@ -529,217 +2089,156 @@ static void compilesources(lua_State* L, int inst, int builtins, int inlist)
         lua_pushvalue(L,out);
         lua_rawseti(L,outlist,++n);
 
-        const time_t srcExists = bs_exists(lua_tostring(L,src));
-        const time_t outExists = bs_exists(lua_tostring(L,out));
-        // check if out is older than source; this is just to avoid total recompile in case of an error,
-        // not for development
-        if( !outExists || outExists < srcExists )
-        {
-            switch(toolchain)
-            {
-            case BS_gcc:
-                lua_pushstring(L,"gcc");
-                break;
-            case BS_clang:
-                lua_pushstring(L,"clang");
-                break;
-            case BS_msvc:
-                lua_pushstring(L,"cl");
-                break;
-            }
-            const int cmd = lua_gettop(L);
-
-            prefixCmd(L, cmd, binst, to_host);
-
-            lua_pushstring(L," ");
-            lua_concat(L,2); // append " " to cmd
-
-            lua_pushvalue(L,cmd);
-            lua_pushvalue(L,cflags);
-            switch(lang)
-            {
-            case BS_c:
-                lua_pushvalue(L,cflags_c);
-                break;
-            case BS_cc:
-                lua_pushvalue(L,cflags_cc);
-                break;
-            case BS_objc:
-                lua_pushvalue(L,cflags_objc);
-                break;
-            case BS_objcc:
-                lua_pushvalue(L,cflags_objcc);
-                break;
-            default:
-                lua_pushstring(L,"");
-                break;
-            }
-            lua_pushvalue(L,defines);
-            lua_pushvalue(L,includes);
-            switch(toolchain)
-            {
-            case BS_gcc:
-            case BS_clang:
-                lua_pushstring(L," -c -o ");
-                lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,out) ) );
-                lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,src) ) );
-                break;
-            case BS_msvc:
-                lua_pushstring(L," /nologo /c /Fo");
-                lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,out) ) );
-                lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,src) ) );
-                break;
-            default:
-                lua_pushstring(L,"");
-                break;
-            }
-            lua_concat(L,8);
-            lua_replace(L,cmd);
-            fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-            fflush(stdout);
-            if( runcmd(L,lua_tostring(L,cmd)) != 0 ) // works for all gcc, clang and cl
-            {
-                // stderr was already written to the console
-                lua_pushnil(L);
-                lua_error(L);
-            }
-            lua_pop(L,1); // cmd
-        }
-        lua_pop(L,3); // file, source, dest
-    }
-    lua_pop(L,1); // sources
-
-    lua_pop(L,13); // outlist, binst, ctdefaults, rootOutDir...relDir, cflags...includes
-
-    const int bottom = lua_gettop(L);
-    assert( top == bottom );
-}
-
-static void addall2(lua_State* L,int inst,int ldflags, int lib_dirs, int lib_names,
-                    int lib_files, int frameworks, int ismsvc, int ismac, int iswin)
-{
-    const int top = lua_gettop(L);
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int conf = lua_gettop(L);
-        // TODO: check for circular deps
-        addall2(L,conf,ldflags,lib_dirs,lib_names,lib_files,frameworks, ismsvc, ismac, iswin);
-        lua_pop(L,1);
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst,"ldflags");
-    addflags(L,-1,ldflags);
-    lua_pop(L,1);
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    lua_getfield(L,inst,"lib_dirs");
-    const int ldirs = lua_gettop(L);
+        // the job is only run if out is older than source or one of the headers listed in the depfile
+        const int job = newjob(L,inst,BS_Compile);
+        addfile(L,job,"inputs",src);
+        addfile(L,job,"outputs",out);
 
-    for( i = 1; i <= lua_objlen(L,ldirs); i++ )
-    {
-        lua_rawgeti(L,ldirs,i);
-        const int path = lua_gettop(L);
-        if( *lua_tostring(L,-1) != '/' )
+        switch(toolchain)
         {
-            // relative path
-            addPath(L,absDir,path);
-            lua_replace(L,path);
+        case BS_gcc:
+            lua_pushstring(L,"gcc");
+            break;
+        case BS_clang:
+            lua_pushstring(L,"clang");
+            break;
+        case BS_msvc:
+            lua_pushstring(L,"cl");
+            break;
         }
-        lua_pushvalue(L,lib_dirs);
-        if(ismsvc)
-            lua_pushfstring(L," /libpath:\"%s\" ", bs_denormalize_path(lua_tostring(L,path)) );
-        else
-            lua_pushfstring(L," -L\"%s\" ", bs_denormalize_path(lua_tostring(L,path)) );
-        lua_concat(L,2);
-        lua_replace(L,lib_dirs);
-        lua_pop(L,1); // path
-    }
-    lua_pop(L,1); // ldirs
+        const int cmd = lua_gettop(L);
 
+        prefixCmd(L, cmd, binst, to_host);
 
-    lua_getfield(L,inst,"lib_names");
-    const int lnames = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,lnames); i++ )
-    {
-        lua_rawgeti(L,lnames,i);
-        lua_pushvalue(L,lib_names);
-        if(ismsvc)
-            lua_pushfstring(L," %s.lib ", lua_tostring(L,-2));
-        else
-            lua_pushfstring(L," -l%s ", lua_tostring(L,-2));
-        lua_concat(L,2);
-        lua_replace(L,lib_names);
-        lua_pop(L,1); // name
-    }
-    lua_pop(L,1); // lnames
+        lua_pushstring(L," ");
+        lua_concat(L,2); // append " " to cmd
 
-    if(ismac)
-    {
-        lua_getfield(L,inst,"frameworks");
-        const int fw = lua_gettop(L);
-        for( i = 1; i <= lua_objlen(L,lnames); i++ )
+        lua_pushvalue(L,cmd);
+        lua_pushvalue(L,cflags);
+        switch(lang)
         {
-            lua_rawgeti(L,fw,i);
-            lua_pushvalue(L,frameworks);
-            lua_pushfstring(L," -framework %s ", lua_tostring(L,-2));
-            lua_concat(L,2);
-            lua_replace(L,frameworks);
-            lua_pop(L,1); // name
+        case BS_c:
+            lua_pushvalue(L,cflags_c);
+            break;
+        case BS_cc:
+            lua_pushvalue(L,cflags_cc);
+            break;
+        case BS_objc:
+            lua_pushvalue(L,cflags_objc);
+            break;
+        case BS_objcc:
+            lua_pushvalue(L,cflags_objcc);
+            break;
+        default:
+            lua_pushstring(L,"");
+            break;
         }
-        lua_pop(L,1); // fw
-    }
-
-    if( iswin )
-    {
-        lua_getfield(L,inst,"def_file");
-        const int def_file = lua_gettop(L);
-        if( !lua_isnil(L,-1) && strcmp(lua_tostring(L,-1),".") != 0 )
+        lua_pushvalue(L,defines);
+        lua_pushvalue(L,includes);
+        const int usesPch = !lua_isnil(L,pch);
+        if( usesPch && toolchain == BS_msvc )
+        {
+            // the header is only included, not precompiled; /Yc requires a source file which includes it
+            lua_pushfstring(L," /FI\"%s\" %s", bs_denormalize_path(lua_tostring(L,pch)), lua_tostring(L,-1));
+            lua_replace(L,-2);
+        }else if( usesPch )
         {
-            lua_pushvalue(L,ldflags);
-            lua_pushstring(L," ");
-            if( *lua_tostring(L,def_file) != '/' )
+            // the header is compiled once per language with the same flags as the sources, and each object
+            // file depends on it, so no source is compiled before the header
+            lua_rawgeti(L,pchjobs,lang);
+            if( lua_isnil(L,-1) )
             {
-                // relative path
-                addPath(L,absDir,def_file);
-                lua_replace(L,def_file);
+                lua_pop(L,1);
+                int k;
+                for( k = 0; k < 5; k++ )
+                    lua_pushvalue(L,-5); // cmd, cflags, lang flags, defines, includes
+                lua_concat(L,5);
+                const int pchcmd = lua_gettop(L);
+                addPath(L,rootOutDir,relDir);
+                lua_pushstring(L,"/");
+                lua_getfield(L,inst,"#decl");
+                lua_getfield(L,-1,"#name");
+                lua_replace(L,-2);
+                lua_concat(L,3);
+                pchjob(L,inst,pch,lua_gettop(L),lang,toolchain,pchcmd);
+                lua_replace(L,pchcmd);
+                lua_pop(L,1); // outbase
+                lua_pushvalue(L,-1);
+                lua_rawseti(L,pchjobs,lang);
+                lua_pushvalue(L,-1);
+                addjob(L); // eats the copy of the job
             }
-            if(ismsvc)
-                lua_pushfstring(L," /def:\"%s\" ", bs_denormalize_path(lua_tostring(L,def_file)) );
-            else
-                lua_pushfstring(L," \"%s\" ", bs_denormalize_path(lua_tostring(L,def_file)) );
-            lua_concat(L,3);
-            lua_replace(L,ldflags);
+            const int pj = lua_gettop(L);
+            lua_getfield(L,pj,"outputs");
+            lua_rawgeti(L,-1,1);
+            addfile(L,job,"inputs",lua_gettop(L));
+            lua_pop(L,2); // outputs, gch
+            lua_getfield(L,job,"deps");
+            lua_pushvalue(L,pj);
+            append(L,-2);
+            lua_pop(L,1); // deps
+            lua_getfield(L,pj,"#pchbase");
+            lua_pushfstring(L," -include \"%s\" %s", bs_denormalize_path(lua_tostring(L,-1)), lua_tostring(L,-3));
+            lua_replace(L,-4); // includes
+            lua_pop(L,2); // pj, pchbase
+        }
+        switch(toolchain)
+        {
+        case BS_gcc:
+        case BS_clang:
+            // let the compiler write the included headers to a depfile next to the object file
+            lua_pushfstring(L,"%s.d", bs_denormalize_path(lua_tostring(L,out) ) );
+            lua_pushfstring(L," -MD -MF \"%s\" -c -o ", lua_tostring(L,-1) );
+            lua_insert(L,-2);
+            lua_setfield(L,job,"depfile");
+            lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,out) ) );
+            lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,src) ) );
+            break;
+        case BS_msvc:
+            lua_pushstring(L," /nologo /c /Fo");
+            lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,out) ) );
+            lua_pushfstring(L,"\"%s\" ", bs_denormalize_path(lua_tostring(L,src) ) );
+            break;
+        default:
+            lua_pushstring(L,"");
+            break;
+        }
+        if( ( toolchain == BS_gcc || toolchain == BS_clang ) && !usesPch )
+        {
+            // the cache key includes the command without the paths of the object file and depfile;
+            // the content of a precompiled header is not known here, so these objects are not cached
+            int j;
+            for( j = 0; j < 5; j++ )
+                lua_pushvalue(L,-8); // cmd, cflags, lang flags, defines, includes
+            lua_pushvalue(L,-6); // src
+            lua_concat(L,6);
+            lua_setfield(L,job,"cachecmd");
         }
-        lua_pop(L,1);// def_file
+        lua_concat(L,8);
+        lua_replace(L,cmd);
+        lua_setfield(L,job,"cmd"); // eats cmd
+        addjob(L); // eats job
+        lua_pop(L,3); // file, source, dest
     }
+    lua_pop(L,3); // sources, pch, pchjobs
 
-    //  TODO: lib_files
+    lua_pop(L,12); // outlist, binst, rootOutDir...relDir, cflags...includes
 
-    lua_pop(L,1); // absDir
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static time_t renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int toolchain, int resKind)
+static void renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int toolchain, int resKind, int job)
 {
     // BS_ObjectFiles: list of file names
     // BS_StaticLib, BS_DynamicLib, BS_Executable: one file name
     // BS_Mixed: list of tables
+    // the rendered files are added to the inputs of job
 
     lua_getfield(L,list,"#kind");
     const int k = lua_tointeger(L,-1);
     lua_pop(L,1); // kind
 
-    time_t srcExists = 0;
-
     size_t i;
     switch(k)
     {
@@ -749,9 +2248,7 @@ static time_t renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int
             lua_rawgeti(L,list,i);
             const int sublist = lua_gettop(L);
             assert( lua_istable(L,sublist) );
-            const time_t exists = renderobjectfiles(L,sublist,out, buf, toolchain, resKind);
-            if( exists > srcExists )
-                srcExists = exists;
+            renderobjectfiles(L,sublist,out, buf, toolchain, resKind, job);
             lua_pop(L,1); // sublist
         }
         break;
@@ -760,9 +2257,7 @@ static time_t renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int
         {
             lua_rawgeti(L,list,i);
             const int path = lua_gettop(L);
-            const time_t exists = bs_exists(lua_tostring(L,path));
-            if( exists > srcExists )
-                srcExists = exists;
+            addfile(L,job,"inputs",path);
             if( buf )
             {
                 lua_pushvalue(L,buf);
@@ -789,9 +2284,7 @@ static time_t renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int
                 lua_concat(L,2); // the name of the import library is xyz.dll.lib
             }
 
-            const time_t exists = bs_exists(lua_tostring(L,path));
-            if( exists > srcExists )
-                srcExists = exists;
+            addfile(L,job,"inputs",path);
 
             if( buf )
             {
@@ -808,7 +2301,6 @@ static time_t renderobjectfiles(lua_State* L, int list, FILE* out, int buf, int
         // ignore
         break;
     }
-    return srcExists;
 }
 
 static int makeCopyOfLibs(lua_State* L, int inlist)
@@ -862,7 +2354,7 @@ static int makeCopyOfLibs(lua_State* L, int inlist)
     return hasLibs;
 }
 
-static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
+static void link(lua_State* L, int inst, const BSGraphNode* node, int builtins, int inlist, int resKind)
 {
     assert( resKind == BS_Executable || resKind == BS_DynamicLib || resKind == BS_StaticLib );
 
@@ -871,108 +2363,77 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
-    lua_getfield(L,inst,"to_host");
-    const int to_host = lua_toboolean(L,-1);
-    lua_pop(L,1);
-
-    const int toolchain = bs_getToolchain(L,binst,to_host);
-    if( to_host )
-        lua_getfield(L,binst,"host_os");
-    else
-        lua_getfield(L,binst,"target_os");
-    const int win32 = strcmp(lua_tostring(L,-1),"win32") == 0 || strcmp(lua_tostring(L,-1),"winrt") == 0;
-    const int mac = strcmp(lua_tostring(L,-1),"darwin") == 0 || strcmp(lua_tostring(L,-1),"macos") == 0;
-    lua_pop(L,1);
-
-    lua_getfield(L,binst,"#ctdefaults");
-    if( to_host )
-        lua_getfield(L,binst,"host_toolchain");
-    else
-        lua_getfield(L,binst,"target_toolchain");
-    lua_rawget(L,-2);
-    lua_replace(L,-2);
-    const int ctdefaults = lua_gettop(L);
-
-    lua_getfield(L,binst,"root_build_dir");
-    const int rootOutDir = lua_gettop(L);
-
-    bs_getModuleVar(L,inst,"#rdir");
-    const int relDir = lua_gettop(L);
+    const int to_host = node->toHost;
+    const int toolchain = node->toolchain;
+    const int win32 = node->os == BS_windows;
+    const int mac = node->os == BS_mac;
+    // clang on windows uses the lib.exe compatible llvm-lib.exe tool
+    const int ismsvc = toolchain == BS_msvc || (win32 && toolchain == BS_clang);
 
     lua_pushstring(L,"");
     const int ldflags = lua_gettop(L);
+    addflags(L,&node->flags[BS_ldflags],ldflags);
+    if( win32 && node->defFile )
+    {
+        lua_pushvalue(L,ldflags);
+        lua_pushstring(L," ");
+        if(ismsvc)
+            lua_pushfstring(L," /def:\"%s\" ", bs_denormalize_path(node->defFile) );
+        else
+            lua_pushfstring(L," \"%s\" ", bs_denormalize_path(node->defFile) );
+        lua_concat(L,3);
+        lua_replace(L,ldflags);
+    }
+
+    int i;
     lua_pushstring(L,"");
     const int lib_dirs = lua_gettop(L);
+    for( i = 0; i < node->flags[BS_lib_dirs].count; i++ )
+    {
+        lua_pushvalue(L,lib_dirs);
+        if(ismsvc)
+            lua_pushfstring(L," /libpath:\"%s\" ", bs_denormalize_path(node->flags[BS_lib_dirs].items[i]) );
+        else
+            lua_pushfstring(L," -L\"%s\" ", bs_denormalize_path(node->flags[BS_lib_dirs].items[i]) );
+        lua_concat(L,2);
+        lua_replace(L,lib_dirs);
+    }
+
     lua_pushstring(L,"");
     const int lib_names = lua_gettop(L);
+    for( i = 0; i < node->flags[BS_lib_names].count; i++ )
+    {
+        lua_pushvalue(L,lib_names);
+        if(ismsvc)
+            lua_pushfstring(L," %s.lib ", node->flags[BS_lib_names].items[i]);
+        else
+            lua_pushfstring(L," -l%s ", node->flags[BS_lib_names].items[i]);
+        lua_concat(L,2);
+        lua_replace(L,lib_names);
+    }
+
+    //  TODO: lib_files
     lua_pushstring(L,"");
     const int lib_files = lua_gettop(L);
+
     lua_pushstring(L,"");
     const int frameworks = lua_gettop(L);
-
-    if( !lua_isnil(L,ctdefaults) )
-        addall2(L,ctdefaults,ldflags,lib_dirs,lib_names,lib_files,frameworks,
-                toolchain == BS_msvc || (win32 && toolchain == BS_clang), mac, win32);
-
-    addall2(L,inst,ldflags,lib_dirs,lib_names,lib_files,frameworks,
-            toolchain == BS_msvc || (win32 && toolchain == BS_clang), mac, win32);
-            // clang on windows uses the lib.exe compatible llvm-lib.exe tool
-
-    addPath(L,rootOutDir,relDir);
-    lua_pushvalue(L,-1);
-    lua_pushstring(L,"/");
-
-    if( !win32 && ( resKind == BS_DynamicLib || resKind == BS_StaticLib ) )
-        lua_pushstring(L,"lib"); // if not on Windows prefix the lib name with "lib"
-    else
-        lua_pushstring(L,"");
-    lua_getfield(L,inst,"name");
-    if( lua_isnil(L,-1) || lua_objlen(L,-1) == 0 )
+    for( i = 0; mac && i < node->flags[BS_frameworks].count; i++ )
     {
-        lua_pop(L,1);
-        lua_getfield(L,inst,"#decl");
-        lua_getfield(L,-1,"#name");
-        lua_replace(L,-2);
+        lua_pushvalue(L,frameworks);
+        lua_pushfstring(L," -framework %s ", node->flags[BS_frameworks].items[i]);
+        lua_concat(L,2);
+        lua_replace(L,frameworks);
     }
-    lua_concat(L,4);
-    lua_replace(L,-2);
-    const int outbase = lua_gettop(L);
 
-    lua_pushvalue(L,outbase);
-    switch(resKind)
-    {
-    case BS_DynamicLib:
-        if( win32 )
-            lua_pushstring(L,".dll");
-        else if(mac)
-            lua_pushstring(L,".dylib");
-        else
-            lua_pushstring(L,".so");
-        break;
-    case BS_Executable:
-        if( win32 )
-            lua_pushstring(L,".exe");
-        else
-            lua_pushstring(L,"");
-        break;
-    case BS_StaticLib:
-        if( win32 )
-            lua_pushstring(L,".lib");
-        else
-            lua_pushstring(L,".a");
-        break;
-    }
-    lua_concat(L,2);
+    assert( node->outputs.count == 1 );
+    lua_pushstring(L,node->outputs.items[0]);
     const int outfile = lua_gettop(L);
 
     lua_pushvalue(L,outfile);
     lua_setfield(L,inst,"#product");
 
-    const time_t outExists = bs_exists(lua_tostring(L,outfile));
-
-    lua_pushvalue(L,outbase);
-    lua_pushstring(L,".rsp");
-    lua_concat(L,2);
+    lua_pushfstring(L,"%s.rsp",lua_tostring(L,outfile));
     const int rsp = lua_gettop(L);
 
     int useRsp = 1;
@@ -1022,6 +2483,22 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
     const int cmd = lua_gettop(L);
 
     prefixCmd(L, cmd, binst, to_host);
+    lua_pushvalue(L,cmd);
+    const int tool = lua_gettop(L);
+
+    // thin archives only reference the object files and are only supported by GNU ar (and llvm-ar) on Linux;
+    // incremental updates work with any ar, but not with lib.exe
+    int thin = 0, incremental = 0;
+    if( resKind == BS_StaticLib && toolchain != BS_msvc && !win32 )
+    {
+        lua_getfield(L,inst,"archive_mode");
+        if( lua_isstring(L,-1) )
+        {
+            thin = strcmp(lua_tostring(L,-1),"thin") == 0 && !mac;
+            incremental = strcmp(lua_tostring(L,-1),"incremental") == 0;
+        }
+        lua_pop(L,1);
+    }
 
     switch(toolchain)
     {
@@ -1046,8 +2523,8 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
             break;
         case BS_StaticLib:
             if( !mac )
-                lua_pushfstring(L,"%s r \"%s\" @\"%s\"",
-                            lua_tostring(L,cmd),
+                lua_pushfstring(L,"%s %s \"%s\" @\"%s\"",
+                            lua_tostring(L,cmd), thin ? "rcT" : "r",
                             bs_denormalize_path(lua_tostring(L,outfile)),
                             bs_denormalize_path(lua_tostring(L,rsp)) );
             else
@@ -1088,8 +2565,8 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
                                 lua_tostring(L,cmd),
                                 bs_denormalize_path(lua_tostring(L,outfile)) );
             }else
-                lua_pushfstring(L,"%s r \"%s\" @\"%s\"",
-                                lua_tostring(L,cmd),
+                lua_pushfstring(L,"%s %s \"%s\" @\"%s\"",
+                                lua_tostring(L,cmd), thin ? "rcT" : "r",
                                 bs_denormalize_path(lua_tostring(L,outfile)),
                                 bs_denormalize_path(lua_tostring(L,rsp)) );
             break;
@@ -1144,15 +2621,20 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
 
     lua_pop(L,1); // outlist
 
-    time_t srcExists = 0;
+    const int job = newjob(L,inst, resKind == BS_Executable ? BS_LinkExe :
+                                   resKind == BS_DynamicLib ? BS_LinkDll : BS_LinkLib );
+    addfile(L,job,"outputs",outfile);
 
     if( useRsp )
     {
+        lua_pushvalue(L,rsp);
+        lua_setfield(L,job,"rsp"); // the rsp content is part of the command
+
         FILE* f = bs_fopen(bs_denormalize_path(lua_tostring(L,rsp)),"w");
         if( f == NULL )
             luaL_error(L, "cannot open rsp file for writing: %s", lua_tostring(L,rsp));
 
-        srcExists = renderobjectfiles(L,inlist,f,0, toolchain, resKind);
+        renderobjectfiles(L,inlist,f,0, toolchain, resKind, job);
 
         if( resKind != BS_StaticLib )
         {
@@ -1167,103 +2649,39 @@ static void link(lua_State* L, int inst, int builtins, int inlist, int resKind)
     }else
     {
         // luaL_Buffer doesn't work; luaL_pushresult produces "attempt to concatenate a table value"
-        srcExists = renderobjectfiles(L,inlist,0,cmd, toolchain, resKind);
+        renderobjectfiles(L,inlist,0,cmd, toolchain, resKind, job);
         // TODO lib_files
     }
 
-    if( !outExists || outExists < srcExists )
+    if( thin )
     {
-        fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-        fflush(stdout);
-        if( runcmd(L,lua_tostring(L,cmd)) != 0 ) // works for all gcc, clang and cl
-        {
-            // stderr was already written to the console
-            lua_pushnil(L);
-            lua_error(L);
-        }
-    }
-    lua_pop(L,1); // cmd
-
-    lua_pop(L,12); // binst, rootOutDir, relDir, ctdefaults, ldflags...frameworks, outbase, out, rsp
-    const int bottom = lua_gettop(L);
-    assert( top == bottom );
-}
-
-static void builddeps(lua_State* L, int inst)
-{
-    const int top = lua_gettop(L);
-
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
+        // ar would keep references to objects which are no longer inputs
+        lua_pushboolean(L,1);
+        lua_setfield(L,job,"clean");
+    }else if( incremental )
     {
-        lua_pop(L,1); // nil
-        return;
+        lua_pushvalue(L,tool);
+        lua_setfield(L,job,"artool");
     }
 
-    lua_createtable(L,0,0);
-    lua_pushinteger(L,BS_Mixed);
-    lua_setfield(L,-2,"#kind");
-    const int out = lua_gettop(L);
-
-    const int ndeps = lua_objlen(L,deps);
-    int nout = 0;
-    int i;
-    for( i = 1; i <= ndeps; i++ )
-    {
-        // TODO: check for circular deps
-        lua_pushcfunction(L, bs_run);
-        lua_rawgeti(L,deps,i);
-        lua_call(L,1,1);
-        // stack: dep_inst
-
-        lua_getfield(L,-1,"#out");
-        lua_replace(L,-2);
-        // stack: subout
-
-        const int subout = lua_gettop(L);
-        int k = BS_Nothing;
-        if( lua_istable(L,subout) )
-        {
-            lua_getfield(L,-1,"#kind");
-            k = lua_tointeger(L,-1);
-            lua_pop(L,1);
-        }
-
-        if( k == BS_Mixed )
-        {
-            const int nsubout = lua_objlen(L,subout);
-            int j;
-            for( j = 1; j <= nsubout; j++ )
-            {
-                lua_rawgeti(L,subout,j);
-
-                lua_getfield(L,-1,"#kind");
-                const int kk = lua_tointeger(L,-1);
-                lua_pop(L,1);
-                assert( kk != BS_Mixed);
+    // the job is only run if outfile is older than one of the inputs
+    lua_pushvalue(L,cmd);
+    lua_setfield(L,job,"cmd");
+    addjob(L); // eats job
+    lua_pop(L,2); // cmd, tool
 
-                lua_rawseti(L,out,++nout);
-            }
-            lua_pop(L,1); // subout
-        }else if( lua_istable(L,subout) )
-            lua_rawseti(L,out,++nout); // eats subout
-        else
-            lua_pop(L,1);
-    }
-    lua_setfield(L,inst,"#out");
-    lua_pop(L,1); // deps
+    lua_pop(L,8); // binst, ldflags...frameworks, outfile, rsp
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void library(lua_State* L,int inst, int cls, int builtins)
+static void library(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,inst,"#out");
     const int inlist = lua_gettop(L); // inlist is of kind BS_Mixed and doesn't have items of kind BS_Mixed
     assert( lua_istable(L,inlist) );
-    compilesources(L,inst,builtins, inlist);
+    compilesources(L,inst,node,builtins,inlist);
 
     lua_getfield(L,inst,"lib_type");
     const int lib_type = ( strcmp(lua_tostring(L,-1),"shared") == 0 ? BS_DynamicLib : BS_StaticLib );
@@ -1291,7 +2709,7 @@ static void library(lua_State* L,int inst, int cls, int builtins)
     // in case a dynamic lib is to be generated by link(), inlist also includes the libs inherited from the initial inlist
 
     // link sets out to a new table of kind BS_DynamicLib or BS_StaticLib; inlist is not passed out
-    link(L,inst,builtins,inlist,lib_type);
+    link(L,inst,node,builtins,inlist,lib_type);
 
     lua_pop(L,1); // inlist
     assert( top == lua_gettop(L) );
@@ -1299,13 +2717,13 @@ static void library(lua_State* L,int inst, int cls, int builtins)
     // passes on one lib (either BS_DynamicLib or BS_StaticLib), or a BS_Mixed of libs
 }
 
-static void executable(lua_State* L,int inst, int cls, int builtins)
+static void executable(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,inst,"#out");
     const int inlist = lua_gettop(L);
     assert( lua_istable(L,inlist) );
-    compilesources(L,inst,builtins,inlist);
+    compilesources(L,inst,node,builtins,inlist);
 
     lua_getfield(L,inst,"#out");
     if( makeCopyOfLibs(L,inlist) )
@@ -1317,20 +2735,20 @@ static void executable(lua_State* L,int inst, int cls, int builtins)
     }else
         lua_replace(L,inlist); // make BS_ObjectFiles from compile output the new inlist
 
-    link(L,inst,builtins,inlist,BS_Executable);
+    link(L,inst,node,builtins,inlist,BS_Executable);
     lua_pop(L,1); // mixed
     assert( top == lua_gettop(L) );
 
     // passes on one BS_Executable
 }
 
-static void sourceset(lua_State* L,int inst, int cls, int builtins)
+static void sourceset(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,inst,"#out");
     const int inlist = lua_gettop(L);
     assert( lua_istable(L,inlist) );
-    compilesources(L,inst,builtins,inlist);
+    compilesources(L,inst,node,builtins,inlist);
     // #out is now a BS_ObjectFiles
 
     if( makeCopyOfLibs(L,inlist) )
@@ -1348,12 +2766,12 @@ static void sourceset(lua_State* L,int inst, int cls, int builtins)
     assert( top == lua_gettop(L) );
 }
 
-static void group(lua_State* L,int inst, int cls, int builtins)
+static void group(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     // NOP. deps were already built and result handed to inst.#out
 }
 
-static void config(lua_State* L,int inst, int cls, int builtins)
+static void config(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     // NOP
 }
@@ -1456,19 +2874,20 @@ static BSPathStatus apply_arg_expansion(lua_State* L,int inst, int builtins, con
     return BS_OK;
 }
 
-static void callLua(lua_State* L, int builtins, int inst, int app, int script, const char* source)
+static void callLua(lua_State* L, int builtins, int inst, int app, int script, const char* source, int job,
+                    int hasOutputs)
 {
 #ifdef BS_USE_LINKED_LUA
     lua_getfield(L,inst,"args");
     const int arglist = lua_gettop(L);
 
-    int argc = 1 + 1 + lua_objlen(L,arglist);
-    char * argv[30];
-    if( argc >= 30 )
-        luaL_error(L,"script requires more arguments than supported: %s", lua_tostring(L,script));
-    argv[0] = (char*)bs_denormalize_path(lua_tostring(L,app));
-    argv[1] = (char*)bs_denormalize_path(lua_tostring(L,script));
-    argv[argc] = 0;
+    const int argc = 1 + 1 + lua_objlen(L,arglist);
+    lua_createtable(L,argc,0);
+    const int argv = lua_gettop(L);
+    lua_pushstring(L,bs_denormalize_path(lua_tostring(L,app)));
+    lua_rawseti(L,argv,1);
+    lua_pushstring(L,bs_denormalize_path(lua_tostring(L,script)));
+    lua_rawseti(L,argv,2);
 
     size_t j;
     for( j = 1; j <= lua_objlen(L,arglist); j++ )
@@ -1476,17 +2895,12 @@ static void callLua(lua_State* L, int builtins, int inst, int app, int script, c
         lua_rawgeti(L,arglist,j);
         if( apply_arg_expansion(L,inst,builtins,source,lua_tostring(L,-1)) != BS_OK )
             luaL_error(L,"cannot do source expansion, invalid placeholders in string: %s", lua_tostring(L,-1));
-        lua_replace(L,-2);
-        argv[j+1] = (char*)lua_tostring(L,-1);
-    }
-    if( lua_main(argc,argv) != 0 )
-    {
-        // stderr was already written to the console
-        lua_pushnil(L);
-        lua_error(L);
+        lua_replace(L,-2);
+        lua_rawseti(L,argv,j+2);
     }
+    lua_setfield(L,job,"argv");
 
-    lua_pop(L,1 + lua_objlen(L,arglist)); // arglist, args
+    lua_pop(L,1); // arglist
 #else
     lua_pushstring(L,"");
     const int args = lua_gettop(L);
@@ -1516,25 +2930,31 @@ static void callLua(lua_State* L, int builtins, int inst, int app, int script, c
                     bs_denormalize_path(lua_tostring(L,app) ),
                     bs_denormalize_path(lua_tostring(L,script) ),
                     lua_tostring(L,args) );
-    const int cmd = lua_gettop(L);
-
-    fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-    fflush(stdout);
-    if( runcmd(L,lua_tostring(L,cmd)) != 0 )
+    lua_setfield(L,job,"cmd");
+    lua_pop(L,1); // args
+#endif
+    lua_pushvalue(L,script);
+    addfile(L,job,"inputs",lua_gettop(L));
+    lua_pop(L,1); // script
+    if( source )
     {
-        // stderr was already written to the console
-        lua_pushnil(L);
-        lua_error(L);
+        lua_pushstring(L,source);
+        addfile(L,job,"inputs",lua_gettop(L));
+        lua_pop(L,1); // source
+    }
+    if( !hasOutputs )
+    {
+        // scripts are always run if their outputs are not known
+        lua_pushboolean(L,1);
+        lua_setfield(L,job,"always");
     }
-    lua_pop(L,2); // args, cmd
-#endif
 }
 
-static void script(lua_State* L,int inst, int cls, int builtins)
+static void script(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
-    lua_createtable(L,0,0);
+    lua_createtable(L,node->outputs.count,0);
     const int out = lua_gettop(L);
     lua_pushinteger(L,BS_SourceFiles);
     lua_setfield(L,out,"#kind");
@@ -1544,34 +2964,12 @@ static void script(lua_State* L,int inst, int cls, int builtins)
     bs_getModuleVar(L,inst,"#dir");
     const int absDir = lua_gettop(L);
 
-    lua_getfield(L,builtins,"#inst");
-    lua_getfield(L,-1,"root_build_dir");
-    lua_replace(L,-2);
-    bs_getModuleVar(L,inst,"#rdir");
-    addPath(L,-2,-1); // root_build_dir, rdir, root_build_dir+rdir
-    lua_replace(L,-3);
-    lua_pop(L,1);
-    const int outDir = lua_gettop(L);
-
-    lua_getfield(L,inst,"outputs");
-    const int outputs = lua_gettop(L);
     size_t j;
-    for( j = 1; j <= lua_objlen(L,outputs); j++ )
+    for( j = 0; j < node->outputs.count; j++ )
     {
-        lua_rawgeti(L,outputs,j);
-        const int src = lua_gettop(L);
-
-        if( *lua_tostring(L,src) != '/' )
-        {
-            addPath(L,outDir,src);
-            lua_replace(L,src);
-        }else
-            luaL_error(L,"the 'outputs' field requires relative paths");
-
-        lua_rawseti(L,out,j);
+        lua_pushstring(L,node->outputs.items[j]);
+        lua_rawseti(L,out,j+1);
     }
-    lua_pop(L,2); // outDir, outputs
-
 
     lua_getfield(L,inst,"script");
     const int script = lua_gettop(L);
@@ -1585,7 +2983,15 @@ static void script(lua_State* L,int inst, int cls, int builtins)
     bs_thisapp2(L);
     const int app = lua_gettop(L);
 
-    callLua(L,builtins,inst,app,script,0);
+    const int job = newjob(L,inst,BS_RunLua);
+    callLua(L,builtins,inst,app,script,0,job,0);
+    for( j = 1; j <= lua_objlen(L,out); j++ )
+    {
+        lua_rawgeti(L,out,j);
+        addfile(L,job,"outputs",lua_gettop(L));
+        lua_pop(L,1);
+    }
+    addjob(L); // eats job
 
     lua_pop(L,4); // out, abDir, script, app
 
@@ -1593,22 +2999,27 @@ static void script(lua_State* L,int inst, int cls, int builtins)
     assert( top == bottom );
 }
 
-static void runforeach(lua_State* L,int inst, int cls, int builtins)
+static void runforeach(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
-#if 0
     lua_createtable(L,0,0);
-    lua_pushinteger(L,BS_Nothing);
-    lua_setfield(L,-2,"#kind");
-#else
-    lua_pushnil(L);
-#endif
-    lua_setfield(L,inst,"#out");
+    const int out = lua_gettop(L);
+    lua_pushinteger(L,BS_SourceFiles);
+    lua_setfield(L,out,"#kind");
 
     bs_getModuleVar(L,inst,"#dir");
     const int absDir = lua_gettop(L);
 
+    lua_getfield(L,builtins,"#inst");
+    lua_getfield(L,-1,"root_build_dir");
+    lua_replace(L,-2);
+    bs_getModuleVar(L,inst,"#rdir");
+    addPath(L,-2,-1); // root_build_dir, rdir, root_build_dir+rdir
+    lua_replace(L,-3);
+    lua_pop(L,1);
+    const int outDir = lua_gettop(L);
+
     lua_getfield(L,inst,"script");
     const int script = lua_gettop(L);
     if( *lua_tostring(L,script) != '/' )
@@ -1621,25 +3032,53 @@ static void runforeach(lua_State* L,int inst, int cls, int builtins)
     bs_thisapp2(L);
     const int app = lua_gettop(L);
 
-    size_t i;
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    // shared by all iterations, so the script is compiled only once
+    lua_createtable(L,0,1);
+    const int chunk = lua_gettop(L);
+
+    lua_getfield(L,inst,"outputs");
+    const int outputs = lua_gettop(L);
+
+    size_t i, j;
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
+
+        const int job = newjob(L,inst,BS_RunLua);
+        callLua(L,builtins,inst,app,script,lua_tostring(L,source),job,lua_objlen(L,outputs) != 0);
+        lua_pushvalue(L,chunk);
+        lua_setfield(L,job,"chunk");
+        for( j = 1; j <= lua_objlen(L,outputs); j++ )
         {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
+            // the outputs of each iteration are declared with source placeholders like those of Copy
+            lua_rawgeti(L,outputs,j);
+            const int to = lua_gettop(L);
+            if( bs_apply_source_expansion(lua_tostring(L,source),lua_tostring(L,to), 1) != BS_OK )
+                luaL_error(L,"cannot do source expansion, invalid placeholders in path: %s", lua_tostring(L,to));
+            lua_pushstring(L,bs_global_buffer());
+            lua_replace(L,to);
+            if( *lua_tostring(L,to) != '/' )
+            {
+                addPath(L,outDir,to);
+                lua_replace(L,to);
+            }else
+                luaL_error(L,"the 'outputs' field requires relative paths");
+            addfile(L,job,"outputs",to);
+            append(L,out);
         }
-
-        callLua(L,builtins,inst,app,script,lua_tostring(L,source));
+        addjob(L); // eats job
 
         lua_pop(L,1); // source
     }
 
-    lua_pop(L,4); // abDir, script, app, sources
+    if( lua_objlen(L,out) == 0 )
+        lua_pushnil(L);
+    else
+        lua_pushvalue(L,out);
+    lua_setfield(L,inst,"#out");
+
+    lua_pop(L,7); // out, abDir, outDir, script, app, chunk, outputs
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
@@ -1721,7 +3160,7 @@ int bs_runmoc(lua_State* L)
     // check if there is a {{source_dir}}/{{source_name_part}}_p.h and - if true - include it in the generated file
     lua_pushstring(L,"{{source_dir}}/{{source_name_part}}_p.h");
     bs_apply_source_expansion(lua_tostring(L,source),lua_tostring(L,-1), 0);
-    const int includePrivateHeader = bs_exists2(bs_global_buffer());
+    const int includePrivateHeader = bs_exists2(bs_global_buffer()) != 0;
     lua_pop(L,1);
 
 #if defined(_WIN32) && !defined(BS_ALT_RUNCMD)
@@ -1748,21 +3187,34 @@ int bs_runmoc(lua_State* L)
     }
     const int cmd = lua_gettop(L);
 
-    const time_t srcExists = bs_exists(lua_tostring(L,source));
-    const time_t outExists = bs_exists(lua_tostring(L,outFile));
-
-    if( !outExists || outExists < srcExists )
+    // only run if outfile is older than source; when called by the runner the product instance is passed as
+    // upvalue and the job is added to the job graph, otherwise it is run immediately
+    const int job = newjob(L, lua_istable(L,lua_upvalueindex(1)) ? lua_upvalueindex(1) : 0, BS_RunMoc);
+    addfile(L,job,"inputs",source);
+    addfile(L,job,"outputs",outFile);
+    lua_pushvalue(L,cmd);
+    lua_setfield(L,job,"cmd");
+    addarg(L,job,lua_tostring(L,MOC));
+    addarg(L,job,bs_denormalize_path(lua_tostring(L,source)));
+    addarg(L,job,"-o");
+    addarg(L,job,bs_denormalize_path(lua_tostring(L,outFile)));
+    for( i = DEFINES; i <= numOfArgs; i++ )
     {
-        fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-        fflush(stdout);
-        // only call if outfile is older than source
-        if( runcmd(L,lua_tostring(L,cmd)) != 0 )
-        {
-            // stderr was already written to the console
-            lua_pushnil(L);
-            lua_error(L);
-        }
+        addarg(L,job,"-D");
+        luaL_gsub(L,lua_tostring(L,i),"\\\"","\""); // as the shell reads it from the command
+        addarg(L,job,lua_tostring(L,-1));
+        lua_pop(L,1);
+    }
+    if( includePrivateHeader && lang == BS_header )
+    {
+        addarg(L,job,"-p");
+        bs_apply_source_expansion(lua_tostring(L,source),"{{source_dir}}", 0);
+        addarg(L,job,bs_global_buffer());
+        addarg(L,job,"-b");
+        bs_apply_source_expansion(lua_tostring(L,source),"{{source_name_part}}_p.h", 0);
+        addarg(L,job,bs_global_buffer());
     }
+    addjob(L); // eats job
 
     lua_pushvalue(L,outFile);
     lua_replace(L,source);
@@ -1772,7 +3224,38 @@ int bs_runmoc(lua_State* L)
     return 1;
 }
 
-static void runmoc(lua_State* L,int inst, int cls, int builtins)
+static int needsmoc(lua_State* L, const char* normalizedPath)
+{
+    // returns 0 if the header uses none of the macros which require moc; the result is kept as a scan record in
+    // the build state database as long as the header is unchanged
+    static const char* const macros[] = { "Q_OBJECT", "Q_GADGET", "Q_GADGET_EXPORT", "Q_NAMESPACE",
+                                          "Q_NAMESPACE_EXPORT", "Q_INTERFACES", 0 };
+    const BSTime t = bs_exists(normalizedPath);
+    BSDb* db = builddb(L);
+    BSDbScan scan;
+    int res;
+    if( db != 0 && t != 0 && bs_dbgetscan(db,normalizedPath,&scan) && scan.mtime == t )
+        res = ( scan.flags & BS_DbNeedsMoc ) != 0;
+    else
+    {
+        res = bs_findtoken(bs_denormalize_path(normalizedPath),macros);
+        if( res < 0 )
+            res = 1; // e.g. generated later; moc reports the error if the header is still missing
+        else
+        {
+            res = res != 0;
+            if( db != 0 && t != 0 )
+            {
+                scan.mtime = t;
+                scan.flags = res ? BS_DbNeedsMoc : 0;
+                bs_dbputscan(db,normalizedPath,&scan);
+            }
+        }
+    }
+    return res;
+}
+
+static void runmoc(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1783,9 +3266,6 @@ static void runmoc(lua_State* L,int inst, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,inst,"#out");
 
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -1815,37 +3295,28 @@ static void runmoc(lua_State* L,int inst, int cls, int builtins)
         lua_replace(L,mocPath);
     }
 
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
     int n = 0;
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    int i;
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
-        const int source = lua_gettop(L);
-        const int lang = bs_guessLang(lua_tostring(L,source));
-
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
+        const char* source = node->inputs.items[i];
+        const int lang = bs_guessLang(source);
 
-        lua_getfield(L,inst,"defines");
-        const int defs = lua_gettop(L);
+        if( lang == BS_header && !needsmoc(L,source) )
+            continue; // moc would generate an empty file, which only had to be compiled
 
-        lua_pushcfunction(L, bs_runmoc);
+        lua_pushvalue(L,inst);
+        lua_pushcclosure(L, bs_runmoc, 1);
         // MOC, INFILE, OUTDIR, DEFINES
         lua_pushstring(L,bs_denormalize_path(lua_tostring(L,mocPath)));
-        lua_pushstring(L,bs_denormalize_path(lua_tostring(L,source)));
+        lua_pushstring(L,bs_denormalize_path(source));
         lua_pushstring(L,bs_denormalize_path(lua_tostring(L,outDir)));
 
-        size_t j;
-        const size_t numOfDefs = lua_objlen(L,defs);
-        for( j = 1; j <= numOfDefs; j++ )
-        {
-            lua_rawgeti(L,defs,j);
-        }
+        int j;
+        const int numOfDefs = node->flags[BS_defines].count;
+        luaL_checkstack(L,numOfDefs,"too many defines");
+        for( j = 0; j < numOfDefs; j++ )
+            lua_pushstring(L,node->flags[BS_defines].items[j]);
 
         lua_call(L,3+numOfDefs,1);
 
@@ -1853,18 +3324,16 @@ static void runmoc(lua_State* L,int inst, int cls, int builtins)
             lua_rawseti(L,outlist,++n);
         else
             lua_pop(L,1); // return
-
-        lua_pop(L,2); // source, defs
     }
 
-    lua_pop(L,6); // outlist absDir binst outDir mocPath sources
+    lua_pop(L,4); // outlist binst outDir mocPath
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 
     // passes on one BS_SourceFiles
 }
 
-static void runrcc(lua_State* L,int inst, int cls, int builtins)
+static void runrcc(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1875,9 +3344,6 @@ static void runrcc(lua_State* L,int inst, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,inst,"#out");
 
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -1907,24 +3373,17 @@ static void runrcc(lua_State* L,int inst, int cls, int builtins)
         lua_replace(L,app);
     }
 
-    size_t i;
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    int i;
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
 
         lua_pushfstring(L,"%s/qrc_%s.cpp",lua_tostring(L,outDir), bs_filename(lua_tostring(L,source)));
         const int outFile = lua_gettop(L);
 
         lua_pushvalue(L,outFile);
-        lua_rawseti(L,outlist,i);
+        lua_rawseti(L,outlist,i+1);
 
         int len = 0;
         const char* name = bs_path_part(lua_tostring(L,source),BS_baseName, &len);
@@ -1941,30 +3400,34 @@ static void runrcc(lua_State* L,int inst, int cls, int builtins)
         lua_replace(L,-2);
         const int cmd = lua_gettop(L);
 
-        const time_t srcExists = bs_exists(lua_tostring(L,source));
-        const time_t outExists = bs_exists(lua_tostring(L,outFile));
+        // only run if outfile is older than source or one of the files listed in it
+        const int job = newjob(L,inst,BS_RunRcc);
+        addfile(L,job,"inputs",source);
+        lua_pushvalue(L,source);
+        lua_setfield(L,job,"qrc");
+        addfile(L,job,"outputs",outFile);
+        lua_pushvalue(L,cmd);
+        lua_setfield(L,job,"cmd");
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,app)));
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,source)));
+        addarg(L,job,"-o");
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,outFile)));
+        addarg(L,job,"-name");
+        name = bs_path_part(lua_tostring(L,source),BS_baseName, &len);
+        lua_pushlstring(L,name,len);
+        addarg(L,job,lua_tostring(L,-1));
+        lua_pop(L,1); // name
+        addjob(L); // eats job
 
-        if( !outExists || outExists < srcExists )
-        {
-            fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-            fflush(stdout);
-            // only call if outfile is older than source
-            if( runcmd(L,lua_tostring(L,cmd)) != 0 )
-            {
-                // stderr was already written to the console
-                lua_pushnil(L);
-                lua_error(L);
-            }
-        }
         lua_pop(L,3); // cmd, source, outFile
     }
 
-    lua_pop(L,6); // outlist absDir binst outDir app sources
+    lua_pop(L,4); // outlist binst outDir app
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void runuic(lua_State* L,int inst, int cls, int builtins)
+static void runuic(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1975,9 +3438,6 @@ static void runuic(lua_State* L,int inst, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,inst,"#out");
 
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -2007,18 +3467,11 @@ static void runuic(lua_State* L,int inst, int cls, int builtins)
         lua_replace(L,app);
     }
 
-    size_t i;
-    lua_getfield(L,inst,"sources");
-    const int sources = lua_gettop(L);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    int i;
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
 
         int len = 0;
         const char* name = bs_path_part(lua_tostring(L,source),BS_baseName, &len);
@@ -2037,30 +3490,27 @@ static void runuic(lua_State* L,int inst, int cls, int builtins)
                         bs_denormalize_path(lua_tostring(L,outFile)));
         const int cmd = lua_gettop(L);
 
-        const time_t srcExists = bs_exists(lua_tostring(L,source));
-        const time_t outExists = bs_exists(lua_tostring(L,outFile));
+        // only run if outfile is older than source
+        const int job = newjob(L,inst,BS_RunUic);
+        addfile(L,job,"inputs",source);
+        addfile(L,job,"outputs",outFile);
+        lua_pushvalue(L,cmd);
+        lua_setfield(L,job,"cmd");
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,app)));
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,source)));
+        addarg(L,job,"-o");
+        addarg(L,job,bs_denormalize_path(lua_tostring(L,outFile)));
+        addjob(L); // eats job
 
-        if( !outExists || outExists < srcExists )
-        {
-            fprintf(stdout,"%s\n", lua_tostring(L,cmd));
-            fflush(stdout);
-            // only call if outfile is older than source
-            if( runcmd(L,lua_tostring(L,cmd)) != 0 )
-            {
-                // stderr was already written to the console
-                lua_pushnil(L);
-                lua_error(L);
-            }
-        }
         lua_pop(L,3); // cmd, source, outFile
     }
 
-    lua_pop(L,6); // outlist absDir binst outDir app sources
+    lua_pop(L,4); // outlist binst outDir app
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void copy(lua_State* L,int inst, int cls, int builtins)
+static void copy(lua_State* L,int inst, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -2081,16 +3531,13 @@ static void copy(lua_State* L,int inst, int cls, int builtins)
 
     size_t i;
 
-    lua_getfield(L,inst,"sources");
+    lua_createtable(L,node->inputs.count,0);
     const int sources = lua_gettop(L);
-    lua_createtable(L,lua_objlen(L,sources),0);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        // copy all sources to a new table to avoid changing the original sources
-        lua_rawgeti(L,sources,i);
-        lua_rawseti(L,-2,i);
+        lua_pushstring(L,node->inputs.items[i]);
+        lua_rawseti(L,sources,i+1);
     }
-    lua_replace(L,-2);
 
     lua_getfield(L,inst,"use_deps");
     const int use_deps = lua_gettop(L);
@@ -2125,6 +3572,20 @@ static void copy(lua_State* L,int inst, int cls, int builtins)
         luaL_error(L,"outputs in Copy instance '%s' cannot be empty", lua_tostring(L,-1));
     }
 
+    int mode = BS_CopyFile;
+    lua_getfield(L,inst,"link_mode");
+    if( lua_isstring(L,-1) )
+    {
+        const char* str = lua_tostring(L,-1);
+        if( strcmp(str,"hardlink") == 0 )
+            mode = BS_HardLink;
+        else if( strcmp(str,"reflink") == 0 )
+            mode = BS_RefLink;
+        else if( strcmp(str,"symlink") == 0 )
+            mode = BS_SymLink;
+    }
+    lua_pop(L,1); // link_mode
+
     for( i = 1; i <= lua_objlen(L,sources); i++ )
     {
         lua_rawgeti(L,sources,i);
@@ -2156,13 +3617,17 @@ static void copy(lua_State* L,int inst, int cls, int builtins)
                 luaL_error(L,"outputs in Copy instance '%s' require relative paths", lua_tostring(L,-1));
             }
 
-            const time_t fromExists = bs_exists(lua_tostring(L,from));
-            const time_t toExists = bs_exists(lua_tostring(L,to));
-            if( !toExists || toExists < fromExists )
-            {
-                if( copycmd(L,lua_tostring(L,to), lua_tostring(L,from) ))
-                    luaL_error(L,"cannot copy %s to %s", lua_tostring(L,from), lua_tostring(L,to));
-            }
+            // only copied if to is older than from
+            const int job = newjob(L,inst,BS_Copy);
+            addfile(L,job,"inputs",from);
+            addfile(L,job,"outputs",to);
+            lua_pushvalue(L,from);
+            lua_setfield(L,job,"from");
+            lua_pushvalue(L,to);
+            lua_setfield(L,job,"to");
+            lua_pushinteger(L,mode);
+            lua_setfield(L,job,"mode");
+            addjob(L); // eats job
 
             lua_pop(L,1); // to
         }
@@ -2251,47 +3716,19 @@ int bs_createBuildDirs(lua_State* L) // lua function; params: rootModuleDef, roo
     return 0;
 }
 
-static void precheckdeps(lua_State* L, int inst)
+int bs_precheck(lua_State* L) // args: graph, no returns
 {
-    const int top = lua_gettop(L);
-
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
-        return;
-
-    const int ndeps = lua_objlen(L,deps);
+    enum { GRAPH = 1 };
+    const BSGraph* g = bs_tograph(L,GRAPH);
     int i;
-    for( i = 1; i <= ndeps; i++ )
+    for( i = 0; i < g->count; i++ )
     {
-        // TODO: check for circular deps
-        lua_pushcfunction(L, bs_precheck);
-        lua_rawgeti(L,deps,i);
-        lua_call(L,1,0);
+        if( g->nodes[i].kind != BS_MessageProduct )
+            continue;
+        bs_graphinst(L,g,i);
+        message(L,lua_gettop(L),1);
+        lua_pop(L,1); // inst
     }
-    lua_pop(L,1); // deps
-    const int bottom = lua_gettop(L);
-    assert( top == bottom );
-}
-
-int bs_precheck(lua_State* L) // args: productinst, no returns
-{
-    const int inst = 1;
-
-    precheckdeps(L,inst);
-
-    lua_getmetatable(L,inst);
-    const int cls = lua_gettop(L);
-
-    lua_getglobal(L, "require");
-    lua_pushstring(L, "builtins");
-    lua_call(L,1,1);
-    const int builtins = lua_gettop(L);
-
-    if( isa( L, builtins, cls, "Message") )
-        message(L,inst,1);
-
-    lua_pop(L,2); // cls, builtins
     return 0;
 }
 
@@ -2360,63 +3797,181 @@ int bs_markActive(lua_State* L) // args: productinst, order, no returns
 }
 
 
-int bs_run(lua_State* L) // args: productinst, returns: inst
+static void planproduct(lua_State* L, const BSGraph* g, int node, int builtins)
 {
-    const int inst = 1;
+    const int top = lua_gettop(L);
+    const BSGraphNode* n = &g->nodes[node];
+
+    bs_graphinst(L,g,node);
+    const int inst = lua_gettop(L);
 
     lua_getfield(L,inst,"#out");
     const int built = !lua_isnil(L,-1);
     lua_pop(L,1);
     if( built )
-        return 1; // we're already built
+    {
+        lua_pop(L,1); // inst
+        return; // we're already built, e.g. by a previous busy.run
+    }
+
+    bs_graphdepout(L,g,node);
+
+    lua_createtable(L,n->depCount,0);
+    const int barriers = lua_gettop(L);
+    int i;
+    for( i = 0; i < n->depCount; i++ )
+    {
+        bs_graphinst(L,g,n->deps[i]);
+        lua_getfield(L,-1,"#barrier");
+        if( lua_istable(L,-1) )
+            append(L,barriers);
+        else
+            lua_pop(L,1); // nil
+        lua_pop(L,1); // dep
+    }
+    lua_setfield(L,inst,"#barriers");
+
+    switch( n->kind )
+    {
+    case BS_LibraryProduct:
+        library(L,inst,n,builtins);
+        break;
+    case BS_ExecutableProduct:
+        executable(L,inst,n,builtins);
+        break;
+    case BS_SourceSetProduct:
+        sourceset(L,inst,n,builtins);
+        break;
+    case BS_GroupProduct:
+        group(L,inst,n,builtins);
+        break;
+    case BS_ConfigProduct:
+        config(L,inst,n,builtins);
+        break;
+    case BS_LuaScriptProduct:
+        script(L,inst,n,builtins);
+        break;
+    case BS_LuaScriptForeachProduct:
+        runforeach(L,inst,n,builtins);
+        break;
+    case BS_CopyProduct:
+        copy(L,inst,n,builtins);
+        break;
+    case BS_MessageProduct:
+        message(L,inst,0);
+        break;
+    case BS_MocProduct:
+        runmoc(L,inst,n,builtins);
+        break;
+    case BS_RccProduct:
+        runrcc(L,inst,n,builtins);
+        break;
+    case BS_UicProduct:
+        runuic(L,inst,n,builtins);
+        break;
+    }
+
+    addbarrier(L,inst);
+    lua_pushnil(L);
+    lua_setfield(L,inst,"#barriers");
+
+    lua_pop(L,1); // inst
+    assert( top == lua_gettop(L) );
+}
 
-    lua_getmetatable(L,inst);
-    const int cls = lua_gettop(L);
+static int planall(lua_State* L) // args: graph, no returns
+{
+    enum { GRAPH = 1 };
+    const BSGraph* g = bs_tograph(L,GRAPH);
 
     lua_getglobal(L, "require");
     lua_pushstring(L, "builtins");
     lua_call(L,1,1);
     const int builtins = lua_gettop(L);
 
-    lua_getfield(L,cls,"#name");
-    const char* name = lua_tostring(L,-1);
+    int i;
+    for( i = 0; i < g->count; i++ )
+        planproduct(L,g,i,builtins);
+    lua_pop(L,1); // builtins
+    return 0;
+}
 
-    builddeps(L,inst);
+int bs_runAll(lua_State* L) // args: graph, no returns
+{
+    enum { GRAPH = 1 };
 
-    lua_getfield(L,inst,"#decl");
-    calcdesig(L,-1);
-    fprintf(stdout,"# building %s %s\n",name,lua_tostring(L,-1));
-    fflush(stdout);
-    lua_pop(L,2); // decl, name
-
-    // use isa instead of strcmp so that users can subclass the built-in classes
-    if( isa( L, builtins, cls, "Library" ) )
-        library(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Executable") )
-        executable(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "SourceSet") )
-        sourceset(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Group") )
-        group(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Config") )
-        config(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "LuaScript") )
-        script(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "LuaScriptForeach") )
-        runforeach(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Copy") )
-        copy(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Message") )
-        message(L,inst,0);
-    else if( isa( L, builtins, cls, "Moc") )
-        runmoc(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Rcc") )
-        runrcc(L,inst,cls,builtins);
-    else if( isa( L, builtins, cls, "Uic") )
-        runuic(L,inst,cls,builtins);
-    else
-        luaL_error(L,"don't know how to build instances of class '%s'", name);
+    // first all jobs of all products are collected in the graph, then the graph is executed
+    lua_createtable(L,0,2);
+    const int graph = lua_gettop(L);
+    lua_createtable(L,0,0);
+    lua_setfield(L,graph,"jobs");
+    lua_createtable(L,0,0);
+    lua_setfield(L,graph,"producers"); // outpath -> job
+    lua_pushvalue(L,graph);
+    lua_setglobal(L,"#jobgraph");
+
+    // the database is already used when planning, e.g. for the moc scan results
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "builtins");
+    lua_call(L,1,1);
+    lua_getfield(L,-1,"#inst");
+    lua_getfield(L,-1,"root_build_dir");
+    openbuilddb(L,lua_tostring(L,-1));
+    lua_getfield(L,-2,"root_source_dir");
+    bs_cachebase(bs_denormalize_path(lua_tostring(L,-1)),bs_denormalize_path(lua_tostring(L,-2)));
+    lua_pop(L,4); // builtins, binst, root_build_dir, root_source_dir
+
+    const long long start = bs_clock();
+    lua_pushcfunction(L, planall);
+    lua_pushvalue(L,GRAPH);
+    const int err = lua_pcall(L,1,0,0);
+    bs_traceevent("plan","phase",0,start,0);
+
+    lua_pushnil(L);
+    lua_setglobal(L,"#jobgraph");
+    if( err )
+    {
+        closebuilddb(L);
+        lua_error(L); // rethrow the error on top
+    }
+
+    const int ok = runjobs(L,graph);
+    closebuilddb(L);
+
+    lua_getglobal(L,"#cacheput");
+    if( lua_toboolean(L,-1) )
+    {
+        // the size limit is set by the -cachesize option in megabytes
+        lua_getglobal(L,"#cachesize");
+        const double mb = lua_isnumber(L,-1) ? lua_tonumber(L,-1) : 5000;
+        bs_cachetrim(cachedir(L),(long long)(mb * 1024 * 1024));
+        lua_pop(L,1);
+        lua_pushnil(L);
+        lua_setglobal(L,"#cacheput");
+    }
+    lua_pop(L,1);
+    if( !ok )
+    {
+        // stderr was already written to the console
+        lua_pushnil(L);
+        lua_error(L);
+    }
 
-    lua_pop(L,3); // cls, builtins, name
+    lua_pop(L,1); // graph
+    return 0;
+}
+
+int bs_run(lua_State* L) // args: productinst, returns: inst
+{
+    const int inst = 1;
+
+    lua_pushcfunction(L, bs_runAll);
+    lua_pushcfunction(L, bs_graphlower);
+    lua_createtable(L,1,0);
+    lua_pushvalue(L,inst);
+    lua_rawseti(L,-2,1);
+    lua_call(L,1,1);
+    lua_call(L,1,0);
+    lua_pushvalue(L,inst);
     return 1; // inst
 }
@@ -37,7 +37,8 @@ typedef enum BSOutKind { // #kind
 } BSOutKind;
 
 extern int bs_run(lua_State* L);
-extern int bs_precheck(lua_State* L);
+extern int bs_runAll(lua_State* L); // params: graph (see bs_graphlower); builds its products using one job graph
+extern int bs_precheck(lua_State* L); // params: graph; reports the Message products with msg_type error
 extern int bs_markActive(lua_State* L); // params: productinst, array of decls in exec order,
 extern int bs_markAllActive(lua_State* L); // params: array of productinst, array of decls in exec order,
 extern int bs_createBuildDirs(lua_State* L);
@@ -0,0 +1,110 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "bstrace.h"
+#include "bshost.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static FILE* s_trace = 0;
+static long long s_start = 0;
+static int s_named = 0; // the slots up to this number have a thread name event
+
+static void writestr(const char* str)
+{
+    fputc('"',s_trace);
+    for( ; *str; str++ )
+    {
+        const unsigned char ch = (unsigned char)*str;
+        if( ch == '"' || ch == '\\' )
+            fprintf(s_trace,"\\%c",ch);
+        else if( ch == '\n' )
+            fputs("\\n",s_trace);
+        else if( ch == '\t' )
+            fputs("\\t",s_trace);
+        else if( ch < 0x20 )
+            fprintf(s_trace,"\\u%04x",ch);
+        else
+            fputc(ch,s_trace);
+    }
+    fputc('"',s_trace);
+}
+
+int bs_traceopen(const char* denormalizedPath)
+{
+    bs_traceclose();
+    s_trace = bs_fopen(denormalizedPath,"w");
+    if( s_trace == NULL )
+        return -1;
+    s_start = bs_clock();
+    s_named = 0;
+    fputs("[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"BUSY\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}",s_trace);
+    return 0;
+}
+
+void bs_traceclose(void)
+{
+    if( s_trace == 0 )
+        return;
+    fputs("\n]\n",s_trace);
+    fclose(s_trace);
+    s_trace = 0;
+}
+
+int bs_tracing(void)
+{
+    return s_trace != 0;
+}
+
+void bs_traceevent(const char* name, const char* cat, int tid, long long start, const char* const* args)
+{
+    if( s_trace == 0 )
+        return;
+    const long long now = bs_clock() - s_start;
+    start -= s_start;
+    while( s_named < tid )
+    {
+        s_named++;
+        fprintf(s_trace,",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"slot %d\"}}",
+                s_named, s_named);
+    }
+    fputs(",\n{\"name\":",s_trace);
+    writestr(name);
+    fputs(",\"cat\":",s_trace);
+    writestr(cat);
+    fprintf(s_trace,",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",tid,start,now-start);
+    if( args != 0 && args[0] != 0 )
+    {
+        fputs(",\"args\":{",s_trace);
+        int i;
+        for( i = 0; args[i] != 0 && args[i+1] != 0; i += 2 )
+        {
+            if( i != 0 )
+                fputc(',',s_trace);
+            writestr(args[i]);
+            fputc(':',s_trace);
+            writestr(args[i+1]);
+        }
+        fputc('}',s_trace);
+    }
+    fputc('}',s_trace);
+    fflush(s_trace);
+}
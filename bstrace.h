@@ -0,0 +1,34 @@
+#ifndef BSTRACE_H
+#define BSTRACE_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the BUSY build system.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the application under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+// Records a timeline of the build in the trace event format read by chrome://tracing and Perfetto. Each event
+// is written when it completes, so the file can be loaded even if the build stops with an error (the format
+// allows the closing bracket of the event array to be missing).
+
+extern int bs_traceopen(const char* denormalizedPath); // starts a new trace; returns 0 on success
+extern void bs_traceclose(void);
+extern int bs_tracing(void); // returns 1 if a trace is open
+extern void bs_traceevent(const char* name, const char* cat, int tid, long long start, const char* const* args);
+    // writes an event lasting from start (as returned by bs_clock) until now; tid 0 is the main thread, the
+    // others are named "slot <tid>"; args is a list of key and value pairs terminated by 0, or 0
+
+#endif // BSTRACE_H
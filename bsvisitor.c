@@ -18,6 +18,7 @@
 */
 
 #include "bsvisitor.h"
+#include "bsgraph.h"
 #include "bshost.h"
 #include "bsparser.h" 
 #include "bslex.h" // default_logger
@@ -25,38 +26,13 @@
 #include <assert.h>
 #include <string.h>
 
-enum VISIT_ARGS { PRODINST = 1, CTX };
+enum VISIT_ARGS { PRODINST = 1, GRAPH, NODE, CTX };
 
 static int calcdesig(lua_State* L, int decl)
 {
     return bs_declpath(L,decl,".");
 }
 
-static int isa(lua_State* L, int builtins, int cls, const char* what )
-{
-    lua_getfield(L,builtins,what);
-    const int res = bs_isa(L,-1,cls);
-    lua_pop(L,1);
-    return res;
-}
-
-static void addflags(lua_State* L, int list, int out)
-{
-    if( list < 0 )
-        list += lua_gettop(L) + 1;
-
-    const int n = lua_objlen(L,list);
-    int i;
-    for( i = 1; i <= n; i++ )
-    {
-        lua_pushvalue(L,out);
-        lua_pushstring(L," ");
-        lua_rawgeti(L,list,i);
-        lua_concat(L,3);
-        lua_replace(L,out);
-    }
-}
-
 static void addPath(lua_State* L, int lhs, int rhs)
 {
     if( *lua_tostring(L,rhs) == '/' )
@@ -123,111 +99,23 @@ static void prefixCmd(lua_State* L, int cmd, int binst, int to_host)
         lua_pop(L,1);
 }
 
-static void emitFlags(lua_State* L,int inst, BSVisitorCtx* ctx, BSBuildParam paramType, const char* field)
+static void emitFlags(BSVisitorCtx* ctx, const BSStrings* list, BSBuildParam paramType)
 {
     assert( ctx->d_param != 0 );
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        // TODO: check for circular deps
-        emitFlags(L, config, ctx, paramType, field);
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    lua_getfield(L,inst, field);
-    const int list = lua_gettop(L);
-    const size_t n = lua_objlen(L,list);
-    for( i = 1; i <= n; i++ )
-    {
-        lua_rawgeti(L,list,i);
-        ctx->d_param(paramType,lua_tostring(L,-1),ctx->d_data);
-        lua_pop(L,1);
-    }
-    lua_pop(L,1);
-}
-
-static void emitPaths(lua_State* L,int inst, BSVisitorCtx* ctx, BSBuildParam paramType, const char* field)
-{
-    assert( ctx->d_param != 0 );
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        // TODO: check for circular deps
-        emitPaths(L,config, ctx, paramType, field);
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    lua_getfield(L,inst,field);
-    const int incls = lua_gettop(L);
-
-    for( i = 1; i <= lua_objlen(L,incls); i++ )
-    {
-        lua_rawgeti(L,incls,i);
-        const int path = lua_gettop(L);
-        if( *lua_tostring(L,-1) != '/' )
-        {
-            // relative path
-            addPath(L,absDir,path);
-            lua_replace(L,path);
-        }
-        ctx->d_param(paramType, bs_denormalize_path(lua_tostring(L,path)),ctx->d_data);
-        lua_pop(L,1); // path
-    }
-    lua_pop(L,2); // absDir, incls
+    int i;
+    for( i = 0; i < list->count; i++ )
+        ctx->d_param(paramType,list->items[i],ctx->d_data);
 }
 
-static void emitPath(lua_State* L,int inst, BSVisitorCtx* ctx, BSBuildParam paramType, const char* field)
+static void emitPaths(BSVisitorCtx* ctx, const BSStrings* list, BSBuildParam paramType)
 {
     assert( ctx->d_param != 0 );
-
-    lua_getfield(L,inst,"configs");
-    const int configs = lua_gettop(L);
-    size_t i;
-    for( i = 1; i <= lua_objlen(L,configs); i++ )
-    {
-        lua_rawgeti(L,configs,i);
-        const int config = lua_gettop(L);
-        // TODO: check for circular deps
-        emitPath(L,config, ctx, paramType, field);
-        lua_pop(L,1); // config
-    }
-    lua_pop(L,1); // configs
-
-    bs_getModuleVar(L,inst,"#dir");
-    const int absDir = lua_gettop(L);
-
-    lua_getfield(L,inst,field);
-    const int path = lua_gettop(L);
-    if( lua_isstring(L,path) )
-    {
-        if( *lua_tostring(L,path) != '/' )
-        {
-            // relative path
-            addPath(L,absDir,path);
-            lua_replace(L,path);
-        }
-        ctx->d_param(paramType, bs_denormalize_path(lua_tostring(L,path)),ctx->d_data);
-    }
-
-    lua_pop(L,2); // absDir, path
+    int i;
+    for( i = 0; i < list->count; i++ )
+        ctx->d_param(paramType,bs_denormalize_path(list->items[i]),ctx->d_data);
 }
 
-static void compilesources(lua_State* L, BSVisitorCtx* ctx, int builtins, int inlist)
+static void compilesources(lua_State* L, BSVisitorCtx* ctx, const BSGraphNode* node, int builtins, int inlist)
 {
     const int top = lua_gettop(L);
 
@@ -241,20 +129,9 @@ static void compilesources(lua_State* L, BSVisitorCtx* ctx, int builtins, int in
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
-    lua_getfield(L,PRODINST,"to_host");
-    const int to_host = lua_toboolean(L,-1);
-    lua_pop(L,1);
-
-    const BSToolchain toolchain = bs_getToolchain(L,binst,to_host);
-
-    lua_getfield(L,binst,"#ctdefaults");
-    if( to_host )
-        lua_getfield(L,binst,"host_toolchain");
-    else
-        lua_getfield(L,binst,"target_toolchain");
-    lua_rawget(L,-2);
-    lua_replace(L,-2);
-    const int ctdefaults = lua_gettop(L);
+    const int to_host = node->toHost;
+    const BSToolchain toolchain = node->toolchain;
+    const BSOperatingSystem os = node->os;
 
     lua_getfield(L,binst,"root_build_dir");
     const int rootOutDir = lua_gettop(L);
@@ -265,33 +142,27 @@ static void compilesources(lua_State* L, BSVisitorCtx* ctx, int builtins, int in
     bs_getModuleVar(L,PRODINST,"#rdir");
     const int relDir = lua_gettop(L);
 
-    const BSOperatingSystem os = bs_getOperatingSystem(L,binst,to_host);
-
     size_t i;
 
-    lua_getfield(L,PRODINST,"sources");
+    lua_createtable(L,node->inputs.count,0);
     const int sources = lua_gettop(L);
-    lua_createtable(L,lua_objlen(L,sources),0);
-    const int tmp = lua_gettop(L);
-    copyItems(L,inlist,tmp, BS_SourceFiles);
-    int n = lua_objlen(L,tmp);
+    copyItems(L,inlist,sources, BS_SourceFiles);
+    int n = lua_objlen(L,sources);
 
     lua_createtable(L,n,0);
     const int generated = lua_gettop(L);
     for( i = 1; i <= n; i++ )
     {
-        lua_rawgeti(L,tmp,i);
+        lua_rawgeti(L,sources,i);
         lua_rawseti(L,generated,i);
     }
     lua_setfield(L,PRODINST,"#generated");
 
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        // copy all sources to a new table to avoid changing the original sources
-        lua_rawgeti(L,sources,i);
-        lua_rawseti(L,tmp,++n);
+        lua_pushstring(L,node->inputs.items[i]);
+        lua_rawseti(L,sources,++n);
     }
-    lua_replace(L,sources);
 
     // the result of source files received via dependencies appeares before the results of this source files
     copyItems(L,inlist,outlist, BS_ObjectFiles);
@@ -372,41 +243,27 @@ static void compilesources(lua_State* L, BSVisitorCtx* ctx, int builtins, int in
 
         if( ctx->d_param )
         {
-            if( !lua_isnil(L,ctdefaults) )
-                emitFlags(L,ctdefaults,ctx, BS_cflag, "cflags");
-            emitFlags(L,PRODINST,ctx, BS_cflag, "cflags");
+            emitFlags(ctx,&node->flags[BS_cflags],BS_cflag);
 
             switch(lang)
             {
             case BS_c:
-                if( !lua_isnil(L,ctdefaults) )
-                    emitFlags(L,ctdefaults,ctx, BS_cflag, "cflags_c");
-                emitFlags(L,PRODINST,ctx, BS_cflag, "cflags_c");
+                emitFlags(ctx,&node->flags[BS_cflags_c],BS_cflag);
                 break;
             case BS_cc:
-                if( !lua_isnil(L,ctdefaults) )
-                    emitFlags(L,ctdefaults,ctx, BS_cflag, "cflags_cc");
-                emitFlags(L,PRODINST,ctx, BS_cflag, "cflags_cc");
+                emitFlags(ctx,&node->flags[BS_cflags_cc],BS_cflag);
                 break;
             case BS_objc:
-                if( !lua_isnil(L,ctdefaults) )
-                    emitFlags(L,ctdefaults,ctx, BS_cflag, "cflags_objc");
-                emitFlags(L,PRODINST,ctx, BS_cflag, "cflags_objc");
+                emitFlags(ctx,&node->flags[BS_cflags_objc],BS_cflag);
                 break;
             case BS_objcc:
-                if( !lua_isnil(L,ctdefaults) )
-                    emitFlags(L,ctdefaults,ctx, BS_cflag, "cflags_objcc");
-                emitFlags(L,PRODINST,ctx, BS_cflag, "cflags_objcc");
+                emitFlags(ctx,&node->flags[BS_cflags_objcc],BS_cflag);
                 break;
             }
 
-            if( !lua_isnil(L,ctdefaults) )
-                emitFlags(L,ctdefaults,ctx, BS_define, "defines");
-            emitFlags(L,PRODINST,ctx, BS_define, "defines");
+            emitFlags(ctx,&node->flags[BS_defines],BS_define);
 
-            if( !lua_isnil(L,ctdefaults) )
-                emitPaths(L,ctdefaults,ctx, BS_include_dir, "include_dirs");
-            emitPaths(L,PRODINST,ctx, BS_include_dir, "include_dirs");
+            emitPaths(ctx,&node->flags[BS_include_dirs],BS_include_dir);
 
             ctx->d_param(BS_outfile, bs_denormalize_path(lua_tostring(L,out)), ctx->d_data);
 
@@ -423,7 +280,7 @@ static void compilesources(lua_State* L, BSVisitorCtx* ctx, int builtins, int in
     if( ctx->d_fork )
         ctx->d_fork(-1,ctx->d_data);
 
-    lua_pop(L,6); // outlist, binst, ctdefaults, rootOutDir...relDir
+    lua_pop(L,5); // outlist, binst, rootOutDir...relDir
 
     const int bottom = lua_gettop(L);
     assert( top == bottom );
@@ -539,7 +396,7 @@ static int makeCopyOfLibs(lua_State* L, int inlist)
     return hasLibs;
 }
 
-static void link(lua_State* L, BSVisitorCtx* ctx, int builtins, int inlist, int resKind)
+static void link(lua_State* L, BSVisitorCtx* ctx, const BSGraphNode* node, int builtins, int inlist, int resKind)
 {
     assert( resKind == BS_Executable || resKind == BS_DynamicLib || resKind == BS_StaticLib );
 
@@ -548,75 +405,13 @@ static void link(lua_State* L, BSVisitorCtx* ctx, int builtins, int inlist, int
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
-    lua_getfield(L,PRODINST,"to_host");
-    const int to_host = lua_toboolean(L,-1);
-    lua_pop(L,1);
-
-    const BSToolchain toolchain = bs_getToolchain(L,binst,to_host);
-    const BSOperatingSystem os = bs_getOperatingSystem(L,binst,to_host);
+    const int to_host = node->toHost;
+    const BSToolchain toolchain = node->toolchain;
+    const BSOperatingSystem os = node->os;
     const int win32 = os == BS_windows;
-    const int mac = os == BS_mac;
-
-    lua_getfield(L,binst,"#ctdefaults");
-    if( to_host )
-        lua_getfield(L,binst,"host_toolchain");
-    else
-        lua_getfield(L,binst,"target_toolchain");
-    lua_rawget(L,-2);
-    lua_replace(L,-2);
-    const int ctdefaults = lua_gettop(L);
-
-    lua_getfield(L,binst,"root_build_dir");
-    const int rootOutDir = lua_gettop(L);
-
-    bs_getModuleVar(L,PRODINST,"#rdir");
-    const int relDir = lua_gettop(L);
-
-    addPath(L,rootOutDir,relDir);
-    lua_pushvalue(L,-1);
-    lua_pushstring(L,"/");
 
-    if( !win32 && ( resKind == BS_DynamicLib || resKind == BS_StaticLib ) )
-        lua_pushstring(L,"lib"); // if not on Windows prefix the lib name with "lib"
-    else
-        lua_pushstring(L,"");
-    lua_getfield(L,PRODINST,"name");
-    if( lua_isnil(L,-1) || lua_objlen(L,-1) == 0 )
-    {
-        lua_pop(L,1);
-        lua_getfield(L,PRODINST,"#decl");
-        lua_getfield(L,-1,"#name");
-        lua_replace(L,-2);
-    }
-    lua_concat(L,4);
-    lua_replace(L,-2);
-    const int outbase = lua_gettop(L);
-
-    lua_pushvalue(L,outbase);
-    switch(resKind)
-    {
-    case BS_DynamicLib:
-        if( win32 )
-            lua_pushstring(L,".dll");
-        else if(mac)
-            lua_pushstring(L,".dylib");
-        else
-            lua_pushstring(L,".so");
-        break;
-    case BS_Executable:
-        if( win32 )
-            lua_pushstring(L,".exe");
-        else
-            lua_pushstring(L,"");
-        break;
-    case BS_StaticLib:
-        if( win32 )
-            lua_pushstring(L,".lib");
-        else
-            lua_pushstring(L,".a");
-        break;
-    }
-    lua_concat(L,2);
+    assert( node->outputs.count == 1 );
+    lua_pushstring(L,node->outputs.items[0]);
     const int outfile = lua_gettop(L);
 
     lua_pushvalue(L,outfile);
@@ -712,30 +507,14 @@ static void link(lua_State* L, BSVisitorCtx* ctx, int builtins, int inlist, int
 
     if( ctx->d_param )
     {
-        if( !lua_isnil(L,ctdefaults) )
-            emitFlags(L,ctdefaults,ctx, BS_ldflag, "ldflags");
-        emitFlags(L,PRODINST,ctx, BS_ldflag, "ldflags");
-
-        if( !lua_isnil(L,ctdefaults) )
-            emitFlags(L,ctdefaults,ctx, BS_lib_name, "lib_names");
-        emitFlags(L,PRODINST,ctx, BS_lib_name, "lib_names");
-
-        if( !lua_isnil(L,ctdefaults) )
-            emitFlags(L,ctdefaults,ctx, BS_framework, "frameworks");
-        emitFlags(L,PRODINST,ctx, BS_framework, "frameworks");
-
-        if( !lua_isnil(L,ctdefaults) )
-            emitPaths(L,ctdefaults,ctx, BS_lib_dir, "lib_dirs");
-        emitPaths(L,PRODINST,ctx, BS_lib_dir, "lib_dirs");
-
-        if( !lua_isnil(L,ctdefaults) )
-            emitPaths(L,ctdefaults,ctx, BS_lib_file, "lib_files");
-        emitPaths(L,PRODINST,ctx, BS_lib_file, "lib_files");
+        emitFlags(ctx,&node->flags[BS_ldflags],BS_ldflag);
+        emitFlags(ctx,&node->flags[BS_lib_names],BS_lib_name);
+        emitFlags(ctx,&node->flags[BS_frameworks],BS_framework);
+        emitPaths(ctx,&node->flags[BS_lib_dirs],BS_lib_dir);
+        emitPaths(ctx,&node->flags[BS_lib_files],BS_lib_file);
 
-        lua_getfield(L,PRODINST,"def_file");
-        if( !lua_isnil(L,-1) && strcmp(lua_tostring(L,-1),".") != 0 )
-            emitPath(L,PRODINST,ctx, BS_defFile, "def_file");
-        lua_pop(L,1);// def_file
+        if( node->defFile )
+            ctx->d_param(BS_defFile,bs_denormalize_path(node->defFile),ctx->d_data);
 
         ctx->d_param(BS_outfile,bs_denormalize_path(lua_tostring(L,outfile)), ctx->d_data);
 
@@ -745,86 +524,18 @@ static void link(lua_State* L, BSVisitorCtx* ctx, int builtins, int inlist, int
     if( ctx->d_end )
         ctx->d_end(ctx->d_data);
 
-    lua_pop(L,6); // binst, rootOutDir, relDir, ctdefaults, outbase, out
+    lua_pop(L,2); // binst, outfile
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void builddeps(lua_State* L, int inst)
-{
-    const int top = lua_gettop(L);
-
-    lua_getfield(L,inst,"deps");
-    const int deps = lua_gettop(L);
-    if( lua_isnil(L,deps) )
-    {
-        lua_pop(L,1); // nil
-        return;
-    }
-
-    lua_createtable(L,0,0);
-    lua_pushinteger(L,BS_Mixed);
-    lua_setfield(L,-2,"#kind");
-    const int out = lua_gettop(L);
-
-    const int ndeps = lua_objlen(L,deps);
-    int nout = 0;
-    int i;
-    for( i = 1; i <= ndeps; i++ )
-    {
-        lua_pushcfunction(L, bs_visit);
-        lua_rawgeti(L,deps,i);
-        lua_pushvalue(L,CTX);
-        lua_call(L,2,0);
-
-        lua_rawgeti(L,deps,i);
-        lua_getfield(L,-1,"#out");
-        lua_replace(L,-2);
-        // stack: subout
-
-        const int subout = lua_gettop(L);
-        int k = BS_Nothing;
-        if( lua_istable(L,subout) )
-        {
-            lua_getfield(L,-1,"#kind");
-            k = lua_tointeger(L,-1);
-            lua_pop(L,1);
-        }
-
-        if( k == BS_Mixed )
-        {
-            const int nsubout = lua_objlen(L,subout);
-            int j;
-            for( j = 1; j <= nsubout; j++ )
-            {
-                lua_rawgeti(L,subout,j);
-
-                lua_getfield(L,-1,"#kind");
-                const int kk = lua_tointeger(L,-1);
-                lua_pop(L,1);
-                assert( kk != BS_Mixed);
-
-                lua_rawseti(L,out,++nout);
-            }
-            lua_pop(L,1); // subout
-        }else if( lua_istable(L,subout) )
-            lua_rawseti(L,out,++nout); // eats subout
-        else
-            lua_pop(L,1);
-    }
-    lua_setfield(L,inst,"#out");
-    lua_pop(L,1); // deps
-    const int bottom = lua_gettop(L);
-    assert( top == bottom );
-}
-
-static void library(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void library(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,PRODINST,"#out");
     const int inlist = lua_gettop(L); // inlist is of kind BS_Mixed and doesn't have items of kind BS_Mixed
     assert( lua_istable(L,inlist) );
-    compilesources(L,ctx,builtins, inlist);
+    compilesources(L,ctx,node,builtins,inlist);
 
     lua_getfield(L,PRODINST,"lib_type");
     const int lib_type = ( strcmp(lua_tostring(L,-1),"shared") == 0 ? BS_DynamicLib : BS_StaticLib );
@@ -852,7 +563,7 @@ static void library(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     // in case a dynamic lib is to be generated by link(), inlist also includes the libs inherited from the initial inlist
 
     // link sets out to a new table of kind BS_DynamicLib or BS_StaticLib; inlist is not passed out
-    link(L,ctx,builtins,inlist,lib_type);
+    link(L,ctx,node,builtins,inlist,lib_type);
 
     lua_pop(L,1); // inlist
     assert( top == lua_gettop(L) );
@@ -860,13 +571,13 @@ static void library(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     // passes on one lib (either BS_DynamicLib or BS_StaticLib), or a BS_Mixed of libs
 }
 
-static void executable(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void executable(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,PRODINST,"#out");
     const int inlist = lua_gettop(L);
     assert( lua_istable(L,inlist) );
-    compilesources(L,ctx,builtins,inlist);
+    compilesources(L,ctx,node,builtins,inlist);
 
     lua_getfield(L,PRODINST,"#out");
     if( makeCopyOfLibs(L,inlist) )
@@ -878,20 +589,20 @@ static void executable(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     }else
         lua_replace(L,inlist); // make BS_ObjectFiles from compile output the new inlist
 
-    link(L,ctx,builtins,inlist,BS_Executable);
+    link(L,ctx,node,builtins,inlist,BS_Executable);
     lua_pop(L,1); // mixed
     assert( top == lua_gettop(L) );
 
     // passes on one BS_Executable
 }
 
-static void sourceset(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void sourceset(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
     lua_getfield(L,PRODINST,"#out");
     const int inlist = lua_gettop(L);
     assert( lua_istable(L,inlist) );
-    compilesources(L,ctx,builtins,inlist);
+    compilesources(L,ctx,node,builtins,inlist);
     // #out is now a BS_ObjectFiles
 
     if( makeCopyOfLibs(L,inlist) )
@@ -909,12 +620,12 @@ static void sourceset(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     assert( top == lua_gettop(L) );
 }
 
-static void group(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void group(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     // NOP. deps were already built and result handed to inst.#out
 }
 
-static void config(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void config(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     // NOP
 }
@@ -987,7 +698,8 @@ static BSPathStatus apply_arg_expansion(lua_State* L,int inst, int builtins, con
     return BS_OK;
 }
 
-static void callLua(lua_State* L, BSVisitorCtx* ctx, int builtins, int inst, int app, int script, const char* source)
+static void callLua(lua_State* L, BSVisitorCtx* ctx, int builtins, int inst, int app, int script, const char* source,
+                    int outlist)
 {
     const int top = lua_gettop(L);
 
@@ -1011,6 +723,17 @@ static void callLua(lua_State* L, BSVisitorCtx* ctx, int builtins, int inst, int
         }
         lua_pop(L,1); // arglist
 
+        if( outlist )
+        {
+            // the outputs declared by a LuaScript
+            for( j = 1; j <= lua_objlen(L,outlist); j++ )
+            {
+                lua_rawgeti(L,outlist,j);
+                ctx->d_param(BS_outfile, bs_denormalize_path(lua_tostring(L,-1)), ctx->d_data);
+                lua_pop(L,1);
+            }
+        }
+
         ctx->d_param(BS_infile, bs_denormalize_path(lua_tostring(L,script)), ctx->d_data);
     }
 
@@ -1021,11 +744,11 @@ static void callLua(lua_State* L, BSVisitorCtx* ctx, int builtins, int inst, int
     assert( top == bottom );
 }
 
-static void script(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void script(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
-    lua_createtable(L,0,0);
+    lua_createtable(L,node->outputs.count,0);
     const int out = lua_gettop(L);
     lua_pushinteger(L,BS_SourceFiles);
     lua_setfield(L,out,"#kind");
@@ -1035,34 +758,12 @@ static void script(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     bs_getModuleVar(L,PRODINST,"#dir");
     const int absDir = lua_gettop(L);
 
-    lua_getfield(L,builtins,"#inst");
-    lua_getfield(L,-1,"root_build_dir");
-    lua_replace(L,-2);
-    bs_getModuleVar(L,PRODINST,"#rdir");
-    addPath(L,-2,-1); // root_build_dir, rdir, root_build_dir+rdir
-    lua_replace(L,-3);
-    lua_pop(L,1);
-    const int outDir = lua_gettop(L);
-
-    lua_getfield(L,PRODINST,"outputs");
-    const int outputs = lua_gettop(L);
-    size_t j;
-    for( j = 1; j <= lua_objlen(L,outputs); j++ )
+    int j;
+    for( j = 0; j < node->outputs.count; j++ )
     {
-        lua_rawgeti(L,outputs,j);
-        const int src = lua_gettop(L);
-
-        if( *lua_tostring(L,src) != '/' )
-        {
-            addPath(L,outDir,src);
-            lua_replace(L,src);
-        }else
-            luaL_error(L,"the 'outputs' field requires relative paths");
-
-        lua_rawseti(L,out,j);
+        lua_pushstring(L,node->outputs.items[j]);
+        lua_rawseti(L,out,j+1);
     }
-    lua_pop(L,2); // outDir, outputs
-
 
     lua_getfield(L,PRODINST,"script");
     const int script = lua_gettop(L);
@@ -1076,7 +777,7 @@ static void script(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     bs_thisapp2(L);
     const int app = lua_gettop(L);
 
-    callLua(L,ctx,builtins,PRODINST,app,script,0);
+    callLua(L,ctx,builtins,PRODINST,app,script,0,out);
 
     lua_pop(L,4); // out, abDir, script, app
 
@@ -1084,16 +785,27 @@ static void script(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     assert( top == bottom );
 }
 
-static void runforeach(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void runforeach(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
-    lua_pushnil(L);
-    lua_setfield(L,PRODINST,"#out");
+    lua_createtable(L,0,0);
+    const int out = lua_gettop(L);
+    lua_pushinteger(L,BS_SourceFiles);
+    lua_setfield(L,out,"#kind");
 
     bs_getModuleVar(L,PRODINST,"#dir");
     const int absDir = lua_gettop(L);
 
+    lua_getfield(L,builtins,"#inst");
+    lua_getfield(L,-1,"root_build_dir");
+    lua_replace(L,-2);
+    bs_getModuleVar(L,PRODINST,"#rdir");
+    addPath(L,-2,-1); // root_build_dir, rdir, root_build_dir+rdir
+    lua_replace(L,-3);
+    lua_pop(L,1);
+    const int outDir = lua_gettop(L);
+
     lua_getfield(L,PRODINST,"script");
     const int script = lua_gettop(L);
     if( *lua_tostring(L,script) != '/' )
@@ -1106,34 +818,58 @@ static void runforeach(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     bs_thisapp2(L);
     const int app = lua_gettop(L);
 
-    size_t i;
-    lua_getfield(L,PRODINST,"sources");
-    const int sources = lua_gettop(L);
+    lua_getfield(L,PRODINST,"outputs");
+    const int outputs = lua_gettop(L);
+
+    int i;
+    size_t j;
     if( ctx->d_fork )
-        ctx->d_fork( lua_objlen(L,sources), ctx->d_data );
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+        ctx->d_fork( node->inputs.count, ctx->d_data );
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
+
+        lua_createtable(L,lua_objlen(L,outputs),0);
+        const int outlist = lua_gettop(L);
+        for( j = 1; j <= lua_objlen(L,outputs); j++ )
         {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
+            lua_rawgeti(L,outputs,j);
+            const int to = lua_gettop(L);
+            if( bs_apply_source_expansion(lua_tostring(L,source),lua_tostring(L,to), 1) != BS_OK )
+                luaL_error(L,"cannot do source expansion, invalid placeholders in path: %s", lua_tostring(L,to));
+            lua_pushstring(L,bs_global_buffer());
+            lua_replace(L,to);
+            if( *lua_tostring(L,to) != '/' )
+            {
+                addPath(L,outDir,to);
+                lua_replace(L,to);
+            }else
+                luaL_error(L,"the 'outputs' field requires relative paths");
+            lua_pushvalue(L,to);
+            lua_rawseti(L,out,lua_objlen(L,out)+1);
+            lua_rawseti(L,outlist,j);
         }
 
-        callLua(L,ctx, builtins,PRODINST,app,script,lua_tostring(L,source));
+        callLua(L,ctx, builtins,PRODINST,app,script,lua_tostring(L,source),outlist);
 
-        lua_pop(L,1); // source
+        lua_pop(L,2); // source, outlist
     }
     if( ctx->d_fork )
         ctx->d_fork( -1, ctx->d_data );
 
-    lua_pop(L,4); // abDir, script, app, sources
+    if( lua_objlen(L,out) == 0 )
+        lua_pushnil(L);
+    else
+        lua_pushvalue(L,out);
+    lua_setfield(L,PRODINST,"#out");
+
+    lua_pop(L,6); // out, abDir, outDir, script, app, outputs
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void runmoc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void runmoc(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1144,9 +880,6 @@ static void runmoc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,PRODINST,"#out");
 
-    bs_getModuleVar(L,PRODINST,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -1176,27 +909,16 @@ static void runmoc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
         lua_replace(L,mocPath);
     }
 
-    lua_getfield(L,PRODINST,"sources");
-    const int sources = lua_gettop(L);
     int n = 0;
-    size_t i;
+    int i;
     if( ctx->d_fork )
-        ctx->d_fork( lua_objlen(L,sources), ctx->d_data );
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+        ctx->d_fork( node->inputs.count, ctx->d_data );
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
         const int lang = bs_guessLang(lua_tostring(L,source));
 
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
-
-        lua_getfield(L,PRODINST,"defines");
-        const int defs = lua_gettop(L);
-
         int len;
         const char* name = bs_path_part(lua_tostring(L,source),BS_baseName,&len);
         lua_pushlstring(L,name,len);
@@ -1217,14 +939,7 @@ static void runmoc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
             ctx->d_param(BS_infile, bs_denormalize_path(lua_tostring(L,source)), ctx->d_data);
             ctx->d_param(BS_outfile, bs_denormalize_path(lua_tostring(L,outFile)), ctx->d_data);
 
-            size_t j;
-            const size_t numOfDefs = lua_objlen(L,defs);
-            for( j = 1; j <= numOfDefs; j++ )
-            {
-                lua_rawgeti(L,defs,j);
-                ctx->d_param(BS_define, lua_tostring(L,-1), ctx->d_data);
-                lua_pop(L,1); // define
-            }
+            emitFlags(ctx,&node->flags[BS_defines],BS_define);
         }
 
         if( ctx->d_end )
@@ -1236,19 +951,19 @@ static void runmoc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
             lua_rawseti(L,outlist,++n);
         }
 
-        lua_pop(L,3); // source, defs, outFile
+        lua_pop(L,2); // source, outFile
     }
     if( ctx->d_fork )
         ctx->d_fork( -1, ctx->d_data );
 
-    lua_pop(L,6); // outlist absDir binst outDir mocPath sources
+    lua_pop(L,4); // outlist binst outDir mocPath
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 
     // passes on one BS_SourceFiles
 }
 
-static void runrcc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void runrcc(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1259,9 +974,6 @@ static void runrcc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,PRODINST,"#out");
 
-    bs_getModuleVar(L,PRODINST,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -1291,26 +1003,19 @@ static void runrcc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
         lua_replace(L,app);
     }
 
-    size_t i;
-    lua_getfield(L,PRODINST,"sources");
-    const int sources = lua_gettop(L);
+    int i;
     if( ctx->d_fork )
-        ctx->d_fork( lua_objlen(L,sources), ctx->d_data );
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+        ctx->d_fork( node->inputs.count, ctx->d_data );
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
 
         lua_pushfstring(L,"%s/qrc_%s.cpp",lua_tostring(L,outDir), bs_filename(lua_tostring(L,source)));
         const int outFile = lua_gettop(L);
 
         lua_pushvalue(L,outFile);
-        lua_rawseti(L,outlist,i);
+        lua_rawseti(L,outlist,i+1);
 
         if( ctx->d_begin )
             ctx->d_begin(BS_RunRcc, bs_denormalize_path(lua_tostring(L,app)), BS_notc, BS_noos, ctx->d_data);
@@ -1334,12 +1039,12 @@ static void runrcc(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     if( ctx->d_fork )
         ctx->d_fork( -1, ctx->d_data );
 
-    lua_pop(L,6); // outlist absDir binst outDir app sources
+    lua_pop(L,4); // outlist binst outDir app
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void runuic(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void runuic(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1350,9 +1055,6 @@ static void runuic(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     lua_pushvalue(L,outlist);
     lua_setfield(L,PRODINST,"#out");
 
-    bs_getModuleVar(L,PRODINST,"#dir");
-    const int absDir = lua_gettop(L);
-
     lua_getfield(L,builtins,"#inst");
     const int binst = lua_gettop(L);
 
@@ -1382,20 +1084,13 @@ static void runuic(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
         lua_replace(L,app);
     }
 
-    size_t i;
-    lua_getfield(L,PRODINST,"sources");
-    const int sources = lua_gettop(L);
+    int i;
     if( ctx->d_fork )
-        ctx->d_fork( lua_objlen(L,sources), ctx->d_data );
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+        ctx->d_fork( node->inputs.count, ctx->d_data );
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        lua_rawgeti(L,sources,i);
+        lua_pushstring(L,node->inputs.items[i]);
         const int source = lua_gettop(L);
-        if( *lua_tostring(L,source) != '/' )
-        {
-            addPath(L,absDir,source);
-            lua_replace(L,source);
-        }
 
         int len = 0;
         const char* name = bs_path_part(lua_tostring(L,source),BS_baseName, &len);
@@ -1421,12 +1116,12 @@ static void runuic(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
     if( ctx->d_fork )
         ctx->d_fork( -1, ctx->d_data );
 
-    lua_pop(L,6); // outlist absDir binst outDir app sources
+    lua_pop(L,4); // outlist binst outDir app
     const int bottom = lua_gettop(L);
     assert( top == bottom );
 }
 
-static void copy(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
+static void copy(lua_State* L,BSVisitorCtx* ctx, const BSGraphNode* node, int builtins)
 {
     const int top = lua_gettop(L);
 
@@ -1447,16 +1142,13 @@ static void copy(lua_State* L,BSVisitorCtx* ctx, int cls, int builtins)
 
     size_t i;
 
-    lua_getfield(L,PRODINST,"sources");
+    lua_createtable(L,node->inputs.count,0);
     const int sources = lua_gettop(L);
-    lua_createtable(L,lua_objlen(L,sources),0);
-    for( i = 1; i <= lua_objlen(L,sources); i++ )
+    for( i = 0; i < node->inputs.count; i++ )
     {
-        // copy all sources to a new table to avoid changing the original sources
-        lua_rawgeti(L,sources,i);
-        lua_rawseti(L,-2,i);
+        lua_pushstring(L,node->inputs.items[i]);
+        lua_rawseti(L,sources,i+1);
     }
-    lua_replace(L,-2);
 
     lua_getfield(L,PRODINST,"use_deps");
     const int use_deps = lua_gettop(L);
@@ -1586,13 +1278,20 @@ static void message(lua_State* L,BSVisitorCtx* ctx, int precheck)
 
 int bs_visit(lua_State* L)
 {
+    const BSGraph* g = bs_tograph(L,1);
+    const int node = lua_tointeger(L,2);
+    luaL_argcheck(L, node >= 0 && node < g->count, 2, "node index out of range");
+    const BSGraphNode* n = &g->nodes[node];
+    bs_graphinst(L,g,node);
+    lua_insert(L,PRODINST);
+
     const int top = lua_gettop(L);
 
     lua_getfield(L,PRODINST,"#out");
     const int built = !lua_isnil(L,-1);
     lua_pop(L,1);
     if( built )
-        return 1; // we're already built
+        return 0; // we're already built
 
     BSVisitorCtx* ctx = (BSVisitorCtx*)lua_topointer(L,CTX);
 
@@ -1602,59 +1301,60 @@ int bs_visit(lua_State* L)
         ctx->d_loggerData = 0;
     }
 
-    lua_getmetatable(L,PRODINST);
-    const int cls = lua_gettop(L);
-
     lua_getglobal(L, "require");
     lua_pushstring(L, "builtins");
     lua_call(L,1,1);
     const int builtins = lua_gettop(L);
 
-    lua_getfield(L,cls,"#name");
-    const char* clsName = lua_tostring(L,-1);
-
-    builddeps(L,PRODINST);
+    bs_graphdepout(L,g,node);
 
     if( ctx->d_begin )
-    {
-        lua_getfield(L,PRODINST,"#decl");
-        calcdesig(L,-1);
-        ctx->d_begin(BS_EnteringProduct,lua_tostring(L,-1),0,0, ctx->d_data);
-        lua_pop(L,2); // decl, desig
-    }
+        ctx->d_begin(BS_EnteringProduct,n->name,0,0, ctx->d_data);
 
-    // use isa instead of strcmp so that users can subclass the built-in classes
-    if( isa( L, builtins, cls, "Library" ) )
-        library(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Executable") )
-        executable(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "SourceSet") )
-        sourceset(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Group") )
-        group(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Config") )
-        config(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "LuaScript") )
-        script(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "LuaScriptForeach") )
-        runforeach(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Copy") )
-        copy(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Message") )
+    switch( n->kind )
+    {
+    case BS_LibraryProduct:
+        library(L,ctx,n,builtins);
+        break;
+    case BS_ExecutableProduct:
+        executable(L,ctx,n,builtins);
+        break;
+    case BS_SourceSetProduct:
+        sourceset(L,ctx,n,builtins);
+        break;
+    case BS_GroupProduct:
+        group(L,ctx,n,builtins);
+        break;
+    case BS_ConfigProduct:
+        config(L,ctx,n,builtins);
+        break;
+    case BS_LuaScriptProduct:
+        script(L,ctx,n,builtins);
+        break;
+    case BS_LuaScriptForeachProduct:
+        runforeach(L,ctx,n,builtins);
+        break;
+    case BS_CopyProduct:
+        copy(L,ctx,n,builtins);
+        break;
+    case BS_MessageProduct:
         message(L,ctx,0);
-    else if( isa( L, builtins, cls, "Moc") )
-        runmoc(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Rcc") )
-        runrcc(L,ctx,cls,builtins);
-    else if( isa( L, builtins, cls, "Uic") )
-        runuic(L,ctx,cls,builtins);
-    else
-        luaL_error(L,"don't know how to build instances of class '%s'", clsName);
+        break;
+    case BS_MocProduct:
+        runmoc(L,ctx,n,builtins);
+        break;
+    case BS_RccProduct:
+        runrcc(L,ctx,n,builtins);
+        break;
+    case BS_UicProduct:
+        runuic(L,ctx,n,builtins);
+        break;
+    }
 
-    lua_pop(L,3); // cls, builtins, clsName
+    lua_pop(L,1); // builtins
 
     assert( top == lua_gettop(L) );
-    return 0; // inst
+    return 0;
 }
 
 int bs_resetOut(lua_State* L)
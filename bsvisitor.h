@@ -35,7 +35,8 @@ typedef struct BSVisitorCtx {
 } BSVisitorCtx;
 
 extern int bs_visit(lua_State* L);
-// param: productinst
+// param: graph (see bs_graphlower)
+// param: node index; the nodes it depends on must have been visited before
 // param: BSVisitorCtx userdata
 // no return
 
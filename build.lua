@@ -45,6 +45,14 @@ local function parseParam(str)
 end
 
 _G["#build_mode"] = nil
+_G["#jobs"] = nil
+_G["#restat"] = nil
+_G["#cache"] = nil
+_G["#cachesize"] = nil
+_G["#trace"] = nil
+_G["#memlimit"] = nil
+_G["#memdefault"] = nil
+_G["#keepgoing"] = nil
 local i = 1
 while i <= #arg do
 	if arg[i] == "-B" then
@@ -73,6 +81,51 @@ while i <= #arg do
 		i = i + 1
 		if arg[i] == nil then error("expecting the name of a generator after -G, like '-G qmake'") end
 		generate = arg[i]
+	elseif arg[i] == "-j" then
+		i = i + 1
+		-- max. number of commands run in parallel; default is the number of online CPUs
+		local n = tonumber(arg[i])
+		if n == nil or n < 1 or n ~= math.floor(n) then error("expecting a positive integer after -j") end
+		_G["#jobs"] = n
+	elseif arg[i] == "-k" then
+		i = i + 1
+		-- keep going until N commands failed, 0 means no limit; the commands depending on a failed one are not run;
+		-- default is 1, i.e. the build stops after the first failure
+		local n = tonumber(arg[i])
+		if n == nil or n < 0 or n ~= math.floor(n) then error("expecting a non-negative integer after -k") end
+		_G["#keepgoing"] = n
+	elseif arg[i] == "-restat" then
+		-- outputs whose content didn't change keep their previous time, so dependent products are not relinked
+		_G["#restat"] = true
+	elseif arg[i] == "-cache" then
+		i = i + 1
+		-- directory of the object cache, which can be shared by build directories; default is no cache
+		if arg[i] == nil then error("expecting a directory after -cache") end
+		_G["#cache"] = arg[i]
+	elseif arg[i] == "-cachesize" then
+		i = i + 1
+		-- max. size of the object cache in megabytes; the least recently used objects are removed; default is 5000
+		local n = tonumber(arg[i])
+		if n == nil or n <= 0 then error("expecting a positive number after -cachesize") end
+		_G["#cachesize"] = n
+	elseif arg[i] == "-trace" then
+		i = i + 1
+		-- writes a timeline of parsing and of all commands run to the file, e.g. for chrome://tracing or Perfetto
+		if arg[i] == nil then error("expecting a file name after -trace") end
+		_G["#trace"] = arg[i]
+	elseif arg[i] == "-mem-limit" then
+		i = i + 1
+		-- megabytes the commands run in parallel may use together, judged by their peak memory in previous runs;
+		-- default is the memory available when the build starts
+		local n = tonumber(arg[i])
+		if n == nil or n <= 0 then error("expecting a positive number after -mem-limit") end
+		_G["#memlimit"] = n
+	elseif arg[i] == "-mem-default" then
+		i = i + 1
+		-- megabytes assumed for a command which has not run before; default is 512
+		local n = tonumber(arg[i])
+		if n == nil or n < 0 then error("expecting a number after -mem-default") end
+		_G["#memdefault"] = n
 	elseif arg[i] == "-c" then 
 		checkOnly = true
 	elseif arg[i] == "-M" then
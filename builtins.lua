@@ -111,6 +111,17 @@ enumtype("FileType")
 	enumitem("shared_lib")
 	enumitem("executable")
 
+enumtype("ArchiveMode")
+	enumitem("full")
+	enumitem("thin")
+	enumitem("incremental")
+
+enumtype("LinkMode")
+	enumitem("copy")
+	enumitem("hardlink")
+	enumitem("reflink")
+	enumitem("symlink")
+
 enumtype("BuildMode")
 	enumitem("optimized")
 	enumitem("nonoptimized")
@@ -164,6 +175,7 @@ class("Config")
 	field("lib_names", listOf(globals.string))
 	field("frameworks", listOf(globals.string))
 	field("lib_files", listOf(globals.path))
+	field("pch", globals.path)
 	field("configs", listOf(globals.Config))
 	
 class("ConfigurableProduct", globals.Product)
@@ -185,6 +197,8 @@ class("CompiledProduct", globals.ConfigurableProduct )
 	field("lib_names", listOf(globals.string))
 	field("frameworks", listOf(globals.string))
 	field("lib_files", listOf(globals.path))
+	field("pch", globals.path)
+	field("unity_batch", globals.int)
 	field("configs", listOf(globals.Config))
 	--field("data", listOf(globals.path))
 
@@ -193,6 +207,7 @@ class("Executable", globals.CompiledProduct )
 
 class("Library", globals.CompiledProduct)
 	field("lib_type", globals.LibraryType) 
+	field("archive_mode", globals.ArchiveMode)
 	field("def_file", globals.path) 
 	field("name", globals.string) 
 
@@ -218,6 +233,7 @@ class("Copy", globals.Action)
 	field("sources", listOf(globals.path)) 
 	field("outputs", listOf(globals.path))
 	field("use_deps", listOf(globals.FileType))
+	field("link_mode", globals.LinkMode)
 
 class("Message", globals.Action)
 	field("msg_type", globals.MessageType) 
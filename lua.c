@@ -376,6 +376,58 @@ static int pmain (lua_State *L) {
   return 0;
 }
 
+struct Schunk {
+  char **argv;
+  const char *chunk;
+  size_t len;
+  int status;
+};
+
+
+static int pchunk (lua_State *L) {
+  /* like pmain with a script, but the script was already compiled */
+  struct Schunk *s = (struct Schunk *)lua_touserdata(L, 1);
+  char **argv = s->argv;
+  int narg;
+  globalL = L;
+  if (argv[0] && argv[0][0]) progname = argv[0];
+  lua_gc(L, LUA_GCSTOP, 0);  /* stop collector during initialization */
+  luaL_openlibs(L);  /* open libraries */
+  lua_pushcfunction(L, bs_open_busy);
+  lua_pushstring(L, BS_BSLIBNAME);
+  lua_call(L, 1, 0);
+  lua_gc(L, LUA_GCRESTART, 0);
+  lua_pushstring(L,progname);
+  lua_setglobal(L,"#prog");
+  narg = getargs(L, argv, 1);  /* collect arguments */
+  lua_setglobal(L, "arg");
+  s->status = luaL_loadbuffer(L, s->chunk, s->len, argv[1]);
+  lua_insert(L, -(narg+1));
+  if (s->status == 0)
+    s->status = docall(L, narg, 0);
+  else
+    lua_pop(L, narg);
+  s->status = report(L, s->status);
+  return 0;
+}
+
+int lua_main_chunk (char **argv, const char *chunk, size_t len) {
+  int status;
+  struct Schunk s;
+  lua_State *L = lua_open();  /* create state */
+  if (L == NULL) {
+    l_message(argv[0], "cannot create state: not enough memory");
+    return EXIT_FAILURE;
+  }
+  s.argv = argv;
+  s.chunk = chunk;
+  s.len = len;
+  status = lua_cpcall(L, &pchunk, &s);
+  report(L, status);
+  lua_close(L);
+  return (status || s.status) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int lua_main (int argc, char **argv) {
   int status;
   struct Smain s;
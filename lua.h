@@ -244,6 +244,8 @@ LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud);
 
 LUA_API int lua_main (int argc, char **argv);
+LUA_API int lua_main_chunk (char **argv, const char *chunk, size_t len);
+/* runs a chunk dumped by lua_dump in a new state; argv[0] is the program, argv[1] the script name, then the args */
 
 typedef void (*lua_reporter)(const char* msg, void* data);
 LUA_API int lua_main_with_reporter (int argc, char **argv, lua_reporter r, void* data);